@@ -22,43 +22,98 @@
 #include <assert.h>
 #include <signal.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <alloca.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <json-c/json.h>
+#include <systemd/sd-event.h>
 
 #define AFB_BINDING_VERSION 3
 #include <afb/afb-binding.h>
 
 #include "verbose.h"
 #include "utils-systemd.h"
+#include "utils-metrics.h"
 #include "afm-udb.h"
 #include "afm-urun.h"
-#include "wgt-info.h"
-#include "wgtpkg-install.h"
-#include "wgtpkg-uninstall.h"
+#include "afm-icons.h"
 #include "wrap-json.h"
 
+#if !defined(WGTPKG_INSTALL_PROGRAM)
+# define WGTPKG_INSTALL_PROGRAM "/usr/bin/wgtpkg-install"
+#endif
+
+#if !defined(AFM_RELOAD_DELAY_MS)
+# define AFM_RELOAD_DELAY_MS 1000
+#endif
+
+#if !defined(AFM_RELOAD_MAX_DELAY_MS)
+# define AFM_RELOAD_MAX_DELAY_MS 5000
+#endif
+
+#if !defined(AFM_APPLIST_COALESCE_MS)
+# define AFM_APPLIST_COALESCE_MS 250
+#endif
+
+#if !defined(AFM_METRICS_PERIOD)
+# define AFM_METRICS_PERIOD 15
+#endif
+
 /*
  * constant strings
  */
 static const char _added_[]     = "added";
 static const char _all_[]       = "all";
 static const char _a_l_c_[]     = "application-list-changed";
+static const char _a_l_c_b_[]   = "application-list-changed-batch";
+static const char _a_l_c_i_[]   = "application-list-changed-immediate";
 static const char _bad_request_[] = "bad-request";
+static const char _batch_[]     = "batch";
 static const char _cannot_start_[] = "cannot-start";
+static const char _class_[]     = "class";
+static const char _clean_[]     = "clean";
+static const char _coalesced_[] = "coalesced";
+static const char _delivery_[]  = "delivery";
 static const char _detail_[]    = "detail";
+static const char _failed_[]    = "failed";
+static const char _format_[]    = "format";
+static const char _grace_[]     = "grace";
+static const char _history_[]   = "history";
+static const char _icons_[]     = "icons";
 static const char _id_[]        = "id";
+static const char _immediate_[] = "immediate";
 static const char _install_[]   = "install";
+static const char _install_many_[] = "install-many";
+static const char _install_progress_[] = "install-progress";
+static const char _job_[]       = "job";
+static const char _known_[]     = "known";
 static const char _lang_[]      = "lang";
+static const char _metrics_[]   = "metrics";
 static const char _not_found_[] = "not-found";
 static const char _not_running_[] = "not-running";
 static const char _once_[]      = "once";
 static const char _pause_[]     = "pause";
+static const char _place_[]     = "place";
+static const char _prometheus_[] = "prometheus";
+static const char _reload_[]    = "reload";
+static const char _reloaded_[]  = "reloaded";
+static const char _removed_[]   = "removed";
 static const char _resume_[]    = "resume";
 static const char _runid_[]     = "runid";
 static const char _runnables_[] = "runnables";
 static const char _runners_[]   = "runners";
 static const char _start_[]     = "start";
 static const char _state_[]     = "state";
+static const char _stats_[]     = "stats";
+static const char _subscribe_[] = "subscribe";
 static const char _terminate_[] = "terminate";
 static const char _uninstall_[] = "uninstall";
 static const char _update_[]    = "update";
@@ -165,350 +220,1704 @@ static struct afm_udb *afudb;
  */
 static afb_event_t applist_changed_event;
 
+/*
+ * the event signaling at once each change of the application list
+ * to its subscribers
+ */
+static afb_event_t applist_immediate_event;
+
+/*
+ * the event signaling in one batch the changes of the application
+ * list received during the window of coalescing to its subscribers
+ */
+static afb_event_t applist_batch_event;
+
+/*
+ * window of coalescing of the changes of the application list (ms)
+ */
+static int applist_coalesce_ms = AFM_APPLIST_COALESCE_MS;
+
+/*
+ * the changes of the application list waiting the end of the window
+ */
+static struct json_object *applist_changes;
+
+/*
+ * the timer of the window of coalescing
+ */
+static struct sd_event_source *applist_timer;
+
+/*
+ * the metrics of the events of changes of the application list
+ */
+static struct metrics_event *applist_metrics, *applist_immediate_metrics, *applist_batch_metrics;
+
+/*
+ * the event signaling the progress of installations
+ */
+static afb_event_t install_progress_event;
+
 /*
  * the preallocated true json_object
  */
 static struct json_object *json_true;
 
-/* enforce daemon reload */
-static void do_reloads()
+/*
+ * Waiting start requests
+ */
+struct reload_waiter {
+	struct reload_waiter *next;	/* next waiter */
+	afb_req_t req;			/* the request */
+	const char *method;		/* the method of the request */
+	void (*done)(void *closure, int runid); /* the reply of the request */
+};
+
+/*
+ * the event loop of the binder
+ */
+static struct sd_event *evloop;
+
+/*
+ * delay of quiet period before reloading systemd (milliseconds)
+ */
+static int reload_delay_ms = AFM_RELOAD_DELAY_MS;
+
+/*
+ * maximum delay of a pending reload since its first request (milliseconds)
+ */
+static int reload_max_delay_ms = AFM_RELOAD_MAX_DELAY_MS;
+
+/*
+ * is a reload of systemd pending?
+ */
+static int reload_pending;
+
+/*
+ * time of the first request of the pending reload (microseconds)
+ */
+static uint64_t reload_first_us;
+
+/*
+ * is a reload of systemd running?
+ */
+static int reload_running;
+
+/*
+ * the timer of pending reload
+ */
+static struct sd_event_source *reload_timer;
+
+/*
+ * the object whose keys are the ids installed since last reload
+ */
+static struct json_object *reload_ids;
+
+/*
+ * the start requests waiting the pending reload
+ */
+static struct reload_waiter *reload_waiters_head, *reload_waiters_tail;
+
+/*
+ * the ids and the start requests of the running reload
+ */
+static struct json_object *running_ids;
+static struct reload_waiter *running_waiters;
+
+/*
+ * counters of reloads
+ */
+static struct {
+	int requested;	/* count of reload requests */
+	int performed;	/* count of effective reloads */
+	int waited;	/* count of starts that waited a reload */
+} reload_stats;
+
+/*
+ * metering of a verb: the verb description holds it as vcbdata
+ */
+struct metered {
+	void (*callback)(afb_req_t req);	/* the metered callback */
+	struct metrics_verb *verb;		/* the metrics of the verb */
+};
+
+/*
+ * a metered call waiting its reply
+ */
+struct metered_call {
+	struct metered_call *next;	/* next call */
+	afb_req_t req;			/* the request */
+	struct metrics_verb *verb;	/* the metrics of its verb */
+	uint64_t start;			/* time of the call in microseconds */
+};
+
+/*
+ * the metered calls not yet replied
+ */
+static struct metered_call *metered_calls;
+
+/*
+ * a call of a verb posted to the event loop
+ */
+struct posted_call {
+	struct posted_call *next;	/* next posted call */
+	afb_req_t req;			/* the request (referenced) */
+	uint64_t start;			/* time of the call in microseconds */
+};
+
+/*
+ * the calls posted to the event loop and their lock
+ */
+static struct posted_call *posted_head, *posted_tail;
+static pthread_mutex_t posted_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * the eventfd waking up the event loop or -1 and its source
+ */
+static int post_fd = -1;
+static struct sd_event_source *post_source;
+
+/*
+ * was SIGHUP received?
+ */
+static volatile sig_atomic_t sighup_received;
+
+/*
+ * file where metrics are periodically exported or NULL
+ */
+static const char *metrics_file;
+
+/*
+ * period of export of the metrics in seconds
+ */
+static int metrics_period = AFM_METRICS_PERIOD;
+
+/*
+ * the timer of export of the metrics
+ */
+static struct sd_event_source *metrics_timer;
+
+static void do_start(afb_req_t req, const char *method, void (*done)(void *closure, int runid));
+
+static void flush_reloads();
+
+/*
+ * End of the running reload: processes the start requests that waited it
+ * and performs the reload requested meanwhile if its delay expired
+ */
+static void end_reloads()
 {
-	systemd_daemon_reload(0);
-	systemd_unit_restart_name(0, "sockets.target");
+	struct reload_waiter *waiter;
+	int enabled;
+
+	json_object_put(running_ids);
+	running_ids = NULL;
+	reload_running = 0;
+	while ((waiter = running_waiters)) {
+		running_waiters = waiter->next;
+		do_start(waiter->req, waiter->method, waiter->done);
+		afb_req_unref(waiter->req);
+		free(waiter);
+	}
+	if (reload_pending && (!reload_timer
+			|| sd_event_source_get_enabled(reload_timer, &enabled) < 0
+			|| enabled == SD_EVENT_OFF))
+		flush_reloads();
 }
 
-/* common bad request reply */
-static void bad_request(afb_req_t req)
+/* end of the restart of the sockets */
+static void on_sockets_restarted(void *closure, int status, const char *path)
 {
-	afb_req_fail(req, _bad_request_, NULL);
+	if (status < 0)
+		WARNING("restart of sockets.target failed: %s", strerror(-status));
+	end_reloads();
 }
 
-/* common not found reply */
-static void not_found(afb_req_t req)
+/* end of the reload of systemd: restarts the sockets */
+static void on_daemon_reloaded(void *closure, int status, const char *path)
 {
-	afb_req_fail(req, _not_found_, NULL);
+	if (status < 0)
+		WARNING("reload of systemd failed: %s", strerror(-status));
+	if (systemd_unit_restart_name_async(0, "sockets.target", on_sockets_restarted, NULL) < 0)
+		on_sockets_restarted(NULL, -errno, NULL);
 }
 
-/* common not running reply */
-static void not_running(afb_req_t req)
+/* enforce daemon reload */
+static void do_reloads()
 {
-	afb_req_fail(req, _not_running_, NULL);
+	reload_stats.performed++;
+	if (systemd_daemon_reload_async(0, on_daemon_reloaded, NULL) < 0)
+		on_daemon_reloaded(NULL, -errno, NULL);
 }
 
-/* common can't start reply */
-static void cant_start(afb_req_t req)
+/*
+ * Performs the pending reload, if any and if no reload is running.
+ * The start requests that waited it are processed at its end.
+ */
+static void flush_reloads()
 {
-	afb_req_fail(req, _cannot_start_, NULL);
+	if (!reload_pending || reload_running)
+		return;
+
+	/* the waiters and the ids now wait the running reload */
+	reload_pending = 0;
+	if (reload_timer)
+		sd_event_source_set_enabled(reload_timer, SD_EVENT_OFF);
+	reload_running = 1;
+	running_ids = reload_ids;
+	reload_ids = NULL;
+	running_waiters = reload_waiters_head;
+	reload_waiters_head = reload_waiters_tail = NULL;
+	do_reloads();
 }
 
 /*
- * Broadcast the event "application-list-changed".
- * This event is sent was the event "changed" is received from dbus.
+ * Called at end of the quiet period
  */
-static void application_list_changed(const char *operation, const char *data)
+static int on_reload_timer(sd_event_source *source, uint64_t usec, void *closure)
 {
-	struct json_object *e = NULL;
-	wrap_json_pack(&e, "{ss ss}", "operation", operation, "data", data);
-	afb_event_broadcast(applist_changed_event, e);
+	flush_reloads();
+	return 0;
 }
 
 /*
- * Retrieve the required language from 'req'.
+ * Records that the starts of 'id' and 'idaver' (or NULL) have to wait
+ * the next reload
  */
-static const char *get_lang(afb_req_t req)
+static void add_reload_ids(const char *id, const char *idaver)
 {
-	const char *lang;
-
-	/* get the optional language */
-	lang = afb_req_value(req, _lang_);
-
-	/* TODO use the req to get the lang of the session (if any) */
-
-	return lang;
+	if (!reload_ids)
+		reload_ids = json_object_new_object();
+	if (reload_ids && id)
+		json_object_object_add(reload_ids, id, NULL);
+	if (reload_ids && idaver)
+		json_object_object_add(reload_ids, idaver, NULL);
 }
 
 /*
- * Retrieve whether all is required from 'req'.
+ * Records that a reload is needed for the installation of 'id' and 'idaver'
+ * (or NULL) and delays it until a quiet period of 'reload_delay_ms' but
+ * no more than 'reload_max_delay_ms' after the first pending request
  */
-static int get_all(afb_req_t req)
+static void request_reloads(const char *id, const char *idaver)
 {
-	struct json_object *val;
-
-	/* get the optional language */
-	return json_object_object_get_ex(afb_req_json(req), _all_, &val)
-		&& json_object_get_boolean(val);
+	int rc;
+	uint64_t usec, max;
+
+	reload_stats.requested++;
+	add_reload_ids(id, idaver);
+
+	/* arm or re-arm the timer */
+	rc = -1;
+	if (evloop && reload_delay_ms > 0 && sd_event_now(evloop, CLOCK_MONOTONIC, &usec) >= 0) {
+		if (!reload_pending)
+			reload_first_us = usec;
+		usec += (uint64_t)reload_delay_ms * 1000;
+		max = reload_first_us + (uint64_t)(reload_max_delay_ms > 0 ? reload_max_delay_ms : 0) * 1000;
+		if (usec > max)
+			usec = max;
+		if (!reload_timer)
+			rc = sd_event_add_time(evloop, &reload_timer, CLOCK_MONOTONIC,
+						usec, 0, on_reload_timer, NULL);
+		else {
+			rc = sd_event_source_set_time(reload_timer, usec);
+			if (rc >= 0)
+				rc = sd_event_source_set_enabled(reload_timer, SD_EVENT_ONESHOT);
+		}
+	}
+	reload_pending = 1;
+	if (rc < 0)
+		flush_reloads();
 }
 
-
 /*
- * retrieves the 'appid' in parameters received with the
- * request 'req' for the 'method'.
- *
- * Returns 1 in case of success.
- * Otherwise, if the 'appid' can't be retrieved, an error stating
- * the bad request is replied for 'req' and 0 is returned.
+ * Queues the start 'req' if its application 'appid'
+ * is waiting a pending or running reload.
+ * Returns 1 if queued or 0 otherwise.
  */
-static int onappid(afb_req_t req, const char *method, const char **appid)
+static int wait_reloads(afb_req_t req, const char *appid, const char *method, void (*done)(void *closure, int runid))
 {
-	struct json_object *json;
+	struct reload_waiter *waiter, **prv;
 
-	/* get the paramaters of the request */
-	json = afb_req_json(req);
+	if (reload_pending && reload_ids && json_object_object_get_ex(reload_ids, appid, NULL))
+		prv = NULL;
+	else if (reload_running && running_ids && json_object_object_get_ex(running_ids, appid, NULL))
+		for (prv = &running_waiters ; *prv ; prv = &(*prv)->next);
+	else
+		return 0;
 
-	/* get the appid if any */
-	if (!wrap_json_unpack(json, "s", appid)
-	 || !wrap_json_unpack(json, "{ss}", _id_, appid)) {
-		/* found */
-		INFO("method %s called for %s", method, *appid);
-		return 1;
+	waiter = malloc(sizeof *waiter);
+	if (!waiter) {
+		/* no memory, reload now */
+		flush_reloads();
+		return 0;
 	}
-
-	/* nothing appropriate */
-	INFO("bad request method %s: %s", method,
-					json_object_to_json_string(json));
-	bad_request(req);
-	return 0;
+	waiter->next = NULL;
+	waiter->req = afb_req_addref(req);
+	waiter->method = method;
+	waiter->done = done;
+	if (prv)
+		*prv = waiter;
+	else {
+		if (reload_waiters_tail)
+			reload_waiters_tail->next = waiter;
+		else
+			reload_waiters_head = waiter;
+		reload_waiters_tail = waiter;
+	}
+	reload_stats.waited++;
+	return 1;
 }
 
-/*
- * retrieves the 'runid' in parameters received with the
- * request 'req' for the 'method'.
- *
- * Returns 1 in case of success.
- * Otherwise, if the 'runid' can't be retrieved, an error stating
- * the bad request is replied for 'req' and 0 is returned.
- */
-static int onrunid(afb_req_t req, const char *method, int *runid)
+/* current monotonic time in microseconds */
+static uint64_t now_us()
 {
-	struct json_object *json;
-	const char *appid;
+	struct timespec ts;
 
-	/* get the paramaters of the request */
-	json = afb_req_json(req);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
 
-	/* get the runid if any */
-	if (!wrap_json_unpack(json, "i", runid)
-	 || !wrap_json_unpack(json, "{si}", _runid_, runid)) {
-		INFO("method %s called for %d", method, *runid);
-		return 1;
-	}
+/* size of the serialisation of 'obj' */
+static size_t json_size(struct json_object *obj)
+{
+	size_t size;
 
-	/* get the appid if any */
-	if (!onappid(req, method, &appid))
+	if (!obj)
 		return 0;
+	json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &size);
+	return size;
+}
 
-	/* search the runid of the appid */
-	*runid = afm_urun_search_runid(afudb, appid, afb_req_get_uid(req));
-	if (*runid < 0) {
-		/* nothing appropriate */
-		INFO("method %s can't get runid for %s: %m", method,
-							appid);
-		if (errno == ESRCH)
-			not_running(req);
-		else
-			not_found(req);
-		return 0;
+/*
+ * Records the call 'req' received at 'start' and
+ * invokes the callback of the verb
+ */
+static void run_metered(afb_req_t req, uint64_t start)
+{
+	struct metered *m = afb_req_get_vcbdata(req);
+	struct metered_call *call;
+
+	if (m->verb) {
+		call = malloc(sizeof *call);
+		if (call) {
+			call->req = req;
+			call->verb = m->verb;
+			call->start = start;
+			call->next = metered_calls;
+			metered_calls = call;
+			metrics_call(m->verb, json_size(afb_req_json(req)));
+		}
 	}
-
-	/* found */
-	INFO("method %s called for %s -> %d", method, appid, *runid);
-	return 1;
+	m->callback(req);
 }
 
+static void run_sighup();
+
 /*
- * Sends the reply 'resp' to the request 'req' if 'resp' is not NULLzero.
- * Otherwise, when 'resp' is NULL replies the error string 'errstr'.
+ * Wakes up the event loop. Async-signal-safe.
  */
-static void reply(afb_req_t req, struct json_object *resp)
+static void wake_event_loop()
 {
-	if (resp)
-		afb_req_reply(req, resp, NULL, NULL);
-	else
-		afb_req_reply(req, NULL, "failed", strerror(errno));
+	uint64_t one = 1;
+
+	/* EAGAIN means that the loop is already woken up */
+	if (post_fd >= 0)
+		while (write(post_fd, &one, sizeof one) < 0 && errno == EINTR);
 }
 
 /*
- * Sends the reply "true" to the request 'req' if 'status' is zero.
- * Otherwise, when 'status' is not zero replies the error string 'errstr'.
+ * Runs in the event loop the pending SIGHUP and the posted calls
  */
-static void reply_status(afb_req_t req, int status)
+static int on_post(sd_event_source *source, int fd, uint32_t revents, void *userdata)
 {
-	reply(req, status ? NULL : json_object_get(json_true));
+	uint64_t count;
+	struct posted_call *call;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		ERROR("can't read the posted calls: %m");
+	run_sighup();
+	for (;;) {
+		pthread_mutex_lock(&posted_lock);
+		call = posted_head;
+		if (call) {
+			posted_head = call->next;
+			if (!posted_head)
+				posted_tail = NULL;
+		}
+		pthread_mutex_unlock(&posted_lock);
+		if (!call)
+			break;
+		run_metered(call->req, call->start);
+		afb_req_unref(call->req);
+		free(call);
+	}
+	return 0;
 }
 
 /*
- * On query "runnables"
+ * Callback of the metered verbs: posts the call to the event loop
+ * that runs it. Running the verbs in the thread of the event loop
+ * serializes them with the callbacks of the loop (timers, replies and
+ * signals of systemd, installation jobs): the state of the binding
+ * and of afm-urun is only accessed from that thread and needs no lock.
  */
-static void runnables(afb_req_t req)
+static void metered(afb_req_t req)
 {
-	int all;
-	const char *lang;
-	struct json_object *resp;
-
-	/* get the language */
-	lang = get_lang(req);
+	struct posted_call *call;
 
-	/* get the all */
-	all = get_all(req);
+	/* without event loop, the verb runs in the calling thread */
+	if (post_fd < 0) {
+		run_sighup();
+		run_metered(req, now_us());
+		return;
+	}
 
-	/* get the details */
-	resp = afm_udb_applications_public(afudb, all, afb_req_get_uid(req), lang);
-	afb_req_success(req, resp, NULL);
+	call = malloc(sizeof *call);
+	if (!call) {
+		ERROR("out of memory");
+		afb_req_reply(req, NULL, _failed_, NULL);
+		return;
+	}
+	call->next = NULL;
+	call->req = afb_req_addref(req);
+	call->start = now_us();
+	pthread_mutex_lock(&posted_lock);
+	if (posted_tail)
+		posted_tail->next = call;
+	else
+		posted_head = call;
+	posted_tail = call;
+	pthread_mutex_unlock(&posted_lock);
+	wake_event_loop();
 }
 
 /*
- * On query "detail"
+ * Creates the eventfd that wakes up the event loop for running
+ * the posted calls and the pending SIGHUP.
+ * Returns 0 in case of success or -1 in case of error.
  */
-static void detail(afb_req_t req)
+static int init_post()
 {
-	const char *lang;
-	const char *appid;
-	struct json_object *resp;
+	int rc;
 
-	/* scan the request */
+	if (!evloop)
+		return 0;
+	post_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (post_fd < 0) {
+		ERROR("can't create eventfd: %m");
+		return -1;
+	}
+	rc = sd_event_add_io(evloop, &post_source, post_fd, EPOLLIN, on_post, NULL);
+	if (rc < 0) {
+		ERROR("can't watch eventfd: %s", strerror(-rc));
+		close(post_fd);
+		post_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sends to 'req' the reply 'resp' (given), 'error' and 'info'
+ * as afb_req_reply does and records it in the metrics of the verb.
+ * The 'error' must be a constant string.
+ */
+static void send_reply(afb_req_t req, struct json_object *resp, const char *error, const char *info)
+{
+	struct metered_call *call, **prv;
+
+	prv = &metered_calls;
+	while ((call = *prv) && call->req != req)
+		prv = &call->next;
+	if (call) {
+		*prv = call->next;
+		metrics_reply(call->verb, now_us() - call->start, error,
+				json_size(resp) + (info ? strlen(info) : 0));
+		free(call);
+	}
+	afb_req_reply(req, resp, error, info);
+}
+
+/*
+ * Updates the database of applications and drops
+ * the cached icons
+ */
+static void update_applications()
+{
+	afm_udb_update(afudb);
+	afm_icons_invalidate();
+}
+
+/* common bad request reply */
+static void bad_request(afb_req_t req)
+{
+	send_reply(req, NULL, _bad_request_, NULL);
+}
+
+/* common not found reply */
+static void not_found(afb_req_t req)
+{
+	send_reply(req, NULL, _not_found_, NULL);
+}
+
+/* common not running reply */
+static void not_running(afb_req_t req)
+{
+	send_reply(req, NULL, _not_running_, NULL);
+}
+
+/* common can't start reply */
+static void cant_start(afb_req_t req)
+{
+	send_reply(req, NULL, _cannot_start_, NULL);
+}
+
+/*
+ * Adds to the array 'data' the string 'id' if not already in
+ */
+static void add_changed_id(struct json_object *data, struct json_object *id)
+{
+	int i, n;
+	const char *str;
+
+	str = json_object_get_string(id);
+	n = (int)json_object_array_length(data);
+	for (i = 0 ; i < n ; i++)
+		if (!strcmp(str, json_object_get_string(json_object_array_get_idx(data, i))))
+			return;
+	json_object_array_add(data, json_object_get(id));
+}
+
+/*
+ * Broadcast the event "application-list-changed" with the change of
+ * 'operation' for the application 'id'
+ */
+static void broadcast_application_list_change(struct json_object *operation, struct json_object *id)
+{
+	struct json_object *e = NULL;
+
+	wrap_json_pack(&e, "{sO sO}", "operation", operation, "data", id);
+	if (applist_metrics)
+		metrics_event(applist_metrics, 1);
+	afb_event_broadcast(applist_changed_event, e);
+}
+
+/*
+ * Sends the changes received during the window of coalescing.
+ * The event "application-list-changed" keeps its legacy form: it is
+ * broadcasted for each change with the id of the application as data,
+ * a change of many applications giving one event per application.
+ * The subscribers of "application-list-changed-batch" receive all the
+ * changes in one event whose operation is "batch", whose data is the
+ * array of the changed ids and whose array "changes" lists the changes.
+ */
+static void flush_application_list_changes()
+{
+	int i, j, n;
+	struct json_object *e, *changes, *data, *c, *o, *d;
+
+	changes = applist_changes;
+	applist_changes = NULL;
+	n = changes ? (int)json_object_array_length(changes) : 0;
+	if (n == 0) {
+		json_object_put(changes);
+		return;
+	}
+
+	data = json_object_new_array();
+	for (i = 0 ; i < n ; i++) {
+		c = json_object_array_get_idx(changes, i);
+		if (!json_object_object_get_ex(c, "operation", &o)
+		 || !json_object_object_get_ex(c, "data", &d))
+			continue;
+		if (!json_object_is_type(d, json_type_array)) {
+			add_changed_id(data, d);
+			broadcast_application_list_change(o, d);
+		} else
+			for (j = 0 ; j < (int)json_object_array_length(d) ; j++) {
+				add_changed_id(data, json_object_array_get_idx(d, j));
+				broadcast_application_list_change(o, json_object_array_get_idx(d, j));
+			}
+	}
+
+	e = NULL;
+	wrap_json_pack(&e, "{ss so so}", "operation", _batch_, "data", data, "changes", changes);
+	if (afb_event_push(applist_batch_event, e) > 0 && applist_batch_metrics)
+		metrics_event(applist_batch_metrics, (unsigned)n);
+}
+
+/*
+ * Called at end of the window of coalescing
+ */
+static int on_applist_timer(sd_event_source *source, uint64_t usec, void *closure)
+{
+	flush_application_list_changes();
+	return 0;
+}
+
+/*
+ * Signals the change 'e' (given) of the application list: pushes it
+ * at once to the subscribers of "application-list-changed-immediate"
+ * and records it for the event "application-list-changed" sent at
+ * the end of the window of coalescing.
+ */
+static void notify_application_list_change(struct json_object *e)
+{
+	int rc;
+	uint64_t usec;
+
+	if (afb_event_push(applist_immediate_event, json_object_get(e)) > 0 && applist_immediate_metrics)
+		metrics_event(applist_immediate_metrics, 1);
+
+	if (!applist_changes)
+		applist_changes = json_object_new_array();
+	json_object_array_add(applist_changes, e);
+
+	/* arm the timer at the first change of the window */
+	rc = -1;
+	if (evloop && applist_coalesce_ms > 0) {
+		if (json_object_array_length(applist_changes) > 1)
+			rc = 0;
+		else if (sd_event_now(evloop, CLOCK_MONOTONIC, &usec) >= 0) {
+			usec += (uint64_t)applist_coalesce_ms * 1000;
+			if (!applist_timer)
+				rc = sd_event_add_time(evloop, &applist_timer, CLOCK_MONOTONIC,
+							usec, 0, on_applist_timer, NULL);
+			else {
+				rc = sd_event_source_set_time(applist_timer, usec);
+				if (rc >= 0)
+					rc = sd_event_source_set_enabled(applist_timer, SD_EVENT_ONESHOT);
+			}
+		}
+	}
+	if (rc < 0)
+		flush_application_list_changes();
+}
+
+/*
+ * Signals the change 'operation' of the application 'data'.
+ * This event is sent was the event "changed" is received from dbus.
+ */
+static void application_list_changed(const char *operation, const char *data)
+{
+	struct json_object *e = NULL;
+	wrap_json_pack(&e, "{ss ss}", "operation", operation, "data", data);
+	notify_application_list_change(e);
+}
+
+/*
+ * Signals the change 'operation' of many applications.
+ * The 'data' is an array of the changed idavers (given).
+ */
+static void application_list_changed_many(const char *operation, struct json_object *data)
+{
+	struct json_object *e = NULL;
+	wrap_json_pack(&e, "{ss so}", "operation", operation, "data", data);
+	notify_application_list_change(e);
+}
+
+/*
+ * Retrieve the required language from 'req'.
+ */
+static const char *get_lang(afb_req_t req)
+{
+	const char *lang;
+
+	/* get the optional language */
+	lang = afb_req_value(req, _lang_);
+
+	/* TODO use the req to get the lang of the session (if any) */
+
+	return lang;
+}
+
+/*
+ * Retrieve whether all is required from 'req'.
+ */
+static int get_all(afb_req_t req)
+{
+	struct json_object *val;
+
+	/* get the optional language */
+	return json_object_object_get_ex(afb_req_json(req), _all_, &val)
+		&& json_object_get_boolean(val);
+}
+
+
+/*
+ * retrieves the 'appid' in parameters received with the
+ * request 'req' for the 'method'.
+ *
+ * Returns 1 in case of success.
+ * Otherwise, if the 'appid' can't be retrieved, an error stating
+ * the bad request is replied for 'req' and 0 is returned.
+ */
+static int onappid(afb_req_t req, const char *method, const char **appid)
+{
+	struct json_object *json;
+
+	/* get the paramaters of the request */
+	json = afb_req_json(req);
+
+	/* get the appid if any */
+	if (!wrap_json_unpack(json, "s", appid)
+	 || !wrap_json_unpack(json, "{ss}", _id_, appid)) {
+		/* found */
+		INFO("method %s called for %s", method, *appid);
+		return 1;
+	}
+
+	/* nothing appropriate */
+	INFO("bad request method %s: %s", method,
+					json_object_to_json_string(json));
+	bad_request(req);
+	return 0;
+}
+
+/*
+ * retrieves the 'runid' in parameters received with the
+ * request 'req' for the 'method'.
+ *
+ * Returns 1 in case of success.
+ * Otherwise, if the 'runid' can't be retrieved, an error stating
+ * the bad request is replied for 'req' and 0 is returned.
+ */
+static int onrunid(afb_req_t req, const char *method, int *runid)
+{
+	struct json_object *json;
+	const char *appid;
+
+	/* get the paramaters of the request */
+	json = afb_req_json(req);
+
+	/* get the runid if any */
+	if (!wrap_json_unpack(json, "i", runid)
+	 || !wrap_json_unpack(json, "{si}", _runid_, runid)) {
+		INFO("method %s called for %d", method, *runid);
+		return 1;
+	}
+
+	/* get the appid if any */
+	if (!onappid(req, method, &appid))
+		return 0;
+
+	/* search the runid of the appid */
+	*runid = afm_urun_search_runid(afudb, appid, afb_req_get_uid(req));
+	if (*runid < 0) {
+		/* nothing appropriate */
+		INFO("method %s can't get runid for %s: %m", method,
+							appid);
+		if (errno == ESRCH)
+			not_running(req);
+		else
+			not_found(req);
+		return 0;
+	}
+
+	/* found */
+	INFO("method %s called for %s -> %d", method, appid, *runid);
+	return 1;
+}
+
+/*
+ * Sends the reply 'resp' to the request 'req' if 'resp' is not NULLzero.
+ * Otherwise, when 'resp' is NULL replies the error string 'errstr'.
+ */
+static void reply(afb_req_t req, struct json_object *resp)
+{
+	if (resp)
+		send_reply(req, resp, NULL, NULL);
+	else
+		send_reply(req, NULL, _failed_, strerror(errno));
+}
+
+/*
+ * Sends the reply "true" to the request 'req' if 'status' is zero.
+ * Otherwise, when 'status' is not zero replies the error string 'errstr'.
+ */
+static void reply_status(afb_req_t req, int status)
+{
+	reply(req, status ? NULL : json_object_get(json_true));
+}
+
+/*
+ * On query "runnables"
+ */
+static void runnables(afb_req_t req)
+{
+	int all;
+	const char *lang;
+	struct json_object *resp;
+
+	/* get the language */
+	lang = get_lang(req);
+
+	/* get the all */
+	all = get_all(req);
+
+	/* get the details */
+	resp = afm_udb_applications_public(afudb, all, afb_req_get_uid(req), lang);
+	send_reply(req, resp, NULL, NULL);
+}
+
+/*
+ * Is the string 'str' in the 'array'?
+ */
+static int array_has_string(struct json_object *array, const char *str)
+{
+	int i, n;
+	const char *item;
+
+	n = (int)json_object_array_length(array);
+	for (i = 0 ; i < n ; i++) {
+		item = json_object_get_string(json_object_array_get_idx(array, i));
+		if (item && !strcmp(item, str))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * On query "icons"
+ */
+static void icons(afb_req_t req)
+{
+	int i, n;
+	const char *lang, *id;
+	struct json_object *json, *apps, *ids, *known, *sel, *app, *resp;
+
+	/* get the optional ids and known hashes */
+	ids = known = NULL;
+	json = afb_req_json(req);
+	if (json_object_is_type(json, json_type_object)
+	 && wrap_json_unpack(json, "{s?o s?o}", "ids", &ids, _known_, &known)) {
+		bad_request(req);
+		return;
+	}
+
+	/* get the applications */
+	lang = get_lang(req);
+	apps = afm_udb_applications_public(afudb, get_all(req), afb_req_get_uid(req), lang);
+	if (apps && json_object_is_type(ids, json_type_array)) {
+		/* select the requested applications */
+		sel = json_object_new_array();
+		n = (int)json_object_array_length(apps);
+		for (i = 0 ; sel && i < n ; i++) {
+			app = json_object_array_get_idx(apps, i);
+			if (!wrap_json_unpack(app, "{ss}", _id_, &id)
+			 && array_has_string(ids, id))
+				json_object_array_add(sel, json_object_get(app));
+		}
+		json_object_put(apps);
+		apps = sel;
+	}
+
+	/* pack the icons */
+	resp = apps ? afm_icons_pack(apps, known) : NULL;
+	json_object_put(apps);
+	reply(req, resp);
+}
+
+/*
+ * On query "detail"
+ */
+static void detail(afb_req_t req)
+{
+	const char *lang;
+	const char *appid;
+	struct json_object *resp;
+
+	/* scan the request */
 	if (!onappid(req, _detail_, &appid))
 		return;
 
-	/* get the language */
-	lang = get_lang(req);
+	/* get the language */
+	lang = get_lang(req);
+
+	/* wants details for appid */
+	resp = afm_udb_get_application_public(afudb, appid, afb_req_get_uid(req), lang);
+	if (resp)
+		send_reply(req, resp, NULL, NULL);
+	else
+		not_found(req);
+}
+
+/*
+ * Replies to the query "start" when the start is done
+ */
+static void start_done(void *closure, int runid)
+{
+	afb_req_t req = closure;
+	struct json_object *resp;
+
+	if (runid < 0)
+		cant_start(req);
+	else {
+		/* returns */
+		resp = NULL;
+#if 0
+		wrap_json_pack(&resp, "{si}", _runid_, runid);
+#else
+		if (runid)
+			wrap_json_pack(&resp, "i", runid);
+#endif
+		send_reply(req, resp, NULL, NULL);
+	}
+	afb_req_unref(req);
+}
+
+/*
+ * Replies to the query "once" when the state of the started runner is known
+ */
+static void once_state_done(void *closure, struct json_object *state)
+{
+	afb_req_t req = closure;
+
+	send_reply(req, state, NULL, NULL);
+	afb_req_unref(req);
+}
+
+/*
+ * Replies to the query "once" when the start is done
+ */
+static void once_done(void *closure, int runid)
+{
+	afb_req_t req = closure;
+
+	if (runid < 0)
+		cant_start(req);
+	else if (runid > 0
+	      && afm_urun_state_async(afudb, runid, afb_req_get_uid(req), once_state_done, req) >= 0)
+		/* replied with the state */
+		return;
+	else
+		send_reply(req, NULL, NULL, NULL);
+	afb_req_unref(req);
+}
+
+/*
+ * Common start of the application of 'req' for 'method'
+ * replied by 'done'
+ */
+static void do_start(afb_req_t req, const char *method, void (*done)(void *closure, int runid))
+{
+	const char *appid;
+	struct json_object *appli;
+	int rc;
+
+	/* scan the request */
+	if (!onappid(req, method, &appid))
+		return;
+
+	/* wait the pending reload if needed */
+	if (wait_reloads(req, appid, method, done))
+		return;
+
+	/* get the application */
+	appli = afm_udb_get_application_private(afudb, appid, afb_req_get_uid(req));
+	if (appli == NULL) {
+		not_found(req);
+		return;
+	}
+
+	/* launch the application */
+	rc = afm_urun_start_async(appli, afb_req_get_uid(req), done, afb_req_addref(req));
+	if (rc < 0) {
+		cant_start(req);
+		afb_req_unref(req);
+	}
+	json_object_put(appli);
+}
+
+/*
+ * On query "start"
+ */
+static void start(afb_req_t req)
+{
+	do_start(req, _start_, start_done);
+}
+
+/*
+ * On query "once"
+ */
+static void once(afb_req_t req)
+{
+	do_start(req, _once_, once_done);
+}
+
+/*
+ * On query "pause"
+ */
+static void pause_app(afb_req_t req)
+{
+	int runid, status;
+	if (onrunid(req, "pause", &runid)) {
+		status = afm_urun_pause(runid, afb_req_get_uid(req));
+		reply_status(req, status);
+	}
+}
+
+/*
+ * On query "resume" from 'smsg' with parameters of 'obj'.
+ */
+static void resume(afb_req_t req)
+{
+	int runid, status;
+	if (onrunid(req, "resume", &runid)) {
+		status = afm_urun_resume(runid, afb_req_get_uid(req));
+		reply_status(req, status);
+	}
+}
+
+/*
+ * On query "place"
+ *
+ * The parameter "class" gives the class of placement, in the
+ * placement policy file, of the CPUs and memory nodes to use.
+ */
+static void place(afb_req_t req)
+{
+	int runid, status;
+	const char *class;
+
+	if (wrap_json_unpack(afb_req_json(req), "{ss}", _class_, &class))
+		bad_request(req);
+	else if (onrunid(req, "place", &runid)) {
+		status = afm_urun_place(afudb, runid, afb_req_get_uid(req), class);
+		reply_status(req, status);
+	}
+}
+
+/*
+ * Replies to "terminate" when the unit is empty
+ */
+static void terminate_done(void *closure, int status)
+{
+	afb_req_t req = closure;
+
+	reply_status(req, status);
+	afb_req_unref(req);
+}
+
+/*
+ * On query "terminate"
+ *
+ * The optional parameter "grace" gives in milliseconds the delay
+ * before killing the processes still alive.
+ */
+static void terminate(afb_req_t req)
+{
+	int runid, grace, rc;
+
+	if (onrunid(req, "terminate", &runid)) {
+		if (wrap_json_unpack(afb_req_json(req), "{si}", _grace_, &grace))
+			grace = -1;
+		rc = afm_urun_terminate_async(afudb, runid, afb_req_get_uid(req), grace,
+							terminate_done, afb_req_addref(req));
+		if (rc < 0) {
+			reply_status(req, rc);
+			afb_req_unref(req);
+		}
+	}
+}
+
+/*
+ * Replies to the queries "runners" and "state" when the result is known
+ */
+static void reply_done(void *closure, struct json_object *resp)
+{
+	afb_req_t req = closure;
+
+	reply(req, resp);
+	afb_req_unref(req);
+}
+
+/*
+ * On query "runners"
+ */
+static void runners(afb_req_t req)
+{
+	int all;
+	all = get_all(req);
+	if (afm_urun_list_async(afudb, all, afb_req_get_uid(req), reply_done, afb_req_addref(req)) < 0) {
+		reply(req, NULL);
+		afb_req_unref(req);
+	}
+}
+
+/*
+ * On query "state"
+ */
+static void state(afb_req_t req)
+{
+	int runid;
+	const char *appid;
+	struct json_object *json, *resp;
+
+	/* applications waiting their activation on demand have no runid */
+	json = afb_req_json(req);
+	if (!wrap_json_unpack(json, "s", &appid) || !wrap_json_unpack(json, "{ss}", _id_, &appid)) {
+		resp = afm_urun_state_on_demand(afudb, appid, afb_req_get_uid(req));
+		if (resp) {
+			reply(req, resp);
+			return;
+		}
+	}
+
+	if (onrunid(req, "state", &runid)
+	 && afm_urun_state_async(afudb, runid, afb_req_get_uid(req), reply_done, afb_req_addref(req)) < 0) {
+		reply(req, NULL);
+		afb_req_unref(req);
+	}
+}
+
+/*
+ * On query "history"
+ */
+static void history(afb_req_t req)
+{
+	const char *id;
+	int failed, clean;
+	struct json_object *json, *resp;
+
+	/* scan the request */
+	id = NULL;
+	failed = clean = 0;
+	json = afb_req_json(req);
+	if (json_object_is_type(json, json_type_object)
+	 && wrap_json_unpack(json, "{s?s s?b s?b}",
+				_id_, &id,
+				_failed_, &failed,
+				_clean_, &clean))
+		return bad_request(req);
 
-	/* wants details for appid */
-	resp = afm_udb_get_application_public(afudb, appid, afb_req_get_uid(req), lang);
+	resp = afm_urun_history(afb_req_get_uid(req), id, failed, clean);
+	reply(req, resp);
+}
+
+/*
+ * On query "stats"
+ */
+static void stats(afb_req_t req)
+{
+	struct json_object *resp, *rel;
+
+	resp = afm_urun_stats();
+	if (resp && !wrap_json_pack(&rel, "{si si sb sb si si si}",
+				"delay-ms", reload_delay_ms,
+				"max-delay-ms", reload_max_delay_ms,
+				"pending", reload_pending,
+				"running", reload_running,
+				"requested", reload_stats.requested,
+				"performed", reload_stats.performed,
+				"waited", reload_stats.waited))
+		json_object_object_add(resp, _reload_, rel);
 	if (resp)
-		afb_req_success(req, resp, NULL);
-	else
-		not_found(req);
+		json_object_object_add(resp, _icons_, afm_icons_stats());
+	reply(req, resp);
 }
 
 /*
- * On query "start"
+ * On query "reload"
  */
-static void start(afb_req_t req)
+static void reload(afb_req_t req)
 {
-	const char *appid;
-	struct json_object *appli, *resp;
-	int runid;
+	struct json_object *resp;
+	int pending;
 
-	/* scan the request */
-	if (!onappid(req, _start_, &appid))
-		return;
+	pending = reload_pending;
+	flush_reloads();
+	wrap_json_pack(&resp, "{sb}", _reloaded_, pending);
+	send_reply(req, resp, NULL, NULL);
+}
 
-	/* get the application */
-	appli = afm_udb_get_application_private(afudb, appid, afb_req_get_uid(req));
-	if (appli == NULL) {
-		not_found(req);
-		return;
+/*
+ * Jobs of installation and uninstallation
+ *
+ * The installations and uninstallations are run by the program
+ * wgtpkg-install in a subprocess so that the other verbs are served
+ * meanwhile from the current database. The jobs are run one after
+ * the other. The subprocess reports its progress on a pipe (see
+ * main-wgtpkg-install.c) and the progress is broadcasted with the
+ * event "install-progress". At the end of the job, the database is
+ * updated, the reload of systemd is requested and the reply is sent.
+ */
+struct install_job {
+	struct install_job *next;	/* next job of the queue */
+	int id;				/* the handle of the job */
+	const char *operation;		/* _install_, _install_many_ or _uninstall_ */
+	afb_req_t req;			/* the request or NULL when already replied */
+	int uid;			/* uid of the requester */
+	char *root;			/* the root directory */
+	int force;			/* force the reinstallation */
+	int reload;			/* request the reload of systemd */
+	int atomic;			/* rollback all on failure */
+	struct json_object *items;	/* array of the wgt files or ids */
+	struct json_object *results;	/* array of the results of the items */
+	pid_t pid;			/* the pid of the installer */
+	int fd;				/* the progress pipe */
+	struct sd_event_source *source;	/* the event source of the pipe */
+	size_t length;			/* length of the pending line */
+	char line[PATH_MAX + 128];	/* the pending line */
+};
+
+/* the queue of the jobs, the head is running */
+static struct install_job *jobs_head, *jobs_tail;
+
+/* the last handle of job */
+static int jobs_last_id;
+
+static void job_end(struct install_job *job);
+
+/*
+ * Sends the 'step' of 'job' for the 'item' with the 'data' (given)
+ * as event "install-progress"
+ */
+static void job_event(struct install_job *job, const char *step, const char *item, struct json_object *data)
+{
+	struct json_object *e = NULL;
+
+	wrap_json_pack(&e, "{si ss ss s?s s?o}",
+			_job_, job->id,
+			"operation", job->operation,
+			"step", step,
+			"item", item,
+			"result", data);
+	afb_event_broadcast(install_progress_event, e);
+}
+
+/*
+ * Returns the first word of '*line' and sets '*line' to the next word
+ * or NULL if none
+ */
+static char *next_word(char **line)
+{
+	char *word, *end;
+
+	word = *line;
+	if (word) {
+		end = strchr(word, ' ');
+		if (end)
+			*end++ = 0;
+		*line = end;
 	}
+	return word;
+}
 
-	/* launch the application */
-	runid = afm_urun_start(appli, afb_req_get_uid(req));
-	if (runid < 0) {
-		cant_start(req);
+/*
+ * Returns the item of 'job' whose index is given by the 'word' or NULL
+ * if not valid. Then stores the index in 'index'.
+ */
+static const char *job_item(struct install_job *job, const char *word, int *index)
+{
+	char *end;
+	long value;
+
+	value = word ? strtol(word, &end, 10) : -1;
+	if (!word || *end || value < 0 || value >= (long)json_object_array_length(job->items))
+		return NULL;
+	*index = (int)value;
+	return json_object_get_string(json_object_array_get_idx(job->items, *index));
+}
+
+/*
+ * Treats the progress 'line' received from the installer of 'job'.
+ * The items are designated by their index, see main-wgtpkg-install.c.
+ */
+static void job_line(struct install_job *job, char *line)
+{
+	int index;
+	char *keyword, *word1, *word2;
+	const char *item;
+	struct json_object *result = NULL;
+
+	keyword = next_word(&line);
+	item = job_item(job, next_word(&line), &index);
+	if (!item) {
+		WARNING("unexpected progress %s of installer", keyword);
+		return;
+	}
+	if (!strcmp(keyword, "step") && line) {
+		/* step INDEX NAME */
+		job_event(job, line, item, NULL);
 		return;
 	}
+	if (!strcmp(keyword, "rolledback")) {
+		/* rolledback INDEX */
+		result = json_object_array_get_idx(job->results, (size_t)index);
+		if (result) {
+			json_object_object_del(result, _added_);
+			json_object_object_add(result, "rolled-back", json_object_new_boolean(1));
+		}
+		return;
+	}
+	if (!strcmp(keyword, "added") && (word1 = next_word(&line)) && (word2 = next_word(&line))) {
+		/* added INDEX ID IDAVER */
+		wrap_json_pack(&result, "{ss ss ss}", "wgt", item, _id_, word1, _added_, word2);
+	}
+	else if (!strcmp(keyword, _removed_)) {
+		/* removed INDEX */
+		wrap_json_pack(&result, "{ss sb}", _id_, item, _removed_, 1);
+	}
+	else if (!strcmp(keyword, _failed_) && line) {
+		/* failed INDEX ERRNO */
+		wrap_json_pack(&result, "{ss ss}",
+				job->operation == _uninstall_ ? _id_ : "wgt", item,
+				"error", strerror(atoi(line)));
+	}
+	else
+		WARNING("unexpected progress %s of installer", keyword);
+	if (result)
+		json_object_array_put_idx(job->results, (size_t)index, result);
+}
 
-	/* returns */
-	resp = NULL;
-#if 0
-	wrap_json_pack(&resp, "{si}", _runid_, runid);
-#else
-	if (runid)
-		wrap_json_pack(&resp, "i", runid);
-#endif
-	afb_req_success(req, resp, NULL);
+/*
+ * Reads the progress pipe of 'job'.
+ * Returns 1 when the pipe reached its end or 0 otherwise.
+ */
+static int job_read(struct install_job *job)
+{
+	ssize_t sizr;
+	char *end;
+
+	sizr = read(job->fd, &job->line[job->length], sizeof job->line - 1 - job->length);
+	if (sizr < 0)
+		return errno != EINTR && errno != EAGAIN;
+	if (sizr == 0)
+		return 1;
+	job->length += (size_t)sizr;
+	job->line[job->length] = 0;
+	while ((end = strchr(job->line, '\n'))) {
+		*end++ = 0;
+		job_line(job, job->line);
+		job->length -= (size_t)(end - job->line);
+		memmove(job->line, end, job->length + 1);
+	}
+	if (job->length == sizeof job->line - 1) {
+		WARNING("progress line of installer too long");
+		job->length = 0;
+	}
+	return 0;
 }
 
 /*
- * On query "once"
+ * Called when the progress pipe of a job is readable
  */
-static void once(afb_req_t req)
+static int on_job_io(sd_event_source *source, int fd, uint32_t revents, void *closure)
 {
-	const char *appid;
-	struct json_object *appli, *resp;
-	int runid;
+	struct install_job *job = closure;
 
-	/* scan the request */
-	if (!onappid(req, _once_, &appid))
-		return;
+	if (job_read(job))
+		job_end(job);
+	return 0;
+}
 
-	/* get the application */
-	appli = afm_udb_get_application_private(afudb, appid, afb_req_get_uid(req));
-	if (appli == NULL) {
-		not_found(req);
-		return;
+/*
+ * Starts the installer for 'job'.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+static int job_spawn(struct install_job *job)
+{
+	int fds[2], i, n, argc;
+	char fdstr[20];
+	const char **argv;
+
+	n = (int)json_object_array_length(job->items);
+	argv = alloca((size_t)(n + 10) * sizeof *argv);
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	snprintf(fdstr, sizeof fdstr, "%d", fds[1]);
+
+	/* arguments of the installer */
+	argc = 0;
+	argv[argc++] = WGTPKG_INSTALL_PROGRAM;
+	if (job->operation == _uninstall_)
+		argv[argc++] = "-u";
+	if (job->force)
+		argv[argc++] = "-f";
+	if (job->atomic)
+		argv[argc++] = "-a";
+	argv[argc++] = "-P";
+	argv[argc++] = fdstr;
+	argv[argc++] = "--";
+	argv[argc++] = job->root;
+	for (i = 0 ; i < n ; i++)
+		argv[argc++] = json_object_get_string(json_object_array_get_idx(job->items, i));
+	argv[argc] = NULL;
+
+	/* launch */
+	job->pid = fork();
+	if (job->pid == 0) {
+		fcntl(fds[1], F_SETFD, 0);
+		execv(argv[0], (char * const*)argv);
+		_exit(127);
 	}
+	close(fds[1]);
+	if (job->pid < 0) {
+		close(fds[0]);
+		return -1;
+	}
+	job->fd = fds[0];
+	return 0;
+}
 
-	/* launch the application */
-	runid = afm_urun_once(appli, afb_req_get_uid(req));
-	if (runid < 0) {
-		cant_start(req);
-		return;
+/*
+ * Runs the 'job' at the head of the queue
+ */
+static void job_run(struct install_job *job)
+{
+	if (job_spawn(job) < 0) {
+		ERROR("can't launch %s: %m", WGTPKG_INSTALL_PROGRAM);
+		job_end(job);
 	}
+	else if (!evloop || sd_event_add_io(evloop, &job->source, job->fd, EPOLLIN, on_job_io, job) < 0) {
+		/* no event loop: wait the end */
+		while (!job_read(job));
+		job_end(job);
+	}
+}
+
+/*
+ * Checks that 'item' can be given to the installer: not empty,
+ * not an option and without control characters
+ */
+static int valid_item(const char *item)
+{
+	if (!item || !*item || *item == '-')
+		return 0;
+	while (*item)
+		if (iscntrl((unsigned char)*item++))
+			return 0;
+	return 1;
+}
+
+/*
+ * Returns a new array containing the 'string'
+ */
+static struct json_object *string_array(const char *string)
+{
+	struct json_object *array;
 
-	/* returns the state */
-	resp = runid ? afm_urun_state(afudb, runid, afb_req_get_uid(req)) : NULL;
-	afb_req_success(req, resp, NULL);
+	array = json_object_new_array();
+	if (array)
+		json_object_array_add(array, json_object_new_string(string));
+	return array;
 }
 
 /*
- * On query "pause"
+ * Creates a job for 'operation' of 'items' (given) requested by 'req'
+ * with the options 'root', 'force', 'reload' and 'atomic' and queues it.
+ * When 'async' is true, the request is replied with the handle of the job.
  */
-static void pause(afb_req_t req)
+static void job_queue(afb_req_t req, const char *operation, struct json_object *items,
+			const char *root, int force, int reload, int atomic, int async)
 {
-	int runid, status;
-	if (onrunid(req, "pause", &runid)) {
-		status = afm_urun_pause(runid, afb_req_get_uid(req));
-		reply_status(req, status);
+	int i, n;
+	struct install_job *job;
+	struct json_object *resp;
+
+	/* the items are arguments of the installer */
+	n = items ? (int)json_object_array_length(items) : 0;
+	for (i = 0 ; i < n ; i++) {
+		if (!valid_item(json_object_get_string(json_object_array_get_idx(items, i)))) {
+			json_object_put(items);
+			bad_request(req);
+			return;
+		}
+	}
+
+	job = items ? calloc(1, sizeof *job) : NULL;
+	if (job) {
+		job->root = strdup(root);
+		job->results = json_object_new_array();
 	}
+	if (!job || !job->root || !job->results) {
+		if (job) {
+			free(job->root);
+			json_object_put(job->results);
+			free(job);
+		}
+		json_object_put(items);
+		send_reply(req, NULL, _failed_, "out of memory");
+		return;
+	}
+	job->id = ++jobs_last_id;
+	job->operation = operation;
+	job->uid = afb_req_get_uid(req);
+	job->force = force;
+	job->reload = reload;
+	job->atomic = atomic;
+	job->items = items;
+	job->fd = -1;
+	if (async) {
+		wrap_json_pack(&resp, "{si}", _job_, job->id);
+		send_reply(req, resp, NULL, NULL);
+	}
+	else
+		job->req = afb_req_addref(req);
+
+	/* queue and run if first */
+	if (jobs_tail)
+		jobs_tail->next = job;
+	else
+		jobs_head = job;
+	jobs_tail = job;
+	if (jobs_head == job)
+		job_run(job);
 }
 
 /*
- * On query "resume" from 'smsg' with parameters of 'obj'.
+ * Sends the reply 'resp' (given, can be NULL) of 'job' or,
+ * if 'error' isn't NULL, the failure 'error'
+ * When the request was already replied, the reply is sent
+ * as the step "done" or "failed" of the job.
  */
-static void resume(afb_req_t req)
+static void job_reply(struct install_job *job, struct json_object *resp, const char *error)
 {
-	int runid, status;
-	if (onrunid(req, "resume", &runid)) {
-		status = afm_urun_resume(runid, afb_req_get_uid(req));
-		reply_status(req, status);
+	char *info;
+
+	if (job->req) {
+		if (!error)
+			send_reply(job->req, resp, NULL, NULL);
+		else {
+			info = NULL;
+			if (asprintf(&info, "%s failed: %s", job->operation, error) < 0)
+				info = NULL;
+			send_reply(job->req, NULL, _failed_, info ?: error);
+			free(info);
+		}
+		afb_req_unref(job->req);
+		job->req = NULL;
 	}
+	else if (!error)
+		job_event(job, "done", NULL, resp);
+	else
+		job_event(job, _failed_, error, NULL);
 }
 
 /*
- * On query "terminate"
+ * Commits the installations of 'job': one update of the database,
+ * one reload and one event
  */
-static void terminate(afb_req_t req)
+static void job_commit_install(struct install_job *job)
 {
-	int runid, status;
-	if (onrunid(req, "terminate", &runid)) {
-		status = afm_urun_terminate(runid, afb_req_get_uid(req));
-		reply_status(req, status);
+	int i, n, installed, failed, needed;
+	const char *idaver, *id, *error;
+	struct json_object *result, *added, *appli, *resp;
+
+	/* the installed widgets, the rolled back ones are removed by the installer */
+	n = (int)json_object_array_length(job->results);
+	added = json_object_new_array();
+	for (i = 0 ; i < n ; i++) {
+		result = json_object_array_get_idx(job->results, i);
+		if (!wrap_json_unpack(result, "{ss}", _added_, &idaver))
+			json_object_array_add(added, json_object_new_string(idaver));
+	}
+	installed = (int)json_object_array_length(added);
+	failed = (int)json_object_array_length(job->items) - installed;
+
+	/* commit */
+	if (installed) {
+		update_applications();
+		needed = 0;
+		for (i = 0 ; i < n ; i++) {
+			result = json_object_array_get_idx(job->results, i);
+			if (wrap_json_unpack(result, "{ss ss}", _id_, &id, _added_, &idaver))
+				continue;
+			appli = afm_udb_get_application_private(afudb, idaver, job->uid);
+			if (job->reload && (!appli || afm_urun_needs_reload(appli))) {
+				add_reload_ids(id, idaver);
+				needed = 1;
+			}
+			json_object_put(appli);
+		}
+		if (needed)
+			request_reloads(NULL, NULL);
+	}
+
+	/* reply */
+	if (job->operation == _install_many_) {
+		wrap_json_pack(&resp, "{si si sO}",
+				"installed", installed,
+				_failed_, failed,
+				"results", job->results);
+		job_reply(job, resp, NULL);
+		if (installed)
+			application_list_changed_many(_install_many_, json_object_get(added));
+	}
+	else if (!installed) {
+		error = "installer failed";
+		if (n)
+			wrap_json_unpack(json_object_array_get_idx(job->results, 0), "{ss}", "error", &error);
+		job_reply(job, NULL, error);
+	}
+	else {
+		idaver = json_object_get_string(json_object_array_get_idx(added, 0));
+		wrap_json_pack(&resp, "{ss}", _added_, idaver);
+		job_reply(job, resp, NULL);
+		application_list_changed(_install_, idaver);
 	}
+	json_object_put(added);
 }
 
 /*
- * On query "runners"
+ * Commits the uninstallation of 'job'
  */
-static void runners(afb_req_t req)
+static void job_commit_uninstall(struct install_job *job)
 {
-	int all;
-	struct json_object *resp;
-	all = get_all(req);
-	resp = afm_urun_list(afudb, all, afb_req_get_uid(req));
-	afb_req_success(req, resp, NULL);
+	const char *idaver, *error;
+	struct json_object *result;
+
+	result = json_object_array_get_idx(job->results, 0);
+	if (!result || wrap_json_unpack(result, "{ss}", "error", &error) == 0)
+		job_reply(job, NULL, result ? error : "installer failed");
+	else {
+		idaver = json_object_get_string(json_object_array_get_idx(job->items, 0));
+		update_applications();
+		request_reloads(NULL, NULL);
+		job_reply(job, NULL, NULL);
+		application_list_changed(_uninstall_, idaver);
+	}
 }
 
 /*
- * On query "state"
+ * Ends the 'job' at the head of the queue and runs the next one
  */
-static void state(afb_req_t req)
+static void job_end(struct install_job *job)
 {
-	int runid;
-	struct json_object *resp;
-	if (onrunid(req, "state", &runid)) {
-		resp = afm_urun_state(afudb, runid, afb_req_get_uid(req));
-		reply(req, resp);
+	int rc, status;
+
+	/* wait the installer */
+	if (job->source)
+		sd_event_source_unref(job->source);
+	if (job->fd >= 0)
+		close(job->fd);
+	if (job->pid > 0) {
+		do {
+			rc = waitpid(job->pid, &status, 0);
+		} while (rc < 0 && errno == EINTR);
+		if (rc > 0 && (!WIFEXITED(status) || WEXITSTATUS(status)))
+			ERROR("installer of job %d ended abnormally (status %d)", job->id, status);
 	}
+
+	/* commit */
+	if (job->operation == _uninstall_)
+		job_commit_uninstall(job);
+	else
+		job_commit_install(job);
+
+	/* dequeue */
+	jobs_head = job->next;
+	if (!jobs_head)
+		jobs_tail = NULL;
+	json_object_put(job->items);
+	json_object_put(job->results);
+	free(job->root);
+	free(job);
+
+	/* next job */
+	if (jobs_head)
+		job_run(jobs_head);
 }
 
 /*
@@ -520,44 +1929,74 @@ static void install(afb_req_t req)
 	const char *root;
 	int force;
 	int reload;
-	struct wgt_info *ifo;
+	int async;
 	struct json_object *json;
-	struct json_object *resp;
 
 	/* default settings */
 	root = rootdir;
 	force = 0;
 	reload = 1;
+	async = 0;
 
 	/* scan the request */
 	json = afb_req_json(req);
 	if (wrap_json_unpack(json, "s", &wgtfile)
-		&& wrap_json_unpack(json, "{ss s?s s?b s?b}",
+		&& wrap_json_unpack(json, "{ss s?s s?b s?b s?b}",
 				"wgt", &wgtfile,
 				"root", &root,
 				"force", &force,
-				"reload", &reload)) {
+				"reload", &reload,
+				"async", &async)) {
 		return bad_request(req);
 	}
 
-	/* install the widget */
-	ifo = install_widget(wgtfile, root, force);
-	if (ifo == NULL)
-		afb_req_fail_f(req, "failed", "installation failed: %m");
-	else {
-		afm_udb_update(afudb);
-		/* reload if needed */
-		if (reload)
-			do_reloads();
+	/* queue the installation of the widget */
+	job_queue(req, _install_, string_array(wgtfile), root, force, reload, 0, async);
+}
+
+/*
+ * On querying installation of many widgets
+ *
+ * The widgets are installed in sequence and committed together:
+ * one update of the database, one reload of systemd and one
+ * event "application-list-changed". When "atomic" is true, the
+ * widgets installed by the request are uninstalled if one fails.
+ */
+static void install_many(afb_req_t req)
+{
+	const char *root;
+	int force, reload, atomic, async;
+	int i, n;
+	struct json_object *json;
+	struct json_object *wgts;
 
-		/* build the response */
-		wrap_json_pack(&resp, "{ss}", _added_, wgt_info_desc(ifo)->idaver);
-		afb_req_success(req, resp, NULL);
-		application_list_changed(_install_, wgt_info_desc(ifo)->idaver);
+	/* default settings */
+	root = rootdir;
+	force = 0;
+	reload = 1;
+	atomic = 0;
+	async = 0;
 
-		/* clean-up */
-		wgt_info_unref(ifo);
-	}
+	/* scan the request */
+	json = afb_req_json(req);
+	wgts = json;
+	if ((!json_object_is_type(json, json_type_array)
+		&& wrap_json_unpack(json, "{so s?s s?b s?b s?b s?b}",
+				"wgts", &wgts,
+				"root", &root,
+				"force", &force,
+				"reload", &reload,
+				"atomic", &atomic,
+				"async", &async))
+	 || !json_object_is_type(wgts, json_type_array))
+		return bad_request(req);
+	n = (int)json_object_array_length(wgts);
+	for (i = 0 ; i < n ; i++)
+		if (!json_object_is_type(json_object_array_get_idx(wgts, i), json_type_string))
+			return bad_request(req);
+
+	/* queue the installation of the widgets */
+	job_queue(req, _install_many_, json_object_get(wgts), root, force, reload, atomic, async);
 }
 
 /*
@@ -567,43 +2006,233 @@ static void uninstall(afb_req_t req)
 {
 	const char *idaver;
 	const char *root;
+	int async;
 	struct json_object *json;
-	int rc;
 
 	/* default settings */
 	root = rootdir;
+	async = 0;
 
 	/* scan the request */
 	json = afb_req_json(req);
 	if (wrap_json_unpack(json, "s", &idaver)
-		&& wrap_json_unpack(json, "{ss s?s}",
+		&& wrap_json_unpack(json, "{ss s?s s?b}",
 				_id_, &idaver,
-				"root", &root)) {
+				"root", &root,
+				"async", &async)) {
 		return bad_request(req);
 	}
 
-	/* install the widget */
-	rc = uninstall_widget(idaver, root);
-	if (rc)
-		afb_req_fail_f(req, "failed", "uninstallation failed: %m");
+	/* queue the uninstallation of the widget */
+	job_queue(req, _uninstall_, string_array(idaver), root, 0, 0, 0, async);
+}
+
+/*
+ * On query "subscribe"
+ */
+static void subscribe(afb_req_t req)
+{
+	int rc;
+	const char *delivery;
+	struct json_object *json;
+
+	/* get the optional delivery */
+	delivery = _coalesced_;
+	json = afb_req_json(req);
+	if (json_object_is_type(json, json_type_object)
+	 && wrap_json_unpack(json, "{s?s}", _delivery_, &delivery)) {
+		bad_request(req);
+		return;
+	}
+
+	/* the coalesced event is broadcasted to all */
+	if (!strcmp(delivery, _immediate_)) {
+		afb_req_unsubscribe(req, applist_batch_event);
+		rc = afb_req_subscribe(req, applist_immediate_event);
+	} else if (!strcmp(delivery, _batch_)) {
+		afb_req_unsubscribe(req, applist_immediate_event);
+		rc = afb_req_subscribe(req, applist_batch_event);
+	} else if (!strcmp(delivery, _coalesced_)) {
+		afb_req_unsubscribe(req, applist_batch_event);
+		rc = afb_req_unsubscribe(req, applist_immediate_event);
+	} else {
+		bad_request(req);
+		return;
+	}
+	reply_status(req, rc);
+}
+
+/*
+ * On query "metrics"
+ */
+static void metrics(afb_req_t req)
+{
+	char *text;
+	const char *format;
+	struct json_object *json, *resp;
+
+	/* get the optional format */
+	format = NULL;
+	json = afb_req_json(req);
+	if (json_object_is_type(json, json_type_object)
+	 && wrap_json_unpack(json, "{s?s}", _format_, &format)) {
+		bad_request(req);
+		return;
+	}
+	if (!format || !strcmp(format, "json"))
+		resp = metrics_json();
+	else if (!strcmp(format, _prometheus_)) {
+		text = metrics_prometheus("afm_");
+		resp = text ? json_object_new_string(text) : NULL;
+		free(text);
+	}
 	else {
-		afm_udb_update(afudb);
-		afb_req_success(req, NULL, NULL);
-		application_list_changed(_uninstall_, idaver);
+		bad_request(req);
+		return;
+	}
+	reply(req, resp);
+}
+
+/*
+ * Exports periodically the metrics to the file
+ */
+static int on_metrics_timer(sd_event_source *source, uint64_t usec, void *closure)
+{
+	if (metrics_write_prometheus(metrics_file, "afm_") < 0)
+		WARNING("can't write metrics to %s: %m", metrics_file);
+	sd_event_source_set_time(source, usec + (uint64_t)metrics_period * 1000000);
+	return 0;
+}
+
+/*
+ * Initialise the metering of the verbs of 'verbs' and the
+ * export of the metrics
+ */
+static void init_metrics(const afb_verb_t *verbs)
+{
+	const char *period;
+	uint64_t usec;
+	struct metered *m;
+
+	for ( ; verbs->verb ; verbs++) {
+		if (verbs->callback == metered) {
+			m = verbs->vcbdata;
+			m->verb = metrics_verb_get(verbs->verb);
+		}
+	}
+
+	applist_metrics = metrics_event_get(_a_l_c_);
+	applist_immediate_metrics = metrics_event_get(_a_l_c_i_);
+	applist_batch_metrics = metrics_event_get(_a_l_c_b_);
+
+	metrics_file = getenv("AFM_METRICS_FILE");
+	period = getenv("AFM_METRICS_PERIOD");
+	if (period)
+		metrics_period = atoi(period);
+	if (metrics_file && *metrics_file && metrics_period > 0 && evloop
+	 && sd_event_now(evloop, CLOCK_MONOTONIC, &usec) >= 0) {
+		usec += (uint64_t)metrics_period * 1000000;
+		if (sd_event_add_time(evloop, &metrics_timer, CLOCK_MONOTONIC,
+					usec, 0, on_metrics_timer, NULL) < 0
+		 || sd_event_source_set_enabled(metrics_timer, SD_EVENT_ON) < 0)
+			WARNING("can't export metrics to %s", metrics_file);
+	}
+}
+
+/*
+ * Updates the applications if SIGHUP was received
+ */
+static void run_sighup()
+{
+	if (sighup_received) {
+		sighup_received = 0;
+		update_applications();
+		application_list_changed(_update_, _update_);
 	}
 }
 
+/*
+ * Handler of SIGHUP: only records it and wakes up the event loop
+ * because updating the applications isn't async-signal-safe.
+ */
 static void onsighup(int signal)
 {
-	afm_udb_update(afudb);
-	application_list_changed(_update_, _update_);
+	int saved = errno;
+
+	sighup_received = 1;
+	wake_event_loop();
+	errno = saved;
 }
 
+extern const afb_binding_t afbBindingExport;
+
 static int init(afb_api_t api)
 {
+	const char *maxjobs, *delay, *cgmode, *mode, *maxage, *grace, *readahead, *coalesce;
+
 	/* create TRUE */
 	json_true = json_object_new_boolean(1);
 
+	/* init the start scheduler */
+	evloop = afb_api_get_event_loop(api);
+	afm_urun_set_event_loop(evloop);
+	maxjobs = getenv("AFM_START_MAX_JOBS");
+	if (maxjobs)
+		afm_urun_set_max_jobs(atoi(maxjobs));
+	mode = getenv("AFM_LAUNCH_MODE");
+	if (mode) {
+		if (afm_urun_launch_mode_of_name(mode) < 0)
+			WARNING("unknown launch mode %s", mode);
+		else
+			afm_urun_set_launch_mode((enum afm_launch_mode)afm_urun_launch_mode_of_name(mode));
+	}
+
+	readahead = getenv("AFM_READAHEAD");
+	if (readahead) {
+		if (afm_urun_readahead_mode_of_name(readahead) < 0)
+			WARNING("unknown readahead mode %s", readahead);
+		else
+			afm_urun_set_readahead_mode((enum afm_readahead_mode)afm_urun_readahead_mode_of_name(readahead));
+	}
+	readahead = getenv("AFM_READAHEAD_SECONDS");
+	if (readahead)
+		afm_urun_set_readahead_seconds(atoi(readahead));
+
+	grace = getenv("AFM_TERMINATE_GRACE_MS");
+	if (grace)
+		afm_urun_set_terminate_grace(atoi(grace));
+
+	maxage = getenv("AFM_HISTORY_MAX_AGE");
+	if (maxage)
+		afm_urun_set_history_max_age(atoi(maxage));
+
+	/* init the coalescing of reloads */
+	delay = getenv("AFM_RELOAD_DELAY_MS");
+	if (delay)
+		reload_delay_ms = atoi(delay);
+	delay = getenv("AFM_RELOAD_MAX_DELAY_MS");
+	if (delay)
+		reload_max_delay_ms = atoi(delay);
+
+	/* init the coalescing of the events of changes */
+	coalesce = getenv("AFM_APPLIST_COALESCE_MS");
+	if (coalesce)
+		applist_coalesce_ms = atoi(coalesce);
+
+	/* init the resolution of pids through cgroups */
+	cgmode = getenv("AFM_CGROUP_MODE");
+	if (cgmode) {
+		if (!strcmp(cgmode, "off"))
+			systemd_set_cgroup_mode(SysD_Cgroup_Off);
+		else if (!strcmp(cgmode, "validate"))
+			systemd_set_cgroup_mode(SysD_Cgroup_Validate);
+		else
+			systemd_set_cgroup_mode(SysD_Cgroup_On);
+	}
+
+	/* init the metrics of the verbs */
+	init_metrics(afbBindingExport.verbs);
+
 	/* init database */
 	afudb = afm_udb_create(1, 0, "afm-");
 	if (!afudb) {
@@ -611,26 +2240,51 @@ static int init(afb_api_t api)
 		return -1;
 	}
 
+	/* read ahead the files of the applications started at boot */
+	afm_urun_readahead_autostart(afudb);
+
+	/* run the verbs and the updates on SIGHUP in the event loop */
+	if (init_post() < 0)
+		return -1;
 	signal(SIGHUP, onsighup);
 
 	/* create the event */
 	applist_changed_event = afb_api_make_event(api, _a_l_c_);
-	return -!afb_event_is_valid(applist_changed_event);
+	applist_immediate_event = afb_api_make_event(api, _a_l_c_i_);
+	applist_batch_event = afb_api_make_event(api, _a_l_c_b_);
+	install_progress_event = afb_api_make_event(api, _install_progress_);
+	return -!(afb_event_is_valid(applist_changed_event)
+		&& afb_event_is_valid(applist_immediate_event)
+		&& afb_event_is_valid(applist_batch_event)
+		&& afb_event_is_valid(install_progress_event));
 }
 
+/*
+ * description of a verb whose calls are metered
+ */
+#define METERED(cb)	.callback=metered, .vcbdata=&(struct metered){ .callback=cb }
+
 static const afb_verb_t verbs[] =
 {
-	{.verb=_runnables_, .callback=runnables, .auth=&auth_detail,    .info="Get list of runnable applications",          .session=AFB_SESSION_CHECK },
-	{.verb=_detail_   , .callback=detail,    .auth=&auth_detail,    .info="Get the details for one application",        .session=AFB_SESSION_CHECK },
-	{.verb=_start_    , .callback=start,     .auth=&auth_start,     .info="Start an application",                       .session=AFB_SESSION_CHECK },
-	{.verb=_once_     , .callback=once,      .auth=&auth_start,     .info="Start once an application",                  .session=AFB_SESSION_CHECK },
-	{.verb=_terminate_, .callback=terminate, .auth=&auth_kill,      .info="Terminate a running application",            .session=AFB_SESSION_CHECK },
-	{.verb=_pause_    , .callback=pause,     .auth=&auth_kill,      .info="Pause a running application",                .session=AFB_SESSION_CHECK },
-	{.verb=_resume_   , .callback=resume,    .auth=&auth_kill,      .info="Resume a paused application",                .session=AFB_SESSION_CHECK },
-	{.verb=_runners_  , .callback=runners,   .auth=&auth_state,     .info="Get the list of running applications",       .session=AFB_SESSION_CHECK },
-	{.verb=_state_    , .callback=state,     .auth=&auth_state,     .info="Get the state of a running application",     .session=AFB_SESSION_CHECK },
-	{.verb=_install_  , .callback=install,   .auth=&auth_install,   .info="Install an application using a widget file", .session=AFB_SESSION_CHECK },
-	{.verb=_uninstall_, .callback=uninstall, .auth=&auth_uninstall, .info="Uninstall an application",                   .session=AFB_SESSION_CHECK },
+	{.verb=_runnables_, METERED(runnables), .auth=&auth_detail,    .info="Get list of runnable applications",          .session=AFB_SESSION_CHECK },
+	{.verb=_detail_   , METERED(detail),    .auth=&auth_detail,    .info="Get the details for one application",        .session=AFB_SESSION_CHECK },
+	{.verb=_icons_    , METERED(icons),     .auth=&auth_detail,    .info="Get the icons of the applications",          .session=AFB_SESSION_CHECK },
+	{.verb=_start_    , METERED(start),     .auth=&auth_start,     .info="Start an application",                       .session=AFB_SESSION_CHECK },
+	{.verb=_once_     , METERED(once),      .auth=&auth_start,     .info="Start once an application",                  .session=AFB_SESSION_CHECK },
+	{.verb=_terminate_, METERED(terminate), .auth=&auth_kill,      .info="Terminate a running application",            .session=AFB_SESSION_CHECK },
+	{.verb=_pause_    , METERED(pause_app), .auth=&auth_kill,      .info="Pause a running application",                .session=AFB_SESSION_CHECK },
+	{.verb=_resume_   , METERED(resume),    .auth=&auth_kill,      .info="Resume a paused application",                .session=AFB_SESSION_CHECK },
+	{.verb=_place_    , METERED(place),     .auth=&auth_kill,      .info="Place a running application on CPUs",        .session=AFB_SESSION_CHECK },
+	{.verb=_runners_  , METERED(runners),   .auth=&auth_state,     .info="Get the list of running applications",       .session=AFB_SESSION_CHECK },
+	{.verb=_state_    , METERED(state),     .auth=&auth_state,     .info="Get the state of a running application",     .session=AFB_SESSION_CHECK },
+	{.verb=_history_  , METERED(history),   .auth=&auth_state,     .info="Get the history of the recent runs",         .session=AFB_SESSION_CHECK },
+	{.verb=_stats_    , METERED(stats),     .auth=&auth_state,     .info="Get the statistics of the framework",        .session=AFB_SESSION_CHECK },
+	{.verb=_install_  , METERED(install),   .auth=&auth_install,   .info="Install an application using a widget file", .session=AFB_SESSION_CHECK },
+	{.verb=_install_many_, METERED(install_many), .auth=&auth_install, .info="Install many applications at once", .session=AFB_SESSION_CHECK },
+	{.verb=_uninstall_, METERED(uninstall), .auth=&auth_uninstall, .info="Uninstall an application",                   .session=AFB_SESSION_CHECK },
+	{.verb=_reload_   , METERED(reload),    .auth=&auth_install,   .info="Perform the pending reload of systemd",      .session=AFB_SESSION_CHECK },
+	{.verb=_subscribe_, METERED(subscribe), .auth=&auth_detail,    .info="Choose the delivery of the changes of the list", .session=AFB_SESSION_CHECK },
+	{.verb=_metrics_  , METERED(metrics),   .auth=&auth_state,     .info="Get the metrics of the verbs",               .session=AFB_SESSION_CHECK },
 	{.verb=NULL }
 };
 
@@ -0,0 +1,359 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <json-c/json.h>
+#include <openssl/sha.h>
+
+#include "verbose.h"
+#include "wgtpkg-base64.h"
+#include "afm-icons.h"
+
+#if !defined(AFM_ICONS_MAX_SIZE)
+# define AFM_ICONS_MAX_SIZE (1024 * 1024)
+#endif
+
+static const char key_id[] = "id";
+static const char key_icon[] = "icon";
+
+/*
+ * The content of an icon, shared by the icons of same content
+ */
+struct icon_data {
+	struct icon_data *next;		/* next content */
+	int refcount;			/* count of icons having the content */
+	size_t size;			/* size of the content */
+	char hash[2 * SHA256_DIGEST_LENGTH + 1]; /* hexadecimal SHA-256 of the content */
+	char data[];			/* the content */
+};
+
+/*
+ * An icon file
+ */
+struct icon {
+	struct icon *next;		/* next icon */
+	struct icon_data *data;		/* its content */
+	const char *type;		/* its media type */
+	char path[];			/* path of the file */
+};
+
+/* the cached icons */
+static struct icon *icons;
+
+/* the cached contents */
+static struct icon_data *contents;
+
+/* statistics of the cache */
+static struct {
+	unsigned long hits;		/* count of icons found in cache */
+	unsigned long misses;		/* count of icons read */
+	unsigned long invalidations;	/* count of invalidations */
+} stats;
+
+/*
+ * Get the media type of the icon of 'path' from its extension
+ */
+static const char *type_of_path(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+
+	if (ext) {
+		ext++;
+		if (!strcasecmp(ext, "png"))
+			return "image/png";
+		if (!strcasecmp(ext, "svg"))
+			return "image/svg+xml";
+		if (!strcasecmp(ext, "jpg") || !strcasecmp(ext, "jpeg"))
+			return "image/jpeg";
+		if (!strcasecmp(ext, "gif"))
+			return "image/gif";
+		if (!strcasecmp(ext, "ico"))
+			return "image/x-icon";
+	}
+	return "application/octet-stream";
+}
+
+/*
+ * Reads the content of the icon file 'path' and records it
+ * in the contents, sharing it with the icons of same content.
+ * Returns the content or NULL on error.
+ */
+static struct icon_data *read_content(const char *path)
+{
+	int fd;
+	ssize_t rsz;
+	size_t size;
+	struct stat st;
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	struct icon_data *data, *iter;
+	int i;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	data = NULL;
+	if (fstat(fd, &st) < 0)
+		goto end;
+	if (!S_ISREG(st.st_mode) || st.st_size > AFM_ICONS_MAX_SIZE) {
+		errno = EFBIG;
+		goto end;
+	}
+	data = malloc(sizeof *data + (size_t)st.st_size);
+	if (!data)
+		goto end;
+	size = 0;
+	while (size < (size_t)st.st_size) {
+		rsz = read(fd, &data->data[size], (size_t)st.st_size - size);
+		if (rsz > 0)
+			size += (size_t)rsz;
+		else if (rsz == 0)
+			break;
+		else if (errno != EINTR) {
+			free(data);
+			data = NULL;
+			goto end;
+		}
+	}
+	data->size = size;
+
+	/* compute the hash */
+	SHA256((const unsigned char*)data->data, size, md);
+	for (i = 0 ; i < SHA256_DIGEST_LENGTH ; i++)
+		sprintf(&data->hash[2 * i], "%02x", md[i]);
+
+	/* share the content */
+	for (iter = contents ; iter && strcmp(iter->hash, data->hash) ; iter = iter->next);
+	if (iter) {
+		free(data);
+		data = iter;
+		data->refcount++;
+	}
+	else {
+		data->refcount = 1;
+		data->next = contents;
+		contents = data;
+	}
+end:
+	close(fd);
+	return data;
+}
+
+/*
+ * Releases the reference of an icon to its content 'data'
+ */
+static void put_content(struct icon_data *data)
+{
+	struct icon_data **prv;
+
+	if (--data->refcount)
+		return;
+	for (prv = &contents ; *prv != data ; prv = &(*prv)->next);
+	*prv = data->next;
+	free(data);
+}
+
+/*
+ * Get the icon of 'path', reading it if not cached.
+ * Returns the icon or NULL on error.
+ */
+static struct icon *get_icon(const char *path)
+{
+	struct icon *icon;
+	size_t len;
+
+	for (icon = icons ; icon && strcmp(icon->path, path) ; icon = icon->next);
+	if (icon) {
+		stats.hits++;
+		return icon;
+	}
+
+	stats.misses++;
+	len = strlen(path);
+	icon = malloc(sizeof *icon + len + 1);
+	if (!icon)
+		return NULL;
+	icon->data = read_content(path);
+	if (!icon->data) {
+		INFO("can't read icon %s: %m", path);
+		free(icon);
+		return NULL;
+	}
+	icon->type = type_of_path(path);
+	memcpy(icon->path, path, len + 1);
+	icon->next = icons;
+	icons = icon;
+	return icon;
+}
+
+/*
+ * Is the 'hash' in the array 'known' of hashes?
+ */
+static int is_known(struct json_object *known, const char *hash)
+{
+	int i, n;
+
+	n = json_object_is_type(known, json_type_array) ? (int)json_object_array_length(known) : 0;
+	for (i = 0 ; i < n ; i++)
+		if (!strcmp(hash, json_object_get_string(json_object_array_get_idx(known, i)) ?: ""))
+			return 1;
+	return 0;
+}
+
+/*
+ * Packs the icons of the applications 'apps', an array of the
+ * public descriptions of applications having the keys "id" and "icon".
+ *
+ * Returns an object with the string "blob", the concatenation of the
+ * distinct contents of the icons encoded in base64, and the object
+ * "icons" giving for each application its icon: "hash", "type" and
+ * "offset" and "size" in the blob. The contents whose hash is in the
+ * array 'known' (can be NULL) are not put in the blob and have neither
+ * "offset" nor "size".
+ *
+ * Returns NULL on error.
+ */
+struct json_object *afm_icons_pack(struct json_object *apps, struct json_object *known)
+{
+	int i, n, j, count;
+	size_t size, offset;
+	char *blob, *b64;
+	struct json_object *app, *id, *path, *result, *desc, *descs;
+	struct icon *icon, **packed;
+
+	/* get the icons */
+	n = (int)json_object_array_length(apps);
+	packed = calloc((size_t)n + 1, sizeof *packed);
+	if (!packed)
+		return NULL;
+	size = 0;
+	for (count = i = 0 ; i < n ; i++) {
+		app = json_object_array_get_idx(apps, i);
+		if (json_object_object_get_ex(app, key_icon, &path)
+		 && json_object_is_type(path, json_type_string)) {
+			icon = get_icon(json_object_get_string(path));
+			if (icon) {
+				for (j = 0 ; j < count && packed[j]->data != icon->data ; j++);
+				if (j == count && !is_known(known, icon->data->hash)) {
+					packed[count++] = icon;
+					size += icon->data->size;
+				}
+			}
+		}
+	}
+
+	/* make the blob of distinct contents */
+	blob = malloc(size + 1);
+	result = json_object_new_object();
+	descs = json_object_new_object();
+	if (!blob || !result || !descs)
+		goto error;
+	for (offset = 0, j = 0 ; j < count ; j++) {
+		memcpy(&blob[offset], packed[j]->data->data, packed[j]->data->size);
+		offset += packed[j]->data->size;
+	}
+	b64 = base64encw(blob, size, UINT_MAX & ~3u);
+	if (!b64)
+		goto error;
+	json_object_object_add(result, "blob", json_object_new_string(b64));
+	free(b64);
+
+	/* describe the icons */
+	for (i = 0 ; i < n ; i++) {
+		app = json_object_array_get_idx(apps, i);
+		if (!json_object_object_get_ex(app, key_id, &id)
+		 || !json_object_object_get_ex(app, key_icon, &path)
+		 || !json_object_is_type(path, json_type_string))
+			continue;
+		for (icon = icons ; icon && strcmp(icon->path, json_object_get_string(path)) ; icon = icon->next);
+		if (!icon)
+			continue;
+		desc = json_object_new_object();
+		json_object_object_add(desc, "hash", json_object_new_string(icon->data->hash));
+		json_object_object_add(desc, "type", json_object_new_string(icon->type));
+		for (offset = 0, j = 0 ; j < count && packed[j]->data != icon->data ; j++)
+			offset += packed[j]->data->size;
+		if (j < count) {
+			json_object_object_add(desc, "offset", json_object_new_int64((int64_t)offset));
+			json_object_object_add(desc, "size", json_object_new_int64((int64_t)icon->data->size));
+		}
+		json_object_object_add(descs, json_object_get_string(id), desc);
+	}
+	json_object_object_add(result, "icons", descs);
+	free(blob);
+	free(packed);
+	return result;
+
+error:
+	json_object_put(descs);
+	json_object_put(result);
+	free(blob);
+	free(packed);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/*
+ * Drops the cached icons. To be called when applications are
+ * installed or uninstalled.
+ */
+void afm_icons_invalidate()
+{
+	struct icon *icon;
+
+	stats.invalidations++;
+	while ((icon = icons)) {
+		icons = icon->next;
+		put_content(icon->data);
+		free(icon);
+	}
+}
+
+/*
+ * Get the statistics of the cache of icons
+ */
+struct json_object *afm_icons_stats()
+{
+	size_t bytes;
+	int count;
+	struct icon *icon;
+	struct icon_data *data;
+	struct json_object *result;
+
+	for (count = 0, icon = icons ; icon ; icon = icon->next, count++);
+	for (bytes = 0, data = contents ; data ; data = data->next)
+		bytes += data->size;
+	result = json_object_new_object();
+	if (result) {
+		json_object_object_add(result, "icons", json_object_new_int(count));
+		json_object_object_add(result, "bytes", json_object_new_int64((int64_t)bytes));
+		json_object_object_add(result, "hits", json_object_new_int64((int64_t)stats.hits));
+		json_object_object_add(result, "misses", json_object_new_int64((int64_t)stats.misses));
+		json_object_object_add(result, "invalidations", json_object_new_int64((int64_t)stats.invalidations));
+	}
+	return result;
+}
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <ctype.h>
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
@@ -28,6 +29,7 @@
 
 #include <json-c/json.h>
 
+#include "verbose.h"
 #include "utils-json.h"
 #include "utils-systemd.h"
 #include "utils-file.h"
@@ -39,6 +41,7 @@ static const char service_extension[] = ".service";
 static const char key_unit_path[] = "-unit-path";
 static const char key_unit_name[] = "-unit-name";
 static const char key_unit_scope[] = "-unit-scope";
+static const char key_unit_directives[] = "unit-directives";
 static const char scope_user[] = "user";
 static const char scope_system[] = "system";
 static const char key_id[] = "id";
@@ -250,6 +253,115 @@ static int add_fields_of_content(
 	}
 }
 
+/*
+ * Returns the array of the directives "Key=value" of the sections
+ * [Unit] and [Service] of the unit 'content', except the X-AFM- ones.
+ * Comment lines are skipped and continued lines are joined.
+ * Returns NULL with errno set on error.
+ */
+static struct json_object *get_directives(const char *content)
+{
+	struct json_object *array, *item;
+	const char *line, *end, *key, *value, *last;
+	char *directive, *write;
+	size_t klen;
+	int keep;
+
+	array = json_object_new_array();
+	if (!array)
+		goto error;
+
+	keep = 0;
+	for (line = content ; *line ; line = end + !!*end) {
+		/* search the end of the line, continued lines included */
+		end = line + strcspn(line, "\n");
+		while (end > line && *(end - 1) == '\\' && *end)
+			end += 1 + strcspn(end + 1, "\n");
+		while (line < end && isspace((unsigned char)*line))
+			line++;
+		if (*line == '#' || *line == ';')
+			continue;
+		if (*line == '[') {
+			/* new section */
+			keep = !strncmp(line, "[Unit]", 6) || !strncmp(line, "[Service]", 9);
+			continue;
+		}
+		value = memchr(line, '=', (size_t)(end - line));
+		if (!keep || !value || !strncmp(line, x_afm_prefix, x_afm_prefix_length))
+			continue;
+
+		/* trim the key and the value */
+		key = value;
+		while (key > line && isspace((unsigned char)*(key - 1)))
+			key--;
+		klen = (size_t)(key - line);
+		for (value++ ; value < end && isspace((unsigned char)*value) ; value++);
+		for (last = end ; last > value && isspace((unsigned char)*(last - 1)) ; last--);
+
+		/* record "key=value", the continuations replaced by spaces */
+		directive = malloc(klen + (size_t)(last - value) + 2);
+		if (!directive)
+			goto error2;
+		memcpy(directive, line, klen);
+		write = &directive[klen];
+		*write++ = '=';
+		for ( ; value < last ; value++) {
+			if (*value == '\\' && value + 1 < last && value[1] == '\n')
+				*write++ = ' ', value++;
+			else
+				*write++ = *value;
+		}
+		*write = 0;
+		item = json_object_new_string(directive);
+		free(directive);
+		if (!item)
+			goto error2;
+		json_object_array_add(array, item);
+	}
+	return array;
+
+error2:
+	json_object_put(array);
+error:
+	errno = ENOMEM;
+	return NULL;
+}
+
+/*
+ * Records in 'priv' the array of the directives of the unit 'content'
+ * of name 'unitname', for launching the application as a transient
+ * unit. When one of the directives can't be translated to a property
+ * of transient unit, nothing is recorded and the application will be
+ * launched from its unit file.
+ * Returns 0 on success or -1 on error.
+ */
+static int add_directives(
+		struct json_object *priv,
+		const char *content,
+		const char *unitname
+)
+{
+	struct json_object *array;
+	const char *directive;
+	size_t i, n;
+
+	array = get_directives(content);
+	if (!array)
+		return -1;
+
+	n = json_object_array_length(array);
+	for (i = 0 ; i < n ; i++) {
+		directive = json_object_get_string(json_object_array_get_idx(array, i));
+		if (systemd_transient_directive_check(directive) < 0) {
+			NOTICE("%s can't be launched as transient unit because of %s", unitname, directive);
+			json_object_put(array);
+			return 0;
+		}
+	}
+	json_object_object_add(priv, key_unit_directives, array);
+	return 0;
+}
+
 /*
  * Adds the application widget 'desc' of the directory 'path' to the
  * afm_apps object 'apps'.
@@ -284,7 +396,8 @@ static int addunit(
 	assert(!memcmp(&unitname[len - (sizeof service_extension - 1)], service_extension, sizeof service_extension));
 
 	/* adds the values */
-	if (add_fields_of_content(priv, pub, content, length)
+	if (add_directives(priv, content, unitname)
+	 || add_fields_of_content(priv, pub, content, length)
 	 || add_field(priv, pub, key_unit_path, unitpath)
 	 || add_field(priv, pub, key_unit_name, unitname)
 	 || add_field(priv, pub, key_unit_scope, isuser ? scope_user : scope_system))
@@ -25,119 +25,299 @@
 #include <assert.h>
 #include <stdio.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
+#include <signal.h>
 
 #include <json-c/json.h>
+#include <systemd/sd-event.h>
 
 #include "verbose.h"
 #include "utils-dir.h"
 #include "utils-json.h"
 #include "utils-systemd.h"
+#include "utils-readahead.h"
+#include "utils-placement.h"
 #include "afm-udb.h"
 #include "afm-urun.h"
 
-static const char key_unit_d_path[] = "-unit-dpath-";
+#if !defined(AFM_START_MAX_JOBS)
+# define AFM_START_MAX_JOBS 4
+#endif
+
+#if !defined(AFM_HISTORY_SIZE)
+# define AFM_HISTORY_SIZE 64
+#endif
+
+#if !defined(AFM_HISTORY_MAX_AGE)
+# define AFM_HISTORY_MAX_AGE 300
+#endif
+
+#if !defined(AFM_TERMINATE_GRACE_MS)
+# define AFM_TERMINATE_GRACE_MS 3000
+#endif
+
+#if !defined(AFM_READAHEAD_MODE)
+# define AFM_READAHEAD_MODE afm_readahead_on
+#endif
+
+#if !defined(AFM_READAHEAD_SECONDS)
+# define AFM_READAHEAD_SECONDS 10
+#endif
+
+#if !defined(FWK_PLACEMENT_CONF)
+# define FWK_PLACEMENT_CONF "/etc/afm/afm-placement.conf"
+#endif
+
+#if !defined(AFM_LAUNCH_MODE)
+# define AFM_LAUNCH_MODE afm_launch_unit
+#endif
+
+/* size of the buffers of unit names */
+#define UNIT_NAME_SIZE 256
+
+static const char key_priority[] = "priority";
+static const char key_launch_mode[] = "launch-mode";
+static const char key_unit_directives[] = "unit-directives";
+static const char key_terminate_grace[] = "terminate-grace";
+static const char key_wgtdir[] = "wgtdir";
+static const char key_target_name[] = "target-name";
+static const char key_autostart[] = "autostart";
+static const char key_activation[] = "activation";
+static const char activation_on_demand[] = "on-demand";
+static const char transient_prefix[] = "transient-";
+
+static const char *launch_mode_names[] = {
+	"unit",
+	"transient"
+};
+
+/*
+ * Priority classes of the start requests.
+ * Lower values are sent to systemd first.
+ */
+enum start_class {
+	start_class_critical,
+	start_class_high,
+	start_class_normal,
+	start_class_background,
+	start_class_count
+};
+
+static const char *start_class_names[start_class_count] = {
+	"critical",
+	"high",
+	"normal",
+	"background"
+};
+
+/*
+ * Records a requester waiting the end of a start
+ */
+struct start_waiter {
+	struct start_waiter *next;	/* next waiter of the same start */
+	void (*callback)(void *closure, int runid); /* callback to call at end */
+	void *closure;			/* closure of the callback */
+};
+
+/*
+ * Records a start request, queued or in flight
+ */
+struct start_job {
+	struct start_job *next;		/* next in the queue or in the in flight list */
+	struct json_object *appli;	/* the started application (referenced) */
+	struct start_waiter *waiters;	/* the waiters of the start */
+	char *dpath;			/* dbus path of the unit */
+	char *jpath;			/* dbus path of the systemd job while running */
+	char *tname;			/* name of the transient unit or NULL */
+	int isuser;			/* is the unit a user unit? */
+	int uid;			/* the requesting user */
+	enum start_class class;		/* the priority class */
+	int waiting;			/* is the end of the systemd job waited? */
+	uint64_t queued;		/* time of enqueuing (microseconds) */
+	uint64_t deadline;		/* deadline of the current step (microseconds) */
+	uint64_t retry;			/* time of checking again the unit or 0 */
+	struct SysD_Unit_Status status;	/* the status of the unit */
+};
+
+/*
+ * Records a terminate request in flight
+ */
+struct stop_job {
+	struct stop_job *next;		/* next in the in flight list */
+	void (*callback)(void *closure, int status); /* callback to call at end */
+	void *closure;			/* closure of the callback */
+	char *dpath;			/* dbus path of the unit */
+	char *jpath;			/* dbus path of the systemd stop job */
+	int isuser;			/* is the unit a user unit? */
+	int runid;			/* the terminated runid */
+	int waiting;			/* is the end of the systemd job waited? */
+	int killed;			/* was SIGKILL sent? */
+	uint64_t begin;			/* time of the stop request (microseconds) */
+	uint64_t escalate;		/* time of sending SIGKILL (microseconds) */
+	uint64_t deadline;		/* deadline after SIGKILL (microseconds) */
+	struct SysD_Unit_Status status;	/* the status of the unit */
+};
+
+/* the event loop driving the scheduler or NULL */
+static struct sd_event *evloop;
+
+/* the timer of the deadlines of the starts and terminates in flight */
+static struct sd_event_source *sched_timer;
+
+/* maximum count of systemd jobs in flight */
+static int start_max_jobs = AFM_START_MAX_JOBS;
+
+/* the default launch mode of applications */
+static enum afm_launch_mode launch_mode = AFM_LAUNCH_MODE;
+
+/* the queues of pending starts by class */
+static struct {
+	struct start_job *head;
+	struct start_job *tail;
+	int depth;
+} start_queues[start_class_count];
+
+/* list and count of the starts in flight */
+static struct start_job *start_inflight;
+static int start_inflight_count;
+
+/* default grace period between SIGTERM and SIGKILL (milliseconds) */
+static int terminate_grace_ms = AFM_TERMINATE_GRACE_MS;
+
+/* list and count of the terminates in flight */
+static struct stop_job *stop_inflight;
+static int stop_inflight_count;
+
+/* statistics of the terminates */
+static struct {
+	int requested;		/* count of terminate requests */
+	int escalated;		/* count of SIGKILL sent */
+	int failed;		/* count of failed terminates */
+	int reclaimed;		/* count of emptied units */
+	uint64_t reclaim_last;	/* last time to reclaim (microseconds) */
+	uint64_t reclaim_max;	/* maximum time to reclaim (microseconds) */
+	uint64_t reclaim_total;	/* cumulated time to reclaim (microseconds) */
+} stop_stats;
+
+/* statistics of the scheduler */
+static struct {
+	int queued_max;		/* maximum depth of the queues */
+	int dispatched;		/* count of starts sent to systemd */
+	int deduplicated;	/* count of starts merged with a pending one */
+	int failed;		/* count of failed starts */
+	int transient;		/* count of starts of transient units */
+	uint64_t wait_last;	/* last waiting time in queue (microseconds) */
+	uint64_t wait_max;	/* maximum waiting time in queue (microseconds) */
+	uint64_t wait_total;	/* total waiting time in queue (microseconds) */
+} start_stats;
 
 /**************** get appli basis *********************/
 
-static int get_basis(struct json_object *appli, int *isuser, const char **dpath, int uid)
+/*
+ * Is 'appli' activated on demand by its sockets?
+ */
+static int is_on_demand(struct json_object *appli)
 {
-	char userid[40];
-	char *dp, *arodot, *nun;
-	const char *uname, *uscope;
-	struct json_object *odp;
-	int rc;
+	const char *activation;
+
+	return j_read_string_at(appli, key_activation, &activation)
+		&& !strcmp(activation, activation_on_demand);
+}
+
+/*
+ * Get the launch mode of 'appli': its private field 'launch-mode'
+ * or the default mode. The transient mode requires the directives
+ * of the unit and isn't used for applications activated on demand
+ * because their sockets activate the unit of the unit file.
+ */
+static enum afm_launch_mode get_launch_mode(struct json_object *appli)
+{
+	int i;
+	const char *name;
+	struct json_object *directives;
+	enum afm_launch_mode mode = launch_mode;
+
+	if (j_read_string_at(appli, key_launch_mode, &name) && *name) {
+		i = afm_urun_launch_mode_of_name(name);
+		if (i >= 0)
+			mode = (enum afm_launch_mode)i;
+		else
+			WARNING("unknown launch mode %s, using %s", name, launch_mode_names[mode]);
+	}
+	if (mode == afm_launch_transient
+	 && (!j_read_object_at(appli, key_unit_directives, &directives)
+	  || !json_object_is_type(directives, json_type_array)
+	  || is_on_demand(appli)))
+		mode = afm_launch_unit;
+	return mode;
+}
+
+/*
+ * Get the basis of 'appli' for the user 'uid': the scope 'isuser'
+ * of its unit and the dbus path 'dpath' of the unit, a copy that
+ * the caller must free when the result isn't -1. When 'name'
+ * isn't NULL, it receives the name of the unit (its size must be
+ * at least UNIT_NAME_SIZE).
+ * Transient units are named by prefixing the name of the unit file
+ * of the application with "transient-".
+ * Returns 1 for transient units, 0 for units of unit files or -1
+ * in case of error.
+ */
+static int get_basis(struct json_object *appli, int *isuser, char **dpath, int uid, char *name)
+{
+	char buffer[UNIT_NAME_SIZE];
+	const char *arodot, *uname, *uscope, *prefix;
+	int rc, transient;
 
 	/* get the scope */
 	if (!j_read_string_at(appli, "unit-scope", &uscope)) {
 		ERROR("'unit-scope' missing in appli description %s", json_object_get_string(appli));
 		goto inval;
 	}
-	*isuser = strcmp(uscope, "system") != 0;
-
-	/* get dpaths of known users */
-	odp = NULL;
-	if (json_object_object_get_ex(appli, key_unit_d_path, &odp)) {
-		/* try not parametric dpath */
-		if (json_object_get_type(odp) == json_type_string) {
-			*dpath = json_object_get_string(odp);
-			return 0;
-		}
-		assert(json_object_get_type(odp) == json_type_object);
-		/* get userid */
-		if (uid < 0) {
-			ERROR("unexpected uid %d", uid);
-			goto inval;
-		}
-		rc = snprintf(userid, sizeof userid, "%d", uid);
-		assert(rc < (int)(sizeof userid));
-		/* try dpath for the user */
-		if (j_read_string_at(odp, userid, dpath))
-			return 0;
-	}
+	*isuser = strcmp(uscope, "system") ? systemd_user_scope(uid) : 0;
 
 	/* get uname */
 	if (!j_read_string_at(appli, "unit-name", &uname)) {
 		ERROR("'unit-name' missing in appli description %s", json_object_get_string(appli));
 		goto inval;
 	}
+	transient = get_launch_mode(appli) == afm_launch_transient;
+	prefix = transient ? transient_prefix : "";
 
 	/* is user parametric? */
 	arodot = strchr(uname, '@');
 	if (arodot && *++arodot == '.') {
-		if (!odp) {
-			/* get userid */
-			if (uid < 0) {
-				ERROR("unexpected uid %d", uid);
-				goto inval;
-			}
-			rc = snprintf(userid, sizeof userid, "%d", uid);
-			assert(rc < (int)(sizeof userid));
-
-			/* create the dpaths of known users */
-			odp = json_object_new_object();
-			if (!odp)
-				goto nomem;
-			json_object_object_add(appli, key_unit_d_path, odp);
+		/* get userid */
+		if (uid < 0) {
+			ERROR("unexpected uid %d", uid);
+			goto inval;
 		}
 
-		/* get dpath of userid */
-		nun = alloca((size_t)(arodot - uname) + strlen(userid) + strlen(arodot) + 1);
-		stpcpy(stpcpy(stpncpy(nun, uname, (size_t)(arodot - uname)), userid), arodot);
-		dp = systemd_unit_dpath_by_name(*isuser, nun, 1);
-		if (dp == NULL) {
-			ERROR("Can't load unit of name %s for %s: %m", nun, uscope);
-			goto error;
-		}
-		/* record the dpath */
-		if (!j_add_string(odp, userid, dp)) {
-			free(dp);
-			goto nomem;
-		}
-		free(dp);
-		j_read_string_at(odp, userid, dpath);
+		/* get the instantiated name */
+		rc = snprintf(buffer, sizeof buffer, "%s%.*s%d%s", prefix,
+				(int)(arodot - uname), uname, uid, arodot);
 	} else {
-		/* get dpath */
-		dp = systemd_unit_dpath_by_name(*isuser, uname, 1);
-		if (dp == NULL) {
-			ERROR("Can't load unit of name %s for %s: %m", uname, uscope);
-			goto error;
-		}
-		/* record the dpath */
-		if (!j_add_string(appli, key_unit_d_path, dp)) {
-			free(dp);
-			goto nomem;
-		}
-		free(dp);
-		j_read_string_at(appli, key_unit_d_path, dpath);
+		/* not parametric, same for all users */
+		uid = -1;
+		rc = snprintf(buffer, sizeof buffer, "%s%s", prefix, uname);
 	}
-	return 0;
+	if (rc >= (int)sizeof buffer) {
+		ERROR("unit name too long for %s", uname);
+		goto inval;
+	}
+	if (name)
+		strcpy(name, buffer);
 
-nomem:
-	ERROR("out of memory");
-	errno = ENOMEM;
-	goto error;
+	/* get dpath from the cache */
+	*dpath = systemd_unit_dpath_cached(*isuser, uid, buffer);
+	if (*dpath == NULL) {
+		ERROR("Can't load unit of name %s for %s: %m", buffer, uscope);
+		goto error;
+	}
+	return transient;
 
 inval:
 	errno = EINVAL;
@@ -145,7 +325,209 @@ error:
 	return -1;
 }
 
-static enum SysD_State wait_state_stable(int isuser, const char *dpath)
+/*
+ * Index of the applications of a user by the dbus path of their unit.
+ * It avoids to compute the dbus path of the unit of every application
+ * (and possibly to load the unit) each time a runid is resolved.
+ * The index is valid as long as the array of the applications of the
+ * database is the same: the database replaces it on update.
+ */
+struct appli_index {
+	struct appli_index *next;	/* next index */
+	struct json_object *apps;	/* the indexed applications (referenced) */
+	struct json_object *bydpath;	/* the applications by dbus path */
+	int uid;			/* the user of the index */
+	int complete;			/* are all the applications indexed? */
+};
+
+/* maximum count of the indexes, one per user */
+#define APPLI_INDEX_MAX  8
+
+/* the indexes, most recently used first */
+static struct appli_index *appli_indexes;
+
+/*
+ * Frees the 'index'
+ */
+static void free_appli_index(struct appli_index *index)
+{
+	json_object_put(index->bydpath);
+	json_object_put(index->apps);
+	free(index);
+}
+
+/*
+ * Drops all the indexes of the applications
+ */
+static void drop_appli_indexes()
+{
+	struct appli_index *index;
+
+	while ((index = appli_indexes)) {
+		appli_indexes = index->next;
+		free_appli_index(index);
+	}
+}
+
+/*
+ * Fills the 'index' with the applications of its array.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+static int fill_appli_index(struct appli_index *index)
+{
+	int i, n, isuser;
+	char *udpath;
+	struct json_object *appli;
+
+	json_object_put(index->bydpath);
+	index->bydpath = json_object_new_object();
+	if (!index->bydpath)
+		return -1;
+
+	index->complete = 1;
+	n = (int)json_object_array_length(index->apps);
+	for (i = 0 ; i < n ; i++) {
+		appli = json_object_array_get_idx(index->apps, i);
+		if (!appli || get_basis(appli, &isuser, &udpath, index->uid, NULL) < 0)
+			index->complete = 0;
+		else {
+			json_object_object_add(index->bydpath, udpath, json_object_get(appli));
+			free(udpath);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Get the index of the applications of 'db' for 'uid', building it if
+ * needed. Returns the index or NULL in case of error.
+ */
+static struct appli_index *get_appli_index(struct afm_udb *db, int uid)
+{
+	int count;
+	struct json_object *apps;
+	struct appli_index *index, **prv;
+
+	apps = afm_udb_applications_private(db, 1, uid);
+	if (!apps)
+		return NULL;
+
+	/* search the index of the user */
+	prv = &appli_indexes;
+	while ((index = *prv) && index->uid != uid)
+		prv = &index->next;
+	if (index) {
+		*prv = index->next;
+		if (index->apps == apps) {
+			/* still valid */
+			json_object_put(apps);
+			index->next = appli_indexes;
+			appli_indexes = index;
+			return index;
+		}
+		free_appli_index(index);
+	}
+
+	/* create the index */
+	index = calloc(1, sizeof *index);
+	if (!index) {
+		json_object_put(apps);
+		return NULL;
+	}
+	index->apps = apps;
+	index->uid = uid;
+	if (fill_appli_index(index) < 0) {
+		free_appli_index(index);
+		return NULL;
+	}
+	index->next = appli_indexes;
+	appli_indexes = index;
+
+	/* forget the least recently used indexes */
+	for (count = 1, prv = &index->next ; *prv && count < APPLI_INDEX_MAX ; count++)
+		prv = &(*prv)->next;
+	while ((index = *prv)) {
+		*prv = index->next;
+		free_appli_index(index);
+	}
+	return appli_indexes;
+}
+
+/*
+ * Search in 'db' the application of the unit of 'dpath' for 'uid'.
+ * Returns the application (referenced) or NULL if not found.
+ */
+static struct json_object *search_appli_of_dpath(struct afm_udb *db, const char *dpath, int uid, int *isuser)
+{
+	const char *uscope;
+	struct appli_index *index;
+	struct json_object *appli;
+
+	index = get_appli_index(db, uid);
+	if (!index)
+		return NULL;
+	if (!json_object_object_get_ex(index->bydpath, dpath, &appli)) {
+		/* some applications were not indexed, try again */
+		if (index->complete
+		 || fill_appli_index(index) < 0
+		 || !json_object_object_get_ex(index->bydpath, dpath, &appli))
+			return NULL;
+	}
+	*isuser = j_read_string_at(appli, "unit-scope", &uscope) && strcmp(uscope, "system")
+			? systemd_user_scope(uid) : 0;
+	return json_object_get(appli);
+}
+
+/*
+ * Starts the transient unit 'name' of 'appli' in the scope 'isuser'.
+ * Returns the dbus path of the start job or NULL with errno set.
+ * When the unit already exists, errno is EEXIST.
+ */
+static char *start_transient(struct json_object *appli, int isuser, const char *name)
+{
+	int i, n;
+	const char **directives;
+	struct json_object *array;
+
+	j_read_object_at(appli, key_unit_directives, &array);
+	n = (int)json_object_array_length(array);
+	directives = alloca((size_t)(n + 1) * sizeof *directives);
+	for (i = 0 ; i < n ; i++)
+		directives[i] = json_object_get_string(json_object_array_get_idx(array, i));
+	start_stats.transient++;
+	return systemd_unit_start_transient_job(isuser, name, directives, n);
+}
+
+/*
+ * Asynchronous version of start_transient: 'callback' receives
+ * the dbus path of the start job.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+static int start_transient_async(struct json_object *appli, int isuser, const char *name,
+				systemd_async_cb callback, void *closure)
+{
+	int i, n;
+	const char **directives;
+	struct json_object *array;
+
+	j_read_object_at(appli, key_unit_directives, &array);
+	n = (int)json_object_array_length(array);
+	directives = alloca((size_t)(n + 1) * sizeof *directives);
+	for (i = 0 ; i < n ; i++)
+		directives[i] = json_object_get_string(json_object_array_get_idx(array, i));
+	start_stats.transient++;
+	return systemd_unit_start_transient_job_async(isuser, name, directives, n, callback, closure);
+}
+
+/*
+ * Waits the end of the job 'jpath' in the scope 'isuser'
+ */
+static void wait_job(int isuser, const char *jpath)
+{
+	systemd_job_wait(isuser, jpath, 10000);
+}
+
+static enum SysD_State wait_state_stable(int isuser, const char *dpath, struct SysD_Unit_Status *status)
 {
 	int trial;
 	enum SysD_State state = SysD_State_INVALID;
@@ -156,7 +538,8 @@ static enum SysD_State wait_state_stable(int isuser, const char *dpath)
 	const int period_ns = period_ms * 1000000;
 
 	for (trial = 1 ; trial <= trial_count ; trial++) {
-		state = systemd_unit_state_of_dpath(isuser, dpath);
+		state = systemd_unit_status_of_dpath(isuser, dpath, status) < 0
+				? SysD_State_INVALID : status->state;
 		switch (state) {
 		case SysD_State_Active:
 		case SysD_State_Failed:
@@ -175,13 +558,13 @@ static enum SysD_State wait_state_stable(int isuser, const char *dpath)
 /*
  * Creates a json object that describes the state for:
  *  - 'id', the id of the application
- *  - 'runid', its runid
+ *  - 'runid', its runid or 0 if not running
  *  - 'pid', its pid
- *  - 'state', its systemd state
+ *  - 'state', the name of its state
  *
  * Returns the created object or NULL in case of error.
  */
-static json_object *mkstate(const char *id, int runid, int pid, enum SysD_State state)
+static json_object *mkstate(const char *id, int runid, int pid, const char *state)
 {
 	struct json_object *result, *pids;
 
@@ -191,7 +574,7 @@ static json_object *mkstate(const char *id, int runid, int pid, enum SysD_State
 		goto error;
 
 	/* the runid */
-	if (!j_add_integer(result, "runid", runid))
+	if (runid > 0 && !j_add_integer(result, "runid", runid))
 		goto error;
 
 	/* the pids */
@@ -204,7 +587,7 @@ static json_object *mkstate(const char *id, int runid, int pid, enum SysD_State
 	}
 
 	/* the state */
-	if (!j_add_string(result, "state", state == SysD_State_Active ? "running" : "terminated"))
+	if (!j_add_string(result, "state", state))
 		goto error;
 
 	/* the application id */
@@ -220,165 +603,1721 @@ error:
 	return NULL;
 }
 
-/**************** API handling ************************/
-
 /*
- * Starts the application described by 'appli' for the 'mode'.
- * In case of remote start, it returns in uri the uri to
- * connect to.
- *
- * A reference to 'appli' is kept during the live of the
- * runner. This is made using json_object_get. Thus be aware
- * that further modifications to 'appli' might create errors.
- *
- * Returns the runid in case of success or -1 in case of error
+ * Returns the name of the state of a runner of systemd 'state'
  */
-int afm_urun_start(struct json_object *appli, int uid)
+static const char *run_state_name(enum SysD_State state)
 {
-	return afm_urun_once(appli, uid);
+	return state == SysD_State_Active ? "running" : "terminated";
 }
 
+/**************** run history *********************/
+
 /*
- * Returns the runid of a previously started application 'appli'
- * or if none is running, starts the application described by 'appli'
- * in local mode.
- *
- * A reference to 'appli' is kept during the live of the
- * runner. This is made using json_object_get. Thus be aware
- * that further modifications to 'appli' might create errors.
- *
- * Returns the runid in case of success or -1 in case of error
+ * Record of a run of an application
  */
-int afm_urun_once(struct json_object *appli, int uid)
-{
-	const char *udpath, *uscope, *uname;
-	enum SysD_State state;
-	int rc, isuser;
-
-	/* retrieve basis */
-	rc = get_basis(appli, &isuser, &udpath, uid);
-	if (rc < 0)
-		goto error;
+struct run_record {
+	char *id;			/* id of the application */
+	char *dpath;			/* dbus path of the unit */
+	int runid;			/* the runid */
+	int uid;			/* the user */
+	int isuser;			/* scope of the unit */
+	int running;			/* is the run still running? */
+	int code;			/* ExecMainCode: CLD_EXITED, CLD_KILLED, ... or 0 */
+	int status;			/* exit status or signal */
+	uint64_t start;			/* start time (realtime microseconds) */
+	uint64_t stop;			/* stop time (realtime microseconds) */
+	uint64_t memory_peak;		/* peak of memory observed (bytes) */
+	struct systemd_unit_watch *watch; /* watch of the unit or NULL */
+};
 
-	/* start the unit */
-	rc = systemd_unit_start_dpath(isuser, udpath);
-	if (rc < 0) {
-		j_read_string_at(appli, "unit-scope", &uscope);
-		j_read_string_at(appli, "unit-name", &uname);
-		ERROR("can't start %s unit %s for uid %d", uscope, uname, uid);
-		goto error;
-	}
+/*
+ * The ring buffer of the recent runs. Like the start scheduler,
+ * it isn't locked: see afm_urun_set_event_loop.
+ */
+static struct {
+	struct run_record *records[AFM_HISTORY_SIZE];
+	unsigned first;		/* index of the oldest record */
+	unsigned count;		/* count of records */
+} history;
 
-	state = wait_state_stable(isuser, udpath);
-	switch (state) {
-	case SysD_State_Active:
-	case SysD_State_Inactive:
-		break;
-	case SysD_State_Failed:
-		j_read_string_at(appli, "unit-scope", &uscope);
-		j_read_string_at(appli, "unit-name", &uname);
-		ERROR("start error %s unit %s for uid %d: %s", uscope, uname, uid,
-							systemd_state_name(state));
-		goto error;
-	default:
-		j_read_string_at(appli, "unit-scope", &uscope);
-		j_read_string_at(appli, "unit-name", &uname);
-		ERROR("can't wait %s unit %s for uid %d: %m", uscope, uname, uid);
-		goto error;
-	}
+/* maximum age of the terminated runs in history (seconds) */
+static int history_max_age = AFM_HISTORY_MAX_AGE;
 
-	rc = systemd_unit_pid_of_dpath(isuser, udpath);
-	if (rc < 0) {
-		j_read_string_at(appli, "unit-scope", &uscope);
-		j_read_string_at(appli, "unit-name", &uname);
-		ERROR("can't get pid of %s unit %s for uid %d: %m", uscope, uname, uid);
-		goto error;
-	}
+/*
+ * Returns the current realtime in microseconds
+ */
+static uint64_t realtime_us()
+{
+	struct timespec ts;
 
-	return rc;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
 
-error:
-	return -1;
+/*
+ * Get the slot of 'index' in the history, 0 being the oldest
+ */
+static struct run_record **history_slot(unsigned index)
+{
+	return &history.records[(history.first + index) % AFM_HISTORY_SIZE];
 }
 
-static int not_yet_implemented(const char *what)
+/*
+ * Frees the 'record'
+ */
+static void history_free(struct run_record *record)
 {
-	ERROR("%s isn't yet implemented", what);
-	errno = ENOTSUP;
-	return -1;
+	systemd_unit_unwatch(record->watch);
+	free(record->dpath);
+	free(record->id);
+	free(record);
 }
 
 /*
- * Terminates the runner of 'runid'
- *
- * Returns 0 in case of success or -1 in case of error
+ * Updates 'record' with the 'status' of its unit
  */
-int afm_urun_terminate(int runid, int uid)
+static void history_update(struct run_record *record, const struct SysD_Unit_Status *status)
 {
-	int rc = systemd_unit_stop_pid(1 /* TODO: isuser? */, (unsigned)runid);
-	if (rc < 0)
-		rc = systemd_unit_stop_pid(0 /* TODO: isuser? */, (unsigned)runid);
-	return rc < 0 ? rc : 0;
+	if (record->running) {
+		/* observe the memory */
+		if (status->memory_peak != UINT64_MAX && status->memory_peak > record->memory_peak)
+			record->memory_peak = status->memory_peak;
+		if (status->memory_current != UINT64_MAX && status->memory_current > record->memory_peak)
+			record->memory_peak = status->memory_current;
+
+		/* still running? */
+		if (status->main_pid == record->runid
+		 && status->state != SysD_State_Inactive
+		 && status->state != SysD_State_Failed)
+			return;
+
+		/* no, terminated */
+		record->running = 0;
+		record->stop = status->inactive_enter >= record->start
+				? status->inactive_enter : realtime_us();
+	}
+
+	/* the exit status can be changed after the state */
+	if (status->exec_main_code) {
+		record->code = status->exec_main_code;
+		record->status = status->exec_main_status;
+		systemd_unit_unwatch(record->watch);
+		record->watch = NULL;
+	}
 }
 
 /*
- * Stops (aka pause) the runner of 'runid'
- *
- * Returns 0 in case of success or -1 in case of error
+ * Receives the changes of the unit of a run
  */
-int afm_urun_pause(int runid, int uid)
+static void on_history_change(void *closure, const struct SysD_Unit_Status *status)
 {
-	return not_yet_implemented("pause");
+	history_update(closure, status);
 }
 
 /*
- * Continue (aka resume) the runner of 'runid'
- *
- * Returns 0 in case of success or -1 in case of error
+ * Removes from history the terminated runs stopped before 'limit'
+ * and, when 'uid' isn't negative, the terminated runs of 'uid' for
+ * the application 'id' (any application if NULL).
  */
-int afm_urun_resume(int runid, int uid)
+static void history_purge(uint64_t limit, int uid, const char *id)
 {
-	return not_yet_implemented("resume");
+	unsigned i, n;
+	struct run_record *record;
+
+	for (i = n = 0 ; i < history.count ; i++) {
+		record = *history_slot(i);
+		if (!record->running
+		 && (record->stop < limit
+		  || (record->uid == uid && (!id || !strcasecmp(id, record->id)))))
+			history_free(record);
+		else
+			*history_slot(n++) = record;
+	}
+	history.count = n;
 }
 
 /*
- * Get the list of the runners.
- *
- * Returns the list or NULL in case of error.
+ * Adds to history the run 'runid' of 'appli' for 'uid' whose unit
+ * is 'dpath' in the scope 'isuser'.
  */
-struct json_object *afm_urun_list(struct afm_udb *db, int all, int uid)
+static void history_add(struct json_object *appli, int runid, int uid, int isuser, const char *dpath)
 {
-	int i, n, isuser, pid;
-	const char *udpath;
+	unsigned i;
 	const char *id;
-	enum SysD_State state;
-	struct json_object *desc;
-	struct json_object *appli;
-	struct json_object *apps;
-	struct json_object *result;
+	struct run_record *record;
+	const struct SysD_Unit_Status *status;
 
-	apps = NULL;
-	result = json_object_new_array();
-	if (result == NULL)
-		goto error;
+	/* already recorded? */
+	for (i = 0 ; i < history.count ; i++) {
+		record = *history_slot(i);
+		if (record->running && record->runid == runid && record->isuser == isuser)
+			return;
+	}
+
+	/* create the record */
+	record = calloc(1, sizeof *record);
+	if (!record)
+		return;
+	if (!j_read_string_at(appli, "id", &id)
+	 || !(record->id = strdup(id))
+	 || !(record->dpath = strdup(dpath))) {
+		history_free(record);
+		return;
+	}
+	record->runid = runid;
+	record->uid = uid;
+	record->isuser = isuser;
+	record->running = 1;
+	record->start = realtime_us();
+	record->watch = systemd_unit_watch(isuser, dpath, on_history_change, record);
+	if (record->watch) {
+		status = systemd_unit_watch_status(record->watch);
+		if (status->state == SysD_State_Active && status->active_enter)
+			record->start = status->active_enter;
+		history_update(record, status);
+	}
+
+	/*
+	 * record it, overwriting the oldest run if full; the runs too old
+	 * are purged when the history is read
+	 */
+	if (history.count == AFM_HISTORY_SIZE) {
+		history_free(*history_slot(0));
+		history.first = (history.first + 1) % AFM_HISTORY_SIZE;
+		history.count--;
+	}
+	*history_slot(history.count++) = record;
+}
+
+/*
+ * Tells whether the 'record' is a failed run. The end of runs whose
+ * code is 0 wasn't observed: they are not counted as failed.
+ */
+static int history_is_failure(struct run_record *record)
+{
+	return !record->running && record->code != 0
+		&& (record->code != CLD_EXITED || record->status != 0);
+}
+
+/*
+ * Creates the json description of 'record'
+ */
+static struct json_object *history_describe(struct run_record *record)
+{
+	const char *state;
+	struct json_object *result;
+
+	if (record->running)
+		state = "running";
+	else switch (record->code) {
+		case CLD_EXITED: state = "exited"; break;
+		case CLD_KILLED: state = "killed"; break;
+		case CLD_DUMPED: state = "dumped"; break;
+		case 0: state = "unknown"; break;
+		default: state = "terminated"; break;
+	}
+
+	result = json_object_new_object();
+	if (!result
+	 || !j_add_string(result, "id", record->id)
+	 || !j_add_integer(result, "runid", record->runid)
+	 || !j_add_string(result, "state", state)
+	 || !j_add(result, "start", json_object_new_int64((int64_t)(record->start / 1000)))
+	 || (!record->running
+	  && (!j_add(result, "stop", json_object_new_int64((int64_t)(record->stop / 1000)))
+	   || !j_add(result, "duration", json_object_new_int64((int64_t)((record->stop - record->start) / 1000)))))
+	 || (record->code
+	  && !j_add_integer(result, record->code == CLD_EXITED ? "exit-code" : "signal", record->status))
+	 || (record->memory_peak
+	  && !j_add(result, "memory-peak", json_object_new_int64((int64_t)record->memory_peak)))) {
+		json_object_put(result);
+		return NULL;
+	}
+	return result;
+}
+
+/*
+ * Set the maximum age 'seconds' of the terminated runs in history
+ */
+void afm_urun_set_history_max_age(int seconds)
+{
+	history_max_age = seconds > 0 ? seconds : 1;
+}
+
+/*
+ * Get the history of the runs of the user 'uid', most recent first.
+ * Terminated runs are kept in history for a limited time.
+ * When 'id' isn't NULL, only the runs of the application 'id' are
+ * returned. When 'failed' is set, only the failed runs are returned.
+ * When 'clean' is set, the terminated runs of the user (of the
+ * application 'id' if not NULL) are removed from history.
+ *
+ * Returns a json array or NULL in case of error.
+ */
+struct json_object *afm_urun_history(int uid, const char *id, int failed, int clean)
+{
+	unsigned i;
+	struct run_record *record;
+	struct SysD_Unit_Status status;
+	struct json_object *result, *desc;
+
+	history_purge(realtime_us() - (uint64_t)history_max_age * 1000000, -1, NULL);
+	result = json_object_new_array();
+	if (!result)
+		goto error;
+
+	for (i = history.count ; i ; ) {
+		record = *history_slot(--i);
+		if (record->uid != uid || (id && strcasecmp(id, record->id)))
+			continue;
+
+		/* refresh the running runs */
+		if (record->running) {
+			if (systemd_unit_status_of_dpath(record->isuser, record->dpath, &status) >= 0)
+				history_update(record, &status);
+			else if (!record->watch) {
+				/* unit collected without watch, the status is lost */
+				record->running = 0;
+				record->stop = realtime_us();
+			}
+		}
+
+		if (failed && !history_is_failure(record))
+			continue;
+		desc = history_describe(record);
+		if (!desc || json_object_array_add(result, desc) < 0) {
+			json_object_put(desc);
+			goto error;
+		}
+	}
+
+	if (clean)
+		history_purge(0, uid, id);
+	return result;
+
+error:
+	json_object_put(result);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/**************** readahead *********************/
+
+/* period of sampling of the files used by a launched application */
+#define READAHEAD_SAMPLE_PERIOD_US 1000000
+
+/*
+ * Records the files used by an application during its first seconds
+ */
+struct readahead_recorder {
+	struct readahead_recorder *next;	/* next recorder */
+	struct readahead_list *list;	/* the files recorded */
+	struct sd_event_source *timer;	/* the timer of the samples */
+	char *file;			/* the file of the list */
+	int runid;			/* the sampled process */
+	int samples;			/* count of remaining samples */
+};
+
+/* the recorders in progress */
+static struct readahead_recorder *readahead_recorders;
+
+/* the readahead mode */
+static enum afm_readahead_mode readahead_mode = AFM_READAHEAD_MODE;
+
+/* duration of the recording (seconds) */
+static int readahead_seconds = AFM_READAHEAD_SECONDS;
+
+static const char *readahead_mode_names[] = {
+	"off",
+	"replay",
+	"on"
+};
+
+/* statistics of readahead */
+static struct {
+	int recorded;		/* count of lists recorded */
+	int replayed;		/* count of lists replayed */
+	int files;		/* count of files read ahead */
+} readahead_stats;
+
+/*
+ * Get the directory 'dir' of 'appli' and the path of its readahead
+ * list in 'file' of 'size'.
+ * Returns 0 in case of success or -1 otherwise.
+ */
+static int get_readahead_file(struct json_object *appli, const char **dir, char *file, size_t size)
+{
+	int rc;
+	const char *target;
+
+	if (!j_read_string_at(appli, key_wgtdir, dir) || !**dir)
+		return -1;
+	if (!j_read_string_at(appli, key_target_name, &target) || !*target)
+		target = "main";
+	rc = snprintf(file, size, "%s/.afm-readahead-%s", *dir, target);
+	return rc > 0 && rc < (int)size ? 0 : -1;
+}
+
+/*
+ * Replays the readahead list of 'appli' if any
+ */
+static void readahead_replay_appli(struct json_object *appli)
+{
+	int rc;
+	const char *dir;
+	char file[PATH_MAX];
+
+	if (readahead_mode != afm_readahead_off && !get_readahead_file(appli, &dir, file, sizeof file)) {
+		rc = readahead_replay(dir, file);
+		if (rc > 0) {
+			readahead_stats.replayed++;
+			readahead_stats.files += rc;
+		}
+	}
+}
+
+/*
+ * Ends the recorder 'rec': saves its list and frees it
+ */
+static void readahead_end(struct readahead_recorder *rec)
+{
+	struct readahead_recorder **prv;
+
+	for (prv = &readahead_recorders ; *prv != rec ; prv = &(*prv)->next);
+	*prv = rec->next;
+
+	if (readahead_list_count(rec->list)) {
+		if (readahead_list_save(rec->list, rec->file) < 0)
+			WARNING("can't save readahead list %s: %m", rec->file);
+		else {
+			INFO("readahead list %s of %d files recorded", rec->file, readahead_list_count(rec->list));
+			readahead_stats.recorded++;
+		}
+	}
+	sd_event_source_unref(rec->timer);
+	readahead_list_destroy(rec->list);
+	free(rec->file);
+	free(rec);
+}
+
+/*
+ * Samples the files used by the process of a recorder
+ */
+static int on_readahead_timer(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	struct readahead_recorder *rec = userdata;
+
+	if (readahead_list_sample(rec->list, rec->runid) >= 0 && --rec->samples > 0) {
+		sd_event_source_set_time(s, usec + READAHEAD_SAMPLE_PERIOD_US);
+		sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+	} else
+		readahead_end(rec);
+	return 0;
+}
+
+/*
+ * Records the files used by 'runid' of 'appli' during its first
+ * seconds if it has no readahead list
+ */
+static void readahead_record(struct json_object *appli, int runid)
+{
+	int rc;
+	uint64_t now;
+	const char *dir;
+	char file[PATH_MAX];
+	struct readahead_recorder *rec;
+
+	/* record only once */
+	if (readahead_mode != afm_readahead_on || !evloop || runid <= 0
+	 || get_readahead_file(appli, &dir, file, sizeof file) < 0
+	 || access(file, F_OK) == 0)
+		return;
+	for (rec = readahead_recorders ; rec ; rec = rec->next)
+		if (!strcmp(rec->file, file))
+			return;
+
+	/* create the recorder */
+	rec = calloc(1, sizeof *rec);
+	if (!rec)
+		goto error;
+	rec->file = strdup(file);
+	rec->list = readahead_list_create(dir);
+	if (!rec->file || !rec->list)
+		goto error2;
+	rec->runid = runid;
+	rec->samples = readahead_seconds * 1000000 / READAHEAD_SAMPLE_PERIOD_US;
+	if (rec->samples <= 0)
+		rec->samples = 1;
+
+	/* arm its timer */
+	sd_event_now(evloop, CLOCK_MONOTONIC, &now);
+	rc = sd_event_add_time(evloop, &rec->timer, CLOCK_MONOTONIC,
+			now + READAHEAD_SAMPLE_PERIOD_US, 1000, on_readahead_timer, rec);
+	if (rc < 0) {
+		errno = -rc;
+		goto error2;
+	}
+	rec->next = readahead_recorders;
+	readahead_recorders = rec;
+	return;
+
+error2:
+	readahead_list_destroy(rec->list);
+	free(rec->file);
+	free(rec);
+error:
+	WARNING("can't record readahead list %s: %m", file);
+}
+
+/*
+ * Set the readahead 'mode'
+ */
+void afm_urun_set_readahead_mode(enum afm_readahead_mode mode)
+{
+	readahead_mode = mode;
+}
+
+/*
+ * Get the readahead mode of 'name' or -1 if unknown
+ */
+int afm_urun_readahead_mode_of_name(const char *name)
+{
+	int i;
+
+	for (i = 0 ; i < (int)(sizeof readahead_mode_names / sizeof *readahead_mode_names) ; i++)
+		if (!strcasecmp(name, readahead_mode_names[i]))
+			return i;
+	return -1;
+}
+
+/*
+ * Set the duration 'seconds' of the recording of readahead lists
+ */
+void afm_urun_set_readahead_seconds(int seconds)
+{
+	readahead_seconds = seconds > 0 ? seconds : 1;
+}
+
+/*
+ * Replays the readahead lists of the applications of 'db' that
+ * are started automatically (private field 'autostart'). The kernel
+ * reads the files of all these applications in parallel.
+ *
+ * Returns the count of applications whose list is replayed.
+ */
+int afm_urun_readahead_autostart(struct afm_udb *db)
+{
+	int i, n, autostart, count;
+	struct json_object *apps, *appli;
+
+	count = 0;
+	if (readahead_mode != afm_readahead_off) {
+		apps = afm_udb_applications_private(db, 1, -1);
+		n = json_object_array_length(apps);
+		for (i = 0 ; i < n ; i++) {
+			appli = json_object_array_get_idx(apps, i);
+			if (appli && j_read_integer_at(appli, key_autostart, &autostart) && autostart) {
+				readahead_replay_appli(appli);
+				count++;
+			}
+		}
+		json_object_put(apps);
+	}
+	return count;
+}
+
+/**************** API handling ************************/
+
+/*
+ * Starts the application described by 'appli' for the 'mode'.
+ * In case of remote start, it returns in uri the uri to
+ * connect to.
+ *
+ * A reference to 'appli' is kept during the live of the
+ * runner. This is made using json_object_get. Thus be aware
+ * that further modifications to 'appli' might create errors.
+ *
+ * Returns the runid in case of success or -1 in case of error
+ */
+int afm_urun_start(struct json_object *appli, int uid)
+{
+	return afm_urun_once(appli, uid);
+}
+
+/*
+ * Returns the runid of a previously started application 'appli'
+ * or if none is running, starts the application described by 'appli'
+ * in local mode.
+ *
+ * A reference to 'appli' is kept during the live of the
+ * runner. This is made using json_object_get. Thus be aware
+ * that further modifications to 'appli' might create errors.
+ *
+ * Returns the runid in case of success or -1 in case of error
+ */
+int afm_urun_once(struct json_object *appli, int uid)
+{
+	const char *uscope, *uname;
+	char tname[UNIT_NAME_SIZE], *jpath, *udpath;
+	enum SysD_State state;
+	struct SysD_Unit_Status status;
+	int rc, isuser;
+
+	/* retrieve basis */
+	rc = get_basis(appli, &isuser, &udpath, uid, tname);
+	if (rc < 0)
+		return -1;
+
+	/* start the unit */
+	readahead_replay_appli(appli);
+	if (!rc)
+		rc = systemd_unit_start_dpath(isuser, udpath);
+	else {
+		jpath = start_transient(appli, isuser, tname);
+		if (jpath) {
+			wait_job(isuser, jpath);
+			free(jpath);
+			rc = 0;
+		} else
+			rc = errno == EEXIST ? 0 : -1;
+	}
+	if (rc < 0) {
+		j_read_string_at(appli, "unit-scope", &uscope);
+		j_read_string_at(appli, "unit-name", &uname);
+		ERROR("can't start %s unit %s for uid %d", uscope, uname, uid);
+		goto error;
+	}
+
+	state = wait_state_stable(isuser, udpath, &status);
+	switch (state) {
+	case SysD_State_Active:
+	case SysD_State_Inactive:
+		break;
+	case SysD_State_Failed:
+		j_read_string_at(appli, "unit-scope", &uscope);
+		j_read_string_at(appli, "unit-name", &uname);
+		ERROR("start error %s unit %s for uid %d: %s", uscope, uname, uid,
+							systemd_state_name(state));
+		goto error;
+	default:
+		j_read_string_at(appli, "unit-scope", &uscope);
+		j_read_string_at(appli, "unit-name", &uname);
+		ERROR("can't wait %s unit %s for uid %d: %m", uscope, uname, uid);
+		goto error;
+	}
+
+	if (status.main_pid > 0) {
+		history_add(appli, status.main_pid, uid, isuser, udpath);
+		readahead_record(appli, status.main_pid);
+	}
+	free(udpath);
+	return status.main_pid;
+
+error:
+	free(udpath);
+	return -1;
+}
+
+/**************** start scheduler *********************/
+
+/* delay before checking again a unit in a transitional state */
+#define START_RETRY_US         10000
+
+/* maximum duration of one step of a start */
+#define START_STEP_TIMEOUT_US  10000000
+
+/*
+ * Returns the current monotonic time in microseconds
+ */
+static uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Get the priority class of 'appli'
+ */
+static enum start_class get_start_class(struct json_object *appli)
+{
+	int i;
+	const char *name;
+
+	if (j_read_integer_at(appli, key_priority, &i))
+		return i <= 0 ? start_class_critical
+			: i >= (int)start_class_count ? start_class_background
+			: (enum start_class)i;
+
+	if (j_read_string_at(appli, key_priority, &name) && *name) {
+		for (i = 0 ; i < (int)start_class_count ; i++)
+			if (!strcasecmp(name, start_class_names[i]))
+				return (enum start_class)i;
+		WARNING("unknown priority %s, using %s", name, start_class_names[start_class_normal]);
+	}
+	return start_class_normal;
+}
+
+/*
+ * Search the start job of 'dpath' in the list 'job'
+ */
+static struct start_job *search_start_job(struct start_job *job, int isuser, const char *dpath)
+{
+	while (job && (job->isuser != isuser || strcmp(job->dpath, dpath)))
+		job = job->next;
+	return job;
+}
+
+/*
+ * Calls the waiters of the 'job' with 'runid' and frees the 'job'
+ */
+static void end_start_job(struct start_job *job, int runid)
+{
+	struct start_waiter *waiter;
+
+	if (runid < 0)
+		start_stats.failed++;
+	else if (runid > 0) {
+		history_add(job->appli, runid, job->uid, job->isuser, job->dpath);
+		readahead_record(job->appli, runid);
+	}
+	while ((waiter = job->waiters)) {
+		job->waiters = waiter->next;
+		waiter->callback(waiter->closure, runid);
+		free(waiter);
+	}
+	json_object_put(job->appli);
+	free(job->jpath);
+	free(job->tname);
+	free(job->dpath);
+	free(job);
+}
+
+static void dispatch_starts();
+static void arm_sched_timer();
+
+/*
+ * Removes the 'job' from the starts in flight
+ */
+static void unlink_start_job(struct start_job *job)
+{
+	struct start_job **prv;
+
+	prv = &start_inflight;
+	while (*prv && *prv != job)
+		prv = &(*prv)->next;
+	if (*prv) {
+		*prv = job->next;
+		start_inflight_count--;
+	}
+}
+
+/*
+ * Ends the start 'job' in flight with 'runid' and dispatches the pending starts
+ */
+static void finish_start_job(struct start_job *job, int runid)
+{
+	unlink_start_job(job);
+	end_start_job(job, runid);
+	dispatch_starts();
+}
+
+/*
+ * Receives the 'state' of the unit of the start 'closure'
+ */
+static void on_start_status(void *closure, int state, const char *path)
+{
+	int runid;
+	uint64_t now;
+	struct start_job *job = closure;
+
+	switch (state) {
+	case SysD_State_Active:
+	case SysD_State_Inactive:
+		runid = job->status.main_pid;
+		break;
+	case SysD_State_Failed:
+		ERROR("start error unit %s for uid %d: %s", job->dpath, job->uid,
+							systemd_state_name(SysD_State_Failed));
+		runid = -1;
+		break;
+	default:
+		/* not yet stable, check again later */
+		now = now_us();
+		if (now < job->deadline) {
+			job->retry = now + START_RETRY_US;
+			arm_sched_timer();
+			return;
+		}
+		ERROR("can't wait unit %s for uid %d", job->dpath, job->uid);
+		runid = -1;
+		break;
+	}
+	finish_start_job(job, runid);
+}
+
+/*
+ * Asks the status of the unit of the start 'job'
+ */
+static void check_start_job(struct start_job *job)
+{
+	if (systemd_unit_status_of_dpath_async(job->isuser, job->dpath, &job->status, on_start_status, job) < 0) {
+		ERROR("can't get status of unit %s for uid %d: %m", job->dpath, job->uid);
+		finish_start_job(job, -1);
+	}
+}
+
+/*
+ * Receives the end of the systemd job of the start 'closure'
+ */
+static void on_start_job_end(void *closure, int status, const char *path)
+{
+	struct start_job *job = closure;
+
+	job->waiting = 0;
+	free(job->jpath);
+	job->jpath = NULL;
+	job->deadline = now_us() + START_STEP_TIMEOUT_US;
+	check_start_job(job);
+}
+
+/*
+ * Receives the systemd job 'jpath' of the start 'closure'
+ */
+static void on_start_job(void *closure, int status, const char *jpath)
+{
+	struct start_job *job = closure;
+
+	if (status < 0) {
+		/* existing transient units are just checked */
+		if (job->tname && status == -EEXIST)
+			check_start_job(job);
+		else {
+			ERROR("can't start unit %s for uid %d: %s", job->dpath, job->uid, strerror(-status));
+			finish_start_job(job, -1);
+		}
+		return;
+	}
+
+	job->jpath = strdup(jpath);
+	if (!job->jpath || systemd_job_wait_async(job->isuser, job->jpath, on_start_job_end, job) < 0) {
+		ERROR("can't wait the job of unit %s for uid %d: %m", job->dpath, job->uid);
+		finish_start_job(job, -1);
+		return;
+	}
+	job->waiting = 1;
+	arm_sched_timer();
+}
+
+/*
+ * Sends to systemd the starts of higher priority while
+ * the count of starts in flight allows it.
+ */
+static void dispatch_starts()
+{
+	int i, rc;
+	uint64_t now, wait;
+	struct start_job *job;
+
+	for (i = 0 ; i < (int)start_class_count && start_inflight_count < start_max_jobs ; ) {
+		job = start_queues[i].head;
+		if (!job) {
+			i++;
+			continue;
+		}
+
+		/* dequeue */
+		start_queues[i].head = job->next;
+		if (!job->next)
+			start_queues[i].tail = NULL;
+		start_queues[i].depth--;
+
+		/* account the waiting time */
+		now = now_us();
+		wait = now - job->queued;
+		start_stats.wait_last = wait;
+		start_stats.wait_total += wait;
+		if (wait > start_stats.wait_max)
+			start_stats.wait_max = wait;
+		start_stats.dispatched++;
+
+		/* record it in flight */
+		job->deadline = now + START_STEP_TIMEOUT_US;
+		job->next = start_inflight;
+		start_inflight = job;
+		start_inflight_count++;
+
+		/* send the start to systemd, the reply continues in on_start_job */
+		rc = !job->tname
+			? systemd_unit_start_dpath_async(job->isuser, job->dpath, on_start_job, job)
+			: start_transient_async(job->appli, job->isuser, job->tname, on_start_job, job);
+		if (rc < 0) {
+			ERROR("can't start unit %s for uid %d: %m", job->dpath, job->uid);
+			unlink_start_job(job);
+			end_start_job(job, -1);
+		}
+	}
+	arm_sched_timer();
+}
+
+/*
+ * Handles the expiration of the timer of the start 'job'
+ */
+static void expire_start_job(struct start_job *job)
+{
+	if (job->retry) {
+		job->retry = 0;
+		check_start_job(job);
+	} else {
+		ERROR("job of unit %s for uid %d still waiting", job->dpath, job->uid);
+		systemd_job_wait_cancel(on_start_job_end, job);
+		finish_start_job(job, -1);
+	}
+}
+
+/*
+ * Get the time of the next timer event of the start 'job'
+ */
+static uint64_t start_job_time(struct start_job *job)
+{
+	return job->retry ? job->retry : job->waiting ? job->deadline : UINT64_MAX;
+}
+
+static void expire_stop_job(struct stop_job *job, uint64_t now);
+
+/*
+ * Get the time of the next timer event of the terminate 'job'
+ */
+static uint64_t stop_job_time(struct stop_job *job)
+{
+	return !job->waiting ? UINT64_MAX : job->killed ? job->deadline : job->escalate;
+}
+
+/*
+ * Handles the deadlines of the starts and terminates in flight
+ */
+static int on_sched_timer(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	uint64_t now;
+	struct start_job *job;
+	struct stop_job *sjob;
+
+	/* one job at a time because handling a job changes the lists */
+	now = now_us();
+	for (;;) {
+		job = start_inflight;
+		while (job && start_job_time(job) > now)
+			job = job->next;
+		if (job) {
+			expire_start_job(job);
+			continue;
+		}
+		sjob = stop_inflight;
+		while (sjob && stop_job_time(sjob) > now)
+			sjob = sjob->next;
+		if (!sjob)
+			break;
+		expire_stop_job(sjob, now);
+	}
+	arm_sched_timer();
+	return 0;
+}
+
+/*
+ * Arms the timer at the earliest deadline of the starts and
+ * terminates in flight or disables it if there is none.
+ */
+static void arm_sched_timer()
+{
+	int rc;
+	uint64_t next, t;
+	struct start_job *job;
+	struct stop_job *sjob;
+
+	next = UINT64_MAX;
+	for (job = start_inflight ; job ; job = job->next)
+		if ((t = start_job_time(job)) < next)
+			next = t;
+	for (sjob = stop_inflight ; sjob ; sjob = sjob->next)
+		if ((t = stop_job_time(sjob)) < next)
+			next = t;
+
+	if (next == UINT64_MAX)
+		rc = sched_timer ? sd_event_source_set_enabled(sched_timer, SD_EVENT_OFF) : 0;
+	else if (!sched_timer)
+		rc = sd_event_add_time(evloop, &sched_timer, CLOCK_MONOTONIC,
+				next, 1000, on_sched_timer, NULL);
+	else {
+		rc = sd_event_source_set_time(sched_timer, next);
+		if (rc >= 0)
+			rc = sd_event_source_set_enabled(sched_timer, SD_EVENT_ONESHOT);
+	}
+	if (rc < 0)
+		ERROR("can't arm the timer of the scheduler: %s", strerror(-rc));
+}
+
+/*
+ * Set the event loop 'loop' that drives the start scheduler
+ * and receives the signals of systemd invalidating the cached
+ * dbus paths of units.
+ * Without event loop, starts are synchronous.
+ * The state of afm-urun (scheduler, terminates and history) isn't
+ * locked: when an event loop is set, the functions must be called
+ * from the thread running it, as afm-binding does for its verbs.
+ */
+void afm_urun_set_event_loop(struct sd_event *loop)
+{
+	evloop = loop;
+	if (systemd_set_event_loop(loop) < 0)
+		WARNING("can't watch signals of systemd: %m");
+}
+
+/*
+ * Set the maximum count 'count' of systemd jobs in flight.
+ */
+void afm_urun_set_max_jobs(int count)
+{
+	start_max_jobs = count > 0 ? count : 1;
+	if (evloop)
+		dispatch_starts();
+}
+
+/*
+ * Set the default launch 'mode' of the applications, used when
+ * their private field 'launch-mode' is not set.
+ */
+void afm_urun_set_launch_mode(enum afm_launch_mode mode)
+{
+	launch_mode = mode;
+	drop_appli_indexes();
+}
+
+/*
+ * Get the launch mode of name 'name'.
+ * Returns the mode or -1 if the name is unknown.
+ */
+int afm_urun_launch_mode_of_name(const char *name)
+{
+	int i;
+
+	for (i = 0 ; i < (int)(sizeof launch_mode_names / sizeof *launch_mode_names) ; i++)
+		if (!strcasecmp(name, launch_mode_names[i]))
+			return i;
+	return -1;
+}
+
+/*
+ * Tells whether starting 'appli' needs systemd to reload its unit files
+ * after installation. It is not the case of applications launched as
+ * transient units that don't depend on units installed with widgets.
+ */
+int afm_urun_needs_reload(struct json_object *appli)
+{
+	int i, n;
+	const char *directive, *value;
+	struct json_object *array;
+
+	if (get_launch_mode(appli) != afm_launch_transient)
+		return 1;
+
+	j_read_object_at(appli, key_unit_directives, &array);
+	n = (int)json_object_array_length(array);
+	for (i = 0 ; i < n ; i++) {
+		directive = json_object_get_string(json_object_array_get_idx(array, i));
+		if (!strncmp(directive, "Requires=", 9)
+		 || !strncmp(directive, "Wants=", 6)
+		 || !strncmp(directive, "BindsTo=", 8)) {
+			value = strchr(directive, '=');
+			if (strstr(value, "afm-api-") || strstr(value, "afm-link-"))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Schedules the start of the application described by 'appli'
+ * for the user 'uid'. At the end of the start, the function
+ * 'callback' is called with 'closure' and the runid of the
+ * application or -1 in case of error.
+ *
+ * Start requests are queued by priority class (the private field
+ * 'priority' of the application) and sent to systemd while the count
+ * of systemd jobs in flight is under the configured maximum.
+ * Requests for an application already queued or in flight are merged
+ * with the pending one.
+ *
+ * Returns 0 when the callback is or will be called or -1 in case of
+ * error (callback isn't called).
+ */
+int afm_urun_start_async(struct json_object *appli, int uid, void (*callback)(void *closure, int runid), void *closure)
+{
+	int rc, isuser, transient;
+	char *udpath;
+	char tname[UNIT_NAME_SIZE];
+	struct start_job *job;
+	struct start_waiter *waiter;
+	enum start_class class;
+
+	/* synchronous start if no event loop */
+	if (!evloop) {
+		callback(closure, afm_urun_once(appli, uid));
+		return 0;
+	}
+
+	/* retrieve basis */
+	transient = get_basis(appli, &isuser, &udpath, uid, tname);
+	if (transient < 0)
+		return -1;
+
+	/* create the waiter */
+	waiter = malloc(sizeof *waiter);
+	if (!waiter)
+		goto nomem;
+	waiter->callback = callback;
+	waiter->closure = closure;
+
+	/* deduplicate the start */
+	job = search_start_job(start_inflight, isuser, udpath);
+	for (class = 0 ; !job && class < start_class_count ; class++)
+		job = search_start_job(start_queues[class].head, isuser, udpath);
+	if (job) {
+		start_stats.deduplicated++;
+		waiter->next = job->waiters;
+		job->waiters = waiter;
+		free(udpath);
+		return 0;
+	}
+
+	/* create the job */
+	job = calloc(1, sizeof *job);
+	if (!job)
+		goto nomem2;
+	job->dpath = udpath;
+	if (transient) {
+		job->tname = strdup(tname);
+		if (!job->tname)
+			goto nomem4;
+	}
+	waiter->next = NULL;
+	job->waiters = waiter;
+	job->appli = json_object_get(appli);
+	job->isuser = isuser;
+	job->uid = uid;
+	job->class = class = get_start_class(appli);
+	job->queued = now_us();
+
+	/* read ahead its files while it waits */
+	readahead_replay_appli(appli);
+
+	/* enqueue it */
+	if (start_queues[class].tail)
+		start_queues[class].tail->next = job;
+	else
+		start_queues[class].head = job;
+	start_queues[class].tail = job;
+	start_queues[class].depth++;
+	rc = start_inflight_count;
+	for (class = 0 ; class < start_class_count ; class++)
+		rc += start_queues[class].depth;
+	if (rc > start_stats.queued_max)
+		start_stats.queued_max = rc;
+
+	dispatch_starts();
+	return 0;
+
+nomem4:
+	free(job);
+nomem2:
+	free(waiter);
+nomem:
+	free(udpath);
+	ERROR("out of memory");
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Get the statistics of afm-urun.
+ *
+ * Returns a json object or NULL in case of error.
+ */
+struct json_object *afm_urun_stats()
+{
+	int i, n, depth;
+	struct readahead_recorder *recorder;
+	unsigned long lookups;
+	struct systemd_dpath_cache_stats dpstats;
+	struct systemd_user_bus_stats ubstats;
+	struct systemd_cgroup_stats cgstats;
+	struct json_object *result, *start, *queued, *wait, *cache, *buses, *cgroup;
+	struct json_object *terminate, *reclaim, *readahead;
+
+	result = json_object_new_object();
+	if (!result)
+		goto error;
+
+	start = j_add_new_object(result, "start");
+	queued = start ? j_add_new_object(start, "queued-by-class") : NULL;
+	wait = queued ? j_add_new_object(start, "wait-ms") : NULL;
+	if (!wait)
+		goto error;
+
+	depth = 0;
+	for (i = 0 ; i < (int)start_class_count ; i++) {
+		depth += start_queues[i].depth;
+		if (!j_add_integer(queued, start_class_names[i], start_queues[i].depth))
+			goto error;
+	}
+
+	if (!j_add_integer(start, "max-jobs", start_max_jobs)
+	 || !j_add_integer(start, "in-flight", start_inflight_count)
+	 || !j_add_integer(start, "queued", depth)
+	 || !j_add_integer(start, "queued-max", start_stats.queued_max)
+	 || !j_add_integer(start, "dispatched", start_stats.dispatched)
+	 || !j_add_integer(start, "deduplicated", start_stats.deduplicated)
+	 || !j_add_integer(start, "failed", start_stats.failed)
+	 || !j_add_integer(start, "transient", start_stats.transient)
+	 || !j_add_integer(wait, "last", (int)(start_stats.wait_last / 1000))
+	 || !j_add_integer(wait, "max", (int)(start_stats.wait_max / 1000))
+	 || !j_add_integer(wait, "mean", start_stats.dispatched
+			? (int)(start_stats.wait_total / 1000 / (uint64_t)start_stats.dispatched) : 0))
+		goto error;
+
+	terminate = j_add_new_object(result, "terminate");
+	reclaim = terminate ? j_add_new_object(terminate, "reclaim-ms") : NULL;
+	if (!reclaim
+	 || !j_add_integer(terminate, "grace-ms", terminate_grace_ms)
+	 || !j_add_integer(terminate, "in-flight", stop_inflight_count)
+	 || !j_add_integer(terminate, "requested", stop_stats.requested)
+	 || !j_add_integer(terminate, "escalated", stop_stats.escalated)
+	 || !j_add_integer(terminate, "failed", stop_stats.failed)
+	 || !j_add_integer(reclaim, "last", (int)(stop_stats.reclaim_last / 1000))
+	 || !j_add_integer(reclaim, "max", (int)(stop_stats.reclaim_max / 1000))
+	 || !j_add_integer(reclaim, "mean", stop_stats.reclaimed
+			? (int)(stop_stats.reclaim_total / 1000 / (uint64_t)stop_stats.reclaimed) : 0))
+		goto error;
+
+	n = 0;
+	for (recorder = readahead_recorders ; recorder ; recorder = recorder->next)
+		n++;
+	readahead = j_add_new_object(result, "readahead");
+	if (!readahead
+	 || !j_add_string(readahead, "mode", readahead_mode_names[readahead_mode])
+	 || !j_add_integer(readahead, "recording", n)
+	 || !j_add_integer(readahead, "recorded", readahead_stats.recorded)
+	 || !j_add_integer(readahead, "replayed", readahead_stats.replayed)
+	 || !j_add_integer(readahead, "files", readahead_stats.files))
+		goto error;
+
+	systemd_unit_dpath_cache_stats(&dpstats);
+	lookups = dpstats.hits + dpstats.misses;
+	cache = j_add_new_object(result, "dpath-cache");
+	if (!cache
+	 || !j_add_integer(cache, "count", (int)dpstats.count)
+	 || !j_add_integer(cache, "capacity", (int)dpstats.capacity)
+	 || !j_add_integer(cache, "hits", (int)dpstats.hits)
+	 || !j_add_integer(cache, "misses", (int)dpstats.misses)
+	 || !j_add_integer(cache, "evictions", (int)dpstats.evictions)
+	 || !j_add_integer(cache, "invalidations", (int)dpstats.invalidations)
+	 || !j_add_integer(cache, "hit-rate-percent", lookups ? (int)(dpstats.hits * 100 / lookups) : 0))
+		goto error;
+
+	systemd_user_bus_stats(&ubstats);
+	buses = j_add_new_object(result, "user-buses");
+	if (!buses
+	 || !j_add_integer(buses, "count", (int)ubstats.count)
+	 || !j_add_integer(buses, "opened", (int)ubstats.opened)
+	 || !j_add_integer(buses, "reused", (int)ubstats.reused)
+	 || !j_add_integer(buses, "closed", (int)ubstats.closed)
+	 || !j_add_integer(buses, "failed", (int)ubstats.failed))
+		goto error;
+
+	systemd_cgroup_stats(&cgstats);
+	cgroup = j_add_new_object(result, "cgroup");
+	if (!cgroup
+	 || !j_add_integer(cgroup, "hits", (int)cgstats.hits)
+	 || !j_add_integer(cgroup, "not-found", (int)cgstats.notfound)
+	 || !j_add_integer(cgroup, "fallbacks", (int)cgstats.fallbacks)
+	 || !j_add_integer(cgroup, "mismatches", (int)cgstats.mismatches))
+		goto error;
+
+	return result;
+
+error:
+	json_object_put(result);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/**************** terminate *********************/
+
+/* maximum wait of the end of the unit after SIGKILL */
+#define TERMINATE_KILL_TIMEOUT_US  10000000
+
+/*
+ * Get the grace period of the unit of 'dpath': the private field
+ * 'terminate-grace' of its application or the default one.
+ */
+static int get_terminate_grace(struct afm_udb *db, const char *dpath, int uid)
+{
+	int isuser, grace;
+	struct json_object *appli;
+
+	grace = terminate_grace_ms;
+	appli = db ? search_appli_of_dpath(db, dpath, uid, &isuser) : NULL;
+	if (appli) {
+		if (!j_read_integer_at(appli, key_terminate_grace, &grace) || grace < 0)
+			grace = terminate_grace_ms;
+		json_object_put(appli);
+	}
+	return grace;
+}
+
+/*
+ * Frees the terminate 'job'
+ */
+static void free_stop_job(struct stop_job *job)
+{
+	free(job->jpath);
+	free(job->dpath);
+	free(job);
+}
+
+/*
+ * Calls the callback of the terminate 'job' with 'status' and frees the 'job'
+ */
+static void end_stop_job(struct stop_job *job, int status, uint64_t now)
+{
+	uint64_t reclaim;
+
+	if (status < 0)
+		stop_stats.failed++;
+	else {
+		reclaim = now - job->begin;
+		stop_stats.reclaimed++;
+		stop_stats.reclaim_last = reclaim;
+		stop_stats.reclaim_total += reclaim;
+		if (reclaim > stop_stats.reclaim_max)
+			stop_stats.reclaim_max = reclaim;
+	}
+	job->callback(job->closure, status);
+	free_stop_job(job);
+}
+
+/*
+ * Removes the 'job' from the terminates in flight
+ */
+static void unlink_stop_job(struct stop_job *job)
+{
+	struct stop_job **prv;
+
+	prv = &stop_inflight;
+	while (*prv && *prv != job)
+		prv = &(*prv)->next;
+	if (*prv) {
+		*prv = job->next;
+		stop_inflight_count--;
+	}
+}
+
+/*
+ * Ends the terminate 'job' in flight with 'status'
+ */
+static void finish_stop_job(struct stop_job *job, int status)
+{
+	unlink_stop_job(job);
+	end_stop_job(job, status, now_us());
+	arm_sched_timer();
+}
+
+/*
+ * Receives the 'state' of the unit of the terminate 'closure'.
+ * The job ends when the unit is inactive: its cgroup is empty.
+ */
+static void on_stop_status(void *closure, int state, const char *path)
+{
+	struct stop_job *job = closure;
+
+	/* is the unit stopped or collected? */
+	if (state < 0 || state == SysD_State_Inactive || state == SysD_State_Failed)
+		finish_stop_job(job, 0);
+	else {
+		ERROR("unit %s still alive after its stop job", job->dpath);
+		finish_stop_job(job, -1);
+	}
+}
+
+/*
+ * Receives the end of the systemd stop job of the terminate 'closure'
+ */
+static void on_stop_job_end(void *closure, int status, const char *path)
+{
+	struct stop_job *job = closure;
+
+	job->waiting = 0;
+	if (systemd_unit_status_of_dpath_async(job->isuser, job->dpath, &job->status, on_stop_status, job) < 0) {
+		ERROR("can't get status of unit %s: %m", job->dpath);
+		finish_stop_job(job, -1);
+	}
+}
+
+/*
+ * Receives the systemd stop job 'jpath' of the terminate 'closure'
+ */
+static void on_stop_job(void *closure, int status, const char *jpath)
+{
+	struct stop_job *job = closure;
+
+	if (status < 0) {
+		ERROR("can't stop unit %s: %s", job->dpath, strerror(-status));
+		finish_stop_job(job, -1);
+		return;
+	}
+	job->jpath = strdup(jpath);
+	if (!job->jpath || systemd_job_wait_async(job->isuser, job->jpath, on_stop_job_end, job) < 0) {
+		ERROR("can't wait the stop of unit %s: %m", job->dpath);
+		finish_stop_job(job, -1);
+		return;
+	}
+	job->waiting = 1;
+	arm_sched_timer();
+}
+
+/*
+ * Receives the reply of SIGKILL
+ */
+static void on_stop_kill(void *closure, int status, const char *path)
+{
+	if (status < 0)
+		ERROR("can't send SIGKILL: %s", strerror(-status));
+}
+
+/*
+ * Handles the expiration of the timer of the terminate 'job':
+ * sends SIGKILL to the processes of the unit when the grace
+ * period is over and fails when they survive it.
+ */
+static void expire_stop_job(struct stop_job *job, uint64_t now)
+{
+	if (!job->killed) {
+		NOTICE("runid %d still alive after grace period, sending SIGKILL", job->runid);
+		if (systemd_unit_kill_dpath_async(job->isuser, job->dpath, SIGKILL, on_stop_kill, NULL) < 0)
+			ERROR("can't kill unit %s: %m", job->dpath);
+		job->killed = 1;
+		job->deadline = now + TERMINATE_KILL_TIMEOUT_US;
+		stop_stats.escalated++;
+	} else {
+		ERROR("unit %s still alive after SIGKILL", job->dpath);
+		systemd_job_wait_cancel(on_stop_job_end, job);
+		finish_stop_job(job, -1);
+	}
+}
+
+/*
+ * Create the terminate job of the runner of 'runid' for 'uid'.
+ * Returns the job or NULL in case of error.
+ */
+static struct stop_job *new_stop_job(struct afm_udb *db, int runid, int uid, int grace_ms,
+				void (*callback)(void *closure, int status), void *closure)
+{
+	int isuser;
+	char *dpath;
+	struct stop_job *job;
+
+	/* get the unit */
+	dpath = systemd_unit_dpath_by_pid(isuser = systemd_user_scope(uid), (unsigned)runid);
+	if (!dpath)
+		dpath = systemd_unit_dpath_by_pid(isuser = 0, (unsigned)runid);
+	if (!dpath)
+		return NULL;
+
+	/* create the job */
+	job = calloc(1, sizeof *job);
+	if (!job) {
+		ERROR("out of memory");
+		free(dpath);
+		errno = ENOMEM;
+		return NULL;
+	}
+	job->callback = callback;
+	job->closure = closure;
+	job->dpath = dpath;
+	job->isuser = isuser;
+	job->runid = runid;
+	if (grace_ms < 0)
+		grace_ms = get_terminate_grace(db, dpath, uid);
+	job->begin = now_us();
+	job->escalate = job->begin + (uint64_t)grace_ms * 1000;
+	return job;
+}
+
+/*
+ * Records the status of a synchronous terminate
+ */
+static void on_terminate_sync(void *closure, int status)
+{
+	*(int*)closure = status;
+}
+
+/*
+ * Set the default grace period 'ms' between SIGTERM and SIGKILL
+ */
+void afm_urun_set_terminate_grace(int ms)
+{
+	terminate_grace_ms = ms < 0 ? 0 : ms;
+}
+
+/*
+ * Terminates the runner of 'runid' and waits until its unit is empty.
+ * The processes still alive after 'grace_ms' milliseconds are killed
+ * with SIGKILL. When 'grace_ms' is negative, the grace period is the
+ * one of the application (private field 'terminate-grace' searched
+ * in 'db' that can be NULL) or the default one.
+ *
+ * Returns 0 in case of success or -1 in case of error
+ */
+int afm_urun_terminate(struct afm_udb *db, int runid, int uid, int grace_ms)
+{
+	int rc, status;
+	char *jpath;
+	struct stop_job *job;
+
+	job = new_stop_job(db, runid, uid, grace_ms, on_terminate_sync, &status);
+	if (!job)
+		return -1;
+
+	/* send SIGTERM through systemd */
+	jpath = systemd_unit_stop_job_dpath(job->isuser, job->dpath);
+	if (!jpath) {
+		ERROR("can't stop unit %s: %m", job->dpath);
+		free_stop_job(job);
+		return -1;
+	}
+	stop_stats.requested++;
+
+	/* wait the end of the stop job, escalating after the grace period */
+	rc = systemd_job_wait(job->isuser, jpath, (int)((job->escalate - job->begin) / 1000));
+	if (rc < 0 && errno == ETIMEDOUT) {
+		NOTICE("runid %d still alive after grace period, sending SIGKILL", runid);
+		stop_stats.escalated++;
+		rc = systemd_unit_kill_dpath(job->isuser, job->dpath, SIGKILL);
+		if (rc < 0)
+			ERROR("can't kill unit %s: %m", job->dpath);
+		else {
+			rc = systemd_job_wait(job->isuser, jpath, TERMINATE_KILL_TIMEOUT_US / 1000);
+			if (rc < 0)
+				ERROR("unit %s still alive after SIGKILL", job->dpath);
+		}
+	}
+	free(jpath);
+	end_stop_job(job, rc, now_us());
+	return status;
+}
+
+/*
+ * Terminates the runner of 'runid' like 'afm_urun_terminate' but
+ * calls 'callback' with 'closure' and the status when the unit is
+ * empty.
+ * Without event loop, the terminate is synchronous.
+ *
+ * Returns 0 when the callback is or will be called or -1 in case of
+ * error (callback isn't called).
+ */
+int afm_urun_terminate_async(struct afm_udb *db, int runid, int uid, int grace_ms,
+				void (*callback)(void *closure, int status), void *closure)
+{
+	struct stop_job *job;
+
+	/* synchronous terminate if no event loop */
+	if (!evloop) {
+		callback(closure, afm_urun_terminate(db, runid, uid, grace_ms));
+		return 0;
+	}
+
+	job = new_stop_job(db, runid, uid, grace_ms, callback, closure);
+	if (!job)
+		return -1;
+
+	/* send SIGTERM through systemd, the reply continues in on_stop_job */
+	if (systemd_unit_stop_dpath_async(job->isuser, job->dpath, on_stop_job, job) < 0) {
+		ERROR("can't stop unit %s: %m", job->dpath);
+		free_stop_job(job);
+		return -1;
+	}
+	stop_stats.requested++;
+	job->next = stop_inflight;
+	stop_inflight = job;
+	stop_inflight_count++;
+	return 0;
+}
+
+/*
+ * Places the runner of 'runid' on the CPUs and memory nodes of the
+ * placement 'class' of the policy file. The runner must be the unit
+ * of an application of 'db'. Only the directives that
+ * systemd can change on running units are applied (AllowedCPUs and
+ * AllowedMemoryNodes), the others take effect at the next start.
+ * The change is runtime only: it doesn't survive the restart of
+ * the unit.
+ *
+ * Returns 0 in case of success or -1 in case of error
+ */
+int afm_urun_place(struct afm_udb *db, int runid, int uid, const char *class)
+{
+	int rc, isuser, i, n;
+	char *dpath, *directives[placement_key_count];
+	struct json_object *appli;
+	struct placement placement;
+
+	/* get the placement */
+	if (placement_get(FWK_PLACEMENT_CONF, class, &placement) < 0) {
+		ERROR("can't get placement class %s: %m", class);
+		goto error;
+	}
+
+	/* get the unit */
+	dpath = systemd_unit_dpath_by_pid(isuser = systemd_user_scope(uid), (unsigned)runid);
+	if (!dpath)
+		dpath = systemd_unit_dpath_by_pid(isuser = 0, (unsigned)runid);
+	if (!dpath)
+		goto error2;
+
+	/* only the units of applications are placed */
+	appli = search_appli_of_dpath(db, dpath, uid, &isuser);
+	if (!appli) {
+		ERROR("runid %d isn't an application", runid);
+		errno = EPERM;
+		goto error3;
+	}
+	json_object_put(appli);
+
+	/* compute the directives */
+	rc = 0;
+	for (i = n = 0 ; rc >= 0 && i < placement_key_count ; i++) {
+		if (!placement.values[i])
+			continue;
+		if (!placement_is_runtime(i))
+			INFO("placement %s of %s applies at next start", placement_directive(i), class);
+		else {
+			rc = asprintf(&directives[n], "%s=%s",
+					placement_directive(i), placement.values[i]);
+			n += rc >= 0;
+		}
+	}
+
+	/* set the properties */
+	if (rc < 0)
+		errno = ENOMEM;
+	else if (n) {
+		rc = systemd_unit_set_properties_dpath(isuser, dpath, 1, (const char * const *)directives, n);
+		if (rc < 0)
+			ERROR("can't place unit %s in %s: %m", dpath, class);
+	}
+	while (n)
+		free(directives[--n]);
+	free(dpath);
+	placement_release(&placement);
+	return rc < 0 ? -1 : 0;
+
+error3:
+	free(dpath);
+error2:
+	placement_release(&placement);
+error:
+	return -1;
+}
+
+static int not_yet_implemented(const char *what)
+{
+	ERROR("%s isn't yet implemented", what);
+	errno = ENOTSUP;
+	return -1;
+}
+
+/*
+ * Stops (aka pause) the runner of 'runid'
+ *
+ * Returns 0 in case of success or -1 in case of error
+ */
+int afm_urun_pause(int runid, int uid)
+{
+	return not_yet_implemented("pause");
+}
+
+/*
+ * Continue (aka resume) the runner of 'runid'
+ *
+ * Returns 0 in case of success or -1 in case of error
+ */
+int afm_urun_resume(int runid, int uid)
+{
+	return not_yet_implemented("resume");
+}
+
+/*
+ * Get the description of the runner of 'appli' whose unit has 'status'.
+ * Returns the description or NULL if 'appli' doesn't run.
+ */
+static struct json_object *mkrunner(struct json_object *appli, struct SysD_Unit_Status *status)
+{
+	const char *id;
+
+	if (!j_read_string_at(appli, "id", &id))
+		return NULL;
+	if (status->main_pid > 0 && status->state == SysD_State_Active)
+		return mkstate(id, status->main_pid, status->main_pid, run_state_name(status->state));
+	if (status->state == SysD_State_Inactive && is_on_demand(appli))
+		return mkstate(id, 0, 0, activation_on_demand);
+	return NULL;
+}
+
+/*
+ * Adds to the list 'result' the runner of 'appli' whose unit has 'status'
+ */
+static void add_runner(struct json_object *result, struct json_object *appli, struct SysD_Unit_Status *status)
+{
+	struct json_object *desc;
+
+	desc = mkrunner(appli, status);
+	if (desc && json_object_array_add(result, desc) == -1) {
+		ERROR("can't add desc %s to result", json_object_get_string(desc));
+		json_object_put(desc);
+	}
+}
+
+/*
+ * Get the list of the runners.
+ *
+ * Returns the list or NULL in case of error.
+ */
+struct json_object *afm_urun_list(struct afm_udb *db, int all, int uid)
+{
+	int i, n, isuser, rc;
+	char *udpath;
+	struct SysD_Unit_Status status;
+	struct json_object *appli;
+	struct json_object *apps;
+	struct json_object *result;
+
+	apps = NULL;
+	result = json_object_new_array();
+	if (result == NULL)
+		goto error;
 
 	apps = afm_udb_applications_private(db, all, uid);
 	n = json_object_array_length(apps);
 	for (i = 0 ; i < n ; i++) {
 		appli = json_object_array_get_idx(apps, i);
-		if (appli && get_basis(appli, &isuser, &udpath, uid) >= 0) {
-			pid = systemd_unit_pid_of_dpath(isuser, udpath);
-			if (pid > 0 && j_read_string_at(appli, "id", &id)) {
-				state = systemd_unit_state_of_dpath(isuser, udpath);
-				if (state == SysD_State_Active) {
-					desc = mkstate(id, pid, pid, state);
-					if (desc && json_object_array_add(result, desc) == -1) {
-						ERROR("can't add desc %s to result", json_object_get_string(desc));
-						json_object_put(desc);
-					}
-				}
-			}
-		}
+		if (!appli
+		 || get_basis(appli, &isuser, &udpath, uid, NULL) < 0)
+			continue;
+		rc = systemd_unit_status_of_dpath(isuser, udpath, &status);
+		free(udpath);
+		if (rc >= 0)
+			add_runner(result, appli, &status);
 	}
 
 error:
@@ -386,6 +2325,144 @@ error:
 	return result;
 }
 
+/*
+ * Records the query of the status of an application while listing
+ * the runners asynchronously
+ */
+struct list_item {
+	struct list_job *job;		/* the listing */
+	struct json_object *appli;	/* the application (referenced) */
+	int rc;				/* the result of the query */
+	struct SysD_Unit_Status status;	/* the status of the unit */
+};
+
+/*
+ * Records an asynchronous listing of the runners
+ */
+struct list_job {
+	void (*callback)(void *closure, struct json_object *result); /* callback to call at end */
+	void *closure;			/* closure of the callback */
+	int pending;			/* count of pending queries */
+	int count;			/* count of items */
+	struct list_item items[];	/* the queries in the order of the applications */
+};
+
+/*
+ * Ends a pending query of the listing 'job'. At end of the last one,
+ * calls the callback with the list of the runners and frees the job.
+ */
+static void list_job_step(struct list_job *job)
+{
+	int i;
+	struct json_object *result;
+
+	if (--job->pending)
+		return;
+
+	result = json_object_new_array();
+	for (i = 0 ; i < job->count ; i++) {
+		if (result && job->items[i].rc >= 0)
+			add_runner(result, job->items[i].appli, &job->items[i].status);
+		json_object_put(job->items[i].appli);
+	}
+	job->callback(job->closure, result);
+	free(job);
+}
+
+/*
+ * Callback of the query of the status of the unit of a listed application
+ */
+static void on_list_status(void *closure, int status, const char *path)
+{
+	struct list_item *item = closure;
+
+	item->rc = status;
+	list_job_step(item->job);
+}
+
+/*
+ * Get asynchronously the list of the runners: the statuses of the
+ * units of the applications are queried in parallel and 'callback'
+ * receives the list (or NULL in case of error) with 'closure'.
+ *
+ * Returns 0 in case of success or -1 in case of error.
+ */
+int afm_urun_list_async(struct afm_udb *db, int all, int uid, void (*callback)(void *closure, struct json_object *result), void *closure)
+{
+	int i, n, isuser, rc;
+	char *udpath;
+	struct json_object *appli, *apps;
+	struct list_item *item;
+	struct list_job *job;
+
+	apps = afm_udb_applications_private(db, all, uid);
+	n = (int)json_object_array_length(apps);
+	job = malloc(sizeof *job + (size_t)n * sizeof *job->items);
+	if (!job) {
+		json_object_put(apps);
+		errno = ENOMEM;
+		return -1;
+	}
+	job->callback = callback;
+	job->closure = closure;
+	job->pending = 1;
+	job->count = 0;
+	for (i = 0 ; i < n ; i++) {
+		appli = json_object_array_get_idx(apps, i);
+		if (!appli
+		 || get_basis(appli, &isuser, &udpath, uid, NULL) < 0)
+			continue;
+		item = &job->items[job->count++];
+		item->job = job;
+		item->appli = json_object_get(appli);
+		item->rc = -1;
+		job->pending++;
+		rc = systemd_unit_status_of_dpath_async(isuser, udpath, &item->status, on_list_status, item);
+		free(udpath);
+		if (rc < 0)
+			job->pending--;
+	}
+	json_object_put(apps);
+	list_job_step(job);
+	return 0;
+}
+
+/*
+ * Search the application of the runner of 'runid' for 'uid'. The scope
+ * of its unit is stored in 'isuser' and the dbus path of its unit in
+ * 'dpath', a copy that the caller must free.
+ *
+ * Returns the application (referenced) or NULL with errno set.
+ */
+static struct json_object *search_appli_of_runid(struct afm_udb *db, int runid, int uid, int *isuser, char **dpath)
+{
+	int wasuser;
+	const char *id;
+	struct json_object *appli;
+
+	/* get the dpath */
+	*dpath = systemd_unit_dpath_by_pid(wasuser = systemd_user_scope(uid), (unsigned)runid);
+	if (!*dpath)
+		*dpath = systemd_unit_dpath_by_pid(wasuser = 0, (unsigned)runid);
+	if (!*dpath) {
+		errno = EINVAL;
+		WARNING("searched runid %d not found", runid);
+		return NULL;
+	}
+
+	/* search in the base */
+	appli = search_appli_of_dpath(db, *dpath, uid, isuser);
+	if (!appli || !j_read_string_at(appli, "id", &id)) {
+		errno = ENOENT;
+		WARNING("searched runid %d of dpath %s isn't an applications", runid, *dpath);
+		json_object_put(appli);
+		free(*dpath);
+		*dpath = NULL;
+		return NULL;
+	}
+	return appli;
+}
+
 /*
  * Get the state of the runner of 'runid'.
  *
@@ -393,48 +2470,125 @@ error:
  */
 struct json_object *afm_urun_state(struct afm_udb *db, int runid, int uid)
 {
-	int i, n, isuser, pid, wasuser;
+	int isuser;
 	char *dpath;
-	const char *udpath;
 	const char *id;
-	enum SysD_State state;
+	struct SysD_Unit_Status status;
 	struct json_object *appli;
-	struct json_object *apps;
 	struct json_object *result;
 
 	result = NULL;
+	appli = search_appli_of_runid(db, runid, uid, &isuser, &dpath);
+	if (appli) {
+		if (systemd_unit_status_of_dpath(isuser, dpath, &status) >= 0
+		 && status.main_pid > 0 && status.state == SysD_State_Active
+		 && j_read_string_at(appli, "id", &id))
+			result = mkstate(id, runid, status.main_pid, run_state_name(status.state));
+		json_object_put(appli);
+		free(dpath);
+	}
 
-	/* get the dpath */
-	dpath = systemd_unit_dpath_by_pid(wasuser = 1, (unsigned)runid);
-	if (!dpath)
-		dpath = systemd_unit_dpath_by_pid(wasuser = 0, (unsigned)runid);
-	if (!dpath) {
-		errno = EINVAL;
-		WARNING("searched runid %d not found", runid);
-	} else {
-		/* search in the base */
-		apps = afm_udb_applications_private(db, 1, uid);
-		n = json_object_array_length(apps);
-		for (i = 0 ; i < n ; i++) {
-			appli = json_object_array_get_idx(apps, i);
-			if (appli
-			 && get_basis(appli, &isuser, &udpath, uid) >= 0
-			 && !strcmp(dpath, udpath)
-			 && j_read_string_at(appli, "id", &id)) {
-				pid = systemd_unit_pid_of_dpath(isuser, udpath);
-				state = systemd_unit_state_of_dpath(isuser, dpath);
-				if (pid > 0 && state == SysD_State_Active)
-					result = mkstate(id, runid, pid, state);
-				goto end;
-			}
-		}
-		errno = ENOENT;
-		WARNING("searched runid %d of dpath %s isn't an applications", runid, dpath);
-end:
-		json_object_put(apps);
+	return result;
+}
+
+/*
+ * Records an asynchronous query of the state of a runner
+ */
+struct state_job {
+	void (*callback)(void *closure, struct json_object *state); /* callback to call at end */
+	void *closure;			/* closure of the callback */
+	struct json_object *appli;	/* the application (referenced) */
+	int runid;			/* the runid */
+	struct SysD_Unit_Status status;	/* the status of the unit */
+};
+
+/*
+ * Callback of the query of the status of the unit of a runner
+ */
+static void on_state_status(void *closure, int status, const char *path)
+{
+	struct state_job *job = closure;
+	struct json_object *result;
+	const char *id;
+
+	result = NULL;
+	if (status >= 0
+	 && job->status.main_pid > 0 && job->status.state == SysD_State_Active
+	 && j_read_string_at(job->appli, "id", &id))
+		result = mkstate(id, job->runid, job->status.main_pid, run_state_name(job->status.state));
+	else
+		errno = status < 0 ? -status : ESRCH;
+	json_object_put(job->appli);
+	job->callback(job->closure, result);
+	free(job);
+}
+
+/*
+ * Get asynchronously the state of the runner of 'runid': 'callback'
+ * receives the state (or NULL with errno set) with 'closure'.
+ *
+ * Returns 0 in case of success or -1 in case of error.
+ */
+int afm_urun_state_async(struct afm_udb *db, int runid, int uid, void (*callback)(void *closure, struct json_object *state), void *closure)
+{
+	int isuser, rc;
+	char *dpath;
+	struct json_object *appli;
+	struct state_job *job;
+
+	appli = search_appli_of_runid(db, runid, uid, &isuser, &dpath);
+	if (!appli)
+		return -1;
+	job = malloc(sizeof *job);
+	if (!job) {
+		json_object_put(appli);
 		free(dpath);
+		errno = ENOMEM;
+		return -1;
 	}
+	job->callback = callback;
+	job->closure = closure;
+	job->appli = appli;
+	job->runid = runid;
+	rc = systemd_unit_status_of_dpath_async(isuser, dpath, &job->status, on_state_status, job);
+	free(dpath);
+	if (rc < 0) {
+		json_object_put(appli);
+		free(job);
+	}
+	return rc;
+}
 
+/*
+ * Get the state of the application of 'id' for the user 'uid' when
+ * it waits its activation on demand.
+ *
+ * Returns the state or NULL with errno set to ESRCH when the
+ * application isn't waiting its activation.
+ */
+struct json_object *afm_urun_state_on_demand(struct afm_udb *db, const char *id, int uid)
+{
+	int isuser, rc;
+	char *udpath;
+	struct SysD_Unit_Status status;
+	struct json_object *appli, *result;
+
+	result = NULL;
+	rc = -1;
+	appli = afm_udb_get_application_private(db, id, uid);
+	if (appli
+	 && is_on_demand(appli)
+	 && get_basis(appli, &isuser, &udpath, uid, NULL) >= 0) {
+		rc = systemd_unit_status_of_dpath(isuser, udpath, &status);
+		free(udpath);
+	}
+	if (rc >= 0
+	 && status.state == SysD_State_Inactive
+	 && j_read_string_at(appli, "id", &id))
+		result = mkstate(id, 0, 0, activation_on_demand);
+	else
+		errno = ESRCH;
+	json_object_put(appli);
 	return result;
 }
 
@@ -445,7 +2599,7 @@ end:
 int afm_urun_search_runid(struct afm_udb *db, const char *id, int uid)
 {
 	int isuser, pid;
-	const char *udpath;
+	char *udpath;
 	struct json_object *appli;
 
 	appli = afm_udb_get_application_private(db, id, uid);
@@ -453,10 +2607,11 @@ int afm_urun_search_runid(struct afm_udb *db, const char *id, int uid)
 		NOTICE("Unknown appid %s", id);
 		errno = ENOENT;
 		pid = -1;
-	} else if (get_basis(appli, &isuser, &udpath, uid) < 0) {
+	} else if (get_basis(appli, &isuser, &udpath, uid, NULL) < 0) {
 		pid = -1;
 	} else {
 		pid = systemd_unit_pid_of_dpath(isuser, udpath);
+		free(udpath);
 		if (pid == 0) {
 			errno = ESRCH;
 			pid = -1;
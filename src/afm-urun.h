@@ -17,13 +17,44 @@
 */
 
 struct afm_udb;
+struct sd_event;
+
+enum afm_launch_mode {
+	afm_launch_unit,	/* start the unit file of the application */
+	afm_launch_transient	/* start a transient unit built from the record */
+};
+
+enum afm_readahead_mode {
+	afm_readahead_off,	/* no readahead */
+	afm_readahead_replay,	/* replay the recorded lists only */
+	afm_readahead_on	/* record the lists at first launch and replay them */
+};
 
 extern int afm_urun_start(struct json_object *appli, int uid);
 extern int afm_urun_once(struct json_object *appli, int uid);
-extern int afm_urun_terminate(int runid, int uid);
+extern int afm_urun_start_async(struct json_object *appli, int uid, void (*callback)(void *closure, int runid), void *closure);
+extern void afm_urun_set_event_loop(struct sd_event *loop);
+extern void afm_urun_set_max_jobs(int count);
+extern void afm_urun_set_launch_mode(enum afm_launch_mode mode);
+extern int afm_urun_launch_mode_of_name(const char *name);
+extern int afm_urun_needs_reload(struct json_object *appli);
+extern void afm_urun_set_readahead_mode(enum afm_readahead_mode mode);
+extern int afm_urun_readahead_mode_of_name(const char *name);
+extern void afm_urun_set_readahead_seconds(int seconds);
+extern int afm_urun_readahead_autostart(struct afm_udb *db);
+extern void afm_urun_set_history_max_age(int seconds);
+extern struct json_object *afm_urun_history(int uid, const char *id, int failed, int clean);
+extern struct json_object *afm_urun_stats();
+extern void afm_urun_set_terminate_grace(int ms);
+extern int afm_urun_terminate(struct afm_udb *db, int runid, int uid, int grace_ms);
+extern int afm_urun_terminate_async(struct afm_udb *db, int runid, int uid, int grace_ms, void (*callback)(void *closure, int status), void *closure);
+extern int afm_urun_place(struct afm_udb *db, int runid, int uid, const char *class);
 extern int afm_urun_pause(int runid, int uid);
 extern int afm_urun_resume(int runid, int uid);
 extern struct json_object *afm_urun_list(struct afm_udb *db, int all, int uid);
+extern int afm_urun_list_async(struct afm_udb *db, int all, int uid, void (*callback)(void *closure, struct json_object *result), void *closure);
 extern struct json_object *afm_urun_state(struct afm_udb *db, int runid, int uid);
+extern int afm_urun_state_async(struct afm_udb *db, int runid, int uid, void (*callback)(void *closure, struct json_object *state), void *closure);
+extern struct json_object *afm_urun_state_on_demand(struct afm_udb *db, const char *id, int uid);
 extern int afm_urun_search_runid(struct afm_udb *db, const char *id, int uid);
 
@@ -22,6 +22,9 @@
 #include <time.h>
 #include <getopt.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
 
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
@@ -36,6 +39,34 @@
 
 #define AFM_USER_DBUS_PATH	"/org/AGL/afm/user"
 
+#if !defined(AFM_USER_CACHE_SIZE)
+# define AFM_USER_CACHE_SIZE	64
+#endif
+
+#if !defined(AFM_USER_QUEUE_SIZE)
+# define AFM_USER_QUEUE_SIZE	128
+#endif
+
+#if !defined(AFM_USER_OUTSTANDING_MAX)
+# define AFM_USER_OUTSTANDING_MAX	16
+#endif
+
+#if !defined(AFM_USER_CALL_TIMEOUT_MS)
+# define AFM_USER_CALL_TIMEOUT_MS	30000
+#endif
+
+#if !defined(AFM_USER_RECONNECT_MIN_MS)
+# define AFM_USER_RECONNECT_MIN_MS	10
+#endif
+
+#if !defined(AFM_USER_RECONNECT_MAX_MS)
+# define AFM_USER_RECONNECT_MAX_MS	5000
+#endif
+
+#if !defined(AFM_USER_RECONNECT_GIVEUP_S)
+# define AFM_USER_RECONNECT_GIVEUP_S	60
+#endif
+
 /*
  * name of the application
  */
@@ -61,6 +92,10 @@ static const char usagestr[] =
 	"\n"
 	"   -d           run as a daemon\n"
 	"   -u addr      address of user D-Bus to use\n"
+	"   -c count     count of replies to cache (0 to disable)\n"
+	"   -Q count     count of calls to queue\n"
+	"   -o count     count of outstanding calls to the framework\n"
+	"   -t ms        timeout of the calls in milliseconds\n"
 	"   -q           quiet\n"
 	"   -v           verbose\n"
 	"   -V           version\n"
@@ -69,9 +104,13 @@ static const char usagestr[] =
 /*
  * Option definition for getopt_long
  */
-static const char options_s[] = "hdqvVu:";
+static const char options_s[] = "hdqvVu:c:Q:o:t:";
 static struct option options_l[] = {
 	{ "user-dbus",   required_argument, NULL, 'u' },
+	{ "cache",       required_argument, NULL, 'c' },
+	{ "queue",       required_argument, NULL, 'Q' },
+	{ "outstanding", required_argument, NULL, 'o' },
+	{ "timeout",     required_argument, NULL, 't' },
 	{ "daemon",      no_argument,       NULL, 'd' },
 	{ "quiet",       no_argument,       NULL, 'q' },
 	{ "verbose",     no_argument,       NULL, 'v' },
@@ -100,6 +139,98 @@ static const char *methods[] = {
 	NULL
 };
 
+/*
+ * The methods whose replies are cached: their replies only change
+ * when the list of applications changes, what is notified by an event
+ */
+static const char *cached_methods[] = {
+	"runnables",
+	"detail",
+	NULL
+};
+
+/*
+ * The methods that are called again after a disconnection of the
+ * framework: they don't change anything, calling them twice is safe
+ */
+static const char *replayed_methods[] = {
+	"runnables",
+	"detail",
+	"runners",
+	"state",
+	NULL
+};
+
+/*
+ * Entry of the cache of replies
+ */
+struct cache_entry {
+	struct cache_entry *next;	/* next entry, less recently used */
+	struct json_object *reply;	/* the cached reply */
+	char key[];			/* the method and its argument */
+};
+
+/*
+ * Call propagated to the framework
+ */
+struct call {
+	struct call *next;		/* next call of the list */
+	struct sd_bus_message *smsg;	/* the D-Bus request or NULL if replied */
+	struct json_object *obj;	/* the argument */
+	const char *verb;		/* the method */
+	uint64_t deadline;		/* time of timeout (CLOCK_MONOTONIC, us) */
+	unsigned generation;		/* generation of the cache at call */
+	char key[];			/* key for caching or empty string */
+};
+
+/*
+ * Cache of replies
+ */
+static struct {
+	struct cache_entry *head;	/* most recently used entry */
+	unsigned count;			/* count of entries */
+	unsigned size;			/* maximum count of entries */
+	unsigned generation;		/* incremented on invalidation */
+	unsigned long hits;		/* count of replies from cache */
+	unsigned long misses;		/* count of cacheable calls propagated */
+	unsigned long invalidations;	/* count of invalidations */
+} cache = { .size = AFM_USER_CACHE_SIZE };
+
+/*
+ * Calls to the framework
+ */
+static struct {
+	struct call *head;		/* first call waiting to be sent */
+	struct call **tail;		/* end of the waiting calls */
+	struct call *sent;		/* calls sent, waiting their reply */
+	unsigned queued;		/* count of calls waiting */
+	unsigned outstanding;		/* count of calls sent */
+	unsigned max_queued;		/* maximum count of calls waiting */
+	unsigned max_outstanding;	/* maximum count of calls sent */
+	unsigned peak_queued;		/* highest count of calls waiting */
+	uint64_t timeout;		/* timeout of calls in us */
+	sd_event_source *timer;		/* timer of the deadlines */
+	unsigned long rejected;		/* count of calls rejected as queue is full */
+	unsigned long timeouts;		/* count of calls timed out */
+	unsigned long replayed;		/* count of calls sent again */
+} calls = {
+	.tail = &calls.head,
+	.max_queued = AFM_USER_QUEUE_SIZE,
+	.max_outstanding = AFM_USER_OUTSTANDING_MAX,
+	.timeout = (uint64_t)AFM_USER_CALL_TIMEOUT_MS * 1000
+};
+
+/*
+ * Reconnection to the framework
+ */
+static struct {
+	uint64_t delay;			/* next delay of reconnection in us */
+	uint64_t since;			/* time of the disconnection */
+	unsigned attempts;		/* attempts since the disconnection */
+	unsigned long reconnections;	/* count of reconnections */
+	uint64_t last_duration;		/* duration of the last disconnection in us */
+} reconnect;
+
 /*
  * Connections
  */
@@ -133,49 +264,295 @@ static struct afb_proto_ws_client_itf pws_itf = {
 	.on_event_broadcast = on_pws_event_broadcast,
 };
 
+static void drain_calls();
+
+/* get the current time in microseconds */
+static uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* tells whether 'verb' is in the NULL terminated 'list' */
+static int is_in(const char **list, const char *verb)
+{
+	while (*list)
+		if (!strcmp(*list++, verb))
+			return 1;
+	return 0;
+}
+
 static int try_connect_pws()
 {
 	pws = afb_ws_client_connect_api(evloop, uri, &pws_itf, NULL);
 	if (pws == NULL) {
-		fprintf(stderr, "connection to %s failed: %m\n", uri);
+		INFO("connection to %s failed: %m", uri);
 		return 0;
 	}
 	afb_proto_ws_on_hangup(pws, on_pws_hangup);
 	return 1;
 }
 
-static void attempt_connect_pws(int count);
+static void attempt_connect_pws();
 
 static int timehand(sd_event_source *s, uint64_t usec, void *userdata)
 {
 	sd_event_source_unref(s);
-	attempt_connect_pws((int)(intptr_t)userdata);
+	attempt_connect_pws();
 	return 0;
 }
 
-static void attempt_connect_pws(int count)
+/*
+ * Attempts to reconnect to the framework, with a delay doubling
+ * at each failure, until AFM_USER_RECONNECT_GIVEUP_S seconds
+ */
+static void attempt_connect_pws()
 {
+	uint64_t now;
 	sd_event_source *s;
-	if (!try_connect_pws()) {
-		if (--count <= 0) {
-			ERROR("Definitely disconnected");
-			exit(1);
+
+	reconnect.attempts++;
+	now = now_us();
+	if (try_connect_pws()) {
+		reconnect.reconnections++;
+		reconnect.last_duration = now - reconnect.since;
+		NOTICE("reconnected to %s after %u attempts in %llu ms, %u calls queued",
+			uri, reconnect.attempts,
+			(unsigned long long)(reconnect.last_duration / 1000), calls.queued);
+		drain_calls();
+		return;
+	}
+	if (now - reconnect.since >= (uint64_t)AFM_USER_RECONNECT_GIVEUP_S * 1000000) {
+		ERROR("Definitely disconnected");
+		exit(1);
+	}
+	if (sd_event_add_time(evloop, &s, CLOCK_MONOTONIC, now + reconnect.delay, 0, timehand, NULL) < 0) {
+		ERROR("can't arm reconnection timer");
+		exit(1);
+	}
+	reconnect.delay *= 2;
+	if (reconnect.delay > (uint64_t)AFM_USER_RECONNECT_MAX_MS * 1000)
+		reconnect.delay = (uint64_t)AFM_USER_RECONNECT_MAX_MS * 1000;
+}
+
+/* release the 'call' */
+static void call_free(struct call *call)
+{
+	json_object_put(call->obj);
+	free(call);
+}
+
+/* reply to the request of the expired 'call' */
+static void call_expire(struct call *call)
+{
+	calls.timeouts++;
+	jbus_reply_error_s(call->smsg, "timeout");
+	call->smsg = NULL;
+}
+
+/* arms the timer of deadlines for the earliest one or disables it */
+static void arm_deadline_timer()
+{
+	uint64_t next;
+	struct call *call;
+
+	next = UINT64_MAX;
+	for (call = calls.head ; call ; call = call->next)
+		if (call->deadline < next)
+			next = call->deadline;
+	for (call = calls.sent ; call ; call = call->next)
+		if (call->smsg && call->deadline < next)
+			next = call->deadline;
+
+	if (next == UINT64_MAX)
+		sd_event_source_set_enabled(calls.timer, SD_EVENT_OFF);
+	else {
+		sd_event_source_set_time(calls.timer, next);
+		sd_event_source_set_enabled(calls.timer, SD_EVENT_ONESHOT);
+	}
+}
+
+/* expires the calls whose deadline is reached */
+static int on_deadline(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	uint64_t now;
+	struct call *call, **prv;
+
+	now = now_us();
+
+	/* the waiting calls are removed */
+	prv = &calls.head;
+	while ((call = *prv) != NULL) {
+		if (call->deadline > now)
+			prv = &call->next;
+		else {
+			*prv = call->next;
+			calls.queued--;
+			call_expire(call);
+			call_free(call);
+		}
+	}
+	calls.tail = prv;
+
+	/* the sent calls wait their reply */
+	for (call = calls.sent ; call ; call = call->next)
+		if (call->smsg && call->deadline <= now)
+			call_expire(call);
+
+	arm_deadline_timer();
+	return 0;
+}
+
+/* put the 'call' in the queue, at its head if 'first' isn't nul */
+static void enqueue_call(struct call *call, int first)
+{
+	if (first) {
+		call->next = calls.head;
+		if (!calls.head)
+			calls.tail = &call->next;
+		calls.head = call;
+	}
+	else {
+		call->next = NULL;
+		*calls.tail = call;
+		calls.tail = &call->next;
+	}
+	if (++calls.queued > calls.peak_queued)
+		calls.peak_queued = calls.queued;
+}
+
+/* send the waiting calls while connected and below the limit of outstanding calls */
+static void drain_calls()
+{
+	int rc;
+	struct call *call;
+	const char *onbehalf = NULL; /* TODO: on behalf of the client */
+
+	while (pws && calls.head && calls.outstanding < calls.max_outstanding) {
+		call = calls.head;
+		calls.head = call->next;
+		if (!calls.head)
+			calls.tail = &calls.head;
+		calls.queued--;
+
+		call->next = calls.sent;
+		calls.sent = call;
+		calls.outstanding++;
+#if defined(AFB_PROTO_WS_VERSION) && (AFB_PROTO_WS_VERSION >= 3)
+		rc = afb_proto_ws_client_call(pws, call->verb, call->obj, sessionid, call, onbehalf);
+#else
+		rc = afb_proto_ws_client_call(pws, call->verb, call->obj, sessionid, call);
+#endif
+		if (rc < 0) {
+			/* keep it for a next attempt */
+			ERROR("calling %s(%s) failed: %m", call->verb, json_object_to_json_string(call->obj));
+			calls.sent = call->next;
+			calls.outstanding--;
+			enqueue_call(call, 1);
+			break;
 		}
-		sd_event_add_time(evloop, &s, CLOCK_MONOTONIC, 5000000, 0, timehand, (void*)(intptr_t)count);
 	}
 }
 
+/* search the entry of 'key' in the cache, making it the most recent */
+static struct cache_entry *cache_search(const char *key)
+{
+	struct cache_entry *entry, **prv;
+
+	prv = &cache.head;
+	while ((entry = *prv) != NULL) {
+		if (!strcmp(entry->key, key)) {
+			*prv = entry->next;
+			entry->next = cache.head;
+			cache.head = entry;
+			break;
+		}
+		prv = &entry->next;
+	}
+	return entry;
+}
+
+/* add to the cache the 'reply' for 'key', dropping the least recent entry if full */
+static void cache_add(const char *key, struct json_object *reply)
+{
+	size_t length;
+	struct cache_entry *entry, **prv;
+
+	if (cache_search(key) || !cache.size)
+		return;
+
+	length = strlen(key);
+	entry = malloc(sizeof *entry + length + 1);
+	if (!entry)
+		return;
+	memcpy(entry->key, key, length + 1);
+	entry->reply = json_object_get(reply);
+	entry->next = cache.head;
+	cache.head = entry;
+	if (++cache.count > cache.size) {
+		for (prv = &cache.head ; (*prv)->next ; prv = &(*prv)->next);
+		entry = *prv;
+		*prv = NULL;
+		cache.count--;
+		json_object_put(entry->reply);
+		free(entry);
+	}
+}
+
+/* drop all the entries of the cache */
+static void cache_invalidate()
+{
+	struct cache_entry *entry;
+
+	while ((entry = cache.head) != NULL) {
+		cache.head = entry->next;
+		json_object_put(entry->reply);
+		free(entry);
+	}
+	cache.count = 0;
+	cache.generation++;
+	cache.invalidations++;
+}
+
 static void on_pws_reply(void *closure, void *request, struct json_object *obj, const char *error, const char *info)
 {
-	struct sd_bus_message *smsg = request;
-	if (error)
-		jbus_reply_error_s(smsg, error);
-	else
-		jbus_reply_j(smsg, obj);
+	struct call *call = request, **prv;
+
+	/* remove from the sent calls */
+	for (prv = &calls.sent ; *prv && *prv != call ; prv = &(*prv)->next);
+	if (*prv) {
+		*prv = call->next;
+		calls.outstanding--;
+	}
+
+	if (call->smsg == NULL)
+		/* already expired */
+		call_free(call);
+	else if (error && !strcmp(error, "disconnected") && is_in(replayed_methods, call->verb)) {
+		/* sent again after reconnection */
+		calls.replayed++;
+		enqueue_call(call, 1);
+		return;
+	}
+	else {
+		if (error)
+			jbus_reply_error_s(call->smsg, error);
+		else {
+			/* don't cache replies that could predate an invalidation */
+			if (call->key[0] && call->generation == cache.generation)
+				cache_add(call->key, obj);
+			jbus_reply_j(call->smsg, obj);
+		}
+		call_free(call);
+	}
+	drain_calls();
 }
 
 static void on_pws_event_broadcast(void *closure, const char *event_name, struct json_object *data)
 {
+	cache_invalidate();
 	jbus_send_signal_j(user_bus, "changed", data);
 }
 
@@ -183,30 +560,110 @@ static void on_pws_event_broadcast(void *closure, const char *event_name, struct
 static void on_pws_hangup(void *closure)
 {
 	struct afb_proto_ws *apw = pws;
+	cache_invalidate();
 	pws = NULL;
 	afb_proto_ws_unref(apw);
-	attempt_connect_pws(10);
+	NOTICE("disconnected from %s, %u calls queued, %u outstanding", uri, calls.queued, calls.outstanding);
+	reconnect.since = now_us();
+	reconnect.attempts = 0;
+	reconnect.delay = (uint64_t)AFM_USER_RECONNECT_MIN_MS * 1000;
+	attempt_connect_pws();
 }
 
 /* propagate the call to the service */
 static void propagate(struct sd_bus_message *smsg, struct json_object *obj, void *closure)
 {
-	int rc;
 	const char *verb = closure;
-	const char *onbehalf = NULL; /* TODO: on behalf of the client */
+	const char *arg = json_object_to_json_string(obj);
+	struct cache_entry *entry;
+	struct call *call;
+	size_t lverb, larg;
+
+	/* make the call, with the key of the cache if cached */
+	lverb = strlen(verb);
+	larg = cache.size && is_in(cached_methods, verb) ? strlen(arg) : 0;
+	call = malloc(sizeof *call + lverb + larg + 2);
+	if (!call) {
+		jbus_reply_error_s(smsg, "out of memory");
+		return;
+	}
+	call->smsg = smsg;
+	call->obj = json_object_get(obj);
+	call->verb = verb;
+	call->deadline = now_us() + calls.timeout;
+	call->generation = cache.generation;
+	call->key[0] = 0;
+	if (larg) {
+		memcpy(call->key, verb, lverb);
+		call->key[lverb] = '\n';
+		memcpy(&call->key[lverb + 1], arg, larg + 1);
+
+		/* reply from the cache if possible */
+		entry = cache_search(call->key);
+		if (entry) {
+			DEBUG("method %s replied from cache for %s", verb, arg);
+			cache.hits++;
+			jbus_reply_j(smsg, entry->reply);
+			call_free(call);
+			return;
+		}
+		cache.misses++;
+	}
 
-	INFO("method %s propagated for %s", verb, json_object_to_json_string(obj));
-	if (!pws)
-		jbus_reply_error_s(smsg, "disconnected");
-	else {
-#if defined(AFB_PROTO_WS_VERSION) && (AFB_PROTO_WS_VERSION >= 3)
-		rc = afb_proto_ws_client_call(pws, verb, obj, sessionid, smsg, onbehalf);
-#else
-		rc = afb_proto_ws_client_call(pws, verb, obj, sessionid, smsg);
-#endif
-		if (rc < 0)
-			ERROR("calling %s(%s) failed: %m\n", verb, json_object_to_json_string(obj));
-	} 
+	/* queue the call */
+	if (calls.queued >= calls.max_queued) {
+		calls.rejected++;
+		jbus_reply_error_s(smsg, pws ? "busy" : "disconnected");
+		call_free(call);
+		return;
+	}
+	INFO("method %s propagated for %s", verb, arg);
+	enqueue_call(call, 0);
+	drain_calls();
+	arm_deadline_timer();
+}
+
+/* reply the statistics of the queue of calls */
+static void queue_stats(struct sd_bus_message *smsg, struct json_object *obj, void *closure)
+{
+	struct json_object *stats;
+
+	stats = json_object_new_object();
+	if (!stats
+	 || !j_add(stats, "connected", json_object_new_boolean(pws != NULL))
+	 || !j_add(stats, "queued", json_object_new_int64(calls.queued))
+	 || !j_add(stats, "outstanding", json_object_new_int64(calls.outstanding))
+	 || !j_add(stats, "max-queued", json_object_new_int64(calls.max_queued))
+	 || !j_add(stats, "max-outstanding", json_object_new_int64(calls.max_outstanding))
+	 || !j_add(stats, "peak-queued", json_object_new_int64(calls.peak_queued))
+	 || !j_add(stats, "rejected", json_object_new_int64((int64_t)calls.rejected))
+	 || !j_add(stats, "timeouts", json_object_new_int64((int64_t)calls.timeouts))
+	 || !j_add(stats, "replayed", json_object_new_int64((int64_t)calls.replayed))
+	 || !j_add(stats, "reconnections", json_object_new_int64((int64_t)reconnect.reconnections))
+	 || !j_add(stats, "reconnect-attempts", json_object_new_int64(reconnect.attempts))
+	 || !j_add(stats, "reconnect-ms", json_object_new_int64((int64_t)(reconnect.last_duration / 1000))))
+		jbus_reply_error_s(smsg, "out of memory");
+	else
+		jbus_reply_j(smsg, stats);
+	json_object_put(stats);
+}
+
+/* reply the statistics of the cache */
+static void cache_stats(struct sd_bus_message *smsg, struct json_object *obj, void *closure)
+{
+	struct json_object *stats;
+
+	stats = json_object_new_object();
+	if (!stats
+	 || !j_add(stats, "size", json_object_new_int64(cache.size))
+	 || !j_add(stats, "entries", json_object_new_int64(cache.count))
+	 || !j_add(stats, "hits", json_object_new_int64((int64_t)cache.hits))
+	 || !j_add(stats, "misses", json_object_new_int64((int64_t)cache.misses))
+	 || !j_add(stats, "invalidations", json_object_new_int64((int64_t)cache.invalidations)))
+		jbus_reply_error_s(smsg, "out of memory");
+	else
+		jbus_reply_j(smsg, stats);
+	json_object_put(stats);
 }
 
 /*
@@ -297,6 +754,20 @@ int main(int ac, char **av)
 		case 'u':
 			usr_bus_addr = optarg;
 			break;
+		case 'c':
+			cache.size = (unsigned)atoi(optarg);
+			break;
+		case 'Q':
+			calls.max_queued = (unsigned)atoi(optarg);
+			break;
+		case 'o':
+			calls.max_outstanding = (unsigned)atoi(optarg);
+			if (!calls.max_outstanding)
+				calls.max_outstanding = 1;
+			break;
+		case 't':
+			calls.timeout = (uint64_t)atoi(optarg) * 1000;
+			break;
 		case ':':
 			ERROR("missing argument value");
 			return 1;
@@ -343,6 +814,13 @@ int main(int ac, char **av)
 		return 1;
 	}
 
+	rc = sd_event_add_time(evloop, &calls.timer, CLOCK_MONOTONIC, 0, 0, on_deadline, NULL);
+	if (rc < 0) {
+		ERROR("can't create timer of calls");
+		return 1;
+	}
+	sd_event_source_set_enabled(calls.timer, SD_EVENT_OFF);
+
 	/* connect to framework */
 	if (!try_connect_pws()) {
 		ERROR("connection to %s failed: %m\n", uri);
@@ -363,6 +841,11 @@ int main(int ac, char **av)
 			return 1;
 		}
 	}
+	if (jbus_add_service_j(user_bus, "cache", cache_stats, NULL)
+	 || jbus_add_service_j(user_bus, "queue", queue_stats, NULL)) {
+		ERROR("adding services failed");
+		return 1;
+	}
 
 	/* start servicing */
 	if (jbus_start_serving(user_bus) < 0) {
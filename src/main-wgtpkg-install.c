@@ -34,10 +34,15 @@
 #include "wgtpkg-xmlsec.h"
 #include "wgt-info.h"
 #include "wgtpkg-install.h"
+#include "wgtpkg-uninstall.h"
 
 static const char appname[] = "wgtpkg-install";
 static const char *root;
 static int force;
+static int uninstall;
+static int atomic;
+static int progress_fd = -1;
+static int progress_index;
 
 static void version()
 {
@@ -56,22 +61,62 @@ static void version()
 static void usage()
 {
 	printf(
-		"usage: %s [-f] [-q] [-v] [-p list] rootdir wgtfile...\n"
+		"usage: %s [-f] [-a] [-q] [-v] [-p list] [-P fd] rootdir wgtfile...\n"
+		"       %s -u [-q] [-v] [-P fd] rootdir id...\n"
 		"\n"
 		"   rootdir       the root directory for installing\n"
+		"   wgtfile       the widget file or - for the standard input\n"
+		"   id            the id of the widget to uninstall\n"
 		"   -p list       a list of comma separated permissions to allow\n"
+		"   -P fd         report the progress on the file descriptor fd\n"
+		"   -u            uninstall\n"
 		"   -f            force overwriting\n"
+		"   -a            atomic: stop at first failure and uninstall\n"
+		"                 the widgets already installed\n"
 		"   -q            quiet\n"
 		"   -v            verbose\n"
 		"   -V            version\n"
 		"\n",
-		appname
+		appname, appname
 	);
 }
 
+/*
+ * The progress is reported as lines where INDEX is the index of the
+ * wgtfile (or id) in the arguments, starting at 0. The arguments
+ * themselves are never echoed.
+ *   step INDEX NAME         the installation of INDEX enters the step NAME
+ *   added INDEX ID IDAVER   INDEX is installed as IDAVER
+ *   removed INDEX           INDEX is uninstalled
+ *   failed INDEX ERRNO      the (un)installation of INDEX failed
+ *   rolledback INDEX        the installation of INDEX was undone (atomic)
+ */
+static void on_progress(void *closure, const char *step, const char *wgtfile)
+{
+	dprintf(progress_fd, "step %d %s\n", progress_index, step);
+}
+
+/*
+ * Uninstalls, in reverse order, the 'count' widgets installed of 'ifos'
+ */
+static void rollback(struct wgt_info **ifos, int count)
+{
+	while (count) {
+		if (ifos[--count] == NULL)
+			continue;
+		if (uninstall_widget(wgt_info_desc(ifos[count])->idaver, root))
+			ERROR("can't rollback installation of %s", wgt_info_desc(ifos[count])->idaver);
+		else if (progress_fd >= 0)
+			dprintf(progress_fd, "rolledback %d\n", count);
+	}
+}
+
 static struct option options[] = {
 	{ "permissions", required_argument, NULL, 'p' },
+	{ "progress",    required_argument, NULL, 'P' },
+	{ "uninstall",   no_argument,       NULL, 'u' },
 	{ "force",       no_argument,       NULL, 'f' },
+	{ "atomic",      no_argument,       NULL, 'a' },
 	{ "help",        no_argument,       NULL, 'h' },
 	{ "quiet",       no_argument,       NULL, 'q' },
 	{ "verbose",     no_argument,       NULL, 'v' },
@@ -82,8 +127,8 @@ static struct option options[] = {
 /* install the widgets of the list */
 int main(int ac, char **av)
 {
-	int i, rc;
-	struct wgt_info *ifo;
+	int i, n, rc;
+	struct wgt_info *ifo, **ifos;
 
 	LOGAUTH(appname);
 
@@ -91,13 +136,16 @@ int main(int ac, char **av)
 
 	force = 0;
 	for (;;) {
-		i = getopt_long(ac, av, "hfqvVp:", options, NULL);
+		i = getopt_long(ac, av, "+hfaqvVp:P:u", options, NULL);
 		if (i < 0)
 			break;
 		switch (i) {
 		case 'f':
 			force = 1;
 			break;
+		case 'a':
+			atomic = 1;
+			break;
 		case 'h':
 			usage();
 			return 0;
@@ -111,6 +159,13 @@ int main(int ac, char **av)
 		case 'V':
 			version();
 			return 0;
+		case 'P':
+			progress_fd = atoi(optarg);
+			install_set_progress(on_progress, NULL);
+			break;
+		case 'u':
+			uninstall = 1;
+			break;
 		case 'p':
 			rc = grant_permission_list(optarg);
 			if (rc < 0) {
@@ -136,11 +191,44 @@ int main(int ac, char **av)
 	/* install widgets */
 	av += optind;
 	root = *av++;
-	for ( ; *av ; av++) {
-		ifo = install_widget(*av, root, force);
-		if (ifo)
-			wgt_info_unref(ifo);
+	n = ac - 1;
+	ifos = calloc((size_t)n, sizeof *ifos);
+	if (!ifos) {
+		ERROR("out of memory");
+		return 1;
+	}
+	for (progress_index = 0 ; progress_index < n ; progress_index++) {
+		if (uninstall) {
+			rc = uninstall_widget(av[progress_index], root);
+			if (progress_fd < 0)
+				continue;
+			if (rc)
+				dprintf(progress_fd, "failed %d %d\n", progress_index, errno);
+			else
+				dprintf(progress_fd, "removed %d\n", progress_index);
+			continue;
+		}
+		if (!strcmp(av[progress_index], "-"))
+			ifo = install_widget_fd(0, root, force);
+		else
+			ifo = install_widget(av[progress_index], root, force);
+		if (progress_fd >= 0) {
+			if (!ifo)
+				dprintf(progress_fd, "failed %d %d\n", progress_index, errno);
+			else
+				dprintf(progress_fd, "added %d %s %s\n", progress_index,
+					wgt_info_desc(ifo)->id, wgt_info_desc(ifo)->idaver);
+		}
+		ifos[progress_index] = ifo;
+		if (!ifo && atomic) {
+			rollback(ifos, progress_index);
+			break;
+		}
 	}
+	for (i = 0 ; i < n ; i++)
+		if (ifos[i])
+			wgt_info_unref(ifos[i]);
+	free(ifos);
 
 	return 0;
 }
@@ -0,0 +1,96 @@
+#!/bin/sh
+###########################################################################
+# Copyright (C) 2015-2020 IoT.bzh
+#
+# author: José Bollo <jose.bollo@iot.bzh>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+###########################################################################
+#
+# usage: test-install-many.sh wgtpkg-install
+#
+# Checks the progress protocol of wgtpkg-install that the verbs
+# install-many and uninstall read (see main-wgtpkg-install.c):
+# items designated by index, arguments never echoed, items looking
+# like options, atomic stop at the first failure.
+# Only failures are exercised: a successful installation needs a
+# signed widget and the rights to write the units of systemd.
+
+installer="$1"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+root="$tmp/root"
+out="$tmp/progress"
+failures=0
+
+# run the installer with the given arguments and its progress in $out
+run() {
+	"$installer" -q -q -P 3 "$@" 3>"$out" >/dev/null 2>&1 </dev/null
+}
+
+# check that the progress has a line matching the pattern $2
+has() {
+	if grep -q -E "$2" "$out"; then
+		echo "PASS: $1"
+	else
+		echo "FAIL: $1"; cat "$out"; failures=$((failures + 1))
+	fi
+}
+
+# check that the progress has no line matching the pattern $2
+hasnt() {
+	if grep -q -E "$2" "$out"; then
+		echo "FAIL: $1"; cat "$out"; failures=$((failures + 1))
+	else
+		echo "PASS: $1"
+	fi
+}
+
+# check that all lines of the progress are well formed
+wellformed() {
+	if grep -q -v -E '^(step [0-9]+ [a-z-]+|failed [0-9]+ [0-9]+|added [0-9]+ [^ ]+ [^ ]+|removed [0-9]+|rolledback [0-9]+)$' "$out"; then
+		echo "FAIL: $1: well formed"; cat "$out"; failures=$((failures + 1))
+	else
+		echo "PASS: $1: well formed"
+	fi
+}
+
+# installation of many items, one looking like an option
+run -- "$root" "$tmp/none.wgt" "-f" "$tmp/other.wgt"
+wellformed "install"
+has "install: first item failed" '^failed 0 [0-9]+$'
+has "install: option like item is an item" '^failed 1 [0-9]+$'
+has "install: last item failed" '^failed 2 [0-9]+$'
+has "install: steps reported by index" '^step 2 extracting$'
+hasnt "install: arguments not echoed" 'wgt|-f|/'
+
+# atomic installation stops at the first failure
+run -a -- "$root" "$tmp/none.wgt" "$tmp/other.wgt"
+wellformed "atomic"
+has "atomic: first item failed" '^failed 0 [0-9]+$'
+hasnt "atomic: stopped at the first failure" '^[a-z]+ 1( |$)'
+
+# installation from the standard input
+echo "this is not a widget" | "$installer" -q -q -P 3 -- "$root" - 3>"$out" >/dev/null 2>&1
+wellformed "stdin"
+has "stdin: item failed" '^failed 0 [0-9]+$'
+
+# uninstallation of unknown ids
+run -u -- "$root" "unknown@1.0" "-a"
+wellformed "uninstall"
+has "uninstall: first id failed" '^failed 0 [0-9]+$'
+has "uninstall: option like id is an id" '^failed 1 [0-9]+$'
+hasnt "uninstall: nothing removed" '^removed'
+
+echo "$failures failure(s)"
+[ $failures -eq 0 ]
@@ -0,0 +1,164 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check and benchmark of the dispatch of the method calls in utils-jbus.
+ *
+ * For a growing count of registered methods, it checks that the hash
+ * table finds the same services than the walk of the list of services
+ * (the dispatch used before) and reports the cost per lookup of both,
+ * for methods found and not found.
+ *
+ * utils-jbus.c is included to access its internal structures.
+ */
+
+#include "utils-jbus.c"
+
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+static int iterations = 1000000;
+static int counts[8] = { 4, 16, 64, 256 };
+static int ncounts = 4;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void oncall(struct sd_bus_message *smsg, const char *content, void *data)
+{
+}
+
+/* records a service without connecting it to the bus */
+static void add(struct jbus *jbus, const char *method)
+{
+	struct jservice *srv;
+
+	srv = calloc(1, sizeof *srv);
+	if (!srv || !(srv->method = strdup(method)))
+		error("out of memory\n");
+	srv->hash = hash_method(method);
+	srv->oncall_s = oncall;
+	srv->next = jbus->services;
+	jbus->services = srv;
+}
+
+/* the dispatch used before: walk of the list */
+static struct jservice *search_list(struct jbus *jbus, const char *method)
+{
+	struct jservice *srv = jbus->services;
+
+	while (srv != NULL && strcmp(srv->method, method))
+		srv = srv->next;
+	return srv;
+}
+
+static void measure(int count)
+{
+	int i;
+	char (*names)[32];
+	struct jbus *jbus;
+	volatile struct jservice *found;
+	uint64_t t0, list, hash, list_miss, hash_miss;
+
+	jbus = create_jbus(NULL, "/bench/jbus");
+	names = calloc((size_t)count * 2, sizeof *names);
+	if (!jbus || !names)
+		error("out of memory\n");
+	for (i = 0 ; i < count ; i++) {
+		snprintf(names[i], sizeof *names, "method-%d", i);
+		snprintf(names[count + i], sizeof *names, "missing-%d", i);
+		add(jbus, names[i]);
+	}
+	if (build_dispatch(jbus) < 0)
+		error("can't build dispatch\n");
+
+	/* check */
+	for (i = 0 ; i < 2 * count ; i++)
+		if (search_service(jbus, names[i]) != search_list(jbus, names[i]))
+			error("dispatch mismatch for %s\n", names[i]);
+
+	/* measure */
+	t0 = now_ns();
+	for (i = 0 ; i < iterations ; i++)
+		found = search_list(jbus, names[i % count]);
+	list = now_ns() - t0;
+	t0 = now_ns();
+	for (i = 0 ; i < iterations ; i++)
+		found = search_service(jbus, names[i % count]);
+	hash = now_ns() - t0;
+	t0 = now_ns();
+	for (i = 0 ; i < iterations ; i++)
+		found = search_list(jbus, names[count + i % count]);
+	list_miss = now_ns() - t0;
+	t0 = now_ns();
+	for (i = 0 ; i < iterations ; i++)
+		found = search_service(jbus, names[count + i % count]);
+	hash_miss = now_ns() - t0;
+	(void)found;
+
+	printf("%8d %10.1f %10.1f %10.1f %10.1f\n", count,
+			(double)list / iterations, (double)hash / iterations,
+			(double)list_miss / iterations, (double)hash_miss / iterations);
+
+	jbus_unref(jbus);
+	free(names);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-i iterations] [-n count-of-methods]...\n", name);
+	exit(0);
+}
+
+int main(int ac, char **av)
+{
+	int opt, i, explicit = 0;
+
+	while ((opt = getopt(ac, av, "i:n:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'n':
+			if (!explicit)
+				ncounts = 0;
+			explicit = 1;
+			if (ncounts < (int)(sizeof counts / sizeof *counts))
+				counts[ncounts++] = atoi(optarg);
+			break;
+		default:
+			usage(av[0]);
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	printf("%8s %10s %10s %10s %10s\n", "methods", "list(ns)", "hash(ns)", "list-miss", "hash-miss");
+	for (i = 0 ; i < ncounts ; i++)
+		if (counts[i] > 0)
+			measure(counts[i]);
+	return 0;
+}
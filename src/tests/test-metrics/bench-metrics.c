@@ -0,0 +1,256 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check and benchmark of the metrics of the verbs.
+ *
+ * It first checks that the recorded calls, errors, latencies and events are
+ * reported as expected in JSON and in the text format of Prometheus.
+ *
+ * Then it measures the overhead added to each call of a verb by the
+ * metering: the recording of the call and of its reply, the reading
+ * of the clock and the computation of the sizes of the payloads for
+ * a small request and a reply listing a growing count of applications.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <json-c/json.h>
+
+#include <utils-metrics.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+static int iterations = 1000000;
+static int counts[8] = { 1, 10, 100 };
+static int ncounts = 3;
+
+/**************** helpers *********************/
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_us()
+{
+	return now_ns() / 1000;
+}
+
+static size_t json_size(struct json_object *obj)
+{
+	size_t size;
+
+	if (!obj)
+		return 0;
+	json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &size);
+	return size;
+}
+
+/* make a reply like the one of runnables for 'napps' applications */
+static struct json_object *make_reply(int napps)
+{
+	int i;
+	char id[40];
+	struct json_object *array, *obj;
+
+	array = json_object_new_array();
+	for (i = 0 ; i < napps ; i++) {
+		snprintf(id, sizeof id, "bench%d@0.1", i);
+		obj = json_object_new_object();
+		json_object_object_add(obj, "id", json_object_new_string(id));
+		json_object_object_add(obj, "version", json_object_new_string("0.1"));
+		json_object_object_add(obj, "width", json_object_new_int(0));
+		json_object_object_add(obj, "height", json_object_new_int(0));
+		json_object_object_add(obj, "name", json_object_new_string("benchmark application"));
+		json_object_object_add(obj, "description", json_object_new_string("an application for benchmarking"));
+		json_object_object_add(obj, "shortname", json_object_new_string("bench"));
+		json_object_object_add(obj, "author", json_object_new_string("IoT.bzh"));
+		json_object_array_add(array, obj);
+	}
+	return array;
+}
+
+/**************** check *********************/
+
+static void expect(const char *text, const char *line)
+{
+	if (!strstr(text, line))
+		error("missing %s in:\n%s\n", line, text);
+}
+
+static int64_t get(struct json_object *obj, const char *section, const char *name, const char *key)
+{
+	struct json_object *s, *v, *k;
+
+	if (!json_object_object_get_ex(obj, section, &s)
+	 || !json_object_object_get_ex(s, name, &v)
+	 || !json_object_object_get_ex(v, key, &k))
+		error("missing %s of %s\n", key, name);
+	return json_object_get_int64(k);
+}
+
+static void check()
+{
+	char *text;
+	struct metrics_verb *a, *b;
+	struct metrics_event *e;
+	struct json_object *obj;
+
+	a = metrics_verb_get("alpha");
+	b = metrics_verb_get("beta");
+	if (!a || !b || metrics_verb_get("alpha") != a)
+		error("bad verbs\n");
+
+	metrics_call(a, 10);
+	metrics_call(a, 10);
+	metrics_call(a, 10);
+	metrics_call(b, 5);
+	metrics_reply(a, 50, NULL, 100);
+	metrics_reply(a, 700, "not-found", 0);
+	metrics_reply(a, 20000000, "not-found", 0);
+
+	e = metrics_event_get("changed");
+	if (!e)
+		error("bad event\n");
+	metrics_event(e, 1);
+	metrics_event(e, 4);
+
+	obj = metrics_json();
+	if (get(obj, "verbs", "alpha", "calls") != 3 || get(obj, "verbs", "alpha", "errors") != 2
+	 || get(obj, "verbs", "alpha", "in-flight") != 0 || get(obj, "verbs", "beta", "in-flight") != 1
+	 || get(obj, "verbs", "alpha", "request-bytes") != 30 || get(obj, "verbs", "alpha", "reply-bytes") != 100
+	 || get(obj, "verbs", "alpha", "latency-us-max") != 20000000
+	 || get(obj, "events", "changed", "sent") != 2 || get(obj, "events", "changed", "changes") != 5)
+		error("bad json metrics: %s\n", json_object_to_json_string(obj));
+	json_object_put(obj);
+
+	text = metrics_prometheus("afm_");
+	if (!text)
+		error("no prometheus text\n");
+	expect(text, "# TYPE afm_verb_latency_seconds histogram\n");
+	expect(text, "afm_verb_calls_total{verb=\"alpha\"} 3\n");
+	expect(text, "afm_verb_errors_total{verb=\"alpha\",reason=\"not-found\"} 2\n");
+	expect(text, "afm_verb_latency_seconds_bucket{verb=\"alpha\",le=\"0.0001\"} 1\n");
+	expect(text, "afm_verb_latency_seconds_bucket{verb=\"alpha\",le=\"0.001\"} 2\n");
+	expect(text, "afm_verb_latency_seconds_bucket{verb=\"alpha\",le=\"10\"} 2\n");
+	expect(text, "afm_verb_latency_seconds_bucket{verb=\"alpha\",le=\"+Inf\"} 3\n");
+	expect(text, "afm_verb_latency_seconds_count{verb=\"alpha\"} 3\n");
+	expect(text, "afm_verb_in_flight{verb=\"beta\"} 1\n");
+	expect(text, "afm_event_sent_total{event=\"changed\"} 2\n");
+	expect(text, "afm_event_changes_total{event=\"changed\"} 5\n");
+	free(text);
+
+	metrics_reset();
+	obj = metrics_json();
+	if (get(obj, "verbs", "alpha", "calls") != 0)
+		error("bad reset\n");
+	json_object_put(obj);
+}
+
+/**************** measure *********************/
+
+/*
+ * Measures the cost per call of the metering of a verb
+ * replying a list of 'napps' applications.
+ */
+static void measure(int napps)
+{
+	int i;
+	uint64_t t0, start, bare, sized;
+	struct metrics_verb *verb;
+	struct json_object *req, *rep;
+
+	verb = metrics_verb_get("bench");
+	req = json_object_new_object();
+	json_object_object_add(req, "id", json_object_new_string("bench0@0.1"));
+	rep = make_reply(napps);
+
+	/* recording only */
+	t0 = now_ns();
+	for (i = 0 ; i < iterations ; i++) {
+		start = now_us();
+		metrics_call(verb, 20);
+		metrics_reply(verb, now_us() - start, (i & 15) ? NULL : "failed", 1000);
+	}
+	bare = now_ns() - t0;
+
+	/* recording with the sizes of the payloads */
+	t0 = now_ns();
+	for (i = 0 ; i < iterations ; i++) {
+		start = now_us();
+		metrics_call(verb, json_size(req));
+		metrics_reply(verb, now_us() - start, (i & 15) ? NULL : "failed", json_size(rep));
+	}
+	sized = now_ns() - t0;
+
+	printf("%6d %14.1f %14.1f\n", napps,
+			(double)bare / iterations,
+			(double)sized / iterations);
+
+	json_object_put(req);
+	json_object_put(rep);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-i iterations] [-n count-of-apps]...\n", name);
+	exit(0);
+}
+
+int main(int ac, char **av)
+{
+	int opt, i, explicit = 0;
+
+	while ((opt = getopt(ac, av, "i:n:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'n':
+			if (!explicit)
+				ncounts = 0;
+			explicit = 1;
+			if (ncounts < (int)(sizeof counts / sizeof *counts))
+				counts[ncounts++] = atoi(optarg);
+			break;
+		default:
+			usage(av[0]);
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	check();
+	printf("%6s %14s %14s\n", "apps", "record(ns)", "+sizes(ns)");
+	for (i = 0 ; i < ncounts ; i++)
+		if (counts[i] > 0)
+			measure(counts[i]);
+	return 0;
+}
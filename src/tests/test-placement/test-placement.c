@@ -0,0 +1,162 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the parser of the placement policy file: the policy
+ * below is written to a temporary file and its classes are read.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <utils-placement.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+static const char policy[] =
+	"# policy of the check\n"
+	"\n"
+	"[hmi]\n"
+	"AllowedCPUs=4-7\n"
+	"  CPUAffinity =  4-7  \n"
+	"# Nice=10\n"
+	"\t; Nice=11\n"
+	"Nice=-5\n"
+	"Unknown=1\n"
+	"no equal sign\n"
+	"\n"
+	"[background]\n"
+	"AllowedCPUs=0-3\n"
+	"CPUSchedulingPolicy=batch\n"
+	"Nice=5\n"
+	"\n"
+	"[ spaced ]\n"
+	"Nice=1\n"
+	"Nice=2\n"
+	"\n"
+	"[broken\n"
+	"Nice=3\n"
+	"\n"
+	"[hmi]\n"
+	"AllowedMemoryNodes=0\n"
+	"\n"
+	"[empty]\n";
+
+static char file[] = "/tmp/test-placement-XXXXXX";
+static int failures;
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	failures += !ok;
+}
+
+/* tells whether the value of 'key' in 'placement' is 'expected' (or NULL) */
+static int is_value(const struct placement *placement, enum placement_key key, const char *expected)
+{
+	const char *value = placement->values[key];
+	return expected ? value && !strcmp(value, expected) : !value;
+}
+
+static void check_classes()
+{
+	int rc, err;
+	struct placement p;
+
+	rc = placement_get(file, "hmi", &p);
+	check(rc == 0
+		&& is_value(&p, placement_allowed_cpus, "4-7")
+		&& is_value(&p, placement_cpu_affinity, "4-7")
+		&& is_value(&p, placement_nice, "-5")
+		&& is_value(&p, placement_cpu_scheduling_policy, NULL),
+		"values trimmed, comments and invalid lines skipped");
+	check(rc == 0 && is_value(&p, placement_allowed_memory_nodes, "0"),
+		"class defined twice merged");
+	placement_release(&p);
+	check(is_value(&p, placement_allowed_cpus, NULL) && is_value(&p, placement_nice, NULL),
+		"values released");
+
+	rc = placement_get(file, "background", &p);
+	check(rc == 0
+		&& is_value(&p, placement_allowed_cpus, "0-3")
+		&& is_value(&p, placement_cpu_scheduling_policy, "batch")
+		&& is_value(&p, placement_nice, "5")
+		&& is_value(&p, placement_cpu_affinity, NULL)
+		&& is_value(&p, placement_allowed_memory_nodes, NULL),
+		"other class not mixed");
+	placement_release(&p);
+
+	rc = placement_get(file, "spaced", &p);
+	check(rc == 0 && is_value(&p, placement_nice, "2"), "spaced header, last value kept");
+	placement_release(&p);
+
+	rc = placement_get(file, "empty", &p);
+	check(rc == 0 && is_value(&p, placement_nice, NULL), "empty class found");
+	placement_release(&p);
+
+	rc = placement_get(file, "broken", &p);
+	err = errno;
+	check(rc < 0 && err == ENOENT, "invalid header not a class");
+
+	rc = placement_get(file, "missing", &p);
+	err = errno;
+	check(rc < 0 && err == ENOENT, "missing class");
+
+	rc = placement_get("/nonexistent/placement.conf", "hmi", &p);
+	err = errno;
+	check(rc < 0 && err == ENOENT, "missing file");
+}
+
+static void check_names()
+{
+	check(placement_is_class_name("hmi") && placement_is_class_name("big_core-2"),
+		"valid class names");
+	check(!placement_is_class_name("") && !placement_is_class_name("a b")
+		&& !placement_is_class_name("../hmi") && !placement_is_class_name("hmi]"),
+		"invalid class names");
+	check(!strcmp(placement_directive(placement_allowed_cpus), "AllowedCPUs")
+		&& !strcmp(placement_directive(placement_nice), "Nice"),
+		"directives of the keys");
+	check(placement_is_runtime(placement_allowed_cpus)
+		&& placement_is_runtime(placement_allowed_memory_nodes)
+		&& !placement_is_runtime(placement_cpu_affinity)
+		&& !placement_is_runtime(placement_nice),
+		"runtime keys");
+}
+
+int main()
+{
+	int fd;
+
+	fd = mkstemp(file);
+	if (fd < 0)
+		error("can't create %s\n", file);
+	if (write(fd, policy, sizeof policy - 1) != (ssize_t)(sizeof policy - 1))
+		error("can't write %s\n", file);
+	close(fd);
+
+	check_classes();
+	check_names();
+
+	unlink(file);
+	printf("%d failure(s)\n", failures);
+	return failures != 0;
+}
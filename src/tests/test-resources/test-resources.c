@@ -0,0 +1,149 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the validators of the values of the feature "resources".
+ *
+ * wgt-json.c is included to access the validators. They are checked
+ * on lists of valid and invalid values, then a config.xml written in
+ * a temporary directory checks that an invalid value makes the
+ * translation fail.
+ */
+
+#include "wgt-json.c"
+
+#include <stdio.h>
+#include <limits.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+static char dir[] = "/tmp/test-resources-XXXXXX";
+static int failures;
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	failures += !ok;
+}
+
+/* checks that 'validator' accepts the values 'valids' and refuses the values 'invalids' */
+static void check_validator(const char *name, int (*validator)(const char *value),
+		const char * const *valids, const char * const *invalids)
+{
+	char what[200];
+
+	for ( ; *valids ; valids++) {
+		snprintf(what, sizeof what, "%s: %s accepted", name, *valids);
+		check(validator(*valids), what);
+	}
+	for ( ; *invalids ; invalids++) {
+		snprintf(what, sizeof what, "%s: \"%s\" refused", name, *invalids);
+		check(!validator(*invalids), what);
+	}
+}
+
+static void check_validators()
+{
+	static const char * const weights[] = { "1", "100", "10000", NULL };
+	static const char * const bad_weights[] = { "", "0", "10001", "-1", "+5", " 5", "5 ", "5x", "1e3", NULL };
+	static const char * const bytes[] = { "0", "1024", "256M", "1K", "2G", "1T", "infinity", NULL };
+	static const char * const bad_bytes[] = { "", "M", "-1", "1.5G", "1MB", "1m", "1 M", "inf", "Infinity", NULL };
+	static const char * const cpus[] = { "0", "0-1", "0-1,3", "1,2,3", "0-3, 6-7", "2-2", "1023", NULL };
+	static const char * const bad_cpus[] = { "", ",", "3-1", "1024", "0-1024", "a", "0-", "-1", "0-1;3", "1,,x", NULL };
+	static const char * const classes[] = { "hmi", "background", "big_core-2", NULL };
+	static const char * const bad_classes[] = { "", "a b", "../hmi", "hmi]", "h.mi", NULL };
+
+	check_validator("weight", is_resource_weight, weights, bad_weights);
+	check_validator("bytes", is_resource_bytes, bytes, bad_bytes);
+	check_validator("cpus", is_resource_cpus, cpus, bad_cpus);
+	check_validator("class", is_resource_class, classes, bad_classes);
+}
+
+/* writes the config.xml of the resource 'name' of 'value' and translates it */
+static struct json_object *translate(const char *name, const char *value)
+{
+	char path[PATH_MAX];
+	FILE *file;
+
+	snprintf(path, sizeof path, "%s/config.xml", dir);
+	file = fopen(path, "w");
+	if (!file)
+		error("can't create %s\n", path);
+	fprintf(file,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<widget xmlns=\"http://www.w3.org/ns/widgets\" id=\"res\" version=\"1.0\">\n"
+		"  <name>res</name>\n"
+		"  <content src=\"res\" type=\"application/vnd.agl.native\"/>\n"
+		"  <feature name=\"urn:AGL:widget:resources\">\n"
+		"    <param name=\"#target\" value=\"main\" />\n"
+		"    <param name=\"%s\" value=\"%s\" />\n"
+		"  </feature>\n"
+		"</widget>\n", name, value);
+	fclose(file);
+	return wgt_path_to_json(dir);
+}
+
+/* tells whether the resource 'name' of the main target of 'obj' is 'expected' (or NULL) */
+static int is_resource(struct json_object *obj, const char *name, const char *expected)
+{
+	const char *value;
+	struct json_object *targets, *target, *resources;
+
+	if (!json_object_object_get_ex(obj, "targets", &targets)
+	 || !(target = json_object_array_get_idx(targets, 0)))
+		return 0;
+	if (!json_object_object_get_ex(target, "resources", &resources))
+		return !expected;
+	if (!j_read_string_at(resources, name, &value))
+		return !expected;
+	return expected && !strcmp(value, expected);
+}
+
+static void check_translation()
+{
+	struct json_object *obj;
+
+	obj = translate("memory-max", "256M");
+	check(obj && is_resource(obj, "memory-max", "256M"), "valid resource translated");
+	json_object_put(obj);
+
+	obj = translate("cpu-weight", "0");
+	check(!obj, "invalid resource refused");
+	json_object_put(obj);
+
+	obj = translate("unknown", "1");
+	check(obj && is_resource(obj, "unknown", NULL), "unknown resource ignored");
+	json_object_put(obj);
+}
+
+int main()
+{
+	char path[PATH_MAX];
+
+	if (!mkdtemp(dir))
+		error("can't create %s\n", dir);
+
+	check_validators();
+	check_translation();
+
+	snprintf(path, sizeof path, "%s/config.xml", dir);
+	unlink(path);
+	rmdir(dir);
+	printf("%d failure(s)\n", failures);
+	return failures != 0;
+}
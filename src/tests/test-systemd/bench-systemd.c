@@ -0,0 +1,351 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Benchmark of the calls to systemd made by the verbs of the framework.
+ *
+ * It runs against fake-systemd on the session bus the sequences of
+ * utils-systemd calls that afm-urun issues for the verbs start, once,
+ * runners and state and reports, for a growing count of installed
+ * applications, the count of calls per verb and the p50/p99 latencies.
+ *
+ * It also compares the launch of freshly installed applications from
+ * their unit file (reload then start) with the launch of transient
+ * units (start only).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <systemd/sd-bus.h>
+
+#include <utils-systemd.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+/* the units are user units of the default user bus */
+#define ISUSER 1
+
+static const char sdb_destination[] = "org.freedesktop.systemd1";
+static const char sdb_path[] = "/org/freedesktop/systemd1";
+static const char sdbi_fake[] = "org.freedesktop.systemd1.Fake";
+
+static int iterations = 50;
+static int counts[8] = { 1, 10, 50 };
+static int ncounts = 3;
+
+/**************** helpers *********************/
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* get the count of calls received by the fake and reset it */
+static unsigned fake_calls()
+{
+	int rc;
+	unsigned calls, units;
+	struct sd_bus *bus;
+	sd_bus_message *ret = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	if (systemd_get_bus(ISUSER, &bus) < 0)
+		error("can't get the bus: %m\n");
+	rc = sd_bus_call_method(bus, sdb_destination, sdb_path, sdbi_fake, "Counters", &err, &ret, NULL);
+	if (rc < 0 || sd_bus_message_read(ret, "uu", &calls, &units) < 0)
+		error("can't query fake-systemd: %s\n", strerror(-rc));
+	sd_bus_message_unref(ret);
+	sd_bus_call_method(bus, sdb_destination, sdb_path, sdbi_fake, "Reset", &err, NULL, NULL);
+	sd_bus_error_free(&err);
+	return calls;
+}
+
+/* wait that fake-systemd is available */
+static void wait_fake()
+{
+	int trial;
+	struct sd_bus *bus;
+
+	if (systemd_get_bus(ISUSER, &bus) < 0)
+		error("can't get the bus: %m\n");
+	for (trial = 0 ; trial < 500 ; trial++) {
+		if (sd_bus_call_method(bus, sdb_destination, sdb_path, sdbi_fake, "Reset", NULL, NULL, NULL) >= 0)
+			return;
+		usleep(10000);
+	}
+	error("fake-systemd not available\n");
+}
+
+static const char *unit_name(int index)
+{
+	static char name[64];
+
+	snprintf(name, sizeof name, "afm-appli-bench%d@.service", index);
+	return name;
+}
+
+static const char *transient_name(int index)
+{
+	static char name[64];
+
+	snprintf(name, sizeof name, "transient-afm-appli-bench%d@%d.service", index, (int)getuid());
+	return name;
+}
+
+/* directives of a typical application unit */
+static const char *directives[] = {
+	"Description=benchmark application",
+	"After=user@%i.service",
+	"EnvironmentFile=-/etc/afm/unit.env.d/*",
+	"SuccessExitStatus=0 SIGKILL",
+	"UMask=0077",
+	"User=%i",
+	"Slice=user-%i.slice",
+	"WorkingDirectory=-/home/%i/app-data/bench",
+	"CapabilityBoundingSet=",
+	"Environment=AFM_ID=bench",
+	"Environment=XDG_RUNTIME_DIR=/run/user/%i",
+	"SyslogIdentifier=afbd-bench",
+	"ExecStart=/usr/bin/afb-daemon --name afbd-bench --workdir=/home/%i/app-data/bench"
+};
+
+/**************** verbs *********************/
+
+/* wait a stable state of the unit of 'dpath' and free 'dpath' */
+static int wait_stable(char *dpath)
+{
+	int rc;
+	struct SysD_Unit_Status status;
+
+	do {
+		rc = systemd_unit_status_of_dpath(ISUSER, dpath, &status);
+	} while (rc >= 0 && status.state == SysD_State_Activating);
+	free(dpath);
+	return rc < 0 ? -1 : status.main_pid;
+}
+
+/* sequence of afm_urun_start: get_basis, start job, end of job, status */
+static int verb_start(int napps, int index)
+{
+	char *dpath, *jpath;
+
+	dpath = systemd_unit_dpath_cached(ISUSER, -1, unit_name(index));
+	if (!dpath)
+		return -1;
+	jpath = systemd_unit_start_job_dpath(ISUSER, dpath);
+	if (!jpath) {
+		free(dpath);
+		return -1;
+	}
+	systemd_job_wait(ISUSER, jpath, 10000);
+	free(jpath);
+	return wait_stable(dpath);
+}
+
+/* sequence of the first start after installation: reload then start */
+static int verb_install(int napps, int index)
+{
+	if (systemd_daemon_reload(ISUSER) < 0)
+		return -1;
+	return verb_start(napps, index);
+}
+
+/* sequence of the start of a transient unit: no reload needed */
+static int verb_transient(int napps, int index)
+{
+	char *dpath, *jpath;
+
+	jpath = systemd_unit_start_transient_job(ISUSER, transient_name(index),
+			directives, (int)(sizeof directives / sizeof *directives));
+	if (!jpath)
+		return -1;
+	systemd_job_wait(ISUSER, jpath, 10000);
+	free(jpath);
+	dpath = systemd_unit_dpath_cached(ISUSER, -1, transient_name(index));
+	return dpath ? wait_stable(dpath) : -1;
+}
+
+/* sequence of afm_urun_state: unit of pid then search of the application */
+static int verb_state(int napps, int runid)
+{
+	int i, rc;
+	char *dpath, *udpath;
+	struct SysD_Unit_Status status;
+
+	dpath = systemd_unit_dpath_by_pid(ISUSER, (unsigned)runid);
+	if (!dpath)
+		return -1;
+	rc = -1;
+	for (i = 0 ; rc < 0 && i < napps ; i++) {
+		udpath = systemd_unit_dpath_cached(ISUSER, -1, unit_name(i));
+		if (udpath && !strcmp(dpath, udpath))
+			rc = systemd_unit_status_of_dpath(ISUSER, udpath, &status) < 0 ? -1 : status.main_pid;
+		free(udpath);
+	}
+	free(dpath);
+	return rc;
+}
+
+/* sequence of afm_urun_once: start then state */
+static int verb_once(int napps, int index)
+{
+	int pid = verb_start(napps, index);
+	return pid <= 0 ? pid : verb_state(napps, pid);
+}
+
+/* sequence of afm_urun_list: status of each application */
+static int verb_runners(int napps, int index)
+{
+	int i;
+	char *udpath;
+	struct SysD_Unit_Status status;
+
+	for (i = 0 ; i < napps ; i++) {
+		udpath = systemd_unit_dpath_cached(ISUSER, -1, unit_name(i));
+		if (udpath) {
+			systemd_unit_status_of_dpath(ISUSER, udpath, &status);
+			free(udpath);
+		}
+	}
+	return 0;
+}
+
+/**************** measure *********************/
+
+static void stop_all(int napps)
+{
+	int i;
+
+	for (i = 0 ; i < napps ; i++) {
+		systemd_unit_stop_name(ISUSER, unit_name(i));
+		systemd_unit_stop_name(ISUSER, transient_name(i));
+	}
+}
+
+/*
+ * Measures 'iterations' calls to 'verb' for 'napps' applications.
+ * When 'started' is set, the applications are started before.
+ */
+static void measure(const char *name, int napps, int (*verb)(int, int), int started)
+{
+	int i, arg;
+	unsigned long calls;
+	char *dpath;
+	uint64_t *lat, t0;
+
+	lat = calloc((size_t)iterations, sizeof *lat);
+	if (!lat)
+		error("out of memory\n");
+
+	stop_all(napps);
+	if (started)
+		for (i = 0 ; i < napps ; i++)
+			verb_start(napps, i);
+
+	calls = 0;
+	for (i = 0 ; i < iterations ; i++) {
+		/* prepare the argument */
+		arg = i % napps;
+		if (!started) {
+			systemd_unit_stop_name(ISUSER, unit_name(arg));
+			systemd_unit_stop_name(ISUSER, transient_name(arg));
+		}
+		else if (verb == verb_state) {
+			dpath = systemd_unit_dpath_cached(ISUSER, -1, unit_name(arg));
+			arg = dpath ? systemd_unit_pid_of_dpath(ISUSER, dpath) : -1;
+			free(dpath);
+		}
+
+		/* measure */
+		fake_calls();
+		t0 = now_us();
+		if (verb(napps, arg) < 0)
+			error("verb %s failed\n", name);
+		lat[i] = now_us() - t0;
+		calls += fake_calls();
+	}
+
+	qsort(lat, (size_t)iterations, sizeof *lat, cmp_u64);
+	printf("%-10s %6d %8.1f %10llu %10llu\n", name, napps,
+			(double)calls / iterations,
+			(unsigned long long)lat[iterations / 2],
+			(unsigned long long)lat[(iterations * 99) / 100]);
+	free(lat);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-i iterations] [-n count-of-apps]...\n", name);
+	exit(0);
+}
+
+int main(int ac, char **av)
+{
+	int opt, i, explicit = 0;
+
+	while ((opt = getopt(ac, av, "i:n:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'n':
+			if (!explicit)
+				ncounts = 0;
+			explicit = 1;
+			if (ncounts < (int)(sizeof counts / sizeof *counts))
+				counts[ncounts++] = atoi(optarg);
+			break;
+		default:
+			usage(av[0]);
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	wait_fake();
+	printf("%-10s %6s %8s %10s %10s\n", "verb", "apps", "calls", "p50(us)", "p99(us)");
+	for (i = 0 ; i < ncounts ; i++) {
+		if (counts[i] <= 0)
+			continue;
+		measure("start", counts[i], verb_start, 0);
+		measure("once", counts[i], verb_once, 0);
+		measure("runners", counts[i], verb_runners, 1);
+		measure("state", counts[i], verb_state, 1);
+		measure("install", counts[i], verb_install, 0);
+		measure("transient", counts[i], verb_transient, 0);
+	}
+	return 0;
+}
@@ -0,0 +1,564 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Fake of the service org.freedesktop.systemd1 for tests and benchmarks.
+ *
+ * It implements the part of the objects Manager, Unit, Service and Job
+ * that the framework uses, on the bus given by DBUS_SESSION_BUS_ADDRESS.
+ * Units are created when loaded. Starting a unit creates a job that
+ * waits for '-w' ms, runs for '-r' ms and then makes the unit active
+ * with a fake pid, or failed when the name of the unit starts with
+ * "fail". Stopping a unit is immediate. The end of jobs is signaled
+ * by JobRemoved. Each call is delayed by '-c' microseconds.
+ *
+ * The extra interface 'org.freedesktop.systemd1.Fake' of the manager
+ * gives the count of calls received (method Counters), the count of
+ * start jobs pending and its peak (method Jobs), resets the count
+ * of calls and the peak (method Reset) and removes a unit signaling
+ * UnitRemoved (method Remove).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+static const char sdb_destination[] = "org.freedesktop.systemd1";
+static const char sdb_path[] = "/org/freedesktop/systemd1";
+static const char sdbi_manager[] = "org.freedesktop.systemd1.Manager";
+static const char sdbi_unit[] = "org.freedesktop.systemd1.Unit";
+static const char sdbi_service[] = "org.freedesktop.systemd1.Service";
+static const char sdbi_job[] = "org.freedesktop.systemd1.Job";
+static const char sdbi_properties[] = "org.freedesktop.DBus.Properties";
+static const char sdbi_fake[] = "org.freedesktop.systemd1.Fake";
+static const char sdbe_no_such_unit[] = "org.freedesktop.systemd1.NoSuchUnit";
+
+/* state of the units */
+enum state { inactive, activating, active, deactivating, failed };
+static const char *state_names[] = { "inactive", "activating", "active", "deactivating", "failed" };
+static const char *sub_state_names[] = { "dead", "start", "running", "stop", "failed" };
+
+struct job;
+
+/* fake unit */
+struct unit {
+	struct unit *next;	/* next unit */
+	struct job *job;	/* the pending job or NULL */
+	enum state state;	/* the state */
+	unsigned pid;		/* the main pid or 0 */
+	uint64_t enter_ts;	/* timestamp of entering active state */
+	uint64_t exit_ts;	/* timestamp of leaving active state */
+	char path[64];		/* dbus path */
+	char name[1];		/* name */
+};
+
+/* fake job */
+struct job {
+	struct unit *unit;	/* the unit of the job */
+	unsigned id;		/* id of the job */
+	int running;		/* is the job running? */
+	sd_event_source *timer;	/* the timer of the job transitions */
+	char path[64];		/* dbus path */
+};
+
+static struct unit *units;
+static unsigned unit_count;
+static unsigned job_count;
+static unsigned job_pending;
+static unsigned job_peak;
+static unsigned next_pid = 1000;
+
+static sd_bus *bus;
+static sd_event *evloop;
+
+/* settings */
+static unsigned call_latency_us;
+static unsigned job_wait_ms = 1;
+static unsigned job_run_ms = 5;
+static unsigned reload_ms = 20;
+
+/* count of calls */
+static unsigned call_count;
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* account a call and simulate its latency */
+static void account()
+{
+	call_count++;
+	if (call_latency_us)
+		usleep(call_latency_us);
+}
+
+/**************** units *********************/
+
+static struct unit *unit_of_name(const char *name, int create)
+{
+	struct unit *unit;
+	size_t length;
+
+	for (unit = units ; unit ; unit = unit->next)
+		if (!strcmp(unit->name, name))
+			return unit;
+	if (!create)
+		return NULL;
+
+	length = strlen(name);
+	unit = calloc(1, length + sizeof *unit);
+	if (!unit)
+		error("out of memory\n");
+	memcpy(unit->name, name, length + 1);
+	snprintf(unit->path, sizeof unit->path, "%s/unit/u%u", sdb_path, ++unit_count);
+	unit->next = units;
+	units = unit;
+	return unit;
+}
+
+static struct unit *unit_of_path(const char *path)
+{
+	struct unit *unit;
+
+	for (unit = units ; unit ; unit = unit->next)
+		if (!strcmp(unit->path, path))
+			return unit;
+	return NULL;
+}
+
+static struct unit *unit_of_pid(unsigned pid)
+{
+	struct unit *unit;
+
+	for (unit = units ; unit ; unit = unit->next)
+		if (unit->pid == pid)
+			return unit;
+	return NULL;
+}
+
+static struct job *job_of_path(const char *path)
+{
+	struct unit *unit;
+
+	for (unit = units ; unit ; unit = unit->next)
+		if (unit->job && !strcmp(unit->job->path, path))
+			return unit->job;
+	return NULL;
+}
+
+static void set_state(struct unit *unit, enum state state)
+{
+	if (state == active && unit->state != active)
+		unit->enter_ts = now_us();
+	else if (state != active && unit->state == active)
+		unit->exit_ts = now_us();
+	unit->state = state;
+}
+
+/**************** jobs *********************/
+
+static void job_removed(unsigned id, const char *path, struct unit *unit, const char *result)
+{
+	sd_bus_emit_signal(bus, sdb_path, sdbi_manager, "JobRemoved", "uoss", id, path, unit->name, result);
+}
+
+static int on_job_timer(sd_event_source *source, uint64_t usec, void *closure)
+{
+	struct job *job = closure;
+	struct unit *unit = job->unit;
+
+	if (!job->running) {
+		/* waiting -> running */
+		job->running = 1;
+		sd_event_source_set_time(source, usec + (uint64_t)job_run_ms * 1000);
+		sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+	} else {
+		/* running -> done */
+		if (strncmp(unit->name, "fail", 4)) {
+			set_state(unit, active);
+			unit->pid = next_pid++;
+		} else
+			set_state(unit, failed);
+		unit->job = NULL;
+		job_pending--;
+		job_removed(job->id, job->path, unit, unit->state == active ? "done" : "failed");
+		sd_event_source_unref(job->timer);
+		free(job);
+	}
+	return 0;
+}
+
+static const char *start_job(struct unit *unit)
+{
+	uint64_t usec;
+	struct job *job;
+
+	if (unit->job)
+		return unit->job->path;
+	if (unit->state == active)
+		return sdb_path; /* no job needed */
+
+	job = calloc(1, sizeof *job);
+	if (!job)
+		error("out of memory\n");
+	job->unit = unit;
+	job->id = ++job_count;
+	snprintf(job->path, sizeof job->path, "%s/job/%u", sdb_path, job->id);
+	sd_event_now(evloop, CLOCK_MONOTONIC, &usec);
+	sd_event_add_time(evloop, &job->timer, CLOCK_MONOTONIC,
+			usec + (uint64_t)job_wait_ms * 1000, 0, on_job_timer, job);
+	unit->job = job;
+	if (++job_pending > job_peak)
+		job_peak = job_pending;
+	set_state(unit, activating);
+	return job->path;
+}
+
+/* makes 'unit' inactive at once */
+static void kill_unit(struct unit *unit)
+{
+	if (unit->job) {
+		job_removed(unit->job->id, unit->job->path, unit, "canceled");
+		sd_event_source_unref(unit->job->timer);
+		free(unit->job);
+		unit->job = NULL;
+		job_pending--;
+	}
+	set_state(unit, inactive);
+	unit->pid = 0;
+}
+
+/* removes the unit of 'name' signaling UnitRemoved */
+static void remove_unit(const char *name)
+{
+	struct unit *unit, **prv;
+
+	prv = &units;
+	while ((unit = *prv) && strcmp(unit->name, name))
+		prv = &unit->next;
+	if (unit) {
+		kill_unit(unit);
+		*prv = unit->next;
+		sd_bus_emit_signal(bus, sdb_path, sdbi_manager, "UnitRemoved", "so", unit->name, unit->path);
+		free(unit);
+	}
+}
+
+/* replies to 'msg' the path of the stop job of 'unit' that ends at once */
+static int reply_stop_job(sd_bus_message *msg, struct unit *unit)
+{
+	int rc;
+	unsigned id;
+	char path[64];
+
+	kill_unit(unit);
+	id = ++job_count;
+	snprintf(path, sizeof path, "%s/job/%u", sdb_path, id);
+	rc = sd_bus_reply_method_return(msg, "o", path);
+	job_removed(id, path, unit, "done");
+	return rc;
+}
+
+/**************** properties *********************/
+
+static int append_property(sd_bus_message *reply, const char *iface, const char *name, struct unit *unit, struct job *job)
+{
+	if (unit && !strcmp(iface, sdbi_unit)) {
+		if (!strcmp(name, "Id"))
+			return sd_bus_message_append(reply, "v", "s", unit->name);
+		if (!strcmp(name, "ActiveState"))
+			return sd_bus_message_append(reply, "v", "s", state_names[unit->state]);
+		if (!strcmp(name, "SubState"))
+			return sd_bus_message_append(reply, "v", "s", sub_state_names[unit->state]);
+		if (!strcmp(name, "ActiveEnterTimestamp"))
+			return sd_bus_message_append(reply, "v", "t", unit->enter_ts);
+		if (!strcmp(name, "ActiveExitTimestamp") || !strcmp(name, "InactiveEnterTimestamp"))
+			return sd_bus_message_append(reply, "v", "t", unit->exit_ts);
+		if (!strcmp(name, "StateChangeTimestamp"))
+			return sd_bus_message_append(reply, "v", "t",
+					unit->enter_ts > unit->exit_ts ? unit->enter_ts : unit->exit_ts);
+	}
+	if (unit && !strcmp(iface, sdbi_service)) {
+		if (!strcmp(name, "MainPID") || !strcmp(name, "ExecMainPID"))
+			return sd_bus_message_append(reply, "v", "u", unit->pid);
+		if (!strcmp(name, "ExecMainStatus"))
+			return sd_bus_message_append(reply, "v", "i", 0);
+	}
+	if (job && !strcmp(iface, sdbi_job)) {
+		if (!strcmp(name, "State"))
+			return sd_bus_message_append(reply, "v", "s", job->running ? "running" : "waiting");
+	}
+	return -ENOENT;
+}
+
+static const char *unit_names[] = {
+	"Id", "ActiveState", "SubState", "ActiveEnterTimestamp", "ActiveExitTimestamp",
+	"InactiveEnterTimestamp", "StateChangeTimestamp", NULL };
+static const char *service_names[] = {
+	"MainPID", "ExecMainPID", "ExecMainStatus", NULL };
+static const char *job_names[] = {
+	"State", NULL };
+
+static int append_all(sd_bus_message *reply, const char *iface, const char **name, struct unit *unit, struct job *job)
+{
+	int rc = 0;
+
+	for ( ; rc >= 0 && *name ; name++) {
+		rc = sd_bus_message_open_container(reply, 'e', "sv");
+		if (rc >= 0)
+			rc = sd_bus_message_append(reply, "s", *name);
+		if (rc >= 0)
+			rc = append_property(reply, iface, *name, unit, job);
+		if (rc >= 0)
+			rc = sd_bus_message_close_container(reply);
+	}
+	return rc;
+}
+
+/* the empty interface name 'iface' stands for all the interfaces */
+static int get_all(sd_bus_message *reply, const char *iface, struct unit *unit, struct job *job)
+{
+	int rc;
+
+	rc = sd_bus_message_open_container(reply, 'a', "{sv}");
+	if (rc >= 0 && unit && (!*iface || !strcmp(iface, sdbi_unit)))
+		rc = append_all(reply, sdbi_unit, unit_names, unit, job);
+	if (rc >= 0 && unit && (!*iface || !strcmp(iface, sdbi_service)))
+		rc = append_all(reply, sdbi_service, service_names, unit, job);
+	if (rc >= 0 && job && (!*iface || !strcmp(iface, sdbi_job)))
+		rc = append_all(reply, sdbi_job, job_names, unit, job);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(reply);
+	return rc;
+}
+
+static int on_properties(sd_bus_message *msg, struct unit *unit, struct job *job)
+{
+	int rc;
+	const char *iface, *name;
+	sd_bus_message *reply = NULL;
+
+	if (sd_bus_message_is_method_call(msg, sdbi_properties, "Get")) {
+		rc = sd_bus_message_read(msg, "ss", &iface, &name);
+		if (rc >= 0)
+			rc = sd_bus_message_new_method_return(msg, &reply);
+		if (rc >= 0)
+			rc = append_property(reply, iface, name, unit, job);
+	} else if (sd_bus_message_is_method_call(msg, sdbi_properties, "GetAll")) {
+		rc = sd_bus_message_read(msg, "s", &iface);
+		if (rc >= 0)
+			rc = sd_bus_message_new_method_return(msg, &reply);
+		if (rc >= 0)
+			rc = get_all(reply, iface, unit, job);
+	} else
+		return 0;
+
+	if (rc >= 0)
+		rc = sd_bus_send(bus, reply, NULL);
+	else
+		rc = sd_bus_reply_method_errorf(msg, "org.freedesktop.DBus.Error.UnknownProperty", "unknown property");
+	sd_bus_message_unref(reply);
+	return rc < 0 ? rc : 1;
+}
+
+/**************** objects *********************/
+
+static int reply_unit(sd_bus_message *msg, struct unit *unit)
+{
+	if (!unit)
+		return sd_bus_reply_method_errorf(msg, sdbe_no_such_unit, "no such unit");
+	return sd_bus_reply_method_return(msg, "o", unit->path);
+}
+
+static int on_manager(sd_bus_message *msg)
+{
+	int rc;
+	unsigned pid;
+	const char *name, *mode;
+	struct unit *unit;
+
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "LoadUnit")) {
+		rc = sd_bus_message_read(msg, "s", &name);
+		return rc < 0 ? rc : reply_unit(msg, unit_of_name(name, 1));
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "GetUnit")) {
+		rc = sd_bus_message_read(msg, "s", &name);
+		return rc < 0 ? rc : reply_unit(msg, unit_of_name(name, 0));
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "GetUnitByPID")) {
+		rc = sd_bus_message_read(msg, "u", &pid);
+		return rc < 0 ? rc : reply_unit(msg, unit_of_pid(pid));
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "StartUnit")
+	 || sd_bus_message_is_method_call(msg, sdbi_manager, "RestartUnit")) {
+		rc = sd_bus_message_read(msg, "ss", &name, &mode);
+		return rc < 0 ? rc : sd_bus_reply_method_return(msg, "o", start_job(unit_of_name(name, 1)));
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "StartTransientUnit")) {
+		rc = sd_bus_message_read(msg, "ss", &name, &mode);
+		if (rc >= 0)
+			rc = sd_bus_message_skip(msg, "a(sv)a(sa(sv))");
+		if (rc < 0)
+			return rc;
+		unit = unit_of_name(name, 1);
+		if (unit->job || (unit->state != inactive && unit->state != failed))
+			return sd_bus_reply_method_errorf(msg, "org.freedesktop.systemd1.UnitExists", "unit exists");
+		return sd_bus_reply_method_return(msg, "o", start_job(unit));
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "StopUnit")) {
+		rc = sd_bus_message_read(msg, "ss", &name, &mode);
+		return rc < 0 ? rc : reply_stop_job(msg, unit_of_name(name, 1));
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "Reload")) {
+		if (reload_ms)
+			usleep(reload_ms * 1000);
+		sd_bus_emit_signal(bus, sdb_path, sdbi_manager, "Reloading", "b", 1);
+		sd_bus_emit_signal(bus, sdb_path, sdbi_manager, "Reloading", "b", 0);
+		return sd_bus_reply_method_return(msg, NULL);
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_manager, "Subscribe"))
+		return sd_bus_reply_method_return(msg, NULL);
+	return 0;
+}
+
+static int on_unit(sd_bus_message *msg, struct unit *unit)
+{
+	int rc;
+	const char *mode;
+
+	if (sd_bus_message_is_method_call(msg, sdbi_unit, "Start")
+	 || sd_bus_message_is_method_call(msg, sdbi_unit, "Restart")) {
+		rc = sd_bus_message_read(msg, "s", &mode);
+		return rc < 0 ? rc : sd_bus_reply_method_return(msg, "o", start_job(unit));
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_unit, "Stop")) {
+		rc = sd_bus_message_read(msg, "s", &mode);
+		return rc < 0 ? rc : reply_stop_job(msg, unit);
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_unit, "Kill")) {
+		kill_unit(unit);
+		return sd_bus_reply_method_return(msg, NULL);
+	}
+	return on_properties(msg, unit, NULL);
+}
+
+static int on_fake(sd_bus_message *msg)
+{
+	int rc;
+	const char *name;
+
+	if (sd_bus_message_is_method_call(msg, sdbi_fake, "Counters"))
+		return sd_bus_reply_method_return(msg, "uu", call_count, unit_count);
+	if (sd_bus_message_is_method_call(msg, sdbi_fake, "Remove")) {
+		rc = sd_bus_message_read(msg, "s", &name);
+		if (rc < 0)
+			return rc;
+		remove_unit(name);
+		return sd_bus_reply_method_return(msg, NULL);
+	}
+	if (sd_bus_message_is_method_call(msg, sdbi_fake, "Jobs"))
+		return sd_bus_reply_method_return(msg, "uu", job_pending, job_peak);
+	if (sd_bus_message_is_method_call(msg, sdbi_fake, "Reset")) {
+		call_count = 0;
+		job_peak = job_pending;
+		return sd_bus_reply_method_return(msg, NULL);
+	}
+	return 0;
+}
+
+static int on_call(sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	const char *path;
+	struct unit *unit;
+	struct job *job;
+
+	path = sd_bus_message_get_path(msg);
+	if (!path)
+		return 0;
+
+	if (!strcmp(path, sdb_path)) {
+		if (sd_bus_message_is_method_call(msg, sdbi_fake, NULL))
+			return on_fake(msg);
+		account();
+		return on_manager(msg);
+	}
+
+	account();
+	unit = unit_of_path(path);
+	if (unit)
+		return on_unit(msg, unit);
+	job = job_of_path(path);
+	if (job)
+		return on_properties(msg, NULL, job);
+	return 0;
+}
+
+/**************** main *********************/
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-c call-latency-us] [-w job-wait-ms] [-r job-run-ms] [-R reload-ms]\n", name);
+	exit(0);
+}
+
+int main(int ac, char **av)
+{
+	int rc, opt;
+
+	while ((opt = getopt(ac, av, "c:w:r:R:h")) != -1) {
+		switch (opt) {
+		case 'c': call_latency_us = (unsigned)atoi(optarg); break;
+		case 'w': job_wait_ms = (unsigned)atoi(optarg); break;
+		case 'r': job_run_ms = (unsigned)atoi(optarg); break;
+		case 'R': reload_ms = (unsigned)atoi(optarg); break;
+		default: usage(av[0]);
+		}
+	}
+
+	rc = sd_event_default(&evloop);
+	if (rc < 0)
+		error("can't create event loop: %s\n", strerror(-rc));
+	rc = sd_bus_open_user(&bus);
+	if (rc < 0)
+		error("can't open the session bus: %s\n", strerror(-rc));
+	rc = sd_bus_add_fallback(bus, NULL, sdb_path, on_call, NULL);
+	if (rc >= 0)
+		rc = sd_bus_request_name(bus, sdb_destination, 0);
+	if (rc >= 0)
+		rc = sd_bus_attach_event(bus, evloop, 0);
+	if (rc < 0)
+		error("can't serve %s: %s\n", sdb_destination, strerror(-rc));
+
+	return sd_event_loop(evloop) < 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+###########################################################################
+# Copyright (C) 2015-2020 IoT.bzh
+#
+# author: José Bollo <jose.bollo@iot.bzh>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+###########################################################################
+#
+# usage: dbus-run-session -- run-bench.sh fake-systemd program [options...]
+#
+# Runs fake-systemd on the session bus and the program (benchmark or
+# test) against it.
+# Set FAKE_SYSTEMD_OPTIONS to configure the latencies of fake-systemd.
+
+fake="$1"
+bench="$2"
+shift 2
+
+"$fake" $FAKE_SYSTEMD_OPTIONS &
+fakepid=$!
+trap 'kill $fakepid 2>/dev/null' EXIT INT TERM
+
+"$bench" "$@"
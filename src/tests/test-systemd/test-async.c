@@ -0,0 +1,484 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the asynchronous calls of utils-systemd against fake-systemd.
+ *
+ * It first checks the calls without event loop, where the callbacks
+ * are called before the calls return, then with an event loop, where
+ * the replies and the ends of jobs (signal JobRemoved) are dispatched
+ * by the loop.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include <utils-systemd.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+/* the units are user units of the default user bus */
+#define ISUSER 1
+
+static const char sdb_destination[] = "org.freedesktop.systemd1";
+static const char sdb_path[] = "/org/freedesktop/systemd1";
+static const char sdbi_fake[] = "org.freedesktop.systemd1.Fake";
+
+static const char job_prefix[] = "/org/freedesktop/systemd1/job/";
+
+static struct sd_event *evloop;
+
+/**************** helpers *********************/
+
+/* result of an asynchronous call */
+struct result {
+	int done;	/* count of calls of the callback */
+	int status;	/* the received status */
+	char *path;	/* copy of the received path or NULL */
+};
+
+static void on_result(void *closure, int status, const char *path)
+{
+	struct result *result = closure;
+
+	result->done++;
+	result->status = status;
+	free(result->path);
+	result->path = path ? strdup(path) : NULL;
+}
+
+static void reset(struct result *result)
+{
+	free(result->path);
+	memset(result, 0, sizeof *result);
+}
+
+/* run the event loop if any until 'result' is received */
+static void wait_result(struct result *result, const char *what)
+{
+	int trial;
+
+	for (trial = 0 ; !result->done && evloop && trial < 500 ; trial++)
+		sd_event_run(evloop, 10000);
+	if (result->done != 1)
+		error("%s: callback called %d times\n", what, result->done);
+}
+
+/* run the event loop during 'ms' milliseconds */
+static void run_loop(int ms)
+{
+	struct timespec ts;
+	uint64_t end, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	end = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000 + (uint64_t)ms;
+	do {
+		sd_event_run(evloop, 1000);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+	} while (now < end);
+}
+
+/* wait that fake-systemd is available */
+static void wait_fake()
+{
+	int trial;
+	struct sd_bus *bus;
+
+	if (systemd_get_bus(ISUSER, &bus) < 0)
+		error("can't get the bus: %m\n");
+	for (trial = 0 ; trial < 500 ; trial++) {
+		if (sd_bus_call_method(bus, sdb_destination, sdb_path, sdbi_fake, "Reset", NULL, NULL, NULL) >= 0)
+			return;
+		usleep(10000);
+	}
+	error("fake-systemd not available\n");
+}
+
+static int is_job(const char *path)
+{
+	return path && !strncmp(path, job_prefix, sizeof job_prefix - 1);
+}
+
+/**************** checks *********************/
+
+/* start the unit 'name' and check its end, returns its pid */
+static int check_start(const char *name, char **dpath)
+{
+	struct result r = { 0 };
+	struct SysD_Unit_Status status;
+	char *jpath;
+	int pid;
+
+	if (systemd_unit_dpath_by_name_async(ISUSER, name, 1, on_result, &r) < 0)
+		error("dpath_by_name_async: %m\n");
+	wait_result(&r, "dpath_by_name_async");
+	if (r.status < 0 || !r.path)
+		error("dpath_by_name_async: status %d\n", r.status);
+	*dpath = r.path;
+	r.path = NULL;
+	reset(&r);
+
+	if (systemd_unit_start_dpath_async(ISUSER, *dpath, on_result, &r) < 0)
+		error("start_dpath_async: %m\n");
+	wait_result(&r, "start_dpath_async");
+	if (r.status < 0 || !is_job(r.path))
+		error("start_dpath_async: status %d path %s\n", r.status, r.path);
+	jpath = r.path;
+	r.path = NULL;
+	reset(&r);
+
+	if (evloop) {
+		/* the job waits 50 ms before running */
+		if (systemd_job_state_of_jpath_async(ISUSER, jpath, on_result, &r) < 0)
+			error("job_state_of_jpath_async: %m\n");
+		wait_result(&r, "job_state_of_jpath_async");
+		if (r.status != SysD_Job_State_Waiting && r.status != SysD_Job_State_Running)
+			error("job_state_of_jpath_async: status %d\n", r.status);
+		reset(&r);
+	}
+
+	if (systemd_job_wait_async(ISUSER, jpath, on_result, &r) < 0)
+		error("job_wait_async: %m\n");
+	wait_result(&r, "job_wait_async");
+	if (r.status != 0)
+		error("job_wait_async: status %d\n", r.status);
+	reset(&r);
+	free(jpath);
+
+	memset(&status, 0, sizeof status);
+	if (systemd_unit_status_of_dpath_async(ISUSER, *dpath, &status, on_result, &r) < 0)
+		error("status_of_dpath_async: %m\n");
+	wait_result(&r, "status_of_dpath_async");
+	if (r.status != SysD_State_Active || status.state != SysD_State_Active || status.main_pid <= 0)
+		error("status_of_dpath_async: status %d state %d pid %d\n", r.status, status.state, status.main_pid);
+	pid = status.main_pid;
+	reset(&r);
+
+	if (systemd_unit_pid_of_dpath_async(ISUSER, *dpath, on_result, &r) < 0)
+		error("pid_of_dpath_async: %m\n");
+	wait_result(&r, "pid_of_dpath_async");
+	if (r.status != pid)
+		error("pid_of_dpath_async: status %d instead of %d\n", r.status, pid);
+	reset(&r);
+
+	if (systemd_unit_dpath_by_pid_async(ISUSER, (unsigned)pid, on_result, &r) < 0)
+		error("dpath_by_pid_async: %m\n");
+	wait_result(&r, "dpath_by_pid_async");
+	if (r.status < 0 || !r.path || strcmp(r.path, *dpath))
+		error("dpath_by_pid_async: status %d path %s\n", r.status, r.path);
+	reset(&r);
+	return pid;
+}
+
+/* stop the unit of 'dpath' and check its state */
+static void check_stop(const char *dpath)
+{
+	struct result r = { 0 };
+	char *jpath;
+
+	if (systemd_unit_stop_dpath_async(ISUSER, dpath, on_result, &r) < 0)
+		error("stop_dpath_async: %m\n");
+	wait_result(&r, "stop_dpath_async");
+	if (r.status < 0 || !is_job(r.path))
+		error("stop_dpath_async: status %d path %s\n", r.status, r.path);
+	jpath = r.path;
+	r.path = NULL;
+	reset(&r);
+
+	/* the job already ended */
+	if (systemd_job_wait_async(ISUSER, jpath, on_result, &r) < 0)
+		error("job_wait_async: %m\n");
+	wait_result(&r, "job_wait_async of ended job");
+	if (r.status != 0)
+		error("job_wait_async of ended job: status %d\n", r.status);
+	reset(&r);
+	free(jpath);
+
+	if (systemd_unit_state_of_dpath_async(ISUSER, dpath, on_result, &r) < 0)
+		error("state_of_dpath_async: %m\n");
+	wait_result(&r, "state_of_dpath_async");
+	if (r.status != SysD_State_Inactive)
+		error("state_of_dpath_async: status %d\n", r.status);
+	reset(&r);
+}
+
+/* kill the processes of the unit of 'dpath' and check its state */
+static void check_kill(const char *dpath)
+{
+	struct result r = { 0 };
+
+	if (systemd_unit_kill_dpath_async(ISUSER, dpath, SIGKILL, on_result, &r) < 0)
+		error("kill_dpath_async: %m\n");
+	wait_result(&r, "kill_dpath_async");
+	if (r.status != 0)
+		error("kill_dpath_async: status %d\n", r.status);
+	reset(&r);
+
+	if (systemd_unit_state_of_dpath_async(ISUSER, dpath, on_result, &r) < 0)
+		error("state_of_dpath_async: %m\n");
+	wait_result(&r, "state_of_dpath_async");
+	if (r.status != SysD_State_Inactive)
+		error("state_of_dpath_async after kill: status %d\n", r.status);
+	reset(&r);
+}
+
+/* checks the failure of starts */
+static void check_failure()
+{
+	struct result r = { 0 };
+	char *jpath;
+
+	if (systemd_unit_start_name_async(ISUSER, "fail-async.service", on_result, &r) < 0)
+		error("start_name_async: %m\n");
+	wait_result(&r, "start_name_async");
+	if (r.status < 0 || !is_job(r.path))
+		error("start_name_async: status %d path %s\n", r.status, r.path);
+	jpath = r.path;
+	r.path = NULL;
+	reset(&r);
+
+	if (systemd_job_wait_async(ISUSER, jpath, on_result, &r) < 0)
+		error("job_wait_async: %m\n");
+	wait_result(&r, "job_wait_async of failed job");
+	if (r.status != -EIO)
+		error("job_wait_async of failed job: status %d\n", r.status);
+	reset(&r);
+	free(jpath);
+
+	if (systemd_unit_stop_name_async(ISUSER, "fail-async.service", on_result, &r) < 0)
+		error("stop_name_async: %m\n");
+	wait_result(&r, "stop_name_async");
+	if (r.status < 0)
+		error("stop_name_async: status %d\n", r.status);
+	reset(&r);
+}
+
+/* checks the waits of jobs canceled by systemd or by the caller */
+static void check_cancel()
+{
+	struct result r = { 0 }, w = { 0 }, c = { 0 };
+	char *jpath;
+
+	if (systemd_unit_start_name_async(ISUSER, "cancel-async.service", on_result, &r) < 0)
+		error("start_name_async: %m\n");
+	wait_result(&r, "start_name_async");
+	jpath = r.path;
+	r.path = NULL;
+	reset(&r);
+
+	if (systemd_job_wait_async(ISUSER, jpath, on_result, &w) < 0
+	 || systemd_job_wait_async(ISUSER, jpath, on_result, &c) < 0)
+		error("job_wait_async: %m\n");
+	systemd_job_wait_cancel(on_result, &c);
+
+	/* stopping the unit cancels its start job */
+	if (systemd_unit_stop_name_async(ISUSER, "cancel-async.service", on_result, &r) < 0)
+		error("stop_name_async: %m\n");
+	wait_result(&r, "stop_name_async");
+	wait_result(&w, "job_wait_async of canceled job");
+	if (w.status != -ECANCELED)
+		error("job_wait_async of canceled job: status %d\n", w.status);
+	run_loop(100);
+	if (c.done)
+		error("job_wait_cancel: callback called\n");
+	reset(&r);
+	reset(&w);
+	free(jpath);
+}
+
+/* checks the transient units */
+static void check_transient()
+{
+	static const char *directives[] = {
+		"Description=check of transient units",
+		"ExecStart=/bin/true"
+	};
+	struct result r = { 0 };
+	char *jpath, *dpath;
+	int pid;
+
+	if (systemd_unit_start_transient_job_async(ISUSER, "transient-async@1.service",
+			directives, 2, on_result, &r) < 0)
+		error("start_transient_job_async: %m\n");
+	wait_result(&r, "start_transient_job_async");
+	if (r.status < 0 || !is_job(r.path))
+		error("start_transient_job_async: status %d path %s\n", r.status, r.path);
+	jpath = r.path;
+	r.path = NULL;
+	reset(&r);
+
+	if (systemd_job_wait_async(ISUSER, jpath, on_result, &r) < 0)
+		error("job_wait_async: %m\n");
+	wait_result(&r, "job_wait_async of transient job");
+	if (r.status != 0)
+		error("job_wait_async of transient job: status %d\n", r.status);
+	reset(&r);
+	free(jpath);
+
+	/* stop by pid chains two calls */
+	dpath = systemd_unit_dpath_by_name(ISUSER, "transient-async@1.service", 0);
+	pid = dpath ? systemd_unit_pid_of_dpath(ISUSER, dpath) : -1;
+	if (pid <= 0)
+		error("transient unit not running\n");
+	free(dpath);
+	if (systemd_unit_stop_pid_async(ISUSER, (unsigned)pid, on_result, &r) < 0)
+		error("stop_pid_async: %m\n");
+	wait_result(&r, "stop_pid_async");
+	if (r.status < 0 || !is_job(r.path))
+		error("stop_pid_async: status %d path %s\n", r.status, r.path);
+	reset(&r);
+}
+
+/* checks the reload */
+static void check_reload()
+{
+	struct result r = { 0 };
+
+	if (systemd_daemon_reload_async(ISUSER, on_result, &r) < 0)
+		error("daemon_reload_async: %m\n");
+	wait_result(&r, "daemon_reload_async");
+	if (r.status != 0)
+		error("daemon_reload_async: status %d\n", r.status);
+	reset(&r);
+}
+
+/* checks the synchronous wait of jobs */
+static void check_job_wait()
+{
+	char *dpath, *jpath;
+
+	dpath = systemd_unit_dpath_by_name(ISUSER, "sync-async.service", 1);
+	jpath = dpath ? systemd_unit_start_job_dpath(ISUSER, dpath) : NULL;
+	if (!jpath)
+		error("can't start sync-async.service: %m\n");
+	if (systemd_job_wait(ISUSER, jpath, 5000) < 0)
+		error("job_wait: %m\n");
+	if (systemd_unit_state_of_dpath(ISUSER, dpath) != SysD_State_Active)
+		error("job_wait: unit not active\n");
+	free(jpath);
+	free(dpath);
+}
+
+/* checks that the scope of the uid of the daemon is its user bus */
+static void check_own_scope()
+{
+	struct result r = { 0 };
+	struct systemd_dpath_cache_stats before, after;
+	struct timespec ts;
+	time_t start;
+	int scope;
+	char *dpath, *cached, *jpath;
+
+	scope = systemd_user_scope((int)getuid());
+	dpath = systemd_unit_dpath_cached(ISUSER, 0, "own.service");
+	if (!dpath)
+		error("dpath_cached: %m\n");
+	systemd_unit_dpath_cache_stats(&before);
+	cached = systemd_unit_dpath_cached(scope, 0, "own.service");
+	systemd_unit_dpath_cache_stats(&after);
+	if (!cached || strcmp(cached, dpath) || after.hits != before.hits + 1)
+		error("own scope: cache entry not shared\n");
+	free(cached);
+
+	if (systemd_unit_start_dpath_async(scope, dpath, on_result, &r) < 0)
+		error("own scope: start_dpath_async: %m\n");
+	wait_result(&r, "own scope: start_dpath_async");
+	if (r.status < 0 || !is_job(r.path))
+		error("own scope: start_dpath_async: status %d path %s\n", r.status, r.path);
+	jpath = r.path;
+	r.path = NULL;
+	reset(&r);
+
+	/* the end of the job is signaled on the user bus */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec;
+	if (systemd_job_wait_async(scope, jpath, on_result, &r) < 0)
+		error("own scope: job_wait_async: %m\n");
+	wait_result(&r, "own scope: job_wait_async");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (r.status != 0 || ts.tv_sec - start > 2)
+		error("own scope: job_wait_async: status %d after %ds\n", r.status, (int)(ts.tv_sec - start));
+	reset(&r);
+	free(jpath);
+
+	/* the reload of the user manager drops the entry of the scope */
+	systemd_unit_dpath_cache_stats(&before);
+	if (systemd_daemon_reload_async(ISUSER, on_result, &r) < 0)
+		error("own scope: daemon_reload_async: %m\n");
+	wait_result(&r, "own scope: daemon_reload_async");
+	reset(&r);
+	run_loop(100);
+	cached = systemd_unit_dpath_cached(scope, 0, "own.service");
+	systemd_unit_dpath_cache_stats(&after);
+	if (!cached || after.misses != before.misses + 1)
+		error("own scope: cache entry not invalidated\n");
+	free(cached);
+	systemd_unit_stop_dpath(ISUSER, dpath);
+	free(dpath);
+}
+
+static void check_all(const char *name)
+{
+	char *dpath;
+
+	check_start(name, &dpath);
+	check_stop(dpath);
+	free(dpath);
+	check_start(name, &dpath);
+	check_kill(dpath);
+	free(dpath);
+	check_failure();
+	check_transient();
+	check_reload();
+}
+
+int main(int ac, char **av)
+{
+	int rc;
+
+	wait_fake();
+
+	/* without event loop */
+	check_all("sync.service");
+	check_job_wait();
+	printf("synchronous calls: ok\n");
+
+	/* with event loop */
+	rc = sd_event_default(&evloop);
+	if (rc < 0)
+		error("can't create event loop: %s\n", strerror(-rc));
+	if (systemd_set_event_loop(evloop) < 0)
+		error("can't set the event loop: %m\n");
+	check_all("async.service");
+	check_cancel();
+	check_own_scope();
+	printf("asynchronous calls: ok\n");
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the parsing of the fast path through the cgroup filesystem.
+ *
+ * utils-systemd.c is included to access its internal functions. The
+ * roots of the process and cgroup filesystems are replaced by fixture
+ * trees written in a temporary directory.
+ */
+
+#include "utils-systemd.c"
+
+#include <utils-dir.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+static char base[] = "/tmp/test-cgroup-XXXXXX";
+static char proc[PATH_MAX];
+static char cgroup[PATH_MAX];
+static int failures;
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	failures += !ok;
+}
+
+/* writes in 'root' the file of relative 'path' with 'content' */
+static void put(const char *root, const char *path, const char *content)
+{
+	char file[PATH_MAX];
+	FILE *f;
+	size_t i;
+
+	snprintf(file, sizeof file, "%s/%s", root, path);
+	for (i = strlen(root) + 1 ; file[i] ; i++)
+		if (file[i] == '/') {
+			file[i] = 0;
+			mkdir(file, 0755);
+			file[i] = '/';
+		}
+	f = fopen(file, "w");
+	if (!f || fputs(content, f) < 0 || fclose(f))
+		error("can't write %s\n", file);
+}
+
+/* writes the fixture of the process 'pid' of parent 'ppid' named 'comm' in 'cg' */
+static void put_process(int pid, int ppid, const char *comm, const char *cg)
+{
+	char path[40], content[PATH_MAX + 100];
+
+	snprintf(path, sizeof path, "%d/stat", pid);
+	snprintf(content, sizeof content, "%d (%s) S %d %d %d 0 -1\n", pid, comm, ppid, ppid, ppid);
+	put(proc, path, content);
+	if (cg) {
+		snprintf(path, sizeof path, "%d/cgroup", pid);
+		put(proc, path, cg);
+	}
+}
+
+/* tells whether the unit of 'path' for 'isuser' is 'expected' (or NULL) */
+static int is_unit(int isuser, const char *path, const char *expected)
+{
+	char buffer[PATH_MAX];
+	const char *unit;
+
+	strcpy(buffer, path);
+	unit = unit_of_cgroup(isuser, buffer);
+	return expected ? unit && !strcmp(unit, expected) : !unit;
+}
+
+static void check_read_cgroup()
+{
+	char buffer[PATH_MAX];
+	int rc;
+
+	put_process(100, 1, "hybrid",
+		"12:pids:/system.slice/a.service\n"
+		"1:name=systemd:/system.slice/a.service\n"
+		"0::/init.scope\n");
+	put_process(101, 1, "unified", "0::/user.slice/user-1000.slice/user@1000.service/b.service\n");
+	put_process(102, 1, "legacy", "3:cpu:/\n2:name=elogind:/\n");
+
+	rc = read_cgroup_of_pid(100, buffer, sizeof buffer);
+	check(rc == 0 && !strcmp(buffer, "/system.slice/a.service"), "named hierarchy of systemd preferred");
+	rc = read_cgroup_of_pid(101, buffer, sizeof buffer);
+	check(rc == 0 && !strcmp(buffer, "/user.slice/user-1000.slice/user@1000.service/b.service"),
+		"unified hierarchy");
+	rc = read_cgroup_of_pid(100, buffer, 10);
+	check(rc < 0, "path too long refused");
+	rc = read_cgroup_of_pid(102, buffer, sizeof buffer);
+	check(rc < 0 && errno == ENOENT, "no hierarchy of systemd");
+	rc = read_cgroup_of_pid(103, buffer, sizeof buffer);
+	check(rc < 0, "missing process");
+}
+
+static void check_unit_of_cgroup()
+{
+	char user[200];
+
+	check(is_unit(0, "/system.slice/a.service", "a.service")
+		&& is_unit(0, "/system.slice/b.service/sub/x", "b.service")
+		&& is_unit(0, "//c.service", "c.service"),
+		"unit of the system manager");
+	check(is_unit(0, "/system.slice", NULL) && is_unit(0, "/", NULL) && is_unit(0, "", NULL),
+		"slices only");
+
+	snprintf(user, sizeof user, "/user.slice/user-%d.slice/user@%d.service/app.slice/d.service/x",
+		(int)getuid(), (int)getuid());
+	check(is_unit(1, user, "d.service"), "unit of the manager of the current user");
+	check(is_unit(-1 - 5, "/user.slice/user-5.slice/user@5.service/e.service", "e.service"),
+		"unit of the manager of a user");
+	check(is_unit(-1 - 5, "/user.slice/user-6.slice/user@6.service/e.service", NULL)
+		&& is_unit(-1 - 5, "/user.slice/user-5.slice/session-2.scope", NULL)
+		&& is_unit(-1 - 5, "/user.slice/user-5.slice/user@5.service", NULL),
+		"not a unit of the manager of the user");
+	check(is_unit(0, "/user.slice/user-5.slice/user@5.service/e.service", "user@5.service"),
+		"user manager is a unit of the system");
+}
+
+static void check_main_pid()
+{
+	int i;
+	char content[1000];
+
+	/* a service with a child */
+	put(cgroup, "system.slice/a.service/cgroup.procs", "200\n201\n");
+	put_process(200, 1, "a (main) x", NULL);
+	put_process(201, 200, "child", NULL);
+	check(main_pid_of_cgroup("/system.slice/a.service") == 200, "main pid of the service");
+
+	/* two processes of parents outside */
+	put(cgroup, "system.slice/b.service/cgroup.procs", "300\n301\n");
+	put_process(300, 1, "b", NULL);
+	put_process(301, 1, "b", NULL);
+	check(main_pid_of_cgroup("/system.slice/b.service") == -1, "ambiguous main pid");
+
+	/* no process */
+	put(cgroup, "system.slice/c.service/cgroup.procs", "");
+	check(main_pid_of_cgroup("/system.slice/c.service") == 0, "empty cgroup");
+	check(main_pid_of_cgroup("/system.slice/d.service") == 0, "missing cgroup");
+
+	/* too many processes */
+	content[0] = 0;
+	for (i = 0 ; i < 65 ; i++)
+		sprintf(&content[strlen(content)], "%d\n", 400 + i);
+	put(cgroup, "system.slice/e.service/cgroup.procs", content);
+	check(main_pid_of_cgroup("/system.slice/e.service") == -1, "too many processes");
+
+	/* a process vanished */
+	put(cgroup, "system.slice/f.service/cgroup.procs", "500\n");
+	check(main_pid_of_cgroup("/system.slice/f.service") == 500, "process without stat");
+}
+
+int main()
+{
+	if (!mkdtemp(base))
+		error("can't create %s\n", base);
+	snprintf(proc, sizeof proc, "%s/proc", base);
+	snprintf(cgroup, sizeof cgroup, "%s/cgroup", base);
+	mkdir(proc, 0755);
+	mkdir(cgroup, 0755);
+	proc_root = proc;
+	cgroup_root = cgroup;
+
+	check_read_cgroup();
+	check_unit_of_cgroup();
+	check_main_pid();
+
+	remove_directory(base, 1);
+	printf("%d failure(s)\n", failures);
+	return failures != 0;
+}
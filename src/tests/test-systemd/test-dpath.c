@@ -0,0 +1,198 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the cache of the dbus paths of the units of utils-systemd
+ * against fake-systemd: hits and misses, eviction of the least recently
+ * used entry when full and invalidation by the signals UnitRemoved and
+ * Reloading received through the event loop.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include <utils-systemd.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+/* the units are user units of the default user bus */
+#define ISUSER 1
+
+static struct sd_event *evloop;
+static int failures;
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	failures += !ok;
+}
+
+/* calls the 'method' of the fake interface with the string 'arg' or NULL */
+static int fake_call(const char *method, const char *arg)
+{
+	struct sd_bus *bus;
+
+	if (systemd_get_bus(ISUSER, &bus) < 0)
+		error("can't get the bus: %m\n");
+	return sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+			"org.freedesktop.systemd1.Fake", method, NULL, NULL, arg ? "s" : "", arg);
+}
+
+/* wait that fake-systemd is available */
+static void wait_fake()
+{
+	int trial;
+
+	for (trial = 0 ; trial < 500 ; trial++) {
+		if (fake_call("Reset", NULL) >= 0)
+			return;
+		usleep(10000);
+	}
+	error("fake-systemd not available\n");
+}
+
+/* get the cached dbus path of the unit of index 'i' */
+static char *get(int i)
+{
+	char name[40], *dpath;
+
+	snprintf(name, sizeof name, "c%d.service", i);
+	dpath = systemd_unit_dpath_cached(ISUSER, -1, name);
+	if (!dpath)
+		error("can't get the dbus path of %s: %m\n", name);
+	return dpath;
+}
+
+/* get the dbus path of the unit of index 'i' and the change of the statistics */
+static char *get_delta(int i, unsigned long *hits, unsigned long *misses)
+{
+	char *dpath;
+	struct systemd_dpath_cache_stats before, after;
+
+	systemd_unit_dpath_cache_stats(&before);
+	dpath = get(i);
+	systemd_unit_dpath_cache_stats(&after);
+	*hits = after.hits - before.hits;
+	*misses = after.misses - before.misses;
+	return dpath;
+}
+
+/* run the event loop until the count of invalidations exceeds 'count' */
+static void wait_invalidations(unsigned long count)
+{
+	int trial;
+	struct systemd_dpath_cache_stats stats;
+
+	for (trial = 0 ; trial < 500 ; trial++) {
+		systemd_unit_dpath_cache_stats(&stats);
+		if (stats.invalidations > count)
+			return;
+		sd_event_run(evloop, 10000);
+	}
+}
+
+static void check_hits(char **first)
+{
+	unsigned long hits, misses;
+	char *dpath;
+
+	*first = get_delta(0, &hits, &misses);
+	check(hits == 0 && misses == 1, "first lookup missed");
+	dpath = get_delta(0, &hits, &misses);
+	check(hits == 1 && misses == 0 && !strcmp(dpath, *first), "second lookup hit");
+	free(dpath);
+}
+
+static void check_eviction()
+{
+	int i;
+	unsigned long hits, misses;
+	char *dpath;
+	struct systemd_dpath_cache_stats stats;
+
+	/* fill the cache: c0 is the least recently used */
+	systemd_unit_dpath_cache_stats(&stats);
+	for (i = 1 ; i < (int)stats.capacity ; i++)
+		free(get(i));
+	systemd_unit_dpath_cache_stats(&stats);
+	check(stats.count == stats.capacity && stats.evictions == 0, "cache filled");
+
+	/* c0 becomes the most recently used: c1 is evicted */
+	free(get_delta(0, &hits, &misses));
+	free(get((int)stats.capacity));
+	systemd_unit_dpath_cache_stats(&stats);
+	check(hits == 1 && stats.count == stats.capacity && stats.evictions == 1,
+		"least recently used entry evicted when full");
+
+	dpath = get_delta(0, &hits, &misses);
+	check(hits == 1 && misses == 0, "recently used entry kept");
+	free(dpath);
+	dpath = get_delta(1, &hits, &misses);
+	check(hits == 0 && misses == 1, "evicted entry loaded again");
+	free(dpath);
+}
+
+static void check_invalidation(char *first)
+{
+	unsigned long hits, misses;
+	char *dpath;
+	struct systemd_dpath_cache_stats stats;
+
+	/* the unit c0 is removed: its dbus path changes */
+	systemd_unit_dpath_cache_stats(&stats);
+	if (fake_call("Remove", "c0.service") < 0)
+		error("can't remove the unit\n");
+	wait_invalidations(stats.invalidations);
+	dpath = get_delta(0, &hits, &misses);
+	check(hits == 0 && misses == 1 && strcmp(dpath, first), "entry invalidated by UnitRemoved");
+	free(dpath);
+
+	/* a reload drops all the entries of the scope */
+	systemd_unit_dpath_cache_stats(&stats);
+	if (systemd_daemon_reload(ISUSER) < 0)
+		error("can't reload: %m\n");
+	wait_invalidations(stats.invalidations + stats.count - 1);
+	systemd_unit_dpath_cache_stats(&stats);
+	check(stats.count == 0, "entries invalidated by Reloading");
+	dpath = get_delta(1, &hits, &misses);
+	check(hits == 0 && misses == 1, "lookup missed after Reloading");
+	free(dpath);
+}
+
+int main(int ac, char **av)
+{
+	char *first;
+
+	wait_fake();
+	if (sd_event_new(&evloop) < 0 || systemd_set_event_loop(evloop) < 0)
+		error("can't set the event loop\n");
+
+	check_hits(&first);
+	check_eviction();
+	check_invalidation(first);
+	free(first);
+
+	printf("%d failure(s)\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,340 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the scheduler of the starts of afm-urun against fake-systemd.
+ *
+ * afm-urun.c is included to access its internal structures and the
+ * database of the applications is replaced by a mock holding the
+ * array 'apps'. The starts are dispatched by priority class and
+ * their count in flight is limited: the order of their ends and the
+ * peak of the jobs pending in fake-systemd are checked. Then the
+ * index of the applications by unit and the asynchronous queries of
+ * the runners are checked.
+ */
+
+#include "afm-urun.c"
+
+#include <systemd/sd-bus.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+/* the units are user units of the default user bus */
+#define ISUSER 1
+
+static struct json_object *apps;
+static struct sd_event *loop;
+static int uid;
+static int failures;
+
+/**************** mocks *********************/
+
+struct json_object *afm_udb_applications_private(struct afm_udb *afudb, int all, int uid)
+{
+	return json_object_get(apps);
+}
+
+struct json_object *afm_udb_get_application_private(struct afm_udb *afudb, const char *id, int uid)
+{
+	int i, n;
+	const char *aid;
+	struct json_object *appli;
+
+	n = (int)json_object_array_length(apps);
+	for (i = 0 ; i < n ; i++) {
+		appli = json_object_array_get_idx(apps, i);
+		if (j_read_string_at(appli, "id", &aid) && !strcmp(aid, id))
+			return json_object_get(appli);
+	}
+	return NULL;
+}
+
+/**************** helpers *********************/
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	failures += !ok;
+}
+
+/* wait that fake-systemd is available */
+static void wait_fake()
+{
+	int trial;
+	struct sd_bus *bus;
+
+	if (systemd_get_bus(ISUSER, &bus) < 0)
+		error("can't get the bus: %m\n");
+	for (trial = 0 ; trial < 500 ; trial++) {
+		if (sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+				"org.freedesktop.systemd1.Fake", "Reset", NULL, NULL, NULL) >= 0)
+			return;
+		usleep(10000);
+	}
+	error("fake-systemd not available\n");
+}
+
+/* get the count of the jobs pending in fake-systemd and its peak */
+static void fake_jobs(unsigned *pending, unsigned *peak)
+{
+	struct sd_bus *bus;
+	struct sd_bus_message *reply = NULL;
+
+	if (systemd_get_bus(ISUSER, &bus) < 0
+	 || sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+				"org.freedesktop.systemd1.Fake", "Jobs", NULL, &reply, NULL) < 0
+	 || sd_bus_message_read(reply, "uu", pending, peak) < 0)
+		error("can't get the jobs of fake-systemd\n");
+	sd_bus_message_unref(reply);
+}
+
+/* adds to 'apps' the application 'id' of 'priority' (or NULL) */
+static struct json_object *add_appli(const char *id, const char *priority)
+{
+	char name[100];
+	struct json_object *appli;
+
+	snprintf(name, sizeof name, "%s.service", id);
+	appli = json_object_new_object();
+	if (!appli
+	 || !j_add_string(appli, "id", id)
+	 || !j_add_string(appli, "unit-scope", "user")
+	 || !j_add_string(appli, "unit-name", name)
+	 || (priority && !j_add_string(appli, "priority", priority))
+	 || json_object_array_add(apps, appli) < 0)
+		error("out of memory\n");
+	return appli;
+}
+
+/* the ends of the starts in their order */
+static const char *ends[20];
+static int runids[20];
+static int nends;
+
+static void on_started(void *closure, int runid)
+{
+	if (nends == (int)(sizeof ends / sizeof *ends))
+		error("too many starts\n");
+	runids[nends] = runid;
+	ends[nends++] = closure;
+}
+
+/* starts the application 'id' */
+static void start(const char *id)
+{
+	struct json_object *appli;
+
+	appli = afm_udb_get_application_private(NULL, id, uid);
+	if (!appli || afm_urun_start_async(appli, uid, on_started, (void*)id) < 0)
+		error("can't start %s\n", id);
+	json_object_put(appli);
+}
+
+/* run the event loop until 'count' starts ended */
+static void wait_ends(int count)
+{
+	int trial;
+
+	for (trial = 0 ; nends < count && trial < 10000 ; trial++)
+		sd_event_run(loop, 10000);
+}
+
+/* tells whether the ends are the 'count' ids of 'expected' with valid runids */
+static int are_ends(const char **expected, int count)
+{
+	int i;
+
+	if (nends != count)
+		return 0;
+	for (i = 0 ; i < count ; i++)
+		if (strcmp(ends[i], expected[i]) || runids[i] <= 0)
+			return 0;
+	return 1;
+}
+
+/* result of an asynchronous query */
+struct result {
+	int done;			/* count of calls of the callback */
+	struct json_object *object;	/* the received object */
+};
+
+static void on_result(void *closure, struct json_object *object)
+{
+	struct result *result = closure;
+
+	result->done++;
+	result->object = object;
+}
+
+/* run the event loop until 'result' is received */
+static void wait_result(struct result *result)
+{
+	int trial;
+
+	for (trial = 0 ; !result->done && trial < 10000 ; trial++)
+		sd_event_run(loop, 10000);
+}
+
+/**************** checks *********************/
+
+static void check_priority()
+{
+	static const char *expected[] = { "bg1", "crit", "norm", "bg2" };
+
+	afm_urun_set_max_jobs(1);
+	nends = 0;
+	start("bg1");
+	start("bg2");
+	start("norm");
+	start("crit");
+	check(start_inflight_count == 1
+		&& start_queues[start_class_critical].depth == 1
+		&& start_queues[start_class_normal].depth == 1
+		&& start_queues[start_class_background].depth == 1,
+		"starts queued by class behind the one in flight");
+	wait_ends(4);
+	check(are_ends(expected, 4), "starts dispatched by priority");
+}
+
+static void check_max_jobs()
+{
+	static const char *ids[] = { "m0", "m1", "m2", "m3", "m4", "m5", "m6", "m7" };
+	int i, inflight, max;
+	unsigned pending, peak;
+	struct json_object *stats, *obj;
+
+	wait_fake();
+	afm_urun_set_max_jobs(2);
+	nends = 0;
+	for (i = 0 ; i < 8 ; i++)
+		start(ids[i]);
+	check(start_inflight_count == 2 && start_queues[start_class_normal].depth == 6,
+		"starts in flight limited");
+
+	stats = afm_urun_stats();
+	check(json_object_object_get_ex(stats, "start", &obj)
+		&& j_read_integer_at(obj, "max-jobs", &max) && max == 2
+		&& j_read_integer_at(obj, "in-flight", &inflight) && inflight == 2,
+		"limit and starts in flight in the statistics");
+	json_object_put(stats);
+
+	wait_ends(8);
+	fake_jobs(&pending, &peak);
+	check(are_ends(ids, 8), "limited starts ended in order");
+	check(pending == 0 && peak == 2, "systemd jobs pending limited");
+}
+
+static void check_index()
+{
+	int isuser;
+	char *dpath;
+	struct json_object *appli, *napps;
+
+	dpath = systemd_unit_dpath_by_name(ISUSER, "crit.service", 1);
+	appli = dpath ? search_appli_of_dpath(NULL, dpath, uid, &isuser) : NULL;
+	check(appli && appli == json_object_array_get_idx(apps, 2)
+		&& isuser == systemd_user_scope(uid),
+		"application of the unit found");
+	json_object_put(appli);
+
+	check(appli_indexes && !appli_indexes->next && appli_indexes->apps == apps
+		&& appli_indexes->complete, "index built once");
+
+	/* the database replaces the array of the applications on update */
+	napps = json_object_new_array();
+	if (!napps)
+		error("out of memory\n");
+	json_object_array_add(napps, json_object_get(json_object_array_get_idx(apps, 0)));
+	json_object_put(apps);
+	apps = napps;
+	appli = dpath ? search_appli_of_dpath(NULL, dpath, uid, &isuser) : NULL;
+	check(!appli && appli_indexes && appli_indexes->apps == apps,
+		"index rebuilt on update");
+	json_object_put(appli);
+	free(dpath);
+
+	dpath = systemd_unit_dpath_by_name(ISUSER, "other.service", 1);
+	appli = dpath ? search_appli_of_dpath(NULL, dpath, uid, &isuser) : NULL;
+	check(dpath && !appli, "unit of no application not found");
+	free(dpath);
+}
+
+static void check_queries()
+{
+	int runid;
+	const char *id;
+	struct result result;
+	struct json_object *runner;
+
+	memset(&result, 0, sizeof result);
+	check(afm_urun_list_async(NULL, 1, uid, on_result, &result) == 0
+		&& !result.done, "list of the runners pending");
+	wait_result(&result);
+	check(result.done == 1 && result.object
+		&& json_object_array_length(result.object) == json_object_array_length(apps),
+		"list of the runners received");
+	json_object_put(result.object);
+
+	memset(&result, 0, sizeof result);
+	runid = runids[0];
+	check(afm_urun_state_async(NULL, runid, uid, on_result, &result) == 0
+		&& !result.done, "state of the runner pending");
+	wait_result(&result);
+	runner = result.object;
+	check(result.done == 1 && runner
+		&& j_read_string_at(runner, "id", &id) && !strcmp(id, ends[0]),
+		"state of the runner received");
+	json_object_put(runner);
+
+	check(afm_urun_state_async(NULL, 999999, uid, on_result, &result) < 0,
+		"state of unknown runner refused");
+}
+
+int main(int ac, char **av)
+{
+	int i;
+	char id[10];
+
+	uid = (int)getuid();
+	wait_fake();
+	systemd_set_cgroup_mode(SysD_Cgroup_Off);
+	if (sd_event_new(&loop) < 0)
+		error("can't create the event loop\n");
+	afm_urun_set_event_loop(loop);
+
+	apps = json_object_new_array();
+	if (!apps)
+		error("out of memory\n");
+	add_appli("bg1", "background");
+	add_appli("bg2", "background");
+	add_appli("crit", "critical");
+	add_appli("norm", NULL);
+	for (i = 0 ; i < 8 ; i++) {
+		snprintf(id, sizeof id, "m%d", i);
+		add_appli(id, "normal");
+	}
+
+	check_priority();
+	check_max_jobs();
+	check_queries();
+	check_index();
+
+	json_object_put(apps);
+	printf("%d failure(s)\n", failures);
+	return failures != 0;
+}
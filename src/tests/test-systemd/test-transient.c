@@ -0,0 +1,238 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the translation of the units to transient units against
+ * fake-systemd.
+ *
+ * afm-udb.c is included to access the extraction of the directives.
+ * The units generated from the template (afm-unit.conf) and the
+ * config.xml given as arguments are extracted and started as transient
+ * units: the units whose directives are recorded must start and the
+ * others must be refused by the translation.
+ */
+
+#include "afm-udb.c"
+
+#include <alloca.h>
+
+#include <systemd/sd-bus.h>
+
+#include <wgt-json.h>
+#include <wgtpkg-unit.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+/* the units are user units of the default user bus */
+#define ISUSER 1
+
+static int failures;
+static int recorded;
+static int refused;
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	failures += !ok;
+}
+
+/* wait that fake-systemd is available */
+static void wait_fake()
+{
+	int trial;
+	struct sd_bus *bus;
+
+	if (systemd_get_bus(ISUSER, &bus) < 0)
+		error("can't get the bus: %m\n");
+	for (trial = 0 ; trial < 500 ; trial++) {
+		if (sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+				"org.freedesktop.systemd1.Fake", "Reset", NULL, NULL, NULL) >= 0)
+			return;
+		usleep(10000);
+	}
+	error("fake-systemd not available\n");
+}
+
+/* tells whether the directive of 'array' at 'index' is 'expected' */
+static int is_directive(struct json_object *array, int index, const char *expected)
+{
+	struct json_object *item = json_object_array_get_idx(array, index);
+	return item && !strcmp(json_object_get_string(item), expected);
+}
+
+/* tells whether the keys of the directives of 'array' are made of letters */
+static int are_keys_valid(struct json_object *array)
+{
+	int i, n;
+	const char *directive;
+
+	n = (int)json_object_array_length(array);
+	for (i = 0 ; i < n ; i++) {
+		directive = json_object_get_string(json_object_array_get_idx(array, i));
+		if (!isalpha((unsigned char)*directive))
+			return 0;
+		while (isalnum((unsigned char)*directive))
+			directive++;
+		if (*directive != '=')
+			return 0;
+	}
+	return 1;
+}
+
+/* starts the transient unit 'name' of the directives of 'array', returns the errno */
+static int start(const char *name, struct json_object *array)
+{
+	int i, n;
+	const char **directives;
+	char *jpath;
+
+	n = (int)json_object_array_length(array);
+	directives = alloca((size_t)(n + 1) * sizeof *directives);
+	for (i = 0 ; i < n ; i++)
+		directives[i] = json_object_get_string(json_object_array_get_idx(array, i));
+	jpath = systemd_unit_start_transient_job(ISUSER, name, directives, n);
+	if (!jpath)
+		return errno;
+	free(jpath);
+	return 0;
+}
+
+/* checks the extraction of the directives */
+static void check_extraction()
+{
+	static const char content[] =
+		"[Unit]\n"
+		"Description=sample\n"
+		"X-AFM-id=sample\n"
+		"# Comment=1\n"
+		"; Comment=2\n"
+		"\n"
+		"[Service]\n"
+		"  #DynamicUser=true\n"
+		"User=%i\n"
+		"ExecStart=/bin/echo \\\n"
+		"\t--a=1 \\\n"
+		"\t--b=2\n"
+		"Environment=A=1   \n"
+		"\n"
+		"[Install]\n"
+		"WantedBy=default.target\n";
+	static const char unsupported[] =
+		"[Service]\n"
+		"ExecStart=/bin/true\n"
+		"ProtectHome=yes\n";
+	struct json_object *array, *priv;
+
+	array = get_directives(content);
+	check(array && json_object_array_length(array) == 4
+		&& is_directive(array, 0, "Description=sample")
+		&& is_directive(array, 1, "User=%i")
+		&& is_directive(array, 2, "ExecStart=/bin/echo  \t--a=1  \t--b=2")
+		&& is_directive(array, 3, "Environment=A=1"),
+		"comments skipped and continued lines joined");
+	json_object_put(array);
+
+	priv = json_object_new_object();
+	if (!priv || add_directives(priv, content, "sample@.service") < 0)
+		error("can't add the directives\n");
+	check(json_object_object_get_ex(priv, key_unit_directives, &array)
+		&& start("transient-sample@1.service", array) == 0,
+		"supported directives recorded and started");
+	json_object_put(priv);
+
+	priv = json_object_new_object();
+	if (!priv || add_directives(priv, unsupported, "unsupported.service") < 0)
+		error("can't add the directives\n");
+	check(!json_object_object_get_ex(priv, key_unit_directives, NULL),
+		"unsupported directive not recorded");
+	json_object_put(priv);
+}
+
+/* checks the service units generated for a widget */
+static int process(void *closure, const struct generatedesc *desc)
+{
+	int i;
+	const struct unitdesc *unit;
+	struct json_object *array, *priv;
+	char name[256], what[320];
+
+	for (i = 0 ; i < desc->nunits ; i++) {
+		unit = &desc->units[i];
+		if (unit->type != unittype_service)
+			continue;
+		snprintf(name, sizeof name, "transient-%.*s%s.service",
+			(int)unit->name_length, unit->name,
+			unit->name[unit->name_length - 1] == '@' ? "1" : "");
+
+		array = get_directives(unit->content);
+		priv = json_object_new_object();
+		if (!array || !priv || add_directives(priv, unit->content, name) < 0)
+			error("can't get the directives of %s\n", name);
+		snprintf(what, sizeof what, "%s: directives extracted", name);
+		check(json_object_array_length(array) > 0 && are_keys_valid(array), what);
+		if (json_object_object_get_ex(priv, key_unit_directives, NULL)) {
+			recorded++;
+			snprintf(what, sizeof what, "%s: started", name);
+			check(start(name, array) == 0, what);
+		} else {
+			refused++;
+			snprintf(what, sizeof what, "%s: refused by the translation", name);
+			check(start(name, array) == ENOTSUP, what);
+		}
+		json_object_put(array);
+		json_object_put(priv);
+	}
+	return 0;
+}
+
+static int new_afid()
+{
+	static int r = 1;
+	return r++;
+}
+
+int main(int ac, char **av)
+{
+	struct unitconf conf;
+	struct json_object *obj;
+
+	if (ac < 3)
+		error("usage: %s template widget-dir...\n", *av);
+
+	wait_fake();
+	check_extraction();
+
+	conf.installdir = "INSTALL-DIR";
+	conf.icondir = "ICONS-DIR";
+	conf.new_afid = new_afid;
+	conf.base_http_ports = 20000;
+	if (unit_generator_open_template(*++av) < 0)
+		error("can't read template %s: %m\n", *av);
+	while (*++av) {
+		obj = wgt_path_to_json(*av);
+		if (!obj)
+			error("can't read widget config at %s: %m\n", *av);
+		if (unit_generator_process(obj, &conf, process, NULL))
+			error("can't generate the units of %s\n", *av);
+		json_object_put(obj);
+	}
+	check(recorded > 0, "units of applications translated");
+
+	printf("%d unit(s) recorded, %d refused, %d failure(s)\n", recorded, refused, failures);
+	return failures != 0;
+}
@@ -0,0 +1,351 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Check of the cache of replies and of the queue of calls of
+ * afm-user-daemon.
+ *
+ * afm-user-daemon.c is included to access its internal structures.
+ * The connections to D-Bus and to the framework are replaced by
+ * mocks: the requests are fake messages whose replies are recorded
+ * and the calls to the framework are recorded to be answered by the
+ * checks.
+ */
+
+#define main afm_user_daemon_main
+#include "afm-user-daemon.c"
+#undef main
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+/* a fake D-Bus request */
+struct msg {
+	int replied;			/* count of replies */
+	const char *error;		/* the error replied or NULL */
+	struct json_object *reply;	/* the reply */
+};
+
+static struct msg msgs[100];
+static int nmsgs;
+
+/* the calls sent to the framework */
+static struct call *sent[100];
+static int nsent;
+
+static int connectable = 1;
+static int signals;
+static char fake_pws;
+static int failures;
+
+/**************** mocks *********************/
+
+struct afb_proto_ws *afb_ws_client_connect_api(struct sd_event *eloop, const char *uri, struct afb_proto_ws_client_itf *itf, void *closure)
+{
+	if (connectable)
+		return (struct afb_proto_ws*)&fake_pws;
+	errno = ECONNREFUSED;
+	return NULL;
+}
+
+void afb_proto_ws_on_hangup(struct afb_proto_ws *protows, void (*on_hangup)(void *closure))
+{
+}
+
+void afb_proto_ws_unref(struct afb_proto_ws *protows)
+{
+}
+
+#if defined(AFB_PROTO_WS_VERSION) && (AFB_PROTO_WS_VERSION >= 3)
+int afb_proto_ws_client_call(struct afb_proto_ws *protows, const char *verb, struct json_object *args, const char *sessionid, void *request, const char *user_creds)
+#else
+int afb_proto_ws_client_call(struct afb_proto_ws *protows, const char *verb, struct json_object *args, const char *sessionid, void *request)
+#endif
+{
+	if (nsent == (int)(sizeof sent / sizeof *sent))
+		error("too many calls\n");
+	sent[nsent++] = request;
+	return 0;
+}
+
+struct jbus *create_jbus(struct sd_bus *sdbus, const char *path)
+{
+	return NULL;
+}
+
+int jbus_add_service_j(struct jbus *jbus, const char *method,
+		void (*oncall) (struct sd_bus_message *, struct json_object *, void *), void *data)
+{
+	return -1;
+}
+
+int jbus_start_serving(struct jbus *jbus)
+{
+	return -1;
+}
+
+int jbus_reply_j(struct sd_bus_message *smsg, struct json_object *reply)
+{
+	struct msg *m = (struct msg*)smsg;
+
+	m->replied++;
+	m->reply = json_object_get(reply);
+	return 0;
+}
+
+int jbus_reply_error_s(struct sd_bus_message *smsg, const char *error)
+{
+	struct msg *m = (struct msg*)smsg;
+
+	m->replied++;
+	m->error = error;
+	return 0;
+}
+
+int jbus_send_signal_j(struct jbus *jbus, const char *name, struct json_object *content)
+{
+	signals++;
+	return 0;
+}
+
+/**************** helpers *********************/
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	failures += !ok;
+}
+
+/* the D-Bus client calls 'verb' with the json 'args' */
+static struct msg *request(const char *verb, const char *args)
+{
+	struct msg *m;
+	struct json_object *obj;
+
+	if (nmsgs == (int)(sizeof msgs / sizeof *msgs))
+		error("too many requests\n");
+	m = &msgs[nmsgs++];
+	obj = json_tokener_parse(args);
+	propagate((struct sd_bus_message*)m, obj, (void*)verb);
+	json_object_put(obj);
+	return m;
+}
+
+/* the call sent to the framework for the request 'm' or NULL */
+static struct call *sent_of(struct msg *m)
+{
+	struct call *call;
+
+	for (call = calls.sent ; call && call->smsg != (struct sd_bus_message*)m ; call = call->next);
+	return call;
+}
+
+/* the framework answers the 'call' with the json 'result' or the 'error' */
+static void answer_call(struct call *call, const char *result, const char *error)
+{
+	struct json_object *obj;
+
+	if (!call)
+		error("no call to answer\n");
+	obj = result ? json_tokener_parse(result) : NULL;
+	on_pws_reply(NULL, call, obj, error, NULL);
+	json_object_put(obj);
+}
+
+/* the framework answers the request 'm' with the json 'result' */
+static void answer(struct msg *m, const char *result)
+{
+	answer_call(sent_of(m), result, NULL);
+}
+
+/* answers all the calls sent to the framework */
+static void answer_all()
+{
+	while (calls.sent)
+		answer_call(calls.sent, "true", NULL);
+}
+
+/* tells whether 'm' was replied once with the json 'result' */
+static int replied(struct msg *m, const char *result)
+{
+	return m->replied == 1 && !m->error && m->reply
+		&& !strcmp(json_object_to_json_string_ext(m->reply, JSON_C_TO_STRING_PLAIN), result);
+}
+
+/* tells whether 'm' was replied once with the 'error' */
+static int failed(struct msg *m, const char *error)
+{
+	return m->replied == 1 && m->error && !strcmp(m->error, error);
+}
+
+/**************** checks *********************/
+
+static void check_cache()
+{
+	int n;
+	struct msg *m, *m2;
+
+	m = request("runnables", "{}");
+	check(nsent == 1 && !m->replied && cache.misses == 1, "cacheable call propagated");
+	answer(m, "[1]");
+	check(replied(m, "[1]") && cache.count == 1, "reply propagated and cached");
+
+	n = nsent;
+	m = request("runnables", "{}");
+	check(nsent == n && replied(m, "[1]") && cache.hits == 1, "reply from the cache");
+
+	m = request("detail", "\"a\"");
+	check(nsent == n + 1 && !m->replied, "other argument not in cache");
+	answer(m, "{\"id\":\"a\"}");
+	m = request("detail", "\"b\"");
+	answer(m, "{\"id\":\"b\"}");
+	check(cache.count == 2, "cache limited to its size");
+
+	n = nsent;
+	m = request("runnables", "{}");
+	check(nsent == n + 1, "least recently used entry dropped");
+	answer(m, "[2]");
+	m = request("detail", "\"b\"");
+	check(nsent == n + 1 && replied(m, "{\"id\":\"b\"}"), "recently used entry kept");
+
+	m = request("start", "\"a\"");
+	answer(m, "1");
+	m = request("start", "\"a\"");
+	check(nsent == n + 3 && !m->replied, "not cacheable call always propagated");
+	answer(m, "2");
+	check(replied(m, "2"), "not cacheable reply propagated");
+
+	on_pws_event_broadcast(NULL, "application-list-changed", NULL);
+	check(cache.count == 0 && signals == 1, "cache invalidated by the events");
+	n = nsent;
+	m = request("detail", "\"b\"");
+	check(nsent == n + 1, "call propagated after invalidation");
+
+	m2 = request("runnables", "{}");
+	on_pws_event_broadcast(NULL, "application-list-changed", NULL);
+	answer(m, "{\"id\":\"b\"}");
+	answer(m2, "[3]");
+	check(replied(m, "{\"id\":\"b\"}") && replied(m2, "[3]") && cache.count == 0,
+		"replies predating an invalidation not cached");
+}
+
+static void check_queue()
+{
+	int n;
+	struct msg *a, *b, *c, *m[6];
+	unsigned long rejected;
+
+	n = nsent;
+	a = request("start", "\"1\"");
+	b = request("start", "\"2\"");
+	c = request("start", "\"3\"");
+	check(nsent == n + 2 && calls.outstanding == 2 && calls.queued == 1, "outstanding calls limited");
+	answer(a, "1");
+	check(nsent == n + 3 && sent_of(c) && calls.queued == 0, "queued call sent on reply");
+	answer(b, "2");
+	answer(c, "3");
+	check(replied(a, "1") && replied(b, "2") && replied(c, "3") && calls.outstanding == 0,
+		"queued calls replied");
+
+	rejected = calls.rejected;
+	for (n = 0 ; n < 6 ; n++)
+		m[n] = request("start", "\"q\"");
+	check(calls.outstanding == 2 && calls.queued == 3 && failed(m[5], "busy")
+		&& calls.rejected == rejected + 1, "calls rejected when the queue is full");
+	answer_all();
+	for (n = 0 ; n < 5 && replied(m[n], "true") ; n++);
+	check(n == 5 && calls.queued == 0 && calls.peak_queued == 3, "full queue replied");
+}
+
+static void check_reconnect()
+{
+	int n;
+	struct msg *r, *s, *q, *q2, *q3;
+
+	r = request("runners", "true");
+	s = request("start", "\"x\"");
+	connectable = 0;
+	on_pws_hangup(NULL);
+	check(pws == NULL, "disconnected");
+	answer_call(sent_of(r), NULL, "disconnected");
+	answer_call(sent_of(s), NULL, "disconnected");
+	check(!r->replied && calls.replayed == 1 && calls.queued == 1, "read only call kept for replay");
+	check(failed(s, "disconnected"), "other call failed");
+
+	q = request("state", "1");
+	q2 = request("once", "\"y\"");
+	q3 = request("once", "\"z\"");
+	check(!q->replied && !q2->replied && failed(q3, "disconnected") && calls.queued == 3,
+		"calls queued while disconnected");
+
+	n = nsent;
+	connectable = 1;
+	attempt_connect_pws();
+	check(pws != NULL && reconnect.reconnections == 1, "reconnected");
+	check(nsent == n + 2 && sent[n]->smsg == (struct sd_bus_message*)r
+		&& sent[n + 1]->smsg == (struct sd_bus_message*)q && calls.queued == 1,
+		"replayed call sent first after reconnection");
+	answer_all();
+	check(replied(r, "true") && replied(q, "true") && replied(q2, "true"), "queued calls replied after reconnection");
+}
+
+static void check_timeouts()
+{
+	struct msg *t1, *t2;
+	struct call *call;
+	unsigned long timeouts;
+
+	timeouts = calls.timeouts;
+	t1 = request("start", "\"t\"");
+	call = sent_of(t1);
+	connectable = 0;
+	on_pws_hangup(NULL);
+	t2 = request("start", "\"u\"");
+	check(!t1->replied && !t2->replied && calls.queued == 1, "calls waiting");
+
+	call->deadline = 0;
+	calls.head->deadline = 0;
+	on_deadline(NULL, 0, NULL);
+	check(failed(t1, "timeout") && failed(t2, "timeout") && calls.queued == 0
+		&& calls.timeouts == timeouts + 2, "calls expired");
+
+	answer_call(call, NULL, "disconnected");
+	check(t1->replied == 1 && calls.outstanding == 0, "late reply of expired call dropped");
+}
+
+int main(int ac, char **av)
+{
+	if (sd_event_new(&evloop) < 0
+	 || sd_event_add_time(evloop, &calls.timer, CLOCK_MONOTONIC, 0, 0, on_deadline, NULL) < 0)
+		error("can't create the event loop\n");
+	sd_event_source_set_enabled(calls.timer, SD_EVENT_OFF);
+
+	uri = "mock";
+	cache.size = 2;
+	calls.max_outstanding = 2;
+	calls.max_queued = 3;
+	if (!try_connect_pws())
+		error("can't connect\n");
+
+	check_cache();
+	check_queue();
+	check_reconnect();
+	check_timeouts();
+
+	printf("%d failure(s)\n", failures);
+	return failures != 0;
+}
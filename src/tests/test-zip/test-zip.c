@@ -0,0 +1,339 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/*
+ * Feeds crafted zip streams to zread_fd through a pipe and checks
+ * that the valid ones are extracted and the others refused.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <zlib.h>
+
+#include <wgtpkg-workdir.h>
+#include <wgtpkg-zip.h>
+
+#define error(...) fprintf(stderr,__VA_ARGS__),exit(1)
+
+#define ZFLAG_DESC	8
+#define ZMETHOD_STORE	0
+#define ZMETHOD_DEFLATE	8
+
+/* description of an entry of a crafted zip */
+struct zent {
+	const char *name;	/* name of the entry */
+	const char *data;	/* data of the entry or NULL for 'size' zeros */
+	size_t size;		/* size of the data */
+	unsigned method;	/* ZMETHOD_STORE or ZMETHOD_DEFLATE */
+	unsigned flags;		/* ZFLAG_DESC or 0 */
+};
+
+/* alterations of the crafted zip */
+enum alter {
+	alter_none,		/* valid zip */
+	alter_cut,		/* truncated in the data of the last entry */
+	alter_cdname,		/* name of the central directory differs */
+	alter_cdcrc,		/* crc of the central directory differs */
+	alter_cdmissing		/* entry missing in the central directory */
+};
+
+static unsigned char zip[1 << 20];
+static size_t ziplen;
+static char base[] = "/tmp/test-zip-XXXXXX";
+static int failures;
+
+static void put16(unsigned value)
+{
+	zip[ziplen++] = (unsigned char)value;
+	zip[ziplen++] = (unsigned char)(value >> 8);
+}
+
+static void put32(unsigned long value)
+{
+	put16((unsigned)(value & 0xffff));
+	put16((unsigned)(value >> 16));
+}
+
+static void putn(const void *data, size_t size)
+{
+	if (ziplen + size > sizeof zip)
+		error("crafted zip too big\n");
+	memcpy(&zip[ziplen], data, size);
+	ziplen += size;
+}
+
+/* compress 'size' bytes of 'data' as a raw deflate stream in 'out' */
+static size_t deflate_raw(const unsigned char *data, size_t size, unsigned char *out, size_t osize)
+{
+	z_stream z;
+
+	memset(&z, 0, sizeof z);
+	if (deflateInit2(&z, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		error("can't init deflate\n");
+	z.next_in = (unsigned char*)data;
+	z.avail_in = (uInt)size;
+	z.next_out = out;
+	z.avail_out = (uInt)osize;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+		error("can't deflate\n");
+	deflateEnd(&z);
+	return osize - z.avail_out;
+}
+
+/* craft in 'zip' the archive of the 'count' entries 'ents' altered by 'alter' */
+static void craft(const struct zent *ents, int count, enum alter alter)
+{
+	static unsigned char data[1 << 18], cdata[1 << 18];
+	unsigned long offsets[16], crcs[16], csizes[16], cdoffset, cut;
+	const unsigned char *content;
+	size_t nlen;
+	int i, n;
+
+	ziplen = cut = 0;
+	for (i = 0 ; i < count ; i++) {
+		if (ents[i].data)
+			content = (const unsigned char*)ents[i].data;
+		else {
+			memset(data, 0, ents[i].size);
+			content = data;
+		}
+		crcs[i] = crc32(crc32(0, Z_NULL, 0), content, (uInt)ents[i].size);
+		if (ents[i].method == ZMETHOD_DEFLATE) {
+			csizes[i] = deflate_raw(content, ents[i].size, cdata, sizeof cdata);
+			content = cdata;
+		} else
+			csizes[i] = ents[i].size;
+		nlen = strlen(ents[i].name);
+		offsets[i] = ziplen;
+
+		/* local header */
+		put32(0x04034b50);
+		put16(20);
+		put16(ents[i].flags);
+		put16(ents[i].method);
+		put32(0);
+		if (ents[i].flags & ZFLAG_DESC) {
+			put32(0);
+			put32(0);
+			put32(0);
+		} else {
+			put32(crcs[i]);
+			put32(csizes[i]);
+			put32(ents[i].size);
+		}
+		put16((unsigned)nlen);
+		put16(0);
+		putn(ents[i].name, nlen);
+		cut = ziplen + csizes[i] / 2;
+		putn(content, csizes[i]);
+
+		/* data descriptor */
+		if (ents[i].flags & ZFLAG_DESC) {
+			put32(0x08074b50);
+			put32(crcs[i]);
+			put32(csizes[i]);
+			put32(ents[i].size);
+		}
+	}
+
+	/* central directory */
+	cdoffset = ziplen;
+	n = alter == alter_cdmissing ? count - 1 : count;
+	for (i = 0 ; i < n ; i++) {
+		nlen = strlen(ents[i].name);
+		put32(0x02014b50);
+		put16(20);
+		put16(20);
+		put16(ents[i].flags);
+		put16(ents[i].method);
+		put32(0);
+		put32(alter == alter_cdcrc ? crcs[i] ^ 1 : crcs[i]);
+		put32(csizes[i]);
+		put32(ents[i].size);
+		put16((unsigned)nlen);
+		put16(0);
+		put16(0);
+		put16(0);
+		put16(0);
+		put32(0);
+		put32(offsets[i]);
+		putn(ents[i].name, nlen);
+		if (alter == alter_cdname)
+			zip[ziplen - 1] ^= 1;
+	}
+
+	/* end of central directory */
+	put32(0x06054b50);
+	put16(0);
+	put16(0);
+	put16((unsigned)n);
+	put16((unsigned)n);
+	put32(ziplen - cdoffset);
+	put32(cdoffset);
+	put16(0);
+
+	if (alter == alter_cut)
+		ziplen = cut;
+}
+
+/* feed 'zip' to zread_fd through a pipe, returns its result and its errno in 'err' */
+static int feed(unsigned long long maxsize, int *err)
+{
+	int rc, fds[2], status;
+	pid_t pid;
+	size_t off;
+	ssize_t sizw;
+
+	if (pipe(fds) < 0)
+		error("can't create pipe\n");
+	pid = fork();
+	if (pid < 0)
+		error("can't fork\n");
+	if (pid == 0) {
+		/* the writer, stopped by the reader closing early */
+		signal(SIGPIPE, SIG_IGN);
+		close(fds[0]);
+		for (off = 0 ; off < ziplen ; off += (size_t)sizw) {
+			sizw = write(fds[1], &zip[off], ziplen - off);
+			if (sizw < 0 && errno != EINTR)
+				_exit(0);
+			if (sizw < 0)
+				sizw = 0;
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+	errno = 0;
+	rc = zread_fd(fds[0], maxsize);
+	*err = errno;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return rc;
+}
+
+/* check that 'path' of the workdir has the 'size' bytes of 'data' (or zeros) */
+static int check_file(const char *path, const char *data, size_t size)
+{
+	int fd, ok;
+	size_t i;
+	ssize_t sizr;
+	char buffer[4096];
+
+	fd = openat(workdirfd, path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	sizr = read(fd, buffer, sizeof buffer);
+	close(fd);
+	ok = sizr == (ssize_t)size;
+	for (i = 0 ; ok && i < size ; i++)
+		ok = buffer[i] == (data ? data[i] : 0);
+	return ok;
+}
+
+/* run the case 'name' and check its result against 'experr' (0 for success) */
+static void run(const char *name, const struct zent *ents, int count, enum alter alter,
+		unsigned long long maxsize, int experr)
+{
+	int rc, err, i, ok;
+	char escape[sizeof base + 10];
+
+	if (make_workdir(base, "case", 0) < 0)
+		error("can't make workdir\n");
+	craft(ents, count, alter);
+	rc = feed(maxsize, &err);
+	if (experr)
+		ok = rc < 0 && err == experr;
+	else {
+		ok = rc == 0;
+		for (i = 0 ; ok && i < count ; i++)
+			ok = ents[i].name[strlen(ents[i].name) - 1] == '/'
+				|| check_file(ents[i].name, ents[i].data, ents[i].size);
+	}
+
+	/* nothing can be written outside of the workdir */
+	snprintf(escape, sizeof escape, "%s/escape", base);
+	if (access(escape, F_OK) == 0) {
+		unlink(escape);
+		ok = 0;
+	}
+
+	printf("%s: %s (rc=%d errno=%s)\n", ok ? "PASS" : "FAIL", name, rc, rc < 0 ? strerror(err) : "-");
+	failures += !ok;
+	remove_workdir();
+}
+
+int main()
+{
+	static const char text[] = "hello, this is the content of the entry\n";
+	static const struct zent valid[] = {
+		{ "a.txt", text, sizeof text - 1, ZMETHOD_STORE, 0 },
+		{ "d/", NULL, 0, ZMETHOD_STORE, 0 },
+		{ "d/b.txt", text, sizeof text - 1, ZMETHOD_DEFLATE, ZFLAG_DESC },
+		{ "e/f/c.bin", NULL, 3000, ZMETHOD_DEFLATE, 0 }
+	};
+	static const struct zent dotdot[] = {
+		{ "../escape", text, sizeof text - 1, ZMETHOD_STORE, 0 }
+	};
+	static const struct zent dotdot2[] = {
+		{ "a.txt", text, sizeof text - 1, ZMETHOD_STORE, 0 },
+		{ "d/../../escape", text, sizeof text - 1, ZMETHOD_DEFLATE, 0 }
+	};
+	static const struct zent absolute[] = {
+		{ "/tmp/escape", text, sizeof text - 1, ZMETHOD_STORE, 0 }
+	};
+	static const struct zent storedesc[] = {
+		{ "a.txt", text, sizeof text - 1, ZMETHOD_STORE, ZFLAG_DESC }
+	};
+	static const struct zent big[] = {
+		{ "a.txt", text, sizeof text - 1, ZMETHOD_STORE, 0 },
+		{ "big.bin", NULL, 100000, ZMETHOD_STORE, 0 }
+	};
+	static const struct zent bomb[] = {
+		{ "bomb.bin", NULL, 200000, ZMETHOD_DEFLATE, 0 }
+	};
+
+	if (!mkdtemp(base))
+		error("can't create %s\n", base);
+
+	run("valid", valid, 4, alter_none, 0, 0);
+	run("valid within maxsize", valid, 4, alter_none, 4000, 0);
+	run("name with ..", dotdot, 1, alter_none, 0, EINVAL);
+	run("name with .. after a valid entry", dotdot2, 2, alter_none, 0, EINVAL);
+	run("absolute name", absolute, 1, alter_none, 0, EINVAL);
+	run("stored with data descriptor", storedesc, 1, alter_none, 0, ENOTSUP);
+	run("truncated stored data", big, 2, alter_cut, 0, EBADMSG);
+	run("truncated deflated data", bomb, 1, alter_cut, 0, EBADMSG);
+	run("central directory name mismatch", valid, 4, alter_cdname, 0, EBADMSG);
+	run("central directory crc mismatch", valid, 4, alter_cdcrc, 0, EBADMSG);
+	run("central directory entry missing", valid, 4, alter_cdmissing, 0, EBADMSG);
+	run("stored maxsize overflow", big, 2, alter_none, 50000, EFBIG);
+	run("deflated maxsize overflow", bomb, 1, alter_none, 50000, EFBIG);
+
+	rmdir(base);
+	printf("%d failure(s)\n", failures);
+	return failures != 0;
+}
@@ -40,12 +40,29 @@
  */
 static const char out_of_memory_string[] = "out of memory";
 
+/*
+ * method answered by servers able to receive and send JSON
+ * as native D-Bus values (see jbus_set_native)
+ */
+static const char native_method[] = "jbus_native";
+
+/*
+ * state of the negotiation of native D-Bus values
+ */
+enum native_state {
+	native_unknown,		/* not yet negotiated */
+	native_probing,		/* negotiation pending */
+	native_yes,		/* the server accepts native values */
+	native_no		/* strings only */
+};
+
 /*
  * structure for services
  */
 struct jservice {
 	struct jservice *next;	/* link to the next service */
 	char *method;		/* method name for the service */
+	unsigned hash;		/* hash of the method name */
 	void (*oncall_s) (struct sd_bus_message *, const char *, void *);
 				/* string callback */
 	void (*oncall_j) (struct sd_bus_message *, struct json_object *, void *);
@@ -82,17 +99,27 @@ struct jrespw {
  * structure for handling either client or server jbus on dbus
  */
 struct jbus {
+	struct jbus *next;		/* next jbus of the same process */
 	int refcount;			/* referenced how many time */
 	struct sd_bus *sdbus;
 	struct sd_bus_slot *sservice;
 	struct sd_bus_slot *ssignal;
 	struct json_tokener *tokener;	/* string to json tokenizer */
 	struct jservice *services;	/* first service */
+	struct jservice **dispatch;	/* hash table of the services or NULL */
+	unsigned dispatch_mask;		/* size of the hash table minus one */
 	struct jsignal *signals;	/* first signal */
+	enum native_state native;	/* use of native D-Bus values */
 	char *path;			/* dbus path */
 	char *name;			/* dbus name */
 };
 
+/*
+ * the jbus objects created, shared by the creations for the
+ * same bus and path
+ */
+static struct jbus *jbuses;
+
 /*********************** STATIC COMMON METHODS *****************/
 
 static int mkerrno(int rc)
@@ -135,12 +162,373 @@ static int jparse(struct jbus *jbus, const char *msg, struct json_object **obj)
 	return 0;
 }
 
+/*
+ * Appends to the message 'smsg' the json 'obj' as a native D-Bus
+ * variant (signature "v") whose content is:
+ *   - a{sv} for objects
+ *   - av for arrays
+ *   - s, b, x or d for strings, booleans, integers and doubles
+ *   - an empty ay for null
+ *
+ * Returns a negative value in case of error.
+ */
+static int append_json(struct sd_bus_message *smsg, struct json_object *obj)
+{
+	int rc;
+	size_t i, n;
+	struct json_object_iterator it, end;
+
+	switch (json_object_get_type(obj)) {
+	case json_type_boolean:
+		return sd_bus_message_append(smsg, "v", "b", (int)json_object_get_boolean(obj));
+	case json_type_int:
+		return sd_bus_message_append(smsg, "v", "x", (int64_t)json_object_get_int64(obj));
+	case json_type_double:
+		return sd_bus_message_append(smsg, "v", "d", json_object_get_double(obj));
+	case json_type_string:
+		return sd_bus_message_append(smsg, "v", "s", json_object_get_string(obj));
+	case json_type_array:
+		rc = sd_bus_message_open_container(smsg, 'v', "av");
+		if (rc >= 0)
+			rc = sd_bus_message_open_container(smsg, 'a', "v");
+		n = json_object_array_length(obj);
+		for (i = 0 ; rc >= 0 && i < n ; i++)
+			rc = append_json(smsg, json_object_array_get_idx(obj, i));
+		if (rc >= 0)
+			rc = sd_bus_message_close_container(smsg);
+		break;
+	case json_type_object:
+		rc = sd_bus_message_open_container(smsg, 'v', "a{sv}");
+		if (rc >= 0)
+			rc = sd_bus_message_open_container(smsg, 'a', "{sv}");
+		it = json_object_iter_begin(obj);
+		end = json_object_iter_end(obj);
+		while (rc >= 0 && !json_object_iter_equal(&it, &end)) {
+			rc = sd_bus_message_open_container(smsg, 'e', "sv");
+			if (rc >= 0)
+				rc = sd_bus_message_append_basic(smsg, 's', json_object_iter_peek_name(&it));
+			if (rc >= 0)
+				rc = append_json(smsg, json_object_iter_peek_value(&it));
+			if (rc >= 0)
+				rc = sd_bus_message_close_container(smsg);
+			json_object_iter_next(&it);
+		}
+		if (rc >= 0)
+			rc = sd_bus_message_close_container(smsg);
+		break;
+	default:
+		rc = sd_bus_message_append(smsg, "v", "ay", 0);
+		return rc;
+	}
+	return rc < 0 ? rc : sd_bus_message_close_container(smsg);
+}
+
+/*
+ * Reads from the message 'smsg' a native D-Bus variant as
+ * written by 'append_json' and stores the json in 'obj'.
+ *
+ * Returns 1 in case of success, 0 at the end of the enclosing
+ * container or a negative value in case of error.
+ */
+static int read_json(struct sd_bus_message *smsg, struct json_object **obj)
+{
+	int rc, b;
+	char type;
+	int64_t x;
+	double d;
+	const char *contents, *str;
+	struct json_object *item;
+
+	*obj = NULL;
+	rc = sd_bus_message_peek_type(smsg, &type, &contents);
+	if (rc <= 0)
+		return rc;
+	if (type != 'v')
+		return -EINVAL;
+	rc = sd_bus_message_enter_container(smsg, 'v', contents);
+	if (rc < 0)
+		return rc;
+
+	switch (contents[0]) {
+	case 'b':
+		rc = sd_bus_message_read_basic(smsg, 'b', &b);
+		if (rc >= 0)
+			*obj = json_object_new_boolean(b);
+		break;
+	case 'x':
+		rc = sd_bus_message_read_basic(smsg, 'x', &x);
+		if (rc >= 0)
+			*obj = json_object_new_int64(x);
+		break;
+	case 'd':
+		rc = sd_bus_message_read_basic(smsg, 'd', &d);
+		if (rc >= 0)
+			*obj = json_object_new_double(d);
+		break;
+	case 's':
+		rc = sd_bus_message_read_basic(smsg, 's', &str);
+		if (rc >= 0)
+			*obj = json_object_new_string(str);
+		break;
+	case 'a':
+		if (!strcmp(contents, "av")) {
+			*obj = json_object_new_array();
+			rc = sd_bus_message_enter_container(smsg, 'a', "v");
+			while (rc >= 0 && (rc = read_json(smsg, &item)) > 0)
+				json_object_array_add(*obj, item);
+			if (rc >= 0)
+				rc = sd_bus_message_exit_container(smsg);
+			break;
+		}
+		if (!strcmp(contents, "a{sv}")) {
+			*obj = json_object_new_object();
+			rc = sd_bus_message_enter_container(smsg, 'a', "{sv}");
+			while (rc >= 0 && (rc = sd_bus_message_enter_container(smsg, 'e', "sv")) > 0) {
+				rc = sd_bus_message_read_basic(smsg, 's', &str);
+				if (rc >= 0)
+					rc = read_json(smsg, &item);
+				if (rc > 0)
+					json_object_object_add(*obj, str, item);
+				if (rc >= 0)
+					rc = sd_bus_message_exit_container(smsg);
+			}
+			if (rc >= 0)
+				rc = sd_bus_message_exit_container(smsg);
+			break;
+		}
+		/* fall through */
+	default:
+		/* null or unexpected */
+		rc = sd_bus_message_skip(smsg, contents);
+		break;
+	}
+	if (rc >= 0)
+		rc = sd_bus_message_exit_container(smsg);
+	if (rc < 0) {
+		json_object_put(*obj);
+		*obj = NULL;
+		return rc;
+	}
+	return 1;
+}
+
+/*
+ * Reads the json of the message 'smsg', either a string (signature "s")
+ * to parse using 'jbus' or a native variant (signature "v").
+ * When 'lax' isn't nul, strings that aren't JSON are read as JSON strings.
+ *
+ * Returns 1 in case of success and put the result in *'obj'.
+ * Returns 0 in case of error and put NULL in *'obj'.
+ */
+static int read_message_json(struct jbus *jbus, struct sd_bus_message *smsg, int lax, struct json_object **obj)
+{
+	const char *str;
+
+	if (sd_bus_message_has_signature(smsg, "v"))
+		return read_json(smsg, obj) > 0;
+
+	*obj = NULL;
+	if (!sd_bus_message_has_signature(smsg, "s")
+	  || sd_bus_message_read_basic(smsg, 's', &str) < 0)
+		return 0;
+	if (!jparse(jbus, str, obj) && lax)
+		*obj = json_object_new_string(str);
+	return *obj != NULL;
+}
+
+/*
+ * Called on reply of the negotiation of native values
+ */
+static int on_native_reply(struct sd_bus_message *smsg, struct jbus *jbus, sd_bus_error *error)
+{
+	int yes;
+
+	jbus->native = !sd_bus_message_is_method_error(smsg, NULL)
+			&& sd_bus_message_read_basic(smsg, 'b', &yes) > 0
+			&& yes ? native_yes : native_no;
+	jbus_unref(jbus);
+	return 1;
+}
+
+/*
+ * Tells whether the calls of 'jbus' can send native values,
+ * starting the negotiation with the server if needed. The
+ * negotiation is synchronous when 'sync' is not nul. Otherwise,
+ * strings are used until its end.
+ */
+static int use_native(struct jbus *jbus, int sync)
+{
+	int rc, yes;
+	struct sd_bus_message *reply;
+
+	if (jbus->native == native_unknown) {
+		if (sync) {
+			reply = NULL;
+			rc = sd_bus_call_method(jbus->sdbus, jbus->name, jbus->path, jbus->name,
+						native_method, NULL, &reply, NULL);
+			jbus->native = rc >= 0
+				&& sd_bus_message_read_basic(reply, 'b', &yes) > 0
+				&& yes ? native_yes : native_no;
+			sd_bus_message_unref(reply);
+		}
+		else {
+			jbus_addref(jbus);
+			jbus->native = native_probing;
+			rc = sd_bus_call_method_async(jbus->sdbus, NULL, jbus->name, jbus->path, jbus->name,
+						native_method, (void*)on_native_reply, jbus, NULL);
+			if (rc < 0) {
+				jbus->native = native_no;
+				jbus_unref(jbus);
+			}
+		}
+	}
+	return jbus->native == native_yes;
+}
+
+/*
+ * Makes in 'msg' the call of 'method' of 'jbus' with either the string
+ * 'query_s' or the json 'query_j', as native value if possible.
+ *
+ * Returns 0 in case of success or a negative value in case of error.
+ */
+static int make_call(struct jbus *jbus, const char *method, const char *query_s,
+			struct json_object *query_j, int sync, struct sd_bus_message **msg)
+{
+	int rc;
+
+	*msg = NULL;
+	if (query_j != NULL && !use_native(jbus, sync)) {
+		query_s = json_object_to_json_string(query_j);
+		if (query_s == NULL)
+			return -ENOMEM;
+	}
+	rc = sd_bus_message_new_method_call(jbus->sdbus, msg, jbus->name, jbus->path, jbus->name, method);
+	if (rc >= 0)
+		rc = query_s ? sd_bus_message_append_basic(*msg, 's', query_s) : append_json(*msg, query_j);
+	if (rc < 0) {
+		sd_bus_message_unref(*msg);
+		*msg = NULL;
+		if (!query_s) {
+			/* not representable natively (ex: NUL in strings), fall back to the string */
+			query_s = json_object_to_json_string(query_j);
+			return query_s ? make_call(jbus, method, query_s, NULL, sync, msg) : -ENOMEM;
+		}
+	}
+	return rc;
+}
+
+/*
+ * Computes the hash of the 'method' name (FNV-1a)
+ */
+static unsigned hash_method(const char *method)
+{
+	unsigned hash = 2166136261u;
+
+	while (*method)
+		hash = (hash ^ (unsigned char)*method++) * 16777619u;
+	return hash;
+}
+
+/*
+ * Builds the open addressed hash table dispatching the calls
+ * of 'jbus' to its services. When many services have the same
+ * method, the last added is the one called.
+ *
+ * Returns 0 in case of success or -1 in case of error (ENOMEM).
+ */
+static int build_dispatch(struct jbus *jbus)
+{
+	unsigned count, size, index;
+	struct jservice *srv, **table;
+
+	/* compute the size: a power of 2 at least twice the count */
+	for (count = 0, srv = jbus->services ; srv ; srv = srv->next)
+		count++;
+	for (size = 8 ; size < 2 * count ; size <<= 1);
+
+	/* allocation */
+	table = calloc(size, sizeof *table);
+	if (table == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* fill the table, services are recorded last added first */
+	for (srv = jbus->services ; srv ; srv = srv->next) {
+		index = srv->hash & (size - 1);
+		while (table[index] != NULL && strcmp(table[index]->method, srv->method))
+			index = (index + 1) & (size - 1);
+		if (table[index] == NULL)
+			table[index] = srv;
+	}
+
+	free(jbus->dispatch);
+	jbus->dispatch = table;
+	jbus->dispatch_mask = size - 1;
+	return 0;
+}
+
+/*
+ * Search the service of 'jbus' for the 'method'
+ *
+ * Returns the service found or NULL if none.
+ */
+static struct jservice *search_service(struct jbus *jbus, const char *method)
+{
+	unsigned hash, index;
+	struct jservice *srv;
+
+	if (jbus->dispatch == NULL && build_dispatch(jbus) < 0) {
+		/* fallback to the list */
+		srv = jbus->services;
+		while (srv != NULL && strcmp(srv->method, method))
+			srv = srv->next;
+		return srv;
+	}
+
+	hash = hash_method(method);
+	index = hash & jbus->dispatch_mask;
+	while ((srv = jbus->dispatch[index]) != NULL) {
+		if (srv->hash == hash && !strcmp(srv->method, method))
+			break;
+		index = (index + 1) & jbus->dispatch_mask;
+	}
+	return srv;
+}
+
 static int on_service_call(struct sd_bus_message *smsg, struct jbus *jbus, sd_bus_error *error)
 {
 	struct jservice *service;
 	const char *member, *content;
 	struct json_object *obj;
 
+	/* negotiation of native values */
+	member = sd_bus_message_get_member(smsg);
+	if (member != NULL && !strcmp(member, native_method)) {
+		sd_bus_reply_method_return(smsg, "b", 1);
+		return 1;
+	}
+
+	/* search the service */
+	service = member ? search_service(jbus, member) : NULL;
+	if (service == NULL)
+		return 0;
+
+	/* native value */
+	if (sd_bus_message_has_signature(smsg, "v")) {
+		if (read_json(smsg, &obj) <= 0) {
+			sd_bus_error_set_const(error, "bad signature", "");
+			return 1;
+		}
+		sd_bus_message_ref(smsg);
+		if (service->oncall_j)
+			service->oncall_j(smsg, obj, service->data);
+		else if (service->oncall_s)
+			service->oncall_s(smsg, json_object_to_json_string(obj), service->data);
+		json_object_put(obj);
+		return 1;
+	}
+
 	/* check the type */
 	if (!sd_bus_message_has_signature(smsg, "s")
 	  || sd_bus_message_read_basic(smsg, 's', &content) < 0) {
@@ -149,24 +537,16 @@ static int on_service_call(struct sd_bus_message *smsg, struct jbus *jbus, sd_bu
 	}
 
 	/* dispatch */
-	member = sd_bus_message_get_member(smsg);
-	service = jbus->services;
-	while (service != NULL) {
-		if (!strcmp(service->method, member)) {
-			sd_bus_message_ref(smsg);
-			if (service->oncall_s)
-				service->oncall_s(smsg, content, service->data);
-			else if (service->oncall_j) {
-				if (!jparse(jbus, content, &obj))
-					obj = json_object_new_string(content);
-				service->oncall_j(smsg, obj, service->data);
-				json_object_put(obj);
-			}
-			return 1;
-		}
-		service = service->next;
+	sd_bus_message_ref(smsg);
+	if (service->oncall_s)
+		service->oncall_s(smsg, content, service->data);
+	else if (service->oncall_j) {
+		if (!jparse(jbus, content, &obj))
+			obj = json_object_new_string(content);
+		service->oncall_j(smsg, obj, service->data);
+		json_object_put(obj);
 	}
-	return 0;
+	return 1;
 }
 
 /*
@@ -209,12 +589,17 @@ static int add_service(
 	}
 
 	/* record the service */
+	srv->hash = hash_method(method);
 	srv->oncall_s = oncall_s;
 	srv->oncall_j = oncall_j;
 	srv->data = data;
 	srv->next = jbus->services;
 	jbus->services = srv;
 
+	/* the dispatch table is rebuilt when needed */
+	free(jbus->dispatch);
+	jbus->dispatch = NULL;
+
 	return 0;
 
  error2:
@@ -322,6 +707,21 @@ static int on_reply(struct sd_bus_message *smsg, struct jrespw *jrespw, sd_bus_e
 	const char *reply;
 	int iserror;
 
+	/* native reply */
+	if (sd_bus_message_has_signature(smsg, "v")) {
+		if (read_json(smsg, &obj) <= 0) {
+			sd_bus_error_set_const(error, "bad signature", "");
+			goto end;
+		}
+		iserror = sd_bus_message_is_method_error(smsg, NULL);
+		if (jrespw->onresp_s != NULL)
+			jrespw->onresp_s(iserror, json_object_to_json_string(obj), jrespw->data);
+		else
+			jrespw->onresp_j(iserror, obj, jrespw->data);
+		json_object_put(obj);
+		goto end;
+	}
+
 	/* check the type */
 	if (!sd_bus_message_has_signature(smsg, "s")
 	  || sd_bus_message_read_basic(smsg, 's', &reply) < 0) {
@@ -348,8 +748,9 @@ static int on_reply(struct sd_bus_message *smsg, struct jrespw *jrespw, sd_bus_e
 }
 
 /*
- * Creates a message for 'method' with one string parameter being 'query'
- * and sends it to the destination, object and interface linked to 'jbus'.
+ * Creates a message for 'method' with one parameter being either the
+ * string 'query' or the json 'query_j' and sends it to the destination,
+ * object and interface linked to 'jbus'.
  *
  * Adds to 'jbus' the response handler defined by the callbacks 'onresp_s'
  * (for string) and 'onresp_j' (for json) and the closure parameter 'data'.
@@ -360,12 +761,14 @@ static int call(
 		struct jbus *jbus,
 		const char *method,
 		const char *query,
+		struct json_object *query_j,
 		void (*onresp_s) (int, const char *, void *),
 		void (*onresp_j) (int, struct json_object *, void *),
 		void *data)
 {
 	int rc;
 	struct jrespw *resp;
+	struct sd_bus_message *msg;
 
 	/* allocates the response structure */
 	resp = malloc(sizeof *resp);
@@ -380,7 +783,11 @@ static int call(
 	resp->onresp_j = onresp_j;
 	resp->data = data;
 
-	rc = sd_bus_call_method_async(jbus->sdbus, NULL, jbus->name, jbus->path, jbus->name, method, (void*)on_reply, resp, "s", query);
+	rc = make_call(jbus, method, query, query_j, 0, &msg);
+	if (rc >= 0) {
+		rc = sd_bus_call_async(jbus->sdbus, NULL, msg, (void*)on_reply, resp, 0);
+		sd_bus_message_unref(msg);
+	}
 	if (rc < 0) {
 		errno = -rc;
 		goto error2;
@@ -411,6 +818,9 @@ static int call(
  * For example, passing path = /a/b/c means that the object /a/b/c is
  * handled by the destination a.b.c and replies to the interface a.b.c
  *
+ * The creations for the same bus and path share the same jbus, its
+ * services, signals and slots: they return a new reference to it.
+ *
  * Returns the created jbus or NULL in case of error.
  */
 struct jbus *create_jbus(struct sd_bus *sdbus, const char *path)
@@ -418,6 +828,14 @@ struct jbus *create_jbus(struct sd_bus *sdbus, const char *path)
 	struct jbus *jbus;
 	char *name;
 
+	/* search an existing jbus */
+	for (jbus = jbuses ; jbus ; jbus = jbus->next) {
+		if (jbus->sdbus == sdbus && !strcmp(jbus->path, path)) {
+			jbus_addref(jbus);
+			return jbus;
+		}
+	}
+
 	/* create the jbus object */
 	jbus = calloc(1, sizeof *jbus);
 	if (jbus == NULL) {
@@ -463,6 +881,8 @@ struct jbus *create_jbus(struct sd_bus *sdbus, const char *path)
 
 	/* connect and init */
 	jbus->sdbus = sd_bus_ref(sdbus);
+	jbus->next = jbuses;
+	jbuses = jbus;
 
 	return jbus;
 
@@ -488,7 +908,13 @@ void jbus_unref(struct jbus *jbus)
 {
 	struct jservice *srv;
 	struct jsignal *sig;
+	struct jbus **prv;
+
 	if (!--jbus->refcount) {
+		for (prv = &jbuses ; *prv != NULL && *prv != jbus ; prv = &(*prv)->next);
+		if (*prv != NULL)
+			*prv = jbus->next;
+		free(jbus->dispatch);
 		while ((srv = jbus->services) != NULL) {
 			jbus->services = srv->next;
 			free(srv->method);
@@ -512,6 +938,19 @@ void jbus_unref(struct jbus *jbus)
 	}
 }
 
+/*
+ * Sets whether the calls of 'jbus' may use native D-Bus values.
+ * When 'native' is nul, only strings are sent. Otherwise, native
+ * values are sent after a negotiation with the server.
+ */
+void jbus_set_native(struct jbus *jbus, int native)
+{
+	if (!native)
+		jbus->native = native_no;
+	else if (jbus->native == native_no)
+		jbus->native = native_unknown;
+}
+
 /*
  * Replies an error of string 'error' to the request handled by 'smsg'.
  * Also destroys the request 'smsg' that must not be used later.
@@ -558,7 +997,26 @@ int jbus_reply_s(struct sd_bus_message *smsg, const char *reply)
  */
 int jbus_reply_j(struct sd_bus_message *smsg, struct json_object *reply)
 {
-	const char *str = json_object_to_json_string(reply);
+	int rc;
+	const char *str;
+	struct sd_bus_message *msg;
+
+	/* native reply to native calls */
+	if (sd_bus_message_has_signature(smsg, "v")) {
+		rc = sd_bus_message_new_method_return(smsg, &msg);
+		if (rc >= 0) {
+			rc = append_json(msg, reply);
+			if (rc >= 0)
+				rc = sd_bus_send(NULL, msg, NULL);
+			sd_bus_message_unref(msg);
+		}
+		if (rc >= 0) {
+			sd_bus_message_unref(smsg);
+			return 0;
+		}
+	}
+
+	str = json_object_to_json_string(reply);
 	return str ? jbus_reply_s(smsg, str) : reply_out_of_memory(smsg);
 }
 
@@ -636,12 +1094,20 @@ int jbus_add_service_j(
  * for calls to the destination derived from the path set at
  * 'jbus' creation.
  * It also allows 'jbus' to emit signals of that origin.
+ * The table dispatching the calls to the services is built here.
  *
  * Returns 0 in case of success or -1 in case of error.
  */
 int jbus_start_serving(struct jbus *jbus)
 {
-	return mkerrno(sd_bus_request_name(jbus->sdbus, jbus->name, 0));
+	int rc;
+
+	/* on failure, dispatching falls back to the list of services */
+	build_dispatch(jbus);
+
+	/* a shared jbus may already own its name */
+	rc = sd_bus_request_name(jbus->sdbus, jbus->name, 0);
+	return mkerrno(rc == -EALREADY ? 0 : rc);
 }
 
 /*
@@ -662,7 +1128,7 @@ int jbus_call_ss(
 		void (*onresp) (int, const char *, void *),
 		void *data)
 {
-	return call(jbus, method, query, onresp, NULL, data);
+	return call(jbus, method, query, NULL, onresp, NULL, data);
 }
 
 /*
@@ -683,7 +1149,7 @@ int jbus_call_sj(
 		void (*onresp) (int, struct json_object *, void *),
 		void *data)
 {
-	return call(jbus, method, query, NULL, onresp, data);
+	return call(jbus, method, query, NULL, NULL, onresp, data);
 }
 
 /*
@@ -704,12 +1170,7 @@ int jbus_call_js(
 		void (*onresp) (int, const char *, void *),
 		void *data)
 {
-	const char *str = json_object_to_json_string(query);
-	if (str == NULL) {
-		errno = ENOMEM;
-		return -1;
-	}
-	return call(jbus, method, str, onresp, NULL, data);
+	return call(jbus, method, NULL, query, onresp, NULL, data);
 }
 
 /*
@@ -730,52 +1191,105 @@ int jbus_call_jj(
 		void (*onresp) (int, struct json_object *, void *),
 		void *data)
 {
-	const char *str = json_object_to_json_string(query);
-	if (str == NULL) {
-		errno = ENOMEM;
-		return -1;
-	}
-	return call(jbus, method, str, NULL, onresp, data);
+	return call(jbus, method, NULL, query, NULL, onresp, data);
 }
 
 /*
- * Synchronous call to 'method' of 'jbus' passing the string 'query'.
- * The returned string response is returned.
+ * Synchronous call to 'method' of 'jbus' passing either the string
+ * 'query_s' or the json 'query_j'.
  *
- * Returns the string response or NULL in case of error.
+ * Returns the reply message or NULL in case of error.
  */
-char *jbus_call_ss_sync(
+static struct sd_bus_message *call_sync(
 		struct jbus *jbus,
 		const char *method,
-		const char *query)
+		const char *query_s,
+		struct json_object *query_j)
 {
-	sd_bus_message *smsg = NULL;
-        sd_bus_error error = SD_BUS_ERROR_NULL;
-	char *result = NULL;
-	const char *reply;
+	int rc;
+	sd_bus_message *msg, *smsg = NULL;
+	sd_bus_error error = SD_BUS_ERROR_NULL;
 
 	/* makes the call */
-	if (mkerrno(sd_bus_call_method(jbus->sdbus, jbus->name, jbus->path, jbus->name, method, &error, &smsg, "s", query)) < 0)
-		goto error;
+	rc = make_call(jbus, method, query_s, query_j, 1, &msg);
+	if (rc >= 0) {
+		rc = sd_bus_call(jbus->sdbus, msg, 0, &error, &smsg);
+		sd_bus_message_unref(msg);
+	}
+	sd_bus_error_free(&error);
+	if (mkerrno(rc) < 0)
+		return NULL;
 
 	/* check if error */
-	if (sd_bus_message_is_method_error(smsg, NULL))
-		goto error;
+	if (sd_bus_message_is_method_error(smsg, NULL)) {
+		sd_bus_message_unref(smsg);
+		return NULL;
+	}
+	return smsg;
+}
 
-	/* check the returned type */
-	if (!sd_bus_message_has_signature(smsg, "s")
-	  || sd_bus_message_read_basic(smsg, 's', &reply) < 0)
-		goto error;
+/*
+ * Get the string of the reply 'smsg' (that is released) of a
+ * synchronous call of 'jbus'.
+ *
+ * Returns the string response or NULL in case of error.
+ */
+static char *sync_reply_s(struct jbus *jbus, struct sd_bus_message *smsg)
+{
+	char *result = NULL;
+	const char *reply;
+	struct json_object *obj;
+
+	if (smsg == NULL)
+		return NULL;
 
-	/* get the result */
-	result = strdup(reply);
+	/* check the returned type */
+	if (sd_bus_message_has_signature(smsg, "v")) {
+		if (read_json(smsg, &obj) > 0) {
+			reply = json_object_to_json_string(obj);
+			result = reply ? strdup(reply) : NULL;
+			json_object_put(obj);
+		}
+	}
+	else if (sd_bus_message_has_signature(smsg, "s")
+	  && sd_bus_message_read_basic(smsg, 's', &reply) >= 0)
+		result = strdup(reply);
 
-error:
 	sd_bus_message_unref(smsg);
-	sd_bus_error_free(&error);
 	return result;
 }
 
+/*
+ * Get the json of the reply 'smsg' (that is released) of a
+ * synchronous call of 'jbus'.
+ *
+ * Returns the json response or NULL in case of error.
+ */
+static struct json_object *sync_reply_j(struct jbus *jbus, struct sd_bus_message *smsg)
+{
+	struct json_object *obj;
+
+	if (smsg == NULL)
+		return NULL;
+	read_message_json(jbus, smsg, 0, &obj);
+	sd_bus_message_unref(smsg);
+	return obj;
+}
+
+/*
+ * Synchronous call to 'method' of 'jbus' passing the string 'query'.
+ * The returned string response is returned.
+ *
+ * Returns the string response or NULL in case of error.
+ */
+char *jbus_call_ss_sync(
+		struct jbus *jbus,
+		const char *method,
+		const char *query)
+{
+	return sync_reply_s(jbus, call_sync(jbus, method, query, NULL));
+}
+
 /*
  * Synchronous call to 'method' of 'jbus' passing the string 'query'.
  * The returned json response is returned.
@@ -787,15 +1301,7 @@ struct json_object *jbus_call_sj_sync(
 		const char *method,
 		const char *query)
 {
-	struct json_object *obj;
-	char *str = jbus_call_ss_sync(jbus, method, query);
-	if (str == NULL)
-		obj = NULL;
-	else {
-		jparse(jbus, str, &obj);
-		free(str);
-	}
-	return obj;
+	return sync_reply_j(jbus, call_sync(jbus, method, query, NULL));
 }
 
 /*
@@ -809,12 +1315,7 @@ char *jbus_call_js_sync(
 		const char *method,
 		struct json_object *query)
 {
-	const char *str = json_object_to_json_string(query);
-	if (str == NULL) {
-		errno = ENOMEM;
-		return NULL;
-	}
-	return jbus_call_ss_sync(jbus, method, str);
+	return sync_reply_s(jbus, call_sync(jbus, method, NULL, query));
 }
 
 /*
@@ -828,12 +1329,7 @@ struct json_object *jbus_call_jj_sync(
 		const char *method,
 		struct json_object *query)
 {
-	const char *str = json_object_to_json_string(query);
-	if (str == NULL) {
-		errno = ENOMEM;
-		return NULL;
-	}
-	return jbus_call_sj_sync(jbus, method, str);
+	return sync_reply_j(jbus, call_sync(jbus, method, NULL, query));
 }
 
 /*
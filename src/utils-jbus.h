@@ -27,6 +27,7 @@ extern struct jbus *create_jbus(struct sd_bus *sdbus, const char *path);
 
 extern void jbus_addref(struct jbus *jbus);
 extern void jbus_unref(struct jbus *jbus);
+extern void jbus_set_native(struct jbus *jbus, int native);
 
 /* verbs for the clients */
 extern int jbus_call_ss(
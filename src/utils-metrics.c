@@ -0,0 +1,353 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <json-c/json.h>
+
+#include "utils-file.h"
+#include "utils-metrics.h"
+
+/* maximum count of verbs */
+#define METRICS_MAX_VERBS 64
+
+/* maximum count of events */
+#define METRICS_MAX_EVENTS 8
+
+/* maximum count of distinct error reasons per verb (one more for others) */
+#define METRICS_MAX_REASONS 8
+
+/* upper bounds of the buckets of latencies in microseconds */
+static const uint64_t bounds[] = {
+	100, 250, 500,
+	1000, 2500, 5000,
+	10000, 25000, 50000,
+	100000, 250000, 500000,
+	1000000, 2500000, 5000000,
+	10000000
+};
+
+#define METRICS_BUCKETS ((int)(sizeof bounds / sizeof *bounds))
+
+/* metrics of a verb */
+struct metrics_verb {
+	const char *name;			/* name of the verb */
+	unsigned long calls;			/* count of calls */
+	unsigned long replies;			/* count of replies */
+	unsigned long errors;			/* count of error replies */
+	const char *reasons[METRICS_MAX_REASONS]; /* the reasons of errors */
+	unsigned long reason_counts[METRICS_MAX_REASONS + 1]; /* count of errors per reason, last for others */
+	unsigned long buckets[METRICS_BUCKETS + 1]; /* count of latencies per bucket, last for greater */
+	uint64_t latency_sum_us;		/* sum of the latencies */
+	uint64_t latency_max_us;		/* maximum latency */
+	unsigned long long request_bytes;	/* sum of sizes of requests */
+	unsigned long long reply_bytes;		/* sum of sizes of replies */
+};
+
+/* metrics of an event */
+struct metrics_event {
+	const char *name;			/* name of the event */
+	unsigned long sent;			/* count of sent events */
+	unsigned long changes;			/* count of changes reported */
+};
+
+/* the metrics of the verbs */
+static struct metrics_verb verbs[METRICS_MAX_VERBS];
+
+/* count of verbs */
+static int verb_count;
+
+/* the metrics of the events */
+static struct metrics_event events[METRICS_MAX_EVENTS];
+
+/* count of events */
+static int event_count;
+
+/*
+ * Get the metrics of the verb of 'name', creating it if needed.
+ * The 'name' must remain valid.
+ * Returns the metrics or NULL when too many verbs.
+ */
+struct metrics_verb *metrics_verb_get(const char *name)
+{
+	int i;
+
+	for (i = 0 ; i < verb_count ; i++)
+		if (!strcmp(verbs[i].name, name))
+			return &verbs[i];
+	if (verb_count == METRICS_MAX_VERBS) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	verbs[verb_count].name = name;
+	return &verbs[verb_count++];
+}
+
+/*
+ * Records a call of 'verb' with a request of 'size' bytes
+ */
+void metrics_call(struct metrics_verb *verb, size_t size)
+{
+	verb->calls++;
+	verb->request_bytes += size;
+}
+
+/*
+ * Records a reply of 'verb' after 'latency_us' microseconds with
+ * a reply of 'size' bytes. When 'error' isn't NULL, the reply is
+ * an error of reason 'error' that must remain valid (constant string).
+ */
+void metrics_reply(struct metrics_verb *verb, uint64_t latency_us, const char *error, size_t size)
+{
+	int i;
+
+	verb->replies++;
+	verb->reply_bytes += size;
+
+	/* latency */
+	for (i = 0 ; i < METRICS_BUCKETS && latency_us > bounds[i] ; i++);
+	verb->buckets[i]++;
+	verb->latency_sum_us += latency_us;
+	if (latency_us > verb->latency_max_us)
+		verb->latency_max_us = latency_us;
+
+	/* error */
+	if (error) {
+		verb->errors++;
+		for (i = 0 ; i < METRICS_MAX_REASONS && verb->reasons[i] && strcmp(verb->reasons[i], error) ; i++);
+		if (i < METRICS_MAX_REASONS && !verb->reasons[i])
+			verb->reasons[i] = error;
+		verb->reason_counts[i]++;
+	}
+}
+
+/*
+ * Get the metrics of the event of 'name', creating it if needed.
+ * The 'name' must remain valid.
+ * Returns the metrics or NULL when too many events.
+ */
+struct metrics_event *metrics_event_get(const char *name)
+{
+	int i;
+
+	for (i = 0 ; i < event_count ; i++)
+		if (!strcmp(events[i].name, name))
+			return &events[i];
+	if (event_count == METRICS_MAX_EVENTS) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	events[event_count].name = name;
+	return &events[event_count++];
+}
+
+/*
+ * Records that 'event' was sent reporting 'changes' changes
+ */
+void metrics_event(struct metrics_event *event, unsigned changes)
+{
+	event->sent++;
+	event->changes += changes;
+}
+
+/*
+ * Get the metrics of the verbs and of the events as a JSON object
+ */
+struct json_object *metrics_json()
+{
+	int i, j;
+	unsigned long cumul;
+	char le[30];
+	struct metrics_verb *verb;
+	struct json_object *result, *vobj, *eobj, *obj, *errors, *histo;
+
+	result = json_object_new_object();
+	vobj = json_object_new_object();
+	eobj = json_object_new_object();
+	json_object_object_add(result, "verbs", vobj);
+	json_object_object_add(result, "events", eobj);
+	for (i = 0 ; i < event_count ; i++) {
+		obj = json_object_new_object();
+		json_object_object_add(obj, "sent", json_object_new_int64((int64_t)events[i].sent));
+		json_object_object_add(obj, "changes", json_object_new_int64((int64_t)events[i].changes));
+		json_object_object_add(eobj, events[i].name, obj);
+	}
+	for (i = 0 ; i < verb_count ; i++) {
+		verb = &verbs[i];
+		obj = json_object_new_object();
+		errors = json_object_new_object();
+		histo = json_object_new_object();
+		for (j = 0 ; j < METRICS_MAX_REASONS && verb->reasons[j] ; j++)
+			json_object_object_add(errors, verb->reasons[j], json_object_new_int64((int64_t)verb->reason_counts[j]));
+		if (verb->reason_counts[METRICS_MAX_REASONS])
+			json_object_object_add(errors, "other", json_object_new_int64((int64_t)verb->reason_counts[METRICS_MAX_REASONS]));
+		for (cumul = 0, j = 0 ; j <= METRICS_BUCKETS ; j++) {
+			cumul += verb->buckets[j];
+			if (j < METRICS_BUCKETS)
+				snprintf(le, sizeof le, "%llu", (unsigned long long)bounds[j]);
+			json_object_object_add(histo, j < METRICS_BUCKETS ? le : "+Inf", json_object_new_int64((int64_t)cumul));
+		}
+		json_object_object_add(obj, "calls", json_object_new_int64((int64_t)verb->calls));
+		json_object_object_add(obj, "in-flight", json_object_new_int64((int64_t)(verb->calls - verb->replies)));
+		json_object_object_add(obj, "errors", json_object_new_int64((int64_t)verb->errors));
+		json_object_object_add(obj, "error-reasons", errors);
+		json_object_object_add(obj, "latency-us-le", histo);
+		json_object_object_add(obj, "latency-us-mean", json_object_new_int64(verb->replies
+					? (int64_t)(verb->latency_sum_us / verb->replies) : 0));
+		json_object_object_add(obj, "latency-us-max", json_object_new_int64((int64_t)verb->latency_max_us));
+		json_object_object_add(obj, "request-bytes", json_object_new_int64((int64_t)verb->request_bytes));
+		json_object_object_add(obj, "reply-bytes", json_object_new_int64((int64_t)verb->reply_bytes));
+		json_object_object_add(vobj, verb->name, obj);
+	}
+	return result;
+}
+
+/*
+ * Prints the header of the metric 'prefix''name' of 'type' with 'help'
+ */
+static void header(FILE *f, const char *prefix, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s%s %s\n# TYPE %s%s %s\n", prefix, name, help, prefix, name, type);
+}
+
+/*
+ * Get the metrics of the verbs and of the events in the text format
+ * of Prometheus, the names of the metrics being prefixed by 'prefix'.
+ * Returns the allocated text or NULL on error.
+ */
+char *metrics_prometheus(const char *prefix)
+{
+	int i, j;
+	unsigned long cumul;
+	char *text;
+	size_t size;
+	FILE *f;
+	struct metrics_verb *verb;
+
+	text = NULL;
+	f = open_memstream(&text, &size);
+	if (!f)
+		return NULL;
+
+	header(f, prefix, "verb_calls_total", "counter", "Count of calls of the verb");
+	for (i = 0 ; i < verb_count ; i++)
+		fprintf(f, "%sverb_calls_total{verb=\"%s\"} %lu\n", prefix, verbs[i].name, verbs[i].calls);
+
+	header(f, prefix, "verb_in_flight", "gauge", "Count of calls of the verb not yet replied");
+	for (i = 0 ; i < verb_count ; i++)
+		fprintf(f, "%sverb_in_flight{verb=\"%s\"} %lu\n", prefix, verbs[i].name, verbs[i].calls - verbs[i].replies);
+
+	header(f, prefix, "verb_errors_total", "counter", "Count of errors of the verb by reason");
+	for (i = 0 ; i < verb_count ; i++) {
+		verb = &verbs[i];
+		for (j = 0 ; j < METRICS_MAX_REASONS && verb->reasons[j] ; j++)
+			fprintf(f, "%sverb_errors_total{verb=\"%s\",reason=\"%s\"} %lu\n",
+					prefix, verb->name, verb->reasons[j], verb->reason_counts[j]);
+		if (verb->reason_counts[METRICS_MAX_REASONS])
+			fprintf(f, "%sverb_errors_total{verb=\"%s\",reason=\"other\"} %lu\n",
+					prefix, verb->name, verb->reason_counts[METRICS_MAX_REASONS]);
+	}
+
+	header(f, prefix, "verb_latency_seconds", "histogram", "Latency of the replies of the verb");
+	for (i = 0 ; i < verb_count ; i++) {
+		verb = &verbs[i];
+		for (cumul = 0, j = 0 ; j < METRICS_BUCKETS ; j++) {
+			cumul += verb->buckets[j];
+			fprintf(f, "%sverb_latency_seconds_bucket{verb=\"%s\",le=\"%g\"} %lu\n",
+					prefix, verb->name, (double)bounds[j] / 1e6, cumul);
+		}
+		fprintf(f, "%sverb_latency_seconds_bucket{verb=\"%s\",le=\"+Inf\"} %lu\n", prefix, verb->name, verb->replies);
+		fprintf(f, "%sverb_latency_seconds_sum{verb=\"%s\"} %.6f\n", prefix, verb->name, (double)verb->latency_sum_us / 1e6);
+		fprintf(f, "%sverb_latency_seconds_count{verb=\"%s\"} %lu\n", prefix, verb->name, verb->replies);
+	}
+
+	header(f, prefix, "verb_request_bytes_total", "counter", "Size of the requests of the verb");
+	for (i = 0 ; i < verb_count ; i++)
+		fprintf(f, "%sverb_request_bytes_total{verb=\"%s\"} %llu\n", prefix, verbs[i].name, verbs[i].request_bytes);
+
+	header(f, prefix, "verb_reply_bytes_total", "counter", "Size of the replies of the verb");
+	for (i = 0 ; i < verb_count ; i++)
+		fprintf(f, "%sverb_reply_bytes_total{verb=\"%s\"} %llu\n", prefix, verbs[i].name, verbs[i].reply_bytes);
+
+	header(f, prefix, "event_sent_total", "counter", "Count of sent events");
+	for (i = 0 ; i < event_count ; i++)
+		fprintf(f, "%sevent_sent_total{event=\"%s\"} %lu\n", prefix, events[i].name, events[i].sent);
+
+	header(f, prefix, "event_changes_total", "counter", "Count of changes reported by the events");
+	for (i = 0 ; i < event_count ; i++)
+		fprintf(f, "%sevent_changes_total{event=\"%s\"} %lu\n", prefix, events[i].name, events[i].changes);
+
+	if (fclose(f)) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+/*
+ * Writes in 'file' the metrics in the text format of Prometheus
+ * with the 'prefix'. The file is replaced atomically so
+ * that readers (like the textfile collector of node exporter) never
+ * see it partially written.
+ * Returns 0 on success or -1 on error.
+ */
+int metrics_write_prometheus(const char *file, const char *prefix)
+{
+	int rc;
+	char *text, *tmp;
+
+	text = metrics_prometheus(prefix);
+	if (!text)
+		return -1;
+	rc = asprintf(&tmp, "%s.tmp", file);
+	if (rc >= 0) {
+		rc = putfile(tmp, text, (size_t)-1);
+		if (rc >= 0) {
+			rc = rename(tmp, file);
+			if (rc < 0)
+				unlink(tmp);
+		}
+		free(tmp);
+	}
+	free(text);
+	return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Resets the metrics of the verbs and of the events
+ */
+void metrics_reset()
+{
+	int i;
+	const char *name;
+
+	for (i = 0 ; i < verb_count ; i++) {
+		name = verbs[i].name;
+		memset(&verbs[i], 0, sizeof verbs[i]);
+		verbs[i].name = name;
+	}
+	for (i = 0 ; i < event_count ; i++)
+		events[i].sent = events[i].changes = 0;
+}
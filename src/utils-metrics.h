@@ -0,0 +1,34 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct json_object;
+struct metrics_verb;
+struct metrics_event;
+
+extern struct metrics_verb *metrics_verb_get(const char *name);
+extern void metrics_call(struct metrics_verb *verb, size_t size);
+extern void metrics_reply(struct metrics_verb *verb, uint64_t latency_us, const char *error, size_t size);
+extern struct metrics_event *metrics_event_get(const char *name);
+extern void metrics_event(struct metrics_event *event, unsigned changes);
+extern struct json_object *metrics_json();
+extern char *metrics_prometheus(const char *prefix);
+extern int metrics_write_prometheus(const char *file, const char *prefix);
+extern void metrics_reset();
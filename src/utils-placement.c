@@ -0,0 +1,196 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "verbose.h"
+#include "utils-placement.h"
+
+/*
+ * The placement policy file maps classes of applications to
+ * the directives that place their processes on the CPUs and
+ * memory nodes. It looks like:
+ *
+ *   # big cores for the HMI
+ *   [hmi]
+ *   AllowedCPUs=4-7
+ *   CPUAffinity=4-7
+ *   Nice=-5
+ *
+ * Empty lines and lines starting with # or ; are ignored.
+ */
+
+/* the directives of the keys, in the order of the enumeration */
+static const struct {
+	const char *directive;	/* name of the directive */
+	int runtime;		/* can be changed at runtime */
+} keys[placement_key_count] = {
+	[placement_allowed_cpus]          = { "AllowedCPUs",         1 },
+	[placement_allowed_memory_nodes]  = { "AllowedMemoryNodes",  1 },
+	[placement_cpu_affinity]          = { "CPUAffinity",         0 },
+	[placement_cpu_scheduling_policy] = { "CPUSchedulingPolicy", 0 },
+	[placement_nice]                  = { "Nice",                0 }
+};
+
+/*
+ * Get the name of the directive of 'key'
+ */
+const char *placement_directive(enum placement_key key)
+{
+	return keys[key].directive;
+}
+
+/*
+ * Tells whether the directive of 'key' applies to running
+ * units (cgroup properties) or only at the start of the unit
+ */
+int placement_is_runtime(enum placement_key key)
+{
+	return keys[key].runtime;
+}
+
+/*
+ * Tells whether 'class' is a valid name of class
+ */
+int placement_is_class_name(const char *class)
+{
+	if (!*class)
+		return 0;
+	while (*class) {
+		if (!isalnum((unsigned char)*class) && *class != '-' && *class != '_')
+			return 0;
+		class++;
+	}
+	return 1;
+}
+
+/*
+ * Removes the leading and trailing spaces of 'text'
+ */
+static char *trim(char *text)
+{
+	char *end;
+
+	while (isspace((unsigned char)*text))
+		text++;
+	end = text + strlen(text);
+	while (end != text && isspace((unsigned char)end[-1]))
+		end--;
+	*end = 0;
+	return text;
+}
+
+/*
+ * Records in 'placement' the 'value' of the directive 'name'
+ * found at 'line' of 'file'
+ */
+static int set_value(struct placement *placement, const char *name, const char *value, const char *file, int line)
+{
+	int i;
+	char *copy;
+
+	for (i = 0 ; i < placement_key_count && strcmp(name, keys[i].directive) ; i++);
+	if (i == placement_key_count) {
+		WARNING("unknown placement directive %s ignored (%s:%d)", name, file, line);
+		return 0;
+	}
+	copy = strdup(value);
+	if (!copy) {
+		errno = ENOMEM;
+		return -1;
+	}
+	free(placement->values[i]);
+	placement->values[i] = copy;
+	return 0;
+}
+
+/*
+ * Reads in 'placement' the directives of 'class' from the policy 'file'.
+ * The values read must be released using 'placement_release'.
+ * Returns 0 in case of success or -1 with errno set to ENOENT when
+ * the file or the class doesn't exist or to an other value on error.
+ */
+int placement_get(const char *file, const char *class, struct placement *placement)
+{
+	FILE *f;
+	char buffer[1024], *text, *value;
+	int line, found, inside;
+
+	memset(placement, 0, sizeof *placement);
+	f = fopen(file, "r");
+	if (!f)
+		return -1;
+
+	line = found = inside = 0;
+	while (fgets(buffer, (int)sizeof buffer, f)) {
+		line++;
+		text = trim(buffer);
+		if (!*text || *text == '#' || *text == ';')
+			continue;
+		if (*text == '[') {
+			value = strchr(text, ']');
+			if (!value || value[1]) {
+				WARNING("invalid placement class header (%s:%d)", file, line);
+				inside = 0;
+				continue;
+			}
+			*value = 0;
+			inside = !strcmp(trim(text + 1), class);
+			found |= inside;
+		}
+		else if (inside) {
+			value = strchr(text, '=');
+			if (!value) {
+				WARNING("invalid placement line (%s:%d)", file, line);
+				continue;
+			}
+			*value = 0;
+			if (set_value(placement, trim(text), trim(value + 1), file, line) < 0)
+				goto error;
+		}
+	}
+	fclose(f);
+	if (found)
+		return 0;
+	errno = ENOENT;
+	return -1;
+
+error:
+	fclose(f);
+	placement_release(placement);
+	return -1;
+}
+
+/*
+ * Releases the values of 'placement'
+ */
+void placement_release(struct placement *placement)
+{
+	int i;
+
+	for (i = 0 ; i < placement_key_count ; i++) {
+		free(placement->values[i]);
+		placement->values[i] = NULL;
+	}
+}
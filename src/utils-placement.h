@@ -0,0 +1,37 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+enum placement_key {
+	placement_allowed_cpus,
+	placement_allowed_memory_nodes,
+	placement_cpu_affinity,
+	placement_cpu_scheduling_policy,
+	placement_nice,
+	placement_key_count
+};
+
+struct placement {
+	char *values[placement_key_count];	/* value of the keys or NULL */
+};
+
+extern const char *placement_directive(enum placement_key key);
+extern int placement_is_runtime(enum placement_key key);
+extern int placement_is_class_name(const char *class);
+extern int placement_get(const char *file, const char *class, struct placement *placement);
+extern void placement_release(struct placement *placement);
+
@@ -0,0 +1,244 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "utils-file.h"
+#include "utils-readahead.h"
+
+/* maximum count of files of a list */
+#define READAHEAD_MAX_FILES 1024
+
+/*
+ * A readahead list records the files of a directory used by
+ * processes. The names are relative to the directory.
+ */
+struct readahead_list {
+	char *dir;		/* the directory */
+	size_t dirlen;		/* length of the directory */
+	int count;		/* count of files */
+	char *files[READAHEAD_MAX_FILES]; /* the files */
+};
+
+/*
+ * Creates a list for the files of 'dir'.
+ * Returns the list or NULL in case of error.
+ */
+struct readahead_list *readahead_list_create(const char *dir)
+{
+	struct readahead_list *list;
+
+	list = malloc(sizeof *list);
+	if (list) {
+		list->dirlen = strlen(dir);
+		while (list->dirlen > 1 && dir[list->dirlen - 1] == '/')
+			list->dirlen--;
+		list->dir = strndup(dir, list->dirlen);
+		list->count = 0;
+		if (!list->dir) {
+			free(list);
+			list = NULL;
+		}
+	}
+	if (!list)
+		errno = ENOMEM;
+	return list;
+}
+
+/*
+ * Destroys the 'list'
+ */
+void readahead_list_destroy(struct readahead_list *list)
+{
+	if (list) {
+		while (list->count)
+			free(list->files[--list->count]);
+		free(list->dir);
+		free(list);
+	}
+}
+
+/*
+ * Adds to 'list' the file of 'path' if it is in the directory of the list.
+ * Returns 1 if added, 0 if not added or -1 in case of error.
+ */
+static int add_path(struct readahead_list *list, const char *path)
+{
+	int i;
+	char *file;
+
+	if (strncmp(path, list->dir, list->dirlen) || path[list->dirlen] != '/')
+		return 0;
+	path += list->dirlen + 1;
+	if (!*path || strchr(path, '\n') || strstr(path, " (deleted)"))
+		return 0;
+	for (i = 0 ; i < list->count ; i++)
+		if (!strcmp(path, list->files[i]))
+			return 0;
+	if (list->count == READAHEAD_MAX_FILES)
+		return 0;
+	file = strdup(path);
+	if (!file) {
+		errno = ENOMEM;
+		return -1;
+	}
+	list->files[list->count++] = file;
+	return 1;
+}
+
+/*
+ * Adds to 'list' the files of its directory mapped in memory or
+ * opened by the process 'pid'.
+ * Returns the count of files added or -1 in case of error.
+ */
+int readahead_list_sample(struct readahead_list *list, int pid)
+{
+	int rc, count, dfd;
+	FILE *file;
+	DIR *dir;
+	struct dirent *ent;
+	char buffer[PATH_MAX + 128], *path;
+	ssize_t len;
+
+	/* files mapped in memory: libraries and executables */
+	snprintf(buffer, sizeof buffer, "/proc/%d/maps", pid);
+	file = fopen(buffer, "r");
+	if (!file)
+		return -1;
+	count = 0;
+	while (fgets(buffer, (int)sizeof buffer, file)) {
+		path = strchr(buffer, '/');
+		if (path) {
+			path[strcspn(path, "\n")] = 0;
+			rc = add_path(list, path);
+			if (rc < 0)
+				break;
+			count += rc;
+		}
+	}
+	fclose(file);
+
+	/* opened files */
+	snprintf(buffer, sizeof buffer, "/proc/%d/fd", pid);
+	dir = opendir(buffer);
+	if (dir) {
+		dfd = dirfd(dir);
+		while ((ent = readdir(dir))) {
+			if (ent->d_name[0] == '.')
+				continue;
+			len = readlinkat(dfd, ent->d_name, buffer, sizeof buffer - 1);
+			if (len > 0) {
+				buffer[len] = 0;
+				rc = add_path(list, buffer);
+				if (rc < 0)
+					break;
+				count += rc;
+			}
+		}
+		closedir(dir);
+	}
+	return count;
+}
+
+/*
+ * Returns the count of files of the 'list'
+ */
+int readahead_list_count(struct readahead_list *list)
+{
+	return list->count;
+}
+
+static int cmp_files(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Saves the 'list' in 'file', one name per line, sorted.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+int readahead_list_save(struct readahead_list *list, const char *file)
+{
+	int i, rc;
+	size_t size;
+	char *content, *write;
+
+	qsort(list->files, (size_t)list->count, sizeof *list->files, cmp_files);
+	size = 1;
+	for (i = 0 ; i < list->count ; i++)
+		size += strlen(list->files[i]) + 1;
+	content = write = malloc(size);
+	if (!content) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0 ; i < list->count ; i++) {
+		write = stpcpy(write, list->files[i]);
+		*write++ = '\n';
+	}
+	*write = 0;
+	rc = putfile(file, content, (size_t)(write - content));
+	free(content);
+	return rc;
+}
+
+/*
+ * Asks the kernel to read ahead the files of 'dir' listed in 'file'.
+ * The reads are done asynchronously by the kernel so the function
+ * doesn't wait for them.
+ * Returns the count of files read ahead or -1 in case of error.
+ */
+int readahead_replay(const char *dir, const char *file)
+{
+	int dfd, fd, count;
+	char *content, *name, *next;
+
+	if (getfile(file, &content, NULL) < 0)
+		return -1;
+	dfd = open(dir, O_DIRECTORY|O_PATH|O_CLOEXEC);
+	if (dfd < 0) {
+		free(content);
+		return -1;
+	}
+	count = 0;
+	for (name = content ; *name ; name = next) {
+		next = name + strcspn(name, "\n");
+		if (*next)
+			*next++ = 0;
+		if (*name && *name != '/' && strncmp(name, "../", 3) && !strstr(name, "/../")) {
+			fd = openat(dfd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+			if (fd >= 0) {
+				if (!posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED))
+					count++;
+				close(fd);
+			}
+		}
+	}
+	close(dfd);
+	free(content);
+	return count;
+}
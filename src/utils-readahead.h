@@ -0,0 +1,26 @@
+/*
+ Copyright (C) 2015-2020 IoT.bzh
+
+ author: José Bollo <jose.bollo@iot.bzh>
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+struct readahead_list;
+
+extern struct readahead_list *readahead_list_create(const char *dir);
+extern void readahead_list_destroy(struct readahead_list *list);
+extern int readahead_list_sample(struct readahead_list *list, int pid);
+extern int readahead_list_count(struct readahead_list *list);
+extern int readahead_list_save(struct readahead_list *list, const char *file);
+extern int readahead_replay(const char *dir, const char *file);
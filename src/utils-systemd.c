@@ -18,6 +18,10 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -27,13 +31,17 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <sched.h>
 
 #ifndef NO_LIBSYSTEMD
 # include <systemd/sd-bus.h>
 # include <systemd/sd-bus-protocol.h>
+# include <systemd/sd-event.h>
 #else
   struct sd_bus;
   struct sd_bus_message;
+  struct sd_event_source;
+  struct sd_bus_slot;
   typedef struct { const char *name; const char *message; } sd_bus_error;
 # define sd_bus_unref(...)                ((void)0)
 # define sd_bus_default_user(p)           ((*(p)=NULL),(-ENOTSUP))
@@ -44,33 +52,92 @@
 # define sd_bus_message_unref(...)        (NULL)
 # define sd_bus_get_property_string(...)  (-ENOTSUP)
 # define sd_bus_get_property_trivial(...) (-ENOTSUP)
+# define sd_bus_message_read(...)         (-ENOTSUP)
+# define sd_bus_message_get_member(...)   (NULL)
+# define sd_bus_add_match(...)            (-ENOTSUP)
+# define sd_bus_attach_event(...)         (-ENOTSUP)
+# define sd_bus_new(p)                    ((*(p)=NULL),(-ENOTSUP))
+# define sd_bus_set_address(...)          (-ENOTSUP)
+# define sd_bus_set_bus_client(...)       (-ENOTSUP)
+# define sd_bus_start(...)                (-ENOTSUP)
+# define sd_bus_flush_close_unref(...)    (NULL)
+# define sd_event_now(...)                (-ENOTSUP)
+# define sd_event_add_time(...)           (-ENOTSUP)
+# define sd_event_source_unref(...)       (NULL)
+# define sd_bus_message_new_method_call(...) (-ENOTSUP)
+# define sd_bus_message_appendv(...)      (-ENOTSUP)
+# define sd_bus_call(...)                 (-ENOTSUP)
+# define sd_bus_call_async(...)           (-ENOTSUP)
+# define sd_bus_message_is_method_error(...) (0)
+# define sd_bus_message_get_errno(...)    (ENOTSUP)
+# define sd_bus_error_free(...)           ((void)0)
+# define sd_bus_message_enter_container(...) (-ENOTSUP)
+# define sd_bus_message_exit_container(...) (-ENOTSUP)
+# define sd_bus_message_skip(...)         (-ENOTSUP)
+# define sd_bus_message_append(...)       (-ENOTSUP)
+# define sd_bus_message_append_basic(...) (-ENOTSUP)
+# define sd_bus_message_append_array(...) (-ENOTSUP)
+# define sd_bus_message_open_container(...) (-ENOTSUP)
+# define sd_bus_message_close_container(...) (-ENOTSUP)
+# define sd_bus_slot_unref(...)           (NULL)
+# define sd_bus_process(...)              (-ENOTSUP)
+# define sd_bus_wait(...)                 (-ENOTSUP)
 #endif
 
+#include "verbose.h"
 #include "utils-systemd.h"
 
 #if !defined(SYSTEMD_UNITS_ROOT)
 # define SYSTEMD_UNITS_ROOT "/usr/local/lib/systemd"
 #endif
 
+#if !defined(SYSTEMD_CGROUP_MODE)
+# define SYSTEMD_CGROUP_MODE SysD_Cgroup_On
+#endif
+
+#if !defined(SYSTEMD_JOB_WAIT_MS)
+# define SYSTEMD_JOB_WAIT_MS 10000
+#endif
+
+#if !defined(FWK_USERS_RUNDIR)
+# define FWK_USERS_RUNDIR "/run/user"
+#endif
+
+#if !defined(SYSTEMD_USER_BUS_IDLE_SECONDS)
+# define SYSTEMD_USER_BUS_IDLE_SECONDS 60
+#endif
+
 static const char sdb_path[] = "/org/freedesktop/systemd1";
 static const char sdb_destination[] = "org.freedesktop.systemd1";
 static const char sdbi_manager[] = "org.freedesktop.systemd1.Manager";
 static const char sdbi_unit[] = "org.freedesktop.systemd1.Unit";
 static const char sdbi_service[] = "org.freedesktop.systemd1.Service";
 static const char sdbi_job[] = "org.freedesktop.systemd1.Job";
+static const char sdbi_properties[] = "org.freedesktop.DBus.Properties";
+static const char sdbm_get[] = "Get";
+static const char sdbm_get_all[] = "GetAll";
 static const char sdbj_state[] = "State";
 static const char sdbm_reload[] = "Reload";
 static const char sdbm_start_unit[] = "StartUnit";
 static const char sdbm_restart_unit[] = "RestartUnit";
 static const char sdbm_stop_unit[] = "StopUnit";
+static const char sdbm_start_transient_unit[] = "StartTransientUnit";
 static const char sdbm_start[] = "Start";
 static const char sdbm_restart[] = "Restart";
 static const char sdbm_stop[] = "Stop";
+static const char sdbm_kill[] = "Kill";
+static const char sdbm_set_properties[] = "SetProperties";
 static const char sdbm_get_unit[] = "GetUnit";
 static const char sdbm_get_unit_by_pid[] = "GetUnitByPID";
 static const char sdbm_load_unit[] = "LoadUnit";
+static const char sdbm_subscribe[] = "Subscribe";
+static const char sdbs_unit_removed[] = "UnitRemoved";
+static const char sdbs_reloading[] = "Reloading";
+static const char sdbs_job_removed[] = "JobRemoved";
+static const char sdbs_properties_changed[] = "PropertiesChanged";
 static const char sdbp_active_state[] = "ActiveState";
 static const char sdbp_exec_main_pid[] = "ExecMainPID";
+static const char sdbp_control_group[] = "ControlGroup";
 
 static const char *sds_state_names[] = {
 	NULL,
@@ -91,6 +158,65 @@ static const char *sds_job_state_names[] = {
 static struct sd_bus *sysbus;
 static struct sd_bus *usrbus;
 
+/* mode of the fast path through cgroup filesystem */
+static enum SysD_Cgroup_Mode cgroup_mode = SYSTEMD_CGROUP_MODE;
+
+/* root of the cgroup hierarchy of systemd */
+static const char *cgroup_root;
+
+/* root of the process filesystem */
+static const char *proc_root = "/proc";
+
+/* statistics of the fast path through cgroup filesystem */
+static struct systemd_cgroup_stats cgroup_stats;
+
+/* the event loop to attach to buses or NULL */
+static struct sd_event *evloop;
+
+/*
+ * Pool of connections to the user managers of uids
+ */
+struct user_bus {
+	struct user_bus *next;		/* next connection of the pool */
+	struct sd_bus *bus;		/* the connection */
+	int uid;			/* uid of the user */
+	uint64_t last_use;		/* time of last use (microseconds) */
+};
+
+/* the pool of connections to the user managers */
+static struct user_bus *user_buses;
+
+/* the timer for closing idle connections */
+static struct sd_event_source *user_bus_timer;
+
+/* statistics of the pool */
+static struct systemd_user_bus_stats user_bus_stats;
+
+/*
+ * Cache of the dbus paths of the units
+ */
+#define DPATH_CACHE_CAPACITY  256
+#define DPATH_CACHE_BUCKETS   64
+
+struct dpath_entry {
+	struct dpath_entry *hnext;	/* next entry in the hash bucket */
+	struct dpath_entry *prev;	/* previous entry in LRU order */
+	struct dpath_entry *next;	/* next entry in LRU order */
+	char *dpath;			/* the dbus path of the unit */
+	char *cgroup;			/* the control group of the unit or NULL */
+	unsigned hash;			/* hash of the key */
+	int isuser;			/* is the unit a user unit? */
+	int uid;			/* uid of the unit or -1 */
+	char name[1];			/* name of the unit */
+};
+
+static struct {
+	struct dpath_entry *buckets[DPATH_CACHE_BUCKETS];
+	struct dpath_entry *mru;	/* most recently used */
+	struct dpath_entry *lru;	/* least recently used */
+	struct systemd_dpath_cache_stats stats;
+} dpcache;
+
 /*
  * Translate systemd errors to errno errors
  */
@@ -111,8 +237,226 @@ static int errno2sderr(int rc)
 }
 
 /*
- * Returns in 'ret' either the system bus (if isuser==0)
- * or the user bus (if isuser!=0).
+ * Returns the key of the scope 'isuser': the scope of the user manager
+ * of the current user, systemd_user_scope(getuid()), is the scope 1 as
+ * both address the same bus whose signals are received with the key 1.
+ */
+static int scope_key(int isuser)
+{
+	return isuser > 0 || (isuser < 0 && -1 - isuser == (int)getuid()) ? 1 : isuser;
+}
+
+static int watch_bus(struct sd_bus *bus, int isuser);
+static void dpath_invalidate(int isuser, const char *name);
+static struct dpath_entry *dpath_get(int isuser, int uid, const char *name);
+static struct dpath_entry *dpath_search_dpath(int isuser, const char *dpath);
+static char *cgroup_dpath_by_pid(int isuser, unsigned pid);
+static int cgroup_pid_of_dpath(struct sd_bus *bus, int isuser, const char *dpath);
+
+/********************************************************************
+ * pool of connections to user managers
+ *******************************************************************/
+
+/*
+ * Returns the current monotonic time in microseconds
+ */
+static uint64_t monotonic_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns the current time of the event loop in microseconds
+ */
+static uint64_t user_bus_now()
+{
+	uint64_t now;
+
+	if (!evloop || sd_event_now(evloop, CLOCK_MONOTONIC, &now) < 0)
+		now = monotonic_now();
+	return now;
+}
+
+static void arm_user_bus_timer(uint64_t usec);
+
+/*
+ * Closes the connections of the pool unused for
+ * SYSTEMD_USER_BUS_IDLE_SECONDS
+ */
+static int on_user_bus_timer(struct sd_event_source *source, uint64_t usec, void *closure)
+{
+	uint64_t now, next;
+	struct user_bus *ubus, **prv;
+
+	user_bus_timer = sd_event_source_unref(user_bus_timer);
+	now = user_bus_now();
+	next = 0;
+	prv = &user_buses;
+	while ((ubus = *prv)) {
+		if (now - ubus->last_use >= SYSTEMD_USER_BUS_IDLE_SECONDS * 1000000ULL) {
+			*prv = ubus->next;
+			dpath_invalidate(systemd_user_scope(ubus->uid), NULL);
+			sd_bus_flush_close_unref(ubus->bus);
+			free(ubus);
+			user_bus_stats.closed++;
+			user_bus_stats.count--;
+		} else {
+			if (!next || ubus->last_use < next)
+				next = ubus->last_use;
+			prv = &ubus->next;
+		}
+	}
+	if (next)
+		arm_user_bus_timer(next + SYSTEMD_USER_BUS_IDLE_SECONDS * 1000000ULL);
+	return 0;
+}
+
+/*
+ * Arms the timer of idle connections for the time 'usec'
+ */
+static void arm_user_bus_timer(uint64_t usec)
+{
+	int rc;
+
+	if (evloop && !user_bus_timer) {
+		rc = sd_event_add_time(evloop, &user_bus_timer, CLOCK_MONOTONIC,
+				usec, 1000000, on_user_bus_timer, NULL);
+		if (rc < 0)
+			user_bus_timer = NULL;
+	}
+}
+
+/*
+ * Opens a connection to the user manager of 'uid'
+ * Returns 0 in case of success or -1 in case of error
+ */
+static int open_user_bus(int uid, struct sd_bus **ret)
+{
+	int rc;
+	char address[256];
+	struct sd_bus *bus;
+
+	rc = snprintf(address, sizeof address, "unix:path=%s/%d/bus", FWK_USERS_RUNDIR, uid);
+	if (rc < 0 || rc >= (int)sizeof address)
+		return seterrno(EINVAL);
+
+	rc = sd_bus_new(&bus);
+	if (rc < 0)
+		goto error;
+	rc = sd_bus_set_address(bus, address);
+	if (rc >= 0)
+		rc = sd_bus_set_bus_client(bus, 1);
+	if (rc >= 0)
+		rc = sd_bus_start(bus);
+	if (rc < 0) {
+		sd_bus_unref(bus);
+		goto error;
+	}
+	*ret = bus;
+	return 0;
+error:
+	return sderr2errno(rc);
+}
+
+/*
+ * Returns in 'ret' the connection to the user manager of 'uid'.
+ * The connection is taken from the pool or opened and added to the pool.
+ * Returns 0 in case of success or -1 in case of error
+ */
+static int get_user_bus(int uid, struct sd_bus **ret)
+{
+	int rc;
+	struct user_bus *ubus, **prv;
+
+	/* search in the pool, moving the found connection at head */
+	prv = &user_buses;
+	while ((ubus = *prv) && ubus->uid != uid)
+		prv = &ubus->next;
+	if (ubus) {
+		*prv = ubus->next;
+		user_bus_stats.reused++;
+	} else {
+		/* open a new connection */
+		ubus = malloc(sizeof *ubus);
+		if (!ubus)
+			return seterrno(ENOMEM);
+		rc = open_user_bus(uid, &ubus->bus);
+		if (rc < 0) {
+			free(ubus);
+			user_bus_stats.failed++;
+			return rc;
+		}
+		ubus->uid = uid;
+		watch_bus(ubus->bus, systemd_user_scope(uid));
+		user_bus_stats.opened++;
+		user_bus_stats.count++;
+	}
+	ubus->next = user_buses;
+	user_buses = ubus;
+	ubus->last_use = user_bus_now();
+	arm_user_bus_timer(ubus->last_use + SYSTEMD_USER_BUS_IDLE_SECONDS * 1000000ULL);
+	*ret = ubus->bus;
+	return 0;
+}
+
+/*
+ * Sets the connection 'bus' to the user manager of 'uid' in the pool,
+ * replacing the pooled one if any. A NULL 'bus' removes it from the pool.
+ * Returns 0 in case of success or -1 in case of error
+ */
+static int set_user_bus(int uid, struct sd_bus *bus)
+{
+	struct user_bus *ubus, **prv;
+
+	/* search in the pool */
+	prv = &user_buses;
+	while ((ubus = *prv) && ubus->uid != uid)
+		prv = &ubus->next;
+	if (ubus) {
+		sd_bus_unref(ubus->bus);
+		*prv = ubus->next;
+		if (!bus) {
+			free(ubus);
+			user_bus_stats.count--;
+			return 0;
+		}
+	} else if (bus) {
+		ubus = malloc(sizeof *ubus);
+		if (!ubus)
+			return seterrno(ENOMEM);
+		ubus->uid = uid;
+		user_bus_stats.count++;
+	} else
+		return 0;
+
+	ubus->bus = bus;
+	watch_bus(bus, systemd_user_scope(uid));
+	ubus->next = user_buses;
+	user_buses = ubus;
+	ubus->last_use = user_bus_now();
+	arm_user_bus_timer(ubus->last_use + SYSTEMD_USER_BUS_IDLE_SECONDS * 1000000ULL);
+	return 0;
+}
+
+/*
+ * Get the statistics of the pool of connections to user managers
+ */
+void systemd_user_bus_stats(struct systemd_user_bus_stats *stats)
+{
+	*stats = user_bus_stats;
+}
+
+/********************************************************************
+ * default connections
+ *******************************************************************/
+
+/*
+ * Returns in 'ret' either the system bus (if isuser==0),
+ * the user bus (if isuser > 0) or the bus of the user manager
+ * of the uid of the scope (if isuser < 0, see systemd_user_scope).
  * Returns 0 in case of success or -1 in case of error
  */
 int systemd_get_bus(int isuser, struct sd_bus **ret)
@@ -120,6 +464,10 @@ int systemd_get_bus(int isuser, struct sd_bus **ret)
 	int rc;
 	struct sd_bus *bus;
 
+	isuser = scope_key(isuser);
+	if (isuser < 0)
+		return get_user_bus(-1 - isuser, ret);
+
 	bus = isuser ? usrbus : sysbus;
 	if (bus)
 		*ret = bus;
@@ -128,23 +476,42 @@ int systemd_get_bus(int isuser, struct sd_bus **ret)
 		if (rc < 0)
 			goto error;
 		usrbus = *ret;
+		watch_bus(usrbus, 1);
 	} else {
 		rc = sd_bus_default_system(ret);
 		if (rc < 0)
 			goto error;
 		sysbus = *ret;
+		watch_bus(sysbus, 0);
 	}
 	return 0;
 error:
 	return sderr2errno(rc);
 }
 
+/*
+ * Sets the 'bus' of the scope 'isuser': the system bus (if isuser==0),
+ * the user bus (if isuser > 0) or the bus of the user manager of the
+ * uid of the scope (if isuser < 0, see systemd_user_scope).
+ * The previous bus of the scope is released.
+ */
 void systemd_set_bus(int isuser, struct sd_bus *bus)
 {
-	struct sd_bus **target = isuser ? &usrbus : &sysbus;
+	struct sd_bus **target;
+
+	isuser = scope_key(isuser);
+	dpath_invalidate(isuser, NULL);
+	if (isuser < 0) {
+		if (set_user_bus(-1 - isuser, bus) < 0)
+			ERROR("can't set the bus of uid %d: %m", -1 - isuser);
+		return;
+	}
+	target = isuser ? &usrbus : &sysbus;
 	if (*target)
 		sd_bus_unref(*target);
 	*target = bus;
+	if (bus)
+		watch_bus(bus, isuser);
 }
 
 #if 0
@@ -269,6 +636,168 @@ static int unit_pid(struct sd_bus *bus, const char *dpath)
 	return rc < 0 ? rc : (int)u;
 }
 
+/*
+ * Get the state of the name 'st' or SysD_State_INVALID if unknown.
+ * The candidate is selected by the first letter and the length
+ * and then checked by a single comparison.
+ */
+static enum SysD_State state_of_name(const char *st)
+{
+	enum SysD_State resu;
+
+	switch (st[0]) {
+	case 'a':
+		resu = st[6] ? SysD_State_Activating : SysD_State_Active;
+		break;
+	case 'd':
+		resu = SysD_State_Deactivating;
+		break;
+	case 'f':
+		resu = SysD_State_Failed;
+		break;
+	case 'i':
+		resu = SysD_State_Inactive;
+		break;
+	case 'r':
+		resu = SysD_State_Reloading;
+		break;
+	default:
+		resu = SysD_State_INVALID;
+		break;
+	}
+	if (resu == SysD_State_INVALID || strcmp(st, sds_state_names[resu])) {
+		errno = EBADMSG;
+		resu = SysD_State_INVALID;
+	}
+	return resu;
+}
+
+/*
+ * Get the job state of the name 'st' or SysD_Job_State_INVALID if unknown
+ */
+static enum SysD_Job_State job_state_of_name(const char *st)
+{
+	if (!strcmp(st, sds_job_state_names[SysD_Job_State_Waiting]))
+		return SysD_Job_State_Waiting;
+	if (!strcmp(st, sds_job_state_names[SysD_Job_State_Running]))
+		return SysD_Job_State_Running;
+	errno = EBADMSG;
+	return SysD_Job_State_INVALID;
+}
+
+/*
+ * Properties read for the status of units, sorted by name
+ */
+static const struct status_property {
+	const char *name;	/* name of the property */
+	char type;		/* dbus type of the property */
+	size_t offset;		/* offset in the status structure */
+} status_properties[] = {
+	{ "ActiveEnterTimestamp",   't', offsetof(struct SysD_Unit_Status, active_enter) },
+	{ "ActiveExitTimestamp",    't', offsetof(struct SysD_Unit_Status, active_exit) },
+	{ "ActiveState",            's', offsetof(struct SysD_Unit_Status, state) },
+	{ "ExecMainCode",           'i', offsetof(struct SysD_Unit_Status, exec_main_code) },
+	{ "ExecMainStatus",         'i', offsetof(struct SysD_Unit_Status, exec_main_status) },
+	{ "InactiveEnterTimestamp", 't', offsetof(struct SysD_Unit_Status, inactive_enter) },
+	{ "MainPID",                'u', offsetof(struct SysD_Unit_Status, main_pid) },
+	{ "MemoryCurrent",          't', offsetof(struct SysD_Unit_Status, memory_current) },
+	{ "MemoryPeak",             't', offsetof(struct SysD_Unit_Status, memory_peak) },
+	{ "StateChangeTimestamp",   't', offsetof(struct SysD_Unit_Status, state_change) },
+	{ "SubState",               's', offsetof(struct SysD_Unit_Status, sub_state) }
+};
+
+static int cmp_status_property(const void *key, const void *item)
+{
+	return strcmp(key, ((const struct status_property*)item)->name);
+}
+
+/*
+ * Updates 'status' with the properties of the array a{sv} of 'msg'
+ */
+static int merge_status(struct sd_bus_message *msg, struct SysD_Unit_Status *status)
+{
+	int rc;
+	char *field;
+	const char *name, *str;
+	const struct status_property *prop;
+	uint32_t u32;
+
+	rc = sd_bus_message_enter_container(msg, 'a', "{sv}");
+	while (rc >= 0 && (rc = sd_bus_message_enter_container(msg, 'e', "sv")) > 0) {
+		rc = sd_bus_message_read_basic(msg, 's', &name);
+		if (rc < 0)
+			break;
+		prop = bsearch(name, status_properties,
+				sizeof status_properties / sizeof *status_properties,
+				sizeof *status_properties, cmp_status_property);
+		if (!prop)
+			rc = sd_bus_message_skip(msg, "v");
+		else {
+			field = (char*)status + prop->offset;
+			switch (prop->type) {
+			case 's':
+				rc = sd_bus_message_read(msg, "v", "s", &str);
+				if (rc < 0)
+					break;
+				if (prop->offset == offsetof(struct SysD_Unit_Status, state))
+					status->state = state_of_name(str);
+				else
+					strncpy(status->sub_state, str, sizeof status->sub_state - 1);
+				break;
+			case 'u':
+				rc = sd_bus_message_read(msg, "v", "u", &u32);
+				if (rc >= 0)
+					*(int*)field = (int)u32;
+				break;
+			case 'i':
+				rc = sd_bus_message_read(msg, "v", "i", (int*)field);
+				break;
+			default:
+				rc = sd_bus_message_read(msg, "v", "t", (uint64_t*)field);
+				break;
+			}
+		}
+		if (rc >= 0)
+			rc = sd_bus_message_exit_container(msg);
+	}
+	return rc < 0 ? rc : sd_bus_message_exit_container(msg);
+}
+
+/*
+ * Reads in 'status' the properties of the reply 'msg' of GetAll
+ */
+static int read_status(struct sd_bus_message *msg, struct SysD_Unit_Status *status)
+{
+	int rc;
+
+	memset(status, 0, sizeof *status);
+	status->state = SysD_State_INVALID;
+	status->memory_current = status->memory_peak = UINT64_MAX;
+
+	rc = merge_status(msg, status);
+	if (rc >= 0 && status->state == SysD_State_INVALID)
+		rc = -EBADMSG;
+	return rc;
+}
+
+/*
+ * Get in 'status' the status of the unit of 'dpath' in one round trip
+ */
+static int unit_status(struct sd_bus *bus, const char *dpath, struct SysD_Unit_Status *status)
+{
+	int rc;
+	struct sd_bus_message *ret = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	/* the empty interface name gets properties of all interfaces */
+	rc = sd_bus_call_method(bus, sdb_destination, dpath, sdbi_properties, sdbm_get_all, &err, &ret, "s", "");
+	if (rc >= 0)
+		rc = read_status(ret, status);
+	sd_bus_message_unref(ret);
+	sd_bus_error_free(&err);
+	return sderr2errno(rc);
+}
+
 static enum SysD_State unit_state(struct sd_bus *bus, const char *dpath)
 {
 	int rc;
@@ -281,34 +810,25 @@ static enum SysD_State unit_state(struct sd_bus *bus, const char *dpath)
 	if (rc < 0) {
 		errno = -rc;
 	} else {
-		switch (st[0]) {
-		case 'a':
-			if (!strcmp(st, sds_state_names[SysD_State_Active]))
-				resu = SysD_State_Active;
-			else if (!strcmp(st, sds_state_names[SysD_State_Activating]))
-				resu = SysD_State_Activating;
-			break;
-		case 'd':
-			if (!strcmp(st, sds_state_names[SysD_State_Deactivating]))
-				resu = SysD_State_Deactivating;
-			break;
-		case 'f':
-			if (!strcmp(st, sds_state_names[SysD_State_Failed]))
-				resu = SysD_State_Failed;
-			break;
-		case 'i':
-			if (!strcmp(st, sds_state_names[SysD_State_Inactive]))
-				resu = SysD_State_Inactive;
-			break;
-		case 'r':
-			if (!strcmp(st, sds_state_names[SysD_State_Reloading]))
-				resu = SysD_State_Reloading;
-			break;
-		default:
-			break;
-		}
-		if (resu == NULL)
-			errno = EBADMSG;
+		resu = state_of_name(st);
+		free(st);
+	}
+	return resu;
+}
+
+static enum SysD_Job_State job_state(struct sd_bus *bus, const char *jpath)
+{
+	int rc;
+	char *st;
+	enum SysD_Job_State resu;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	resu = SysD_Job_State_INVALID;
+	rc = sd_bus_get_property_string(bus, sdb_destination, jpath, sdbi_job, sdbj_state, &err, &st);
+	if (rc < 0) {
+		errno = -rc;
+	} else {
+		resu = job_state_of_name(st);
 		free(st);
 	}
 	return resu;
@@ -382,6 +902,23 @@ static int unit_restart(struct sd_bus *bus, const char *dpath)
 	return rc;
 }
 
+static char *unit_job(struct sd_bus *bus, const char *dpath, const char *method)
+{
+	int rc;
+	struct sd_bus_message *ret = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	rc = sd_bus_call_method(bus, sdb_destination, dpath, sdbi_unit, method, &err, &ret, "s", "replace");
+	if (rc < 0)
+		goto error;
+
+	return get_dpath(ret);
+error:
+	sd_bus_message_unref(ret);
+	sderr2errno(rc);
+	return NULL;
+}
+
 static int unit_stop(struct sd_bus *bus, const char *dpath)
 {
 	int rc;
@@ -393,6 +930,18 @@ static int unit_stop(struct sd_bus *bus, const char *dpath)
 	return rc;
 }
 
+static int unit_kill(struct sd_bus *bus, const char *dpath, const char *who, int sig)
+{
+	int rc;
+	struct sd_bus_message *ret = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	rc = sd_bus_call_method(bus, sdb_destination, dpath, sdbi_unit, sdbm_kill, &err, &ret, "si", who, sig);
+	sd_bus_message_unref(ret);
+	sd_bus_error_free(&err);
+	return sderr2errno(rc);
+}
+
 static int unit_start_name(struct sd_bus *bus, const char *name)
 {
 	int rc;
@@ -493,6 +1042,7 @@ int systemd_daemon_reload(int isuser)
 		/* TODO: more diagnostic... */
 		rc = sd_bus_call_method(bus, sdb_destination, sdb_path, sdbi_manager, sdbm_reload, &err, &ret, NULL);
 		sd_bus_message_unref(ret);
+		dpath_invalidate(isuser, NULL);
 	}
 	return rc;
 }
@@ -575,8 +1125,34 @@ char *systemd_unit_dpath_by_name(int isuser, const char *name, int load)
 char *systemd_unit_dpath_by_pid(int isuser, unsigned pid)
 {
 	struct sd_bus *bus;
-
-	return systemd_get_bus(isuser, &bus) < 0 ? NULL : get_unit_dpath_by_pid(bus, pid);
+	char *fast, *slow;
+
+	if (systemd_get_bus(isuser, &bus) < 0)
+		return NULL;
+	if (cgroup_mode == SysD_Cgroup_Off)
+		return get_unit_dpath_by_pid(bus, pid);
+
+	fast = cgroup_dpath_by_pid(isuser, pid);
+	if (!fast && errno != ENOENT) {
+		/* fallback */
+		cgroup_stats.fallbacks++;
+		return get_unit_dpath_by_pid(bus, pid);
+	}
+	if (fast)
+		cgroup_stats.hits++;
+	else
+		cgroup_stats.notfound++;
+	if (cgroup_mode != SysD_Cgroup_Validate)
+		return fast;
+
+	/* cross-check */
+	slow = get_unit_dpath_by_pid(bus, pid);
+	if (fast && slow ? strcmp(fast, slow) : fast != slow) {
+		cgroup_stats.mismatches++;
+		WARNING("cgroup mismatch for unit of pid %u: %s != %s", pid, fast ?: "none", slow ?: "none");
+	}
+	free(fast);
+	return slow;
 }
 
 int systemd_unit_start_dpath(int isuser, const char *dpath)
@@ -588,6 +1164,20 @@ int systemd_unit_start_dpath(int isuser, const char *dpath)
 	return rc < 0 ? rc : unit_start(bus, dpath);
 }
 
+char *systemd_unit_start_job_dpath(int isuser, const char *dpath)
+{
+	struct sd_bus *bus;
+
+	return systemd_get_bus(isuser, &bus) < 0 ? NULL : unit_job(bus, dpath, sdbm_start);
+}
+
+char *systemd_unit_stop_job_dpath(int isuser, const char *dpath)
+{
+	struct sd_bus *bus;
+
+	return systemd_get_bus(isuser, &bus) < 0 ? NULL : unit_job(bus, dpath, sdbm_stop);
+}
+
 int systemd_unit_restart_dpath(int isuser, const char *dpath)
 {
 	int rc;
@@ -606,6 +1196,18 @@ int systemd_unit_stop_dpath(int isuser, const char *dpath)
 	return rc < 0 ? rc : unit_stop(bus, dpath);
 }
 
+/*
+ * Sends the signal 'sig' to all the processes of the unit of 'dpath'
+ */
+int systemd_unit_kill_dpath(int isuser, const char *dpath, int sig)
+{
+	int rc;
+	struct sd_bus *bus;
+
+	rc = systemd_get_bus(isuser, &bus);
+	return rc < 0 ? rc : unit_kill(bus, dpath, "all", sig);
+}
+
 int systemd_unit_start_name(int isuser, const char *name)
 {
 	int rc;
@@ -660,11 +1262,30 @@ int systemd_unit_stop_pid(int isuser, unsigned pid)
 
 int systemd_unit_pid_of_dpath(int isuser, const char *dpath)
 {
-	int rc;
+	int rc, fast;
 	struct sd_bus *bus;
 
 	rc = systemd_get_bus(isuser, &bus);
-	return rc < 0 ? rc : unit_pid(bus, dpath);
+	if (rc < 0 || cgroup_mode == SysD_Cgroup_Off)
+		return rc < 0 ? rc : unit_pid(bus, dpath);
+
+	fast = cgroup_pid_of_dpath(bus, isuser, dpath);
+	if (fast < 0) {
+		/* fallback */
+		cgroup_stats.fallbacks++;
+		return unit_pid(bus, dpath);
+	}
+	cgroup_stats.hits++;
+	if (cgroup_mode != SysD_Cgroup_Validate)
+		return fast;
+
+	/* cross-check */
+	rc = unit_pid(bus, dpath);
+	if (rc != fast) {
+		cgroup_stats.mismatches++;
+		WARNING("cgroup mismatch for pid of unit %s: %d != %d", dpath, fast, rc);
+	}
+	return rc;
 }
 
 enum SysD_State systemd_unit_state_of_dpath(int isuser, const char *dpath)
@@ -676,6 +1297,1747 @@ enum SysD_State systemd_unit_state_of_dpath(int isuser, const char *dpath)
 	return rc < 0 ? SysD_State_INVALID : unit_state(bus, dpath);
 }
 
+int systemd_unit_status_of_dpath(int isuser, const char *dpath, struct SysD_Unit_Status *status)
+{
+	int rc;
+	struct sd_bus *bus;
+
+	rc = systemd_get_bus(isuser, &bus);
+	return rc < 0 ? rc : unit_status(bus, dpath, status);
+}
+
+enum SysD_Job_State systemd_job_state_of_jpath(int isuser, const char *jpath)
+{
+	int rc;
+	struct sd_bus *bus;
+
+	rc = systemd_get_bus(isuser, &bus);
+	return rc < 0 ? SysD_Job_State_INVALID : job_state(bus, jpath);
+}
+
+/********************************************************************
+ * asynchronous calls
+ *******************************************************************/
+
+/*
+ * Pending asynchronous call
+ */
+struct async_call {
+	/* decoder of the reply returning the status and setting the path */
+	int (*decode)(struct async_call *call, struct sd_bus_message *reply, const char **path);
+	systemd_async_cb callback;	/* callback to call with the result */
+	void *closure;			/* closure of the callback */
+	int isuser;			/* the scope of the call */
+	struct SysD_Unit_Status *status; /* the status to fill or NULL */
+};
+
+/* status of the chained calls */
+#define CALL_CHAINED INT_MIN
+
+static int send_call(struct async_call *call, const char *path, const char *iface, const char *member, const char *types, ...);
+
+/*
+ * decoders of replies
+ */
+static int decode_none(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	return 0;
+}
+
+static int decode_reload(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	dpath_invalidate(call->isuser, NULL);
+	return 0;
+}
+
+static int decode_path(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	int rc = sd_bus_message_read_basic(reply, 'o', path);
+	return rc < 0 ? rc : 0;
+}
+
+static int decode_pid(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	int rc;
+	unsigned u = 0;
+
+	rc = sd_bus_message_read(reply, "v", "u", &u);
+	return rc < 0 ? rc : (int)u;
+}
+
+static int decode_state(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	int rc;
+	const char *st;
+	enum SysD_State state;
+
+	rc = sd_bus_message_read(reply, "v", "s", &st);
+	if (rc < 0)
+		return rc;
+	state = state_of_name(st);
+	return state == SysD_State_INVALID ? -EBADMSG : (int)state;
+}
+
+static int decode_status(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	int rc = read_status(reply, call->status);
+	return rc < 0 ? rc : (int)call->status->state;
+}
+
+static int decode_job_state(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	int rc;
+	const char *st;
+	enum SysD_Job_State state;
+
+	rc = sd_bus_message_read(reply, "v", "s", &st);
+	if (rc < 0)
+		return rc;
+	state = job_state_of_name(st);
+	return state == SysD_Job_State_INVALID ? -EBADMSG : (int)state;
+}
+
+static int decode_stop_pid(struct async_call *call, struct sd_bus_message *reply, const char **path)
+{
+	int rc;
+	const char *dpath;
+
+	rc = sd_bus_message_read_basic(reply, 'o', &dpath);
+	if (rc >= 0) {
+		/* chain the stop of the unit with the same call */
+		call->decode = decode_path;
+		rc = send_call(call, dpath, sdbi_unit, sdbm_stop, "s", "replace");
+		rc = rc < 0 ? -errno : CALL_CHAINED;
+	}
+	return rc;
+}
+
+/*
+ * Dispatch the 'reply' of 'call' to its callback and release the call
+ * unless the call is chained to an other one.
+ */
+static void dispatch_reply(struct async_call *call, struct sd_bus_message *reply, int rc)
+{
+	const char *path = NULL;
+
+	if (rc >= 0) {
+		if (sd_bus_message_is_method_error(reply, NULL))
+			rc = -sd_bus_message_get_errno(reply);
+		else {
+			rc = call->decode(call, reply, &path);
+			if (rc == CALL_CHAINED)
+				return;
+		}
+	}
+	call->callback(call->closure, rc, path);
+	free(call);
+}
+
+/*
+ * Receives the replies of asynchronous calls
+ */
+static int on_async_reply(struct sd_bus_message *reply, void *closure, sd_bus_error *error)
+{
+	dispatch_reply(closure, reply, 0);
+	return 0;
+}
+
+/*
+ * Sends the method call 'msg' on 'bus' for 'call'.
+ * When an event loop is set, the call is asynchronous and its reply
+ * is dispatched by the event loop. Otherwise, the call is synchronous
+ * and the callback is called before returning.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+static int send_message(struct async_call *call, struct sd_bus *bus, struct sd_bus_message *msg)
+{
+	int rc;
+	struct sd_bus_message *reply = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	if (evloop) {
+		rc = sd_bus_call_async(bus, NULL, msg, on_async_reply, call, 0);
+		if (rc < 0)
+			return sderr2errno(rc);
+	} else {
+		rc = sd_bus_call(bus, msg, 0, &err, &reply);
+		sd_bus_error_free(&err);
+		dispatch_reply(call, reply, rc);
+		sd_bus_message_unref(reply);
+	}
+	return 0;
+}
+
+/*
+ * Calls the 'member' of 'iface' of the object of 'path' for 'call'.
+ * See send_message.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+static int send_call(struct async_call *call, const char *path, const char *iface, const char *member, const char *types, ...)
+{
+	int rc;
+	va_list args;
+	struct sd_bus *bus;
+	struct sd_bus_message *msg = NULL;
+
+	rc = systemd_get_bus(call->isuser, &bus);
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_message_new_method_call(bus, &msg, sdb_destination, path, iface, member);
+	if (rc >= 0 && types) {
+		va_start(args, types);
+		rc = sd_bus_message_appendv(msg, types, args);
+		va_end(args);
+	}
+	rc = rc < 0 ? sderr2errno(rc) : send_message(call, bus, msg);
+	sd_bus_message_unref(msg);
+	return rc;
+}
+
+/*
+ * Releases the 'call' if its sending failed as reported by 'rc'
+ */
+static int check_call(struct async_call *call, int rc)
+{
+	if (rc < 0)
+		free(call);
+	return rc;
+}
+
+/*
+ * Creates a call record for 'callback' and 'closure' of the scope 'isuser'
+ * with the 'decode'r. Returns it or NULL on error.
+ */
+static struct async_call *new_call(int isuser, systemd_async_cb callback, void *closure,
+		int (*decode)(struct async_call*, struct sd_bus_message*, const char**))
+{
+	struct async_call *call;
+
+	call = malloc(sizeof *call);
+	if (!call)
+		errno = ENOMEM;
+	else {
+		call->decode = decode;
+		call->callback = callback;
+		call->closure = closure;
+		call->isuser = isuser;
+		call->status = NULL;
+	}
+	return call;
+}
+
+int systemd_daemon_reload_async(int isuser, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_reload);
+	return call ? check_call(call, send_call(call, sdb_path, sdbi_manager, sdbm_reload, NULL)) : -1;
+}
+
+int systemd_unit_dpath_by_name_async(int isuser, const char *name, int load, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, sdb_path, sdbi_manager, load ? sdbm_load_unit : sdbm_get_unit, "s", name)) : -1;
+}
+
+int systemd_unit_dpath_by_pid_async(int isuser, unsigned pid, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, sdb_path, sdbi_manager, sdbm_get_unit_by_pid, "u", pid)) : -1;
+}
+
+int systemd_unit_start_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, dpath, sdbi_unit, sdbm_start, "s", "replace")) : -1;
+}
+
+int systemd_unit_restart_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, dpath, sdbi_unit, sdbm_restart, "s", "replace")) : -1;
+}
+
+int systemd_unit_stop_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, dpath, sdbi_unit, sdbm_stop, "s", "replace")) : -1;
+}
+
+int systemd_unit_kill_dpath_async(int isuser, const char *dpath, int sig, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_none);
+	return call ? check_call(call, send_call(call, dpath, sdbi_unit, sdbm_kill, "si", "all", sig)) : -1;
+}
+
+int systemd_unit_start_name_async(int isuser, const char *name, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, sdb_path, sdbi_manager, sdbm_start_unit, "ss", name, "replace")) : -1;
+}
+
+int systemd_unit_restart_name_async(int isuser, const char *name, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, sdb_path, sdbi_manager, sdbm_restart_unit, "ss", name, "replace")) : -1;
+}
+
+int systemd_unit_stop_name_async(int isuser, const char *name, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_path);
+	return call ? check_call(call, send_call(call, sdb_path, sdbi_manager, sdbm_stop_unit, "ss", name, "replace")) : -1;
+}
+
+int systemd_unit_stop_pid_async(int isuser, unsigned pid, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_stop_pid);
+	return call ? check_call(call, send_call(call, sdb_path, sdbi_manager, sdbm_get_unit_by_pid, "u", pid)) : -1;
+}
+
+int systemd_unit_pid_of_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_pid);
+	return call ? check_call(call, send_call(call, dpath, sdbi_properties, sdbm_get, "ss", sdbi_service, sdbp_exec_main_pid)) : -1;
+}
+
+int systemd_unit_state_of_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_state);
+	return call ? check_call(call, send_call(call, dpath, sdbi_properties, sdbm_get, "ss", sdbi_unit, sdbp_active_state)) : -1;
+}
+
+int systemd_job_state_of_jpath_async(int isuser, const char *jpath, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_job_state);
+	return call ? check_call(call, send_call(call, jpath, sdbi_properties, sdbm_get, "ss", sdbi_job, sdbj_state)) : -1;
+}
+
+/*
+ * Get in 'status' the status of the unit of 'dpath' in one round trip.
+ * The 'callback' receives the state of the unit. The 'status' must
+ * remain valid until the callback is called.
+ */
+int systemd_unit_status_of_dpath_async(int isuser, const char *dpath, struct SysD_Unit_Status *status, systemd_async_cb callback, void *closure)
+{
+	struct async_call *call = new_call(isuser, callback, closure, decode_status);
+	if (!call)
+		return -1;
+	call->status = status;
+	return check_call(call, send_call(call, dpath, sdbi_properties, sdbm_get_all, "s", ""));
+}
+
+/********************************************************************
+ * waiting the end of jobs
+ *******************************************************************/
+
+/*
+ * Waiter of the end of a job
+ */
+struct job_waiter {
+	struct job_waiter *next;	/* next waiter */
+	systemd_async_cb callback;	/* callback to call at end of the job */
+	void *closure;			/* closure of the callback */
+	unsigned id;			/* identifier of the waiter */
+	int isuser;			/* scope of the job */
+	char jpath[1];			/* dbus path of the job */
+};
+
+/* the waiters of the end of jobs */
+static struct job_waiter *job_waiters;
+
+/* the last identifier given to a waiter */
+static unsigned job_waiter_id;
+
+/*
+ * Get the status of the 'result' of a job as given by JobRemoved
+ */
+static int job_result_status(const char *result)
+{
+	if (!strcmp(result, "done") || !strcmp(result, "skipped"))
+		return 0;
+	if (!strcmp(result, "canceled"))
+		return -ECANCELED;
+	if (!strcmp(result, "timeout"))
+		return -ETIMEDOUT;
+	return -EIO;
+}
+
+/*
+ * Calls with 'status' the waiters of the job 'jpath' of 'isuser'
+ */
+static void job_ended(int isuser, const char *jpath, int status)
+{
+	struct job_waiter *waiter, **prv;
+
+	isuser = scope_key(isuser);
+	prv = &job_waiters;
+	while ((waiter = *prv)) {
+		if (waiter->isuser != isuser || strcmp(waiter->jpath, jpath))
+			prv = &waiter->next;
+		else {
+			/* the callback may add or cancel waiters */
+			*prv = waiter->next;
+			waiter->callback(waiter->closure, status, NULL);
+			free(waiter);
+			prv = &job_waiters;
+		}
+	}
+}
+
+/*
+ * Receives the state of the job of the waiter 'closure' just after
+ * its registration: an error means that the job already ended.
+ */
+static void on_job_check(void *closure, int status, const char *path)
+{
+	unsigned id = (unsigned)(uintptr_t)closure;
+	struct job_waiter *waiter;
+
+	if (status >= 0)
+		return;
+	for (waiter = job_waiters ; waiter ; waiter = waiter->next)
+		if (waiter->id == id) {
+			job_ended(waiter->isuser, waiter->jpath, 0);
+			break;
+		}
+}
+
+/*
+ * Calls 'callback' when the job 'jpath' of 'isuser' ends, as signaled
+ * by JobRemoved. The status is 0 when the job succeeded or already
+ * ended, -ECANCELED, -ETIMEDOUT or -EIO when it failed.
+ * Without event loop, the wait is synchronous (see systemd_job_wait).
+ * Returns 0 in case of success or -1 in case of error.
+ */
+int systemd_job_wait_async(int isuser, const char *jpath, systemd_async_cb callback, void *closure)
+{
+	int rc;
+	size_t length;
+	unsigned id;
+	struct sd_bus *bus;
+	struct job_waiter *waiter;
+
+	if (!evloop) {
+		rc = systemd_job_wait(isuser, jpath, SYSTEMD_JOB_WAIT_MS);
+		callback(closure, rc < 0 ? -errno : 0, NULL);
+		return 0;
+	}
+
+	/* ensure the bus watches the signals */
+	rc = systemd_get_bus(isuser, &bus);
+	if (rc < 0)
+		return rc;
+
+	length = strlen(jpath);
+	waiter = malloc(length + sizeof *waiter);
+	if (!waiter)
+		return seterrno(ENOMEM);
+	waiter->callback = callback;
+	waiter->closure = closure;
+	waiter->id = id = ++job_waiter_id;
+	waiter->isuser = scope_key(isuser);
+	memcpy(waiter->jpath, jpath, length + 1);
+	waiter->next = job_waiters;
+	job_waiters = waiter;
+
+	/* the job may have ended before the registration */
+	rc = systemd_job_state_of_jpath_async(isuser, jpath, on_job_check, (void*)(uintptr_t)id);
+	if (rc < 0)
+		systemd_job_wait_cancel(callback, closure);
+	return rc;
+}
+
+/*
+ * Cancels the waits of jobs of 'callback' and 'closure'
+ */
+void systemd_job_wait_cancel(systemd_async_cb callback, void *closure)
+{
+	struct job_waiter *waiter, **prv;
+
+	prv = &job_waiters;
+	while ((waiter = *prv)) {
+		if (waiter->callback != callback || waiter->closure != closure)
+			prv = &waiter->next;
+		else {
+			*prv = waiter->next;
+			free(waiter);
+		}
+	}
+}
+
+/*
+ * Records the end of the synchronously waited job
+ */
+struct job_wait_sync {
+	const char *jpath;	/* the waited job */
+	int status;		/* its status */
+	int ended;		/* has it ended? */
+};
+
+static int on_sync_job_removed(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct job_wait_sync *sync = closure;
+	const char *member, *jpath, *unit, *result;
+	uint32_t id;
+
+	member = sd_bus_message_get_member(msg);
+	if (member && !strcmp(member, sdbs_job_removed)
+	 && sd_bus_message_read(msg, "uoss", &id, &jpath, &unit, &result) >= 0
+	 && !strcmp(jpath, sync->jpath)) {
+		sync->status = job_result_status(result);
+		sync->ended = 1;
+	}
+	return 0;
+}
+
+/*
+ * Waits at most 'timeout_ms' milliseconds the end of the job 'jpath'
+ * of 'isuser' by processing the bus until it signals JobRemoved.
+ * For use without event loop.
+ * Returns 0 in case of success or -1 with errno set, ETIMEDOUT
+ * when the job didn't end in time.
+ */
+int systemd_job_wait(int isuser, const char *jpath, int timeout_ms)
+{
+	int rc;
+	uint64_t now, end;
+	struct sd_bus *bus;
+	struct sd_bus_slot *slot = NULL;
+	struct job_wait_sync sync = { jpath, 0, 0 };
+	static const char match[] =
+		"type='signal',"
+		"sender='org.freedesktop.systemd1',"
+		"path='/org/freedesktop/systemd1',"
+		"interface='org.freedesktop.systemd1.Manager',"
+		"member='JobRemoved'";
+
+	rc = systemd_get_bus(isuser, &bus);
+	if (rc < 0)
+		return rc;
+
+	rc = sd_bus_add_match(bus, &slot, match, on_sync_job_removed, &sync);
+	if (rc >= 0)
+		rc = sd_bus_call_method(bus, sdb_destination, sdb_path, sdbi_manager, sdbm_subscribe, NULL, NULL, NULL);
+	if (rc < 0)
+		goto end;
+
+	/* the job may have ended before the match */
+	if (job_state(bus, jpath) == SysD_Job_State_INVALID)
+		goto end;
+
+	end = monotonic_now() + (uint64_t)timeout_ms * 1000;
+	while (rc >= 0 && !sync.ended) {
+		rc = sd_bus_process(bus, NULL);
+		if (rc == 0 && !sync.ended) {
+			now = monotonic_now();
+			rc = now >= end ? -ETIMEDOUT : sd_bus_wait(bus, end - now);
+		}
+	}
+	if (rc >= 0)
+		rc = sync.status;
+end:
+	sd_bus_slot_unref(slot);
+	return sderr2errno(rc);
+}
+
+/********************************************************************
+ * Cache of the dbus paths of units
+ *******************************************************************/
+
+/*
+ * Computes the hash of the key ('isuser', 'uid', 'name')
+ */
+static unsigned dpath_hash(int isuser, int uid, const char *name)
+{
+	unsigned h = (unsigned)uid * 31u + (unsigned)!!isuser;
+
+	while (*name)
+		h = h * 33u + (unsigned char)*name++;
+	return h;
+}
+
+/*
+ * Removes the 'entry' from the cache and frees it
+ */
+static void dpath_drop(struct dpath_entry *entry)
+{
+	struct dpath_entry **prv;
+
+	prv = &dpcache.buckets[entry->hash % DPATH_CACHE_BUCKETS];
+	while (*prv != entry)
+		prv = &(*prv)->hnext;
+	*prv = entry->hnext;
+
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		dpcache.mru = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		dpcache.lru = entry->prev;
+
+	dpcache.stats.count--;
+	free(entry->cgroup);
+	free(entry->dpath);
+	free(entry);
+}
+
+/*
+ * Removes from the cache the entries of 'isuser' and of 'name'
+ * (any name if NULL)
+ */
+static void dpath_invalidate(int isuser, const char *name)
+{
+	struct dpath_entry *entry, *next;
+
+	isuser = scope_key(isuser);
+	for (entry = dpcache.mru ; entry ; entry = next) {
+		next = entry->next;
+		if (entry->isuser == isuser && (!name || !strcmp(name, entry->name))) {
+			dpath_drop(entry);
+			dpcache.stats.invalidations++;
+		}
+	}
+}
+
+/*
+ * Search in the cache the entry of the key ('isuser', 'uid', 'name')
+ * and puts it in front of the LRU list
+ */
+static struct dpath_entry *dpath_search(unsigned hash, int isuser, int uid, const char *name)
+{
+	struct dpath_entry *entry;
+
+	entry = dpcache.buckets[hash % DPATH_CACHE_BUCKETS];
+	while (entry && (entry->hash != hash || entry->isuser != isuser
+				|| entry->uid != uid || strcmp(entry->name, name)))
+		entry = entry->hnext;
+
+	if (entry && entry->prev) {
+		entry->prev->next = entry->next;
+		if (entry->next)
+			entry->next->prev = entry->prev;
+		else
+			dpcache.lru = entry->prev;
+		entry->prev = NULL;
+		entry->next = dpcache.mru;
+		dpcache.mru->prev = entry;
+		dpcache.mru = entry;
+	}
+	return entry;
+}
+
+/*
+ * Adds to the cache the 'dpath' for the key ('isuser', 'uid', 'name')
+ * The given 'dpath' is owned by the cache or freed on error.
+ */
+static struct dpath_entry *dpath_add(unsigned hash, int isuser, int uid, const char *name, char *dpath)
+{
+	size_t length;
+	struct dpath_entry *entry, **bucket;
+
+	length = strlen(name);
+	entry = malloc(length + sizeof *entry);
+	if (!entry) {
+		free(dpath);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* evict the least recently used if full */
+	if (dpcache.stats.count >= DPATH_CACHE_CAPACITY) {
+		dpath_drop(dpcache.lru);
+		dpcache.stats.evictions++;
+	}
+
+	/* init */
+	entry->dpath = dpath;
+	entry->cgroup = NULL;
+	entry->hash = hash;
+	entry->isuser = isuser;
+	entry->uid = uid;
+	memcpy(entry->name, name, length + 1);
+
+	/* link */
+	bucket = &dpcache.buckets[hash % DPATH_CACHE_BUCKETS];
+	entry->hnext = *bucket;
+	*bucket = entry;
+	entry->prev = NULL;
+	entry->next = dpcache.mru;
+	if (dpcache.mru)
+		dpcache.mru->prev = entry;
+	else
+		dpcache.lru = entry;
+	dpcache.mru = entry;
+	dpcache.stats.count++;
+	return entry;
+}
+
+/*
+ * Get the entry of the cache for the key ('isuser', 'uid', 'name'),
+ * loading the unit if not in cache.
+ * Returns the entry or NULL in case of error.
+ */
+static struct dpath_entry *dpath_get(int isuser, int uid, const char *name)
+{
+	unsigned hash;
+	char *dpath;
+	struct dpath_entry *entry;
+
+	isuser = scope_key(isuser);
+	hash = dpath_hash(isuser, uid, name);
+	entry = dpath_search(hash, isuser, uid, name);
+	if (entry) {
+		dpcache.stats.hits++;
+		return entry;
+	}
+
+	dpcache.stats.misses++;
+	dpath = systemd_unit_dpath_by_name(isuser, name, 1);
+	return dpath ? dpath_add(hash, isuser, uid, name, dpath) : NULL;
+}
+
+/*
+ * Search in the cache an entry of 'isuser' for the 'dpath'
+ */
+static struct dpath_entry *dpath_search_dpath(int isuser, const char *dpath)
+{
+	struct dpath_entry *entry;
+
+	isuser = scope_key(isuser);
+	for (entry = dpcache.mru ; entry ; entry = entry->next)
+		if (entry->isuser == isuser && !strcmp(entry->dpath, dpath))
+			break;
+	return entry;
+}
+
+/*
+ * Receives the signals of systemd that invalidates the cache
+ */
+static int on_manager_signal(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	int isuser = (int)(intptr_t)closure;
+	const char *member, *name, *dpath, *jpath, *result;
+	uint32_t id;
+
+	member = sd_bus_message_get_member(msg);
+	if (member && !strcmp(member, sdbs_unit_removed)) {
+		if (sd_bus_message_read(msg, "so", &name, &dpath) >= 0)
+			dpath_invalidate(isuser, name);
+	} else if (member && !strcmp(member, sdbs_reloading)) {
+		dpath_invalidate(isuser, NULL);
+	} else if (member && !strcmp(member, sdbs_job_removed)) {
+		if (sd_bus_message_read(msg, "uoss", &id, &jpath, &name, &result) >= 0)
+			job_ended(isuser, jpath, job_result_status(result));
+	}
+	return 0;
+}
+
+/*
+ * Attach the 'bus' to the event loop if any and subscribe to
+ * the signals of systemd that invalidate the cache.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+static int watch_bus(struct sd_bus *bus, int isuser)
+{
+	int rc;
+	static const char match[] =
+		"type='signal',"
+		"sender='org.freedesktop.systemd1',"
+		"path='/org/freedesktop/systemd1',"
+		"interface='org.freedesktop.systemd1.Manager'";
+
+	if (!evloop)
+		return 0;
+
+	rc = sd_bus_attach_event(bus, evloop, 0);
+	if (rc < 0 && rc != -EBUSY)
+		goto error;
+
+	rc = sd_bus_add_match(bus, NULL, match, on_manager_signal, (void*)(intptr_t)isuser);
+	if (rc < 0)
+		goto error;
+
+	rc = sd_bus_call_method(bus, sdb_destination, sdb_path, sdbi_manager, sdbm_subscribe, NULL, NULL, NULL);
+	if (rc < 0)
+		goto error;
+
+	return 0;
+error:
+	return sderr2errno(rc);
+}
+
+/*
+ * Set the event loop to use for receiving signals of systemd.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+int systemd_set_event_loop(struct sd_event *loop)
+{
+	int rc, rc2;
+	struct user_bus *ubus;
+
+	if (loop == evloop)
+		return 0;
+	evloop = loop;
+	rc = usrbus ? watch_bus(usrbus, 1) : 0;
+	rc2 = sysbus ? watch_bus(sysbus, 0) : 0;
+	for (ubus = user_buses ; ubus ; ubus = ubus->next)
+		watch_bus(ubus->bus, systemd_user_scope(ubus->uid));
+	if (user_buses)
+		arm_user_bus_timer(user_bus_now() + SYSTEMD_USER_BUS_IDLE_SECONDS * 1000000ULL);
+	return rc < 0 ? rc : rc2;
+}
+
+/*
+ * Get the dbus path of the unit of 'name' for the user 'uid' (or -1)
+ * of the system (isuser == 0) or of the user (isuser != 0).
+ * The unit is loaded if needed.
+ *
+ * The returned path is a copy of the cached one that the caller
+ * must free.
+ *
+ * Returns the path or NULL in case of error.
+ */
+char *systemd_unit_dpath_cached(int isuser, int uid, const char *name)
+{
+	char *result;
+	struct dpath_entry *entry;
+
+	entry = dpath_get(isuser, uid, name);
+	if (!entry)
+		return NULL;
+	result = strdup(entry->dpath);
+	if (!result)
+		errno = ENOMEM;
+	return result;
+}
+
+/*
+ * Get the statistics of the cache of dbus paths
+ */
+void systemd_unit_dpath_cache_stats(struct systemd_dpath_cache_stats *stats)
+{
+	*stats = dpcache.stats;
+	stats->capacity = DPATH_CACHE_CAPACITY;
+}
+
+/********************************************************************
+ * fast path through the cgroup filesystem
+ *******************************************************************/
+
+/*
+ * Get the root of the cgroup hierarchy of systemd
+ */
+static const char *get_cgroup_root()
+{
+	struct stat st;
+
+	if (!cgroup_root)
+		cgroup_root = stat("/sys/fs/cgroup/systemd", &st) == 0 && S_ISDIR(st.st_mode)
+				? "/sys/fs/cgroup/systemd" /* legacy or hybrid */
+				: "/sys/fs/cgroup"; /* unified */
+	return cgroup_root;
+}
+
+/*
+ * Reads in 'buffer' of 'size' the cgroup path of the process 'pid'
+ * Returns 0 in case of success or -1 in case of error.
+ */
+static int read_cgroup_of_pid(unsigned pid, char *buffer, size_t size)
+{
+	FILE *file;
+	char line[PATH_MAX + 64], *path;
+	int found;
+
+	snprintf(line, sizeof line, "%s/%u/cgroup", proc_root, pid);
+	file = fopen(line, "r");
+	if (!file)
+		return -1;
+
+	/* search the named hierarchy of systemd, else the unified one */
+	found = 0;
+	while (found < 2 && fgets(line, (int)sizeof line, file)) {
+		path = strstr(line, ":name=systemd:");
+		if (path)
+			path += 14;
+		else if (!found && !strncmp(line, "0::", 3))
+			path = line + 3;
+		else
+			continue;
+		path[strcspn(path, "\n")] = 0;
+		if (strlen(path) < size) {
+			strcpy(buffer, path);
+			found = path == line + 3 ? 1 : 2;
+		}
+	}
+	fclose(file);
+	return found ? 0 : seterrno(ENOENT);
+}
+
+/*
+ * Search in the 'cgroup' path the unit of the manager of 'isuser'.
+ * It is the first component that isn't a slice, after the component
+ * "user@UID.service" for user managers.
+ * The 'cgroup' is cut after the found unit.
+ * Returns the name of the unit or NULL if not found.
+ */
+static const char *unit_of_cgroup(int isuser, char *cgroup)
+{
+	char *comp, *end, manager[40];
+	size_t length, mlen;
+	int inside;
+
+	mlen = 0;
+	if (isuser)
+		mlen = (size_t)snprintf(manager, sizeof manager, "user@%d.service",
+				isuser > 0 ? (int)getuid() : -1 - isuser);
+	inside = !isuser;
+	comp = cgroup;
+	while (*comp) {
+		while (*comp == '/')
+			comp++;
+		end = comp + strcspn(comp, "/");
+		length = (size_t)(end - comp);
+		if (!inside)
+			inside = length == mlen && !memcmp(comp, manager, length);
+		else if (length && (length < 6 || memcmp(end - 6, ".slice", 6))) {
+			*end = 0;
+			return comp;
+		}
+		comp = end;
+	}
+	return NULL;
+}
+
+/*
+ * Get the parent pid of the process 'pid' or -1 on error
+ */
+static int ppid_of_pid(int pid)
+{
+	FILE *file;
+	char buffer[512], *p;
+	int ppid;
+
+	snprintf(buffer, sizeof buffer, "%s/%d/stat", proc_root, pid);
+	file = fopen(buffer, "r");
+	if (!file)
+		return -1;
+	p = fgets(buffer, (int)sizeof buffer, file);
+	fclose(file);
+	if (!p || !(p = strrchr(buffer, ')')) || sscanf(p + 1, " %*c %d", &ppid) != 1)
+		return -1;
+	return ppid;
+}
+
+/*
+ * Get the main pid of the processes of the 'cgroup'. It is the
+ * only process whose parent isn't in the cgroup. When there are
+ * many such processes (forking or multi-process services) or too
+ * many processes to check, the main pid can't be told and
+ * the manager has to be asked.
+ * Returns the pid, 0 if the cgroup doesn't exist or is empty
+ * or -1 in case of error or when the main pid is ambiguous.
+ */
+static int main_pid_of_cgroup(const char *cgroup)
+{
+	FILE *file;
+	char path[PATH_MAX];
+	int pids[64], n, i, j, ppid, extra, result;
+
+	snprintf(path, sizeof path, "%s%s/cgroup.procs", get_cgroup_root(), cgroup);
+	file = fopen(path, "r");
+	if (!file)
+		return errno == ENOENT ? 0 : -1;
+	n = 0;
+	while (n < (int)(sizeof pids / sizeof *pids) && fscanf(file, "%d", &pids[n]) == 1)
+		n++;
+	extra = n == (int)(sizeof pids / sizeof *pids) && fscanf(file, "%d", &i) == 1;
+	fclose(file);
+	if (extra)
+		return -1;
+
+	result = 0;
+	for (i = 0 ; i < n ; i++) {
+		ppid = ppid_of_pid(pids[i]);
+		for (j = 0 ; j < n && pids[j] != ppid ; j++);
+		if (j == n) {
+			if (result)
+				return -1;
+			result = pids[i];
+		}
+	}
+	return result;
+}
+
+/*
+ * Get the dbus path of the unit of the process 'pid' using the cgroup
+ * filesystem.
+ * Returns the allocated path or NULL with errno set to ENOENT if the
+ * process isn't in a unit of the manager or to an other value if
+ * the fast path can't be used.
+ */
+static char *cgroup_dpath_by_pid(int isuser, unsigned pid)
+{
+	char cgroup[PATH_MAX];
+	const char *name;
+	struct dpath_entry *entry;
+
+	if (read_cgroup_of_pid(pid, cgroup, sizeof cgroup) < 0) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	name = unit_of_cgroup(isuser, cgroup);
+	if (!name) {
+		errno = ENOENT;
+		return NULL;
+	}
+	entry = dpath_get(isuser, -1, name);
+	if (!entry) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	if (!entry->cgroup)
+		entry->cgroup = strdup(cgroup);
+	return strdup(entry->dpath);
+}
+
+/*
+ * Get the main pid of the unit of 'dpath' using the cgroup filesystem.
+ * The control group of the unit is learnt from systemd once.
+ * Returns the pid, 0 if not running or -1 if the fast path can't be used.
+ */
+static int cgroup_pid_of_dpath(struct sd_bus *bus, int isuser, const char *dpath)
+{
+	int rc;
+	char *cgroup;
+	struct dpath_entry *entry;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	entry = dpath_search_dpath(isuser, dpath);
+	if (!entry)
+		return -1;
+	if (!entry->cgroup) {
+		rc = sd_bus_get_property_string(bus, sdb_destination, dpath, sdbi_unit, sdbp_control_group, &err, &cgroup);
+		sd_bus_error_free(&err);
+		if (rc < 0)
+			return -1;
+		if (!*cgroup) {
+			/* no control group: not running */
+			free(cgroup);
+			return 0;
+		}
+		entry->cgroup = cgroup;
+	}
+	return main_pid_of_cgroup(entry->cgroup);
+}
+
+/*
+ * Set the 'mode' of the fast path through the cgroup filesystem
+ */
+void systemd_set_cgroup_mode(enum SysD_Cgroup_Mode mode)
+{
+	cgroup_mode = mode;
+}
+
+/*
+ * Get the statistics of the fast path through the cgroup filesystem
+ */
+void systemd_cgroup_stats(struct systemd_cgroup_stats *stats)
+{
+	*stats = cgroup_stats;
+}
+
+/********************************************************************
+ * watch of the status of units
+ *******************************************************************/
+
+struct systemd_unit_watch {
+	struct sd_bus_slot *slot;	/* the slot of the match */
+	systemd_unit_watch_cb callback;	/* the callback of changes */
+	void *closure;			/* closure of the callback */
+	struct SysD_Unit_Status status;	/* the current status */
+};
+
+/*
+ * Receives the changes of properties of the watched unit
+ */
+static int on_unit_signal(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct systemd_unit_watch *watch = closure;
+
+	if (sd_bus_message_skip(msg, "s") >= 0
+	 && merge_status(msg, &watch->status) >= 0)
+		watch->callback(watch->closure, &watch->status);
+	return 0;
+}
+
+/*
+ * Watch the changes of the status of the unit of 'dpath' in the scope
+ * 'isuser'. Each change of the properties of the status calls 'callback'
+ * with 'closure' and the updated status.
+ * Watches need an event loop (see systemd_set_event_loop).
+ * Returns the watch or NULL with errno set.
+ */
+struct systemd_unit_watch *systemd_unit_watch(int isuser, const char *dpath, systemd_unit_watch_cb callback, void *closure)
+{
+	int rc;
+	char match[PATH_MAX];
+	struct sd_bus *bus;
+	struct systemd_unit_watch *watch;
+
+	if (!evloop) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	rc = snprintf(match, sizeof match,
+		"type='signal',"
+		"sender='%s',"
+		"path='%s',"
+		"interface='%s',"
+		"member='%s'",
+		sdb_destination, dpath, sdbi_properties, sdbs_properties_changed);
+	if (check_snprintf_result(rc, sizeof match) < 0)
+		return NULL;
+	if (systemd_get_bus(isuser, &bus) < 0)
+		return NULL;
+
+	watch = malloc(sizeof *watch);
+	if (!watch) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	watch->slot = NULL;
+	watch->callback = callback;
+	watch->closure = closure;
+	rc = sderr2errno(sd_bus_add_match(bus, &watch->slot, match, on_unit_signal, watch));
+	if (rc >= 0)
+		rc = unit_status(bus, dpath, &watch->status);
+	if (rc < 0) {
+		sd_bus_slot_unref(watch->slot);
+		free(watch);
+		return NULL;
+	}
+	return watch;
+}
+
+/*
+ * Get the current status of the unit of 'watch'
+ */
+const struct SysD_Unit_Status *systemd_unit_watch_status(struct systemd_unit_watch *watch)
+{
+	return &watch->status;
+}
+
+/*
+ * Stops the 'watch'. It can be called from the callback of the watch.
+ */
+void systemd_unit_unwatch(struct systemd_unit_watch *watch)
+{
+	if (watch) {
+		sd_bus_slot_unref(watch->slot);
+		free(watch);
+	}
+}
+
+/********************************************************************
+ * transient units
+ *******************************************************************/
+
+/*
+ * Kinds of translation of the directives of unit files
+ * to the properties of transient units
+ */
+enum transient_kind {
+	tk_string,	/* s: the value */
+	tk_strings,	/* as: the words of the value */
+	tk_command,	/* a(sasb): a command, failure ignored if prefixed with - */
+	tk_file,	/* a(sb): a file, optional if prefixed with - */
+	tk_label,	/* (bs): a label, optional if prefixed with - */
+	tk_umask,	/* u: an octal value */
+	tk_int,		/* i: an integer value */
+	tk_ioclass,	/* i: a class of IO scheduling */
+	tk_caps,	/* t: empty for none or ~ for all */
+	tk_exit,	/* (aiai): exit status and signals */
+	tk_syscalls,	/* (bas): a filter, deny list if prefixed with ~ */
+	tk_condition,	/* a(sbbs): a condition, negated if prefixed with ! */
+	tk_weight,	/* t: a weight of cgroup */
+	tk_bytes,	/* t: a size with optional suffix K, M, G or T, or infinity */
+	tk_cpus,	/* ay: a mask built from a list of CPUs */
+	tk_schedpolicy	/* i: a CPU scheduling policy */
+};
+
+static const char *transient_signatures[] = {
+	[tk_string]    = "s",
+	[tk_strings]   = "as",
+	[tk_command]   = "a(sasb)",
+	[tk_file]      = "a(sb)",
+	[tk_label]     = "(bs)",
+	[tk_umask]     = "u",
+	[tk_int]       = "i",
+	[tk_ioclass]   = "i",
+	[tk_caps]      = "t",
+	[tk_exit]      = "(aiai)",
+	[tk_syscalls]  = "(bas)",
+	[tk_condition] = "a(sbbs)",
+	[tk_weight]    = "t",
+	[tk_bytes]     = "t",
+	[tk_cpus]      = "ay",
+	[tk_schedpolicy] = "i"
+};
+
+/*
+ * Directives translated to properties of transient units, sorted by name
+ */
+static const struct transient_directive {
+	const char *name;	/* name of the directive */
+	const char *property;	/* name of the property or NULL if the same */
+	enum transient_kind kind; /* kind of translation */
+} transient_directives[] = {
+	{ "After",                 NULL,               tk_strings },
+	{ "AllowedCPUs",           NULL,               tk_cpus },
+	{ "AllowedMemoryNodes",    NULL,               tk_cpus },
+	{ "AmbientCapabilities",   NULL,               tk_caps },
+	{ "BindsTo",               NULL,               tk_strings },
+	{ "CPUAffinity",           NULL,               tk_cpus },
+	{ "CPUSchedulingPolicy",   NULL,               tk_schedpolicy },
+	{ "CPUWeight",             NULL,               tk_weight },
+	{ "CapabilityBoundingSet", NULL,               tk_caps },
+	{ "ConditionSecurity",     "Conditions",       tk_condition },
+	{ "Description",           NULL,               tk_string },
+	{ "Environment",           NULL,               tk_strings },
+	{ "EnvironmentFile",       "EnvironmentFiles", tk_file },
+	{ "ExecStart",             NULL,               tk_command },
+	{ "ExecStartPre",          NULL,               tk_command },
+	{ "Group",                 NULL,               tk_string },
+	{ "IOSchedulingClass",     NULL,               tk_ioclass },
+	{ "IOWeight",              NULL,               tk_weight },
+	{ "MemoryHigh",            NULL,               tk_bytes },
+	{ "MemoryMax",             NULL,               tk_bytes },
+	{ "Nice",                  NULL,               tk_int },
+	{ "OOMScoreAdjust",        NULL,               tk_int },
+	{ "Requires",              NULL,               tk_strings },
+	{ "Slice",                 NULL,               tk_string },
+	{ "SmackProcessLabel",     NULL,               tk_label },
+	{ "StandardError",         NULL,               tk_string },
+	{ "StandardInput",         NULL,               tk_string },
+	{ "StandardOutput",        NULL,               tk_string },
+	{ "SuccessExitStatus",     NULL,               tk_exit },
+	{ "SupplementaryGroups",   NULL,               tk_strings },
+	{ "SyslogIdentifier",      NULL,               tk_string },
+	{ "SystemCallFilter",      NULL,               tk_syscalls },
+	{ "Type",                  NULL,               tk_string },
+	{ "UMask",                 NULL,               tk_umask },
+	{ "User",                  NULL,               tk_string },
+	{ "Wants",                 NULL,               tk_strings },
+	{ "WorkingDirectory",      NULL,               tk_string }
+};
+
+static int cmp_transient_directive(const void *key, const void *item)
+{
+	return strcmp(key, ((const struct transient_directive*)item)->name);
+}
+
+/*
+ * Returns the next word of '*text', unquoted in place, and updates
+ * '*text' to point after it. Returns NULL when there is no more word.
+ */
+static char *next_word(char **text)
+{
+	char *read, *write, *word, quote;
+
+	read = *text;
+	while (*read == ' ' || *read == '\t')
+		read++;
+	if (!*read)
+		return NULL;
+
+	quote = 0;
+	word = write = read;
+	while (*read && (quote || (*read != ' ' && *read != '\t'))) {
+		if (*read == quote)
+			quote = 0;
+		else if (!quote && (*read == '"' || *read == '\''))
+			quote = *read;
+		else if (*read == '\\' && read[1])
+			*write++ = *++read;
+		else
+			*write++ = *read;
+		read++;
+	}
+	*text = read + !!*read;
+	*write = 0;
+	return word;
+}
+
+/*
+ * Returns an allocated copy of 'value' where the specifiers %i, %I
+ * and %% are expanded, %i and %I to the 'instance' of the unit.
+ * Returns NULL with errno set to ENOTSUP for other specifiers.
+ */
+static char *expand_specifiers(const char *value, const char *instance, size_t ilen)
+{
+	const char *read;
+	char *result, *write;
+	size_t length;
+
+	/* compute the length */
+	length = 0;
+	for (read = value ; *read ; read++) {
+		if (*read != '%')
+			length++;
+		else if (*++read == '%')
+			length++;
+		else if ((*read == 'i' || *read == 'I') && instance)
+			length += ilen;
+		else {
+			errno = ENOTSUP;
+			return NULL;
+		}
+	}
+
+	/* expand */
+	result = write = malloc(length + 1);
+	if (!result)
+		return NULL;
+	for (read = value ; *read ; read++) {
+		if (*read != '%')
+			*write++ = *read;
+		else if (*++read == '%')
+			*write++ = '%';
+		else
+			write = mempcpy(write, instance, ilen);
+	}
+	*write = 0;
+	return result;
+}
+
+/*
+ * Returns the signal number of the 'name' or -1 if unknown
+ */
+static int signal_of_name(const char *name)
+{
+	static const char *names[] = {
+		"HUP", "INT", "QUIT", "ILL", "TRAP", "ABRT", "BUS", "FPE",
+		"KILL", "USR1", "SEGV", "USR2", "PIPE", "ALRM", "TERM"
+	};
+	int i;
+
+	if (!strncmp(name, "SIG", 3))
+		name += 3;
+	for (i = 0 ; i < (int)(sizeof names / sizeof *names) ; i++)
+		if (!strcmp(name, names[i]))
+			return i + 1;
+	return -1;
+}
+
+/*
+ * Appends to 'msg' the value of the property for the directive 'dir'
+ * of 'value' (modified in place). Returns a negative sd-bus error code
+ * on error.
+ */
+static int append_transient_value(struct sd_bus_message *msg, const struct transient_directive *dir, char *value)
+{
+	int rc, flag, i, n, codes[2][32], counts[2];
+	char *word, *end;
+	uint64_t caps, u64;
+	uint32_t umask;
+	unsigned long first, last;
+	uint8_t cpus[128];
+
+	switch (dir->kind) {
+	case tk_string:
+		return sd_bus_message_append_basic(msg, 's', value);
+
+	case tk_strings:
+		rc = sd_bus_message_open_container(msg, 'a', "s");
+		while (rc >= 0 && (word = next_word(&value)))
+			rc = sd_bus_message_append_basic(msg, 's', word);
+		return rc < 0 ? rc : sd_bus_message_close_container(msg);
+
+	case tk_command:
+		flag = *value == '-';
+		value += flag;
+		if (strchr("@+!:", *value) || !(word = next_word(&value)))
+			return -ENOTSUP;
+		rc = sd_bus_message_open_container(msg, 'a', "(sasb)");
+		if (rc >= 0)
+			rc = sd_bus_message_open_container(msg, 'r', "sasb");
+		if (rc >= 0)
+			rc = sd_bus_message_append_basic(msg, 's', word);
+		if (rc >= 0)
+			rc = sd_bus_message_open_container(msg, 'a', "s");
+		while (rc >= 0 && word) {
+			rc = sd_bus_message_append_basic(msg, 's', word);
+			word = next_word(&value);
+		}
+		if (rc >= 0)
+			rc = sd_bus_message_close_container(msg);
+		if (rc >= 0)
+			rc = sd_bus_message_append_basic(msg, 'b', &flag);
+		if (rc >= 0)
+			rc = sd_bus_message_close_container(msg);
+		return rc < 0 ? rc : sd_bus_message_close_container(msg);
+
+	case tk_file:
+		flag = *value == '-';
+		rc = sd_bus_message_open_container(msg, 'a', "(sb)");
+		if (rc >= 0)
+			rc = sd_bus_message_append(msg, "(sb)", value + flag, flag);
+		return rc < 0 ? rc : sd_bus_message_close_container(msg);
+
+	case tk_label:
+		flag = *value == '-';
+		return sd_bus_message_append(msg, "(bs)", flag, value + flag);
+
+	case tk_umask:
+		umask = (uint32_t)strtoul(value, &end, 8);
+		return *value && !*end ? sd_bus_message_append_basic(msg, 'u', &umask) : -EINVAL;
+
+	case tk_int:
+		i = (int)strtol(value, &end, 10);
+		return *value && !*end ? sd_bus_message_append_basic(msg, 'i', &i) : -EINVAL;
+
+	case tk_ioclass:
+		if (!strcmp(value, "realtime"))
+			i = 1;
+		else if (!strcmp(value, "best-effort"))
+			i = 2;
+		else if (!strcmp(value, "idle"))
+			i = 3;
+		else if (!*value || (i = (int)strtol(value, &end, 10), *end))
+			return -EINVAL;
+		return sd_bus_message_append_basic(msg, 'i', &i);
+
+	case tk_caps:
+		if (!*value)
+			caps = 0;
+		else if (!strcmp(value, "~"))
+			caps = UINT64_MAX;
+		else
+			return -ENOTSUP;
+		return sd_bus_message_append_basic(msg, 't', &caps);
+
+	case tk_exit:
+		counts[0] = counts[1] = 0;
+		while ((word = next_word(&value))) {
+			i = (int)strtol(word, &end, 10);
+			n = !!*end;
+			if (n && (i = signal_of_name(word)) < 0)
+				return -EINVAL;
+			if (counts[n] < (int)(sizeof codes[n] / sizeof *codes[n]))
+				codes[n][counts[n]++] = i;
+		}
+		rc = sd_bus_message_open_container(msg, 'r', "aiai");
+		for (n = 0 ; rc >= 0 && n < 2 ; n++)
+			rc = sd_bus_message_append_array(msg, 'i', codes[n], (size_t)counts[n] * sizeof **codes);
+		return rc < 0 ? rc : sd_bus_message_close_container(msg);
+
+	case tk_syscalls:
+		flag = *value != '~';
+		value += !flag;
+		rc = sd_bus_message_open_container(msg, 'r', "bas");
+		if (rc >= 0)
+			rc = sd_bus_message_append_basic(msg, 'b', &flag);
+		if (rc >= 0)
+			rc = sd_bus_message_open_container(msg, 'a', "s");
+		while (rc >= 0 && (word = next_word(&value)))
+			rc = sd_bus_message_append_basic(msg, 's', word);
+		if (rc >= 0)
+			rc = sd_bus_message_close_container(msg);
+		return rc < 0 ? rc : sd_bus_message_close_container(msg);
+
+	case tk_condition:
+		flag = *value == '!';
+		rc = sd_bus_message_open_container(msg, 'a', "(sbbs)");
+		if (rc >= 0)
+			rc = sd_bus_message_append(msg, "(sbbs)", dir->name, 0, flag, value + flag);
+		return rc < 0 ? rc : sd_bus_message_close_container(msg);
+
+	case tk_weight:
+		u64 = strtoull(value, &end, 10);
+		return *value && !*end ? sd_bus_message_append_basic(msg, 't', &u64) : -EINVAL;
+
+	case tk_bytes:
+		if (!strcmp(value, "infinity"))
+			u64 = UINT64_MAX;
+		else {
+			u64 = strtoull(value, &end, 10);
+			switch (*end) {
+			case 'T': u64 <<= 10; /*@fallthrough@*/
+			case 'G': u64 <<= 10; /*@fallthrough@*/
+			case 'M': u64 <<= 10; /*@fallthrough@*/
+			case 'K': u64 <<= 10; end++; break;
+			case '%': return -ENOTSUP;
+			}
+			if (!*value || *end)
+				return -EINVAL;
+		}
+		return sd_bus_message_append_basic(msg, 't', &u64);
+
+	case tk_cpus:
+		memset(cpus, 0, sizeof cpus);
+		n = 0;
+		for (value += strspn(value, ", ") ; *value ; value += strspn(value, ", ")) {
+			first = last = strtoul(value, &end, 10);
+			if (*end == '-')
+				last = strtoul(end + 1, &end, 10);
+			if (end == value || first > last || last >= 8 * sizeof cpus || (*end && !strchr(", ", *end)))
+				return -EINVAL;
+			for ( ; first <= last ; first++)
+				cpus[first >> 3] |= (uint8_t)(1 << (first & 7));
+			if ((int)(last >> 3) >= n)
+				n = (int)(last >> 3) + 1;
+			value = end;
+		}
+		return sd_bus_message_append_array(msg, 'y', cpus, (size_t)n);
+
+	case tk_schedpolicy:
+		if (!strcmp(value, "other"))
+			i = SCHED_OTHER;
+		else if (!strcmp(value, "fifo"))
+			i = SCHED_FIFO;
+		else if (!strcmp(value, "rr"))
+			i = SCHED_RR;
+		else if (!strcmp(value, "batch"))
+			i = SCHED_BATCH;
+		else if (!strcmp(value, "idle"))
+			i = SCHED_IDLE;
+		else
+			return -EINVAL;
+		return sd_bus_message_append_basic(msg, 'i', &i);
+	}
+	return -EINVAL;
+}
+
+/*
+ * Returns the translation of the directive whose key is the 'klen'
+ * first characters of 'directive' or NULL if it has none.
+ */
+static const struct transient_directive *search_transient_directive(const char *directive, size_t klen)
+{
+	char key[64];
+
+	if (klen >= sizeof key)
+		return NULL;
+	memcpy(key, directive, klen);
+	key[klen] = 0;
+	return bsearch(key, transient_directives,
+			sizeof transient_directives / sizeof *transient_directives,
+			sizeof *transient_directives, cmp_transient_directive);
+}
+
+/*
+ * Checks that the 'directive' ("Key=value") of unit file can be
+ * translated to a property of transient unit: its key is known, its
+ * specifiers are %i, %I or %% and its command has no special prefix.
+ * Returns 0 if it can or -1 with errno set to ENOTSUP.
+ */
+int systemd_transient_directive_check(const char *directive)
+{
+	const char *value;
+	size_t klen;
+	const struct transient_directive *dir;
+
+	klen = strcspn(directive, "=");
+	dir = directive[klen] ? search_transient_directive(directive, klen) : NULL;
+	if (!dir)
+		goto notsup;
+	value = &directive[klen + 1];
+	if (dir->kind == tk_command && strchr("@+!:", value[*value == '-']))
+		goto notsup;
+	for ( ; (value = strchr(value, '%')) ; value += 2)
+		if (!value[1] || !strchr("%iI", value[1]))
+			goto notsup;
+	return 0;
+
+notsup:
+	errno = ENOTSUP;
+	return -1;
+}
+
+/*
+ * Appends to 'msg' the property translating the 'directive' ("Key=value")
+ * after expansion of the specifiers using 'instance'.
+ * Returns a negative sd-bus error code on error.
+ */
+static int append_transient_property(struct sd_bus_message *msg, const char *directive, const char *instance, size_t ilen)
+{
+	int rc;
+	char *value;
+	size_t klen;
+	const struct transient_directive *dir;
+
+	/* search the directive */
+	klen = strcspn(directive, "=");
+	if (!directive[klen])
+		return -EINVAL;
+	dir = search_transient_directive(directive, klen);
+	if (!dir)
+		return -ENOTSUP;
+
+	/* translate it */
+	value = expand_specifiers(&directive[klen + 1], instance, ilen);
+	if (!value)
+		return -errno;
+	rc = sd_bus_message_open_container(msg, 'r', "sv");
+	if (rc >= 0)
+		rc = sd_bus_message_append_basic(msg, 's', dir->property ?: dir->name);
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(msg, 'v', transient_signatures[dir->kind]);
+	if (rc >= 0)
+		rc = append_transient_value(msg, dir, value);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(msg);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(msg);
+	free(value);
+	return rc;
+}
+
+/*
+ * Creates in 'msg' the call to StartTransientUnit of 'bus' for the
+ * unit 'name' and its 'count' 'directives'.
+ * Returns 0 in case of success or a negative sd-bus error code.
+ */
+static int new_transient_message(struct sd_bus *bus, struct sd_bus_message **msg, const char *name, const char * const *directives, int count)
+{
+	int rc, i;
+	const char *instance, *dot;
+	size_t ilen;
+
+	/* the instance */
+	instance = strchr(name, '@');
+	dot = strrchr(name, '.');
+	if (instance && dot > instance) {
+		ilen = (size_t)(dot - ++instance);
+	} else {
+		instance = NULL;
+		ilen = 0;
+	}
+
+	/* build the call */
+	*msg = NULL;
+	rc = sd_bus_message_new_method_call(bus, msg, sdb_destination, sdb_path, sdbi_manager, sdbm_start_transient_unit);
+	if (rc >= 0)
+		rc = sd_bus_message_append(*msg, "ss", name, "replace");
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(*msg, 'a', "(sv)");
+	if (rc >= 0)
+		rc = sd_bus_message_append(*msg, "(sv)", "CollectMode", "s", "inactive-or-failed");
+	for (i = 0 ; rc >= 0 && i < count ; i++) {
+		rc = append_transient_property(*msg, directives[i], instance, ilen);
+		if (rc == -ENOTSUP)
+			NOTICE("can't translate %s for transient unit %s", directives[i], name);
+	}
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(*msg);
+	if (rc >= 0)
+		rc = sd_bus_message_append(*msg, "a(sa(sv))", 0);
+	if (rc < 0) {
+		sd_bus_message_unref(*msg);
+		*msg = NULL;
+	}
+	return rc;
+}
+
+/*
+ * Starts the transient unit of 'name' described by the 'count'
+ * 'directives' of unit file (strings "Key=value" of the sections
+ * [Unit] and [Service]). The specifiers %i and %I are expanded to
+ * the instance of 'name'. The unit is collected by systemd when it
+ * stops, even if it failed.
+ *
+ * Returns the dbus path of the start job or NULL with errno set.
+ * The errno ENOTSUP means that a directive can't be translated.
+ */
+char *systemd_unit_start_transient_job(int isuser, const char *name, const char * const *directives, int count)
+{
+	int rc;
+	struct sd_bus *bus;
+	struct sd_bus_message *msg = NULL, *ret = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	rc = systemd_get_bus(isuser, &bus);
+	if (rc < 0)
+		return NULL;
+
+	/* call */
+	rc = new_transient_message(bus, &msg, name, directives, count);
+	if (rc >= 0)
+		rc = sd_bus_call(bus, msg, 0, &err, &ret);
+	sd_bus_message_unref(msg);
+	sd_bus_error_free(&err);
+	if (rc < 0) {
+		sd_bus_message_unref(ret);
+		sderr2errno(rc);
+		return NULL;
+	}
+	return get_dpath(ret);
+}
+
+/*
+ * Asynchronous version of systemd_unit_start_transient_job.
+ * The 'callback' receives the dbus path of the start job.
+ * The 'directives' are used before returning.
+ */
+int systemd_unit_start_transient_job_async(int isuser, const char *name, const char * const *directives, int count, systemd_async_cb callback, void *closure)
+{
+	int rc;
+	struct sd_bus *bus;
+	struct sd_bus_message *msg;
+	struct async_call *call;
+
+	rc = systemd_get_bus(isuser, &bus);
+	if (rc < 0)
+		return rc;
+
+	call = new_call(isuser, callback, closure, decode_path);
+	if (!call)
+		return -1;
+	rc = new_transient_message(bus, &msg, name, directives, count);
+	rc = rc < 0 ? sderr2errno(rc) : send_message(call, bus, msg);
+	sd_bus_message_unref(msg);
+	return check_call(call, rc);
+}
+
+/*
+ * Sets to the unit of 'dpath' the properties translating the 'count'
+ * 'directives' of unit file (strings "Key=value"), only until its
+ * next restart when 'runtime' is set. Only the properties of resource
+ * control can be set on units.
+ * Returns 0 in case of success or -1 in case of error.
+ */
+int systemd_unit_set_properties_dpath(int isuser, const char *dpath, int runtime, const char * const *directives, int count)
+{
+	int rc, i;
+	struct sd_bus *bus;
+	struct sd_bus_message *msg = NULL, *ret = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	rc = systemd_get_bus(isuser, &bus);
+	if (rc < 0)
+		return rc;
+
+	/* build the call */
+	rc = sd_bus_message_new_method_call(bus, &msg, sdb_destination, dpath, sdbi_unit, sdbm_set_properties);
+	if (rc >= 0)
+		rc = sd_bus_message_append(msg, "b", !!runtime);
+	if (rc >= 0)
+		rc = sd_bus_message_open_container(msg, 'a', "(sv)");
+	for (i = 0 ; rc >= 0 && i < count ; i++)
+		rc = append_transient_property(msg, directives[i], NULL, 0);
+	if (rc >= 0)
+		rc = sd_bus_message_close_container(msg);
+
+	/* call */
+	if (rc >= 0)
+		rc = sd_bus_call(bus, msg, 0, &err, &ret);
+	sd_bus_message_unref(msg);
+	sd_bus_message_unref(ret);
+	sd_bus_error_free(&err);
+	return rc < 0 ? sderr2errno(rc) : 0;
+}
+
 const char *systemd_state_name(enum SysD_State state)
 {
 	return sds_state_names[state];
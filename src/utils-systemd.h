@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 enum SysD_State {
     SysD_State_INVALID,
     SysD_State_Inactive,
@@ -34,9 +36,66 @@ enum SysD_Job_State {
     SysD_Job_State_Running
 };
 
+enum SysD_Cgroup_Mode {
+    SysD_Cgroup_Off,        /* always ask systemd */
+    SysD_Cgroup_On,         /* use cgroup filesystem, ask systemd as fallback */
+    SysD_Cgroup_Validate    /* use both and report differences */
+};
+
+struct SysD_Unit_Status {
+    enum SysD_State state;      /* ActiveState */
+    char sub_state[32];         /* SubState */
+    int main_pid;               /* MainPID of services or 0 */
+    int exec_main_code;         /* ExecMainCode of services (CLD_EXITED, CLD_KILLED, ...) */
+    int exec_main_status;       /* ExecMainStatus of services */
+    uint64_t active_enter;      /* ActiveEnterTimestamp (microseconds) */
+    uint64_t active_exit;       /* ActiveExitTimestamp (microseconds) */
+    uint64_t inactive_enter;    /* InactiveEnterTimestamp (microseconds) */
+    uint64_t state_change;      /* StateChangeTimestamp (microseconds) */
+    uint64_t memory_current;    /* MemoryCurrent (bytes or UINT64_MAX) */
+    uint64_t memory_peak;       /* MemoryPeak (bytes or UINT64_MAX) */
+};
+
+struct systemd_dpath_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    unsigned count;
+    unsigned capacity;
+};
+
+struct systemd_user_bus_stats {
+    unsigned long opened;
+    unsigned long reused;
+    unsigned long closed;
+    unsigned long failed;
+    unsigned count;
+};
+
+/*
+ * The functions taking 'isuser' address the system manager when 'isuser'
+ * is 0, the user manager of the current user when 'isuser' is 1, or the
+ * user manager of a given uid when 'isuser' is systemd_user_scope(uid).
+ */
+static inline int systemd_user_scope(int uid)
+{
+    return uid < 0 ? 1 : -1 - uid;
+}
+
+struct systemd_cgroup_stats {
+    unsigned long hits;
+    unsigned long notfound;
+    unsigned long fallbacks;
+    unsigned long mismatches;
+};
+
 struct sd_bus;
+struct sd_event;
 extern int systemd_get_bus(int isuser, struct sd_bus **ret);
 extern void systemd_set_bus(int isuser, struct sd_bus *bus);
+extern int systemd_set_event_loop(struct sd_event *loop);
+extern void systemd_user_bus_stats(struct systemd_user_bus_stats *stats);
 
 extern int systemd_get_units_dir(char *path, size_t pathlen, int isuser);
 extern int systemd_get_unit_path(char *path, size_t pathlen, int isuser, const char *unit, const char *uext);
@@ -47,20 +106,82 @@ extern int systemd_daemon_reload(int isuser);
 extern char *systemd_unit_dpath_by_name(int isuser, const char *name, int load);
 extern char *systemd_unit_dpath_by_pid(int isuser, unsigned pid);
 
+extern void systemd_set_cgroup_mode(enum SysD_Cgroup_Mode mode);
+extern void systemd_cgroup_stats(struct systemd_cgroup_stats *stats);
+
+extern char *systemd_unit_dpath_cached(int isuser, int uid, const char *name);
+extern void systemd_unit_dpath_cache_stats(struct systemd_dpath_cache_stats *stats);
+
 extern int systemd_unit_start_dpath(int isuser, const char *dpath);
+extern char *systemd_unit_start_job_dpath(int isuser, const char *dpath);
 extern int systemd_unit_restart_dpath(int isuser, const char *dpath);
 extern int systemd_unit_stop_dpath(int isuser, const char *dpath);
+extern char *systemd_unit_stop_job_dpath(int isuser, const char *dpath);
+extern int systemd_unit_kill_dpath(int isuser, const char *dpath, int sig);
 
 extern int systemd_unit_start_name(int isuser, const char *name);
 extern int systemd_unit_restart_name(int isuser, const char *name);
 extern int systemd_unit_stop_name(int isuser, const char *name);
 extern int systemd_unit_stop_pid(int isuser, unsigned pid);
 
+extern char *systemd_unit_start_transient_job(int isuser, const char *name, const char * const *directives, int count);
+extern int systemd_transient_directive_check(const char *directive);
+extern int systemd_unit_set_properties_dpath(int isuser, const char *dpath, int runtime, const char * const *directives, int count);
+
 extern int systemd_unit_pid_of_dpath(int isuser, const char *dpath);
 extern enum SysD_State systemd_unit_state_of_dpath(int isuser, const char *dpath);
+extern int systemd_unit_status_of_dpath(int isuser, const char *dpath, struct SysD_Unit_Status *status);
+
+/*
+ * Watch of the changes of the status of a unit. The 'callback' receives
+ * the status of the unit updated with the changed properties.
+ */
+struct systemd_unit_watch;
+typedef void (*systemd_unit_watch_cb)(void *closure, const struct SysD_Unit_Status *status);
+
+extern struct systemd_unit_watch *systemd_unit_watch(int isuser, const char *dpath, systemd_unit_watch_cb callback, void *closure);
+extern const struct SysD_Unit_Status *systemd_unit_watch_status(struct systemd_unit_watch *watch);
+extern void systemd_unit_unwatch(struct systemd_unit_watch *watch);
+extern enum SysD_Job_State systemd_job_state_of_jpath(int isuser, const char *jpath);
 
 extern int systemd_unit_list(int isuser, int (*callback)(void *closure, const char *name, const char *path, int isuser), void *closure);
 extern int systemd_unit_list_all(int (*callback)(void *closure, const char *name, const char *path, int isuser), void *closure);
 
 extern const char *systemd_state_name(enum SysD_State state);
 
+/*
+ * Callback of asynchronous calls. 'status' is negative (-errno) on error.
+ * Otherwise it is the pid, the state or the job state for the calls
+ * returning them or 0 for the others. 'path' is the dbus path returned by
+ * the calls returning a unit or a job or NULL.
+ * Without event loop (see systemd_set_event_loop) the calls are synchronous
+ * and the callback is called before they return.
+ */
+typedef void (*systemd_async_cb)(void *closure, int status, const char *path);
+
+extern int systemd_daemon_reload_async(int isuser, systemd_async_cb callback, void *closure);
+
+extern int systemd_unit_dpath_by_name_async(int isuser, const char *name, int load, systemd_async_cb callback, void *closure);
+extern int systemd_unit_dpath_by_pid_async(int isuser, unsigned pid, systemd_async_cb callback, void *closure);
+
+extern int systemd_unit_start_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure);
+extern int systemd_unit_restart_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure);
+extern int systemd_unit_stop_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure);
+extern int systemd_unit_kill_dpath_async(int isuser, const char *dpath, int sig, systemd_async_cb callback, void *closure);
+
+extern int systemd_unit_start_name_async(int isuser, const char *name, systemd_async_cb callback, void *closure);
+extern int systemd_unit_restart_name_async(int isuser, const char *name, systemd_async_cb callback, void *closure);
+extern int systemd_unit_stop_name_async(int isuser, const char *name, systemd_async_cb callback, void *closure);
+extern int systemd_unit_stop_pid_async(int isuser, unsigned pid, systemd_async_cb callback, void *closure);
+
+extern int systemd_unit_pid_of_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure);
+extern int systemd_unit_state_of_dpath_async(int isuser, const char *dpath, systemd_async_cb callback, void *closure);
+extern int systemd_unit_status_of_dpath_async(int isuser, const char *dpath, struct SysD_Unit_Status *status, systemd_async_cb callback, void *closure);
+extern int systemd_job_state_of_jpath_async(int isuser, const char *jpath, systemd_async_cb callback, void *closure);
+
+extern int systemd_unit_start_transient_job_async(int isuser, const char *name, const char * const *directives, int count, systemd_async_cb callback, void *closure);
+
+extern int systemd_job_wait_async(int isuser, const char *jpath, systemd_async_cb callback, void *closure);
+extern void systemd_job_wait_cancel(systemd_async_cb callback, void *closure);
+extern int systemd_job_wait(int isuser, const char *jpath, int timeout_ms);
+
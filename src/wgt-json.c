@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -345,6 +346,23 @@ static int add_param_object(struct json_object *obj, const struct wgt_desc_param
 	return -ENOMEM;
 }
 
+/* add a param as a simple string value of an object of the given 'obj' */
+static int add_param_sub(struct json_object *obj, const struct wgt_desc_param *param, void *closure)
+{
+	const char *object_name = closure;
+	struct json_object *object;
+
+	/* get or create the object of 'object_name=closure' */
+	if (!json_object_object_get_ex(obj, object_name, &object)) {
+		object = j_add_new_object(obj, object_name);
+		if (!object)
+			return -ENOMEM;
+	}
+
+	/* record the value */
+	return j_add_string(object, param->name, param->value) ? 0 : -ENOMEM;
+}
+
 /* Retrieve within 'targets' the target of the feature 'feat' and applies 'actions' to it */
 static int add_targeted_params(struct json_object *targets, const struct wgt_desc_feature *feat, struct paramaction actions[])
 {
@@ -417,6 +435,114 @@ static int add_required_permission(struct json_object *targets, const struct wgt
 	return add_targeted_params(targets, feat, actions);
 }
 
+/* Treats the feature "launch" */
+static int add_launch(struct json_object *targets, const struct wgt_desc_feature *feat)
+{
+	static struct paramaction actions[] = {
+		{ .name = string_sharp_target, .action = NULL, .closure = NULL }, /* skip #target */
+		{ .name = NULL, .action = add_param_sub, .closure = (void*)string_launch }
+	};
+	return add_targeted_params(targets, feat, actions);
+}
+
+/* checks that 'value' is a weight of cgroups: an integer from 1 to 10000 */
+static int is_resource_weight(const char *value)
+{
+	char *end;
+	long w = strtol(value, &end, 10);
+	return *value >= '0' && *value <= '9' && !*end && w >= 1 && w <= 10000;
+}
+
+/* checks that 'value' is a size in bytes with optional suffix K, M, G or T, or infinity */
+static int is_resource_bytes(const char *value)
+{
+	char *end;
+
+	if (!strcmp(value, "infinity"))
+		return 1;
+	if (*value < '0' || *value > '9')
+		return 0;
+	strtoull(value, &end, 10);
+	return !*end || ((*end == 'K' || *end == 'M' || *end == 'G' || *end == 'T') && !end[1]);
+}
+
+/* checks that 'value' is a list of CPU indexes or ranges of indexes (like 0-1,3) */
+static int is_resource_cpus(const char *value)
+{
+	char *end;
+	unsigned long first, last;
+
+	do {
+		while (*value == ',' || *value == ' ')
+			value++;
+		if (*value < '0' || *value > '9')
+			return 0;
+		first = last = strtoul(value, &end, 10);
+		if (*end == '-') {
+			value = end + 1;
+			if (*value < '0' || *value > '9')
+				return 0;
+			last = strtoul(value, &end, 10);
+		}
+		if (first > last || last >= 1024)
+			return 0;
+		value = end;
+	} while (*value == ',' || *value == ' ');
+	return !*value;
+}
+
+/* checks that 'value' is a name of class of placement (like hmi) */
+static int is_resource_class(const char *value)
+{
+	if (!*value)
+		return 0;
+	while (*value) {
+		if (!isalnum((unsigned char)*value) && *value != '-' && *value != '_')
+			return 0;
+		value++;
+	}
+	return 1;
+}
+
+/* add a param of the feature "resources" after checking its value */
+static int add_resource(struct json_object *obj, const struct wgt_desc_param *param, void *closure)
+{
+	static const struct {
+		const char *name;
+		int (*check)(const char *value);
+	} resources[] = {
+		{ "allowed-cpus", is_resource_cpus },
+		{ "cpu-weight",   is_resource_weight },
+		{ "io-weight",    is_resource_weight },
+		{ "memory-high",  is_resource_bytes },
+		{ "memory-max",   is_resource_bytes },
+		{ "placement",    is_resource_class }
+	};
+	int i;
+
+	for (i = 0 ; i < (int)(sizeof resources / sizeof *resources) ; i++) {
+		if (!strcmp(param->name, resources[i].name)) {
+			if (!resources[i].check(param->value)) {
+				ERROR("invalid value %s of resource %s", param->value, param->name);
+				return -EINVAL;
+			}
+			return add_param_sub(obj, param, closure);
+		}
+	}
+	WARNING("unknown resource %s ignored", param->name);
+	return 0;
+}
+
+/* Treats the feature "resources" */
+static int add_resources(struct json_object *targets, const struct wgt_desc_feature *feat)
+{
+	static struct paramaction actions[] = {
+		{ .name = string_sharp_target, .action = NULL, .closure = NULL }, /* skip #target */
+		{ .name = NULL, .action = add_resource, .closure = (void*)string_resources }
+	};
+	return add_targeted_params(targets, feat, actions);
+}
+
 /* Treats the feature "defined_permission" */
 static int add_defined_permission(struct json_object *defperm, const struct wgt_desc_feature *feat)
 {
@@ -491,6 +617,12 @@ static struct json_object *to_json(const struct wgt_desc *desc)
 			}
 			else if (!strcmp(featname, string_required_permission)) {
 				rc2 = add_required_permission(targets, feat);
+			}
+			else if (!strcmp(featname, string_launch)) {
+				rc2 = add_launch(targets, feat);
+			}
+			else if (!strcmp(featname, string_resources)) {
+				rc2 = add_resources(targets, feat);
 			} else {
 				/* gently ignore other features */
 				rc2 = 0;
@@ -52,6 +52,7 @@ const char string_defined_permission[] = "defined-permission";
 const char string_dict[] = "dict";
 const char string_idaver[] = "idaver";
 const char string_index[] = "index";
+const char string_launch[] = "launch";
 const char string_level[] = "level";
 const char string_list[] = "list";
 const char string_main[] = "main";
@@ -62,6 +63,7 @@ const char string_provided_unit[] = "provided-unit";
 const char string_required_api[] = "required-api";
 const char string_required_binding[] = "required-binding";
 const char string_required_permission[] = "required-permission";
+const char string_resources[] = "resources";
 const char string_targets[] = "targets";
 const char string_sharp_target[] = "#target";
 
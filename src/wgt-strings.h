@@ -50,6 +50,7 @@ extern const char string_defined_permission[];
 extern const char string_dict[];
 extern const char string_idaver[];
 extern const char string_index[];
+extern const char string_launch[];
 extern const char string_level[];
 extern const char string_list[];
 extern const char string_main[];
@@ -60,6 +61,7 @@ extern const char string_provided_unit[];
 extern const char string_required_api[];
 extern const char string_required_binding[];
 extern const char string_required_permission[];
+extern const char string_resources[];
 extern const char string_sharp_target[];
 extern const char string_targets[];
 
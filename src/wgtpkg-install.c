@@ -662,8 +662,33 @@ end:
 	return rc;
 }
 
-/* install the widget of the file */
-struct wgt_info *install_widget(const char *wgtfile, const char *root, int force)
+/* the callback receiving the progress of installations */
+static void (*progress_callback)(void *closure, const char *step, const char *wgtfile);
+static void *progress_closure;
+
+/*
+ * Set the 'callback' receiving with 'closure' the steps of
+ * the installations (extracting, verifying, installing-security,
+ * writing-units)
+ */
+void install_set_progress(void (*callback)(void *closure, const char *step, const char *wgtfile), void *closure)
+{
+	progress_callback = callback;
+	progress_closure = closure;
+}
+
+/* reports the 'step' of the installation of 'wgtfile' */
+static void progress(const char *step, const char *wgtfile)
+{
+	if (progress_callback)
+		progress_callback(progress_closure, step, wgtfile ? : "-");
+}
+
+/*
+ * install the widget read from the file 'wgtfile' or,
+ * when 'wgtfile' is NULL, from the stream 'fd'
+ */
+static struct wgt_info *install(const char *wgtfile, int fd, const char *root, int force)
 {
 	struct wgt_info *ifo;
 	const struct wgt_desc *desc;
@@ -671,8 +696,6 @@ struct wgt_info *install_widget(const char *wgtfile, const char *root, int force
 	int err, rc;
 	struct unitconf uconf;
 
-	NOTICE("-- INSTALLING widget %s to %s --", wgtfile, root);
-
 	/* workdir */
 	create_directory(root, 0755, 1);
 	if (make_workdir(root, "TMP", 0)) {
@@ -680,9 +703,11 @@ struct wgt_info *install_widget(const char *wgtfile, const char *root, int force
 		goto error1;
 	}
 
-	if (zread(wgtfile, 0))
+	progress("extracting", wgtfile);
+	if (wgtfile ? zread(wgtfile, 0) : zread_fd(fd, 0))
 		goto error2;
 
+	progress("verifying", wgtfile);
 #if defined(ALLOW_NO_SIGNATURE)
 	rc = check_all_signatures(1);
 #else
@@ -719,6 +744,7 @@ struct wgt_info *install_widget(const char *wgtfile, const char *root, int force
 	if (install_icon(desc))
 		goto error3;
 
+	progress("installing-security", wgtfile);
 	if (install_security(desc))
 		goto error4;
 
@@ -728,6 +754,7 @@ struct wgt_info *install_widget(const char *wgtfile, const char *root, int force
 	if (install_file_properties(desc))
 		goto error4;
 
+	progress("writing-units", wgtfile);
 	uconf.installdir = installdir;
 	uconf.icondir = FWK_ICON_DIR;
 	uconf.new_afid = get_new_afid;
@@ -754,3 +781,38 @@ error1:
 	return NULL;
 }
 
+/*
+ * install the widget of the file
+ * When the file is a named pipe, the widget is extracted while read.
+ */
+struct wgt_info *install_widget(const char *wgtfile, const char *root, int force)
+{
+	int fd, err;
+	struct stat st;
+	struct wgt_info *ifo;
+
+	NOTICE("-- INSTALLING widget %s to %s --", wgtfile, root);
+
+	if (stat(wgtfile, &st) < 0 || !S_ISFIFO(st.st_mode))
+		return install(wgtfile, -1, root, force);
+
+	fd = open(wgtfile, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		ERROR("can't open %s: %m", wgtfile);
+		return NULL;
+	}
+	ifo = install(NULL, fd, root, force);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ifo;
+}
+
+/* install the widget read from the stream 'fd' (pipe, socket, ...) */
+struct wgt_info *install_widget_fd(int fd, const char *root, int force)
+{
+	NOTICE("-- INSTALLING widget from stream %d to %s --", fd, root);
+
+	return install(NULL, fd, root, force);
+}
+
@@ -17,3 +17,5 @@
 */
 
 extern struct wgt_info *install_widget(const char *wgtfile, const char *root, int force);
+extern struct wgt_info *install_widget_fd(int fd, const char *root, int force);
+extern void install_set_progress(void (*callback)(void *closure, const char *step, const char *wgtfile), void *closure);
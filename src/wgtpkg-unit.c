@@ -36,6 +36,7 @@
 #include "utils-json.h"
 #include "wgt-json.h"
 #include "utils-systemd.h"
+#include "utils-placement.h"
 
 #include "wgtpkg-unit.h"
 #include "wgt-strings.h"
@@ -46,6 +47,10 @@
 #define isblank(c) ((c)==' '||(c)=='\t')
 #endif
 
+#if !defined(FWK_PLACEMENT_CONF)
+# define FWK_PLACEMENT_CONF "/etc/afm/afm-placement.conf"
+#endif
+
 /* the template for all units */
 static char *template;
 
@@ -372,6 +377,38 @@ int unit_generator_open_template(const char *filename)
 	return rc;
 }
 
+/*
+ * Adds to the target 'targ' the placement directives of its class
+ * read from the placement policy file. The class is the resource
+ * 'placement' of the target or "default".
+ */
+static int add_placement(struct json_object *targ)
+{
+	int rc, i;
+	const char *class;
+	char key[100];
+	struct placement placement;
+
+	class = j_string_at_m(targ, "resources.placement", NULL);
+	rc = placement_get(FWK_PLACEMENT_CONF, class ? : "default", &placement);
+	if (rc < 0 && errno == ENOENT && class) {
+		WARNING("unknown placement class %s, using default", class);
+		rc = placement_get(FWK_PLACEMENT_CONF, "default", &placement);
+	}
+	if (rc < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	for (i = 0 ; !rc && i < placement_key_count ; i++) {
+		if (placement.values[i]) {
+			snprintf(key, sizeof key, "#placement.%s", placement_directive(i));
+			if (!j_add_many_strings_m(targ, key, placement.values[i], NULL))
+				rc = -1;
+		}
+	}
+	placement_release(&placement);
+	return rc;
+}
+
 static int add_metadata(struct json_object *jdesc, const struct unitconf *conf)
 {
 	struct json_object *targets, *targ;
@@ -398,6 +435,8 @@ static int add_metadata(struct json_object *jdesc, const struct unitconf *conf)
 				"#metatarget.afid", afidstr,
 				NULL))
 				return -1;
+			if (add_placement(targ) < 0)
+				return -1;
 		}
 	}
 
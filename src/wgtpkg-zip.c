@@ -45,7 +45,10 @@
  ***********************************************************/
 #if USE_LIBZIP
 
+#include <stdlib.h>
+#include <stdint.h>
 #include <zip.h>
+#include <zlib.h>
 
 static int is_valid_filename(const char *filename)
 {
@@ -350,6 +353,441 @@ int zwrite(const char *zipfile)
 	return err;
 }
 
+/***********************************************************
+ *        STREAMING FROM A FILE DESCRIPTOR
+ ***********************************************************/
+
+#define ZSIG_LOCAL	0x04034b50	/* local file header */
+#define ZSIG_DESC	0x08074b50	/* data descriptor */
+#define ZSIG_CENTRAL	0x02014b50	/* central directory file header */
+#define ZSIG_END	0x06054b50	/* end of central directory */
+
+#define ZFLAG_ENCRYPTED	1		/* the entry is encrypted */
+#define ZFLAG_DESC	8		/* sizes and crc are in a data descriptor */
+
+#define ZMETHOD_STORE	0
+#define ZMETHOD_DEFLATE	8
+
+/* buffered input stream */
+struct zstream {
+	int fd;				/* the input */
+	size_t pos;			/* position of the next byte in buffer */
+	size_t len;			/* count of bytes in buffer */
+	unsigned long long offset;	/* offset in the stream of the buffer */
+	unsigned char buffer[32768];	/* the buffer */
+};
+
+/* local entry recorded for the check of the central directory */
+struct zentry {
+	char *name;		/* name of the entry */
+	uint32_t offset;	/* offset of the local header */
+	uint32_t crc;		/* crc32 of the data */
+	uint32_t csize;		/* compressed size */
+	uint32_t usize;		/* uncompressed size */
+};
+
+static uint16_t get16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* offset in the stream of the next byte */
+static unsigned long long zs_offset(struct zstream *zs)
+{
+	return zs->offset + zs->pos;
+}
+
+/*
+ * Ensure that the buffer of 'zs' isn't empty.
+ * Returns 0 on success or -1 on error or unexpected end of stream.
+ */
+static int zs_fill(struct zstream *zs)
+{
+	ssize_t sizr;
+
+	if (zs->pos < zs->len)
+		return 0;
+	do {
+		sizr = read(zs->fd, zs->buffer, sizeof zs->buffer);
+	} while (sizr < 0 && errno == EINTR);
+	if (sizr <= 0) {
+		if (sizr == 0) {
+			ERROR("unexpected end of zip stream");
+			errno = EBADMSG;
+		}
+		return -1;
+	}
+	zs->offset += zs->len;
+	zs->pos = 0;
+	zs->len = (size_t)sizr;
+	return 0;
+}
+
+/*
+ * Reads 'size' bytes of 'zs' in 'to' or skips them if 'to' is NULL.
+ * Returns 0 on success or -1 on error.
+ */
+static int zs_read(struct zstream *zs, void *to, size_t size)
+{
+	size_t n;
+
+	while (size) {
+		if (zs_fill(zs) < 0)
+			return -1;
+		n = zs->len - zs->pos;
+		if (n > size)
+			n = size;
+		if (to) {
+			memcpy(to, &zs->buffer[zs->pos], n);
+			to = (char*)to + n;
+		}
+		zs->pos += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t size)
+{
+	ssize_t sizw;
+
+	while (size) {
+		sizw = write(fd, buffer, size);
+		if (sizw < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer = (const char*)buffer + sizw;
+		size -= (size_t)sizw;
+	}
+	return 0;
+}
+
+/*
+ * Extracts to 'fd' (or discards if 'fd' < 0) the data of the 'entry'
+ * of 'method' and 'flags' from 'zs'. The size extracted is added to
+ * 'total' that must not exceed 'maxsize' (if not zero).
+ * When the sizes and crc are in a data descriptor, they are read
+ * and stored in 'entry'.
+ * Returns 0 on success or -1 on error.
+ */
+static int zs_extract(struct zstream *zs, struct zentry *entry, unsigned method, unsigned flags,
+			int fd, unsigned long long *total, unsigned long long maxsize)
+{
+	int rc;
+	z_stream z;
+	uLong crc;
+	size_t n;
+	unsigned long long csize, usize;
+	unsigned char out[32768], desc[16];
+
+	crc = crc32(0, Z_NULL, 0);
+	csize = usize = 0;
+	if (method == ZMETHOD_STORE) {
+		/* copy */
+		if (maxsize && *total + entry->csize > maxsize) {
+			ERROR("extracted size greater than allowed size %llu", maxsize);
+			errno = EFBIG;
+			return -1;
+		}
+		while (csize < entry->csize) {
+			if (zs_fill(zs) < 0)
+				return -1;
+			n = zs->len - zs->pos;
+			if (n > entry->csize - csize)
+				n = (size_t)(entry->csize - csize);
+			crc = crc32(crc, &zs->buffer[zs->pos], (uInt)n);
+			if (fd >= 0 && write_all(fd, &zs->buffer[zs->pos], n) < 0)
+				goto errorw;
+			zs->pos += n;
+			csize += n;
+		}
+		usize = csize;
+		*total += usize;
+	} else {
+		/* inflate */
+		memset(&z, 0, sizeof z);
+		if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+			ERROR("can't init inflate of %s", entry->name);
+			errno = ENOMEM;
+			return -1;
+		}
+		do {
+			if (zs_fill(zs) < 0)
+				goto errorz;
+			z.next_in = &zs->buffer[zs->pos];
+			z.avail_in = (uInt)(zs->len - zs->pos);
+			z.next_out = out;
+			z.avail_out = (uInt)sizeof out;
+			rc = inflate(&z, Z_NO_FLUSH);
+			if (rc != Z_OK && rc != Z_STREAM_END) {
+				ERROR("corrupted data of %s in zip stream", entry->name);
+				errno = EBADMSG;
+				goto errorz;
+			}
+			n = (zs->len - zs->pos) - z.avail_in;
+			zs->pos += n;
+			csize += n;
+			n = sizeof out - z.avail_out;
+			crc = crc32(crc, out, (uInt)n);
+			usize += n;
+			*total += n;
+			if (maxsize && *total > maxsize)
+				break;
+			if (fd >= 0 && write_all(fd, out, n) < 0) {
+				inflateEnd(&z);
+				goto errorw;
+			}
+		} while (rc != Z_STREAM_END);
+		inflateEnd(&z);
+	}
+
+	/* check the size */
+	if (maxsize && *total > maxsize) {
+		ERROR("extracted size greater than allowed size %llu", maxsize);
+		errno = EFBIG;
+		return -1;
+	}
+
+	/* read the data descriptor */
+	if (flags & ZFLAG_DESC) {
+		if (zs_read(zs, desc, 12) < 0)
+			return -1;
+		if (get32(desc) == ZSIG_DESC) {
+			if (zs_read(zs, &desc[12], 4) < 0)
+				return -1;
+			memmove(desc, &desc[4], 12);
+		}
+		entry->crc = get32(desc);
+		entry->csize = get32(&desc[4]);
+		entry->usize = get32(&desc[8]);
+	}
+
+	/* check the data */
+	if (csize != entry->csize || usize != entry->usize || crc != entry->crc) {
+		ERROR("size or crc mismatch for %s in zip stream", entry->name);
+		errno = EBADMSG;
+		return -1;
+	}
+	return 0;
+
+errorz:
+	inflateEnd(&z);
+	return -1;
+errorw:
+	ERROR("error while writing %s", entry->name);
+	return -1;
+}
+
+/*
+ * Checks that the name of the entry is valid.
+ * Names with components '..' are refused because the
+ * entries are extracted before any check of the archive.
+ */
+static int zs_check_name(const char *name)
+{
+	const char *comp;
+
+	if (!*name) {
+		ERROR("empty entry found in zip stream");
+		return 0;
+	}
+	if (!is_valid_filename(name) || name[0] == '/') {
+		ERROR("invalid entry %s found in zip stream", name);
+		return 0;
+	}
+	comp = name;
+	while (comp) {
+		if (comp[0] == '.' && comp[1] == '.' && (!comp[2] || comp[2] == '/')) {
+			ERROR("invalid entry %s found in zip stream", name);
+			return 0;
+		}
+		comp = strchr(comp, '/');
+		if (comp)
+			comp++;
+	}
+	return 1;
+}
+
+/*
+ * Checks the central directory of 'zs' whose header signature
+ * was already read in 'head' against the 'count' local 'entries'
+ * Returns 0 on success or -1 on error.
+ */
+static int zs_check_central(struct zstream *zs, unsigned char *head, struct zentry *entries, unsigned count)
+{
+	unsigned index;
+	uint32_t sig;
+	uint16_t nlen;
+	unsigned long long cdoffset;
+	char name[PATH_MAX];
+
+	cdoffset = zs_offset(zs) - 4;
+	index = 0;
+	sig = get32(head);
+	while (sig == ZSIG_CENTRAL) {
+		if (zs_read(zs, &head[4], 42) < 0)
+			return -1;
+		nlen = get16(&head[28]);
+		if (index >= count || nlen >= sizeof name || zs_read(zs, name, nlen) < 0)
+			goto mismatch;
+		name[nlen] = 0;
+		if (strcmp(name, entries[index].name)
+		 || get32(&head[16]) != entries[index].crc
+		 || get32(&head[20]) != entries[index].csize
+		 || get32(&head[24]) != entries[index].usize
+		 || get32(&head[42]) != entries[index].offset)
+			goto mismatch;
+		if (zs_read(zs, NULL, (size_t)get16(&head[30]) + get16(&head[32])) < 0
+		 || zs_read(zs, head, 4) < 0)
+			return -1;
+		sig = get32(head);
+		index++;
+	}
+	if (index != count || sig != ZSIG_END || zs_read(zs, &head[4], 18) < 0
+	 || get16(&head[10]) != count || get32(&head[16]) != cdoffset)
+		goto mismatch;
+	return zs_read(zs, NULL, get16(&head[20]));
+
+mismatch:
+	ERROR("central directory inconsistent with the entries of zip stream");
+	errno = EBADMSG;
+	return -1;
+}
+
+/*
+ * read (extract) the zip of the stream 'fd' in current directory
+ *
+ * The entries are extracted while reading their local headers so that
+ * transfer and extraction overlap. The central directory is then
+ * checked against the extracted entries.
+ */
+int zread_fd(int fd, unsigned long long maxsize)
+{
+	int rc, err, ofd;
+	size_t len;
+	unsigned count, index, flags, method;
+	uint16_t nlen;
+	unsigned long long total;
+	struct zstream *zs;
+	struct zentry *entries, *entry;
+	struct filedesc *fdesc;
+	unsigned char head[46];
+	char name[PATH_MAX];
+
+	zs = malloc(sizeof *zs);
+	if (!zs) {
+		errno = ENOMEM;
+		return -1;
+	}
+	zs->fd = fd;
+	zs->pos = zs->len = 0;
+	zs->offset = 0;
+
+	file_reset();
+	entries = NULL;
+	count = 0;
+	total = 0;
+	rc = -1;
+	for (;;) {
+		/* read the local header */
+		if (zs_read(zs, head, 4) < 0)
+			goto end;
+		if (get32(head) != ZSIG_LOCAL)
+			break;
+		if (zs_offset(zs) - 4 > UINT32_MAX) {
+			ERROR("zip stream too big");
+			errno = ENOTSUP;
+			goto end;
+		}
+		if ((count & 63) == 0) {
+			entry = realloc(entries, (count + 64) * sizeof *entries);
+			if (!entry) {
+				errno = ENOMEM;
+				goto end;
+			}
+			entries = entry;
+		}
+		entry = &entries[count];
+		entry->name = NULL;
+		entry->offset = (uint32_t)(zs_offset(zs) - 4);
+		if (zs_read(zs, &head[4], 26) < 0)
+			goto end;
+		flags = get16(&head[6]);
+		method = get16(&head[8]);
+		entry->crc = get32(&head[14]);
+		entry->csize = get32(&head[18]);
+		entry->usize = get32(&head[22]);
+		nlen = get16(&head[26]);
+		if (nlen >= sizeof name) {
+			ERROR("name too long in zip stream");
+			errno = ENAMETOOLONG;
+			goto end;
+		}
+		if (zs_read(zs, name, nlen) < 0 || zs_read(zs, NULL, get16(&head[28])) < 0)
+			goto end;
+		name[nlen] = 0;
+		entry->name = strdup(name);
+		if (!entry->name) {
+			errno = ENOMEM;
+			goto end;
+		}
+		count++;
+
+		/* check the entry */
+		if (!zs_check_name(name)) {
+			errno = EINVAL;
+			goto end;
+		}
+		if ((flags & ZFLAG_ENCRYPTED)
+		 || (method != ZMETHOD_STORE && method != ZMETHOD_DEFLATE)
+		 || (method == ZMETHOD_STORE && (flags & ZFLAG_DESC))
+		 || entry->csize == UINT32_MAX || entry->usize == UINT32_MAX) {
+			ERROR("unsupported entry %s in zip stream", name);
+			errno = ENOTSUP;
+			goto end;
+		}
+
+		/* extract the entry */
+		len = strlen(name);
+		if (name[len - 1] == '/') {
+			fdesc = file_add_directory(name);
+			if (!fdesc || (create_directory(name, MODE_OF_DIRECTORY_CREATION) && errno != EEXIST))
+				goto end;
+			if (zs_extract(zs, entry, method, flags, -1, &total, maxsize) < 0)
+				goto end;
+		} else {
+			fdesc = file_add_file(name);
+			if (!fdesc)
+				goto end;
+			ofd = create_file(name, MODE_OF_FILE_CREATION, MODE_OF_DIRECTORY_CREATION);
+			if (ofd < 0)
+				goto end;
+			err = zs_extract(zs, entry, method, flags, ofd, &total, maxsize);
+			close(ofd);
+			if (err < 0)
+				goto end;
+		}
+		fdesc->zindex = count - 1;
+	}
+
+	/* check the central directory */
+	rc = zs_check_central(zs, head, entries, count);
+
+end:
+	for (index = 0 ; index < count ; index++)
+		free(entries[index].name);
+	free(entries);
+	free(zs);
+	return rc;
+}
+
 /***********************************************************
  *        NOT USING LIBZIP: FORKING
  ***********************************************************/
@@ -357,6 +795,7 @@ int zwrite(const char *zipfile)
 
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 extern char **environ;
 
@@ -442,6 +881,49 @@ int zread(const char *zipfile, unsigned long long maxsize)
 	return rc;
 }
 
+/* read (extract) the zip of the stream 'fd' in current directory */
+int zread_fd(int fd, unsigned long long maxsize)
+{
+	int rc, tfd;
+	size_t off;
+	ssize_t sizr, sizw;
+	char path[PATH_MAX + 16];
+	char buffer[32768];
+
+	/* unzip can't read streams: copy to a temporary file beside the workdir */
+	rc = snprintf(path, sizeof path, "%s.zip-XXXXXX", workdir);
+	if (rc >= (int)sizeof path) {
+		ERROR("temporary file name too long");
+		errno = EINVAL;
+		return -1;
+	}
+	tfd = mkstemp(path);
+	if (tfd < 0) {
+		ERROR("can't create temporary file %s: %m", path);
+		return -1;
+	}
+	rc = 0;
+	while (!rc && (sizr = read(fd, buffer, sizeof buffer)) != 0) {
+		if (sizr < 0)
+			rc = errno == EINTR ? 0 : -1;
+		else
+			for (off = 0 ; !rc && off < (size_t)sizr ; ) {
+				sizw = write(tfd, &buffer[off], (size_t)sizr - off);
+				if (sizw > 0)
+					off += (size_t)sizw;
+				else if (sizw == 0 || errno != EINTR)
+					rc = -1;
+			}
+	}
+	close(tfd);
+	if (rc)
+		ERROR("can't copy zip stream to %s: %m", path);
+	else
+		rc = zread(path, maxsize);
+	unlink(path);
+	return rc;
+}
+
 /* write (pack) content of the current directory in 'zipfile' */
 int zwrite(const char *zipfile)
 {
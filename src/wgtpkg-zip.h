@@ -20,6 +20,9 @@
 /* read (extract) 'zipfile' in current directory */
 extern int zread(const char *zipfile, unsigned long long maxsize);
 
+/* read (extract) the zip of the stream 'fd' in current directory */
+extern int zread_fd(int fd, unsigned long long maxsize);
+
 /* write (pack) content of the current directory in 'zipfile' */
 extern int zwrite(const char *zipfile);
 